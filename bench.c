@@ -0,0 +1,1246 @@
+// Benchmarks for the drive and playback paths.
+// Each benchmark is a subcommand and prints one line of results per configuration it tries.
+//
+// usage: bench <benchmark> [args...]
+// 	read [seconds] [batch blocks] [blocks per read] [latency ms] [commands in flight]
+// 					sweep the read path over comma separated lists of each, x-speed, command latency, syscalls and CPU per configuration
+// 	playback [seconds] [stall ms] [stall every ms] [cpu hogs] [period frames] [buffer frames]
+// 					play the disc through the whole pipeline for seconds, counting xruns, buffer occupancy, wakeup jitter, time to first sound,
+// 					and the playback thread's wakeups and CPU
+// 	transport [seconds] [start LBA]	compare the copy, direct I/O and mmap READ CD transports
+// 	checksum [MB]			CRC32 and AccurateRip throughput of each checksum kernel on a synthetic track, no drive needed
+// 	startup [runs]			time to get the TOC and CD-Text from the drive (cold) and through the disc cache (warm)
+// 	seek [seeks]			time from a seek to its first audio, with the urgent first read playback uses and with a full slot
+// 	firstsound [runs]		time from starting playback to its first audio, with and without a fast start, in both PCM accesses
+// 	control [round trips]		round trip time of control socket commands to a running playerd, pause/resume too if it is playing
+// 	uevents record <file> [seconds]	record every uevent on this host, with its timing, for replaying later
+// 	uevents replay <file> [speedup]	replay a recording into a socketpair with and without the BPF filter, counting wakeups and CPU per uevent
+//
+// Every benchmark prints CSV with a header line, so results can be kept and compared between releases.
+// The read and playback benchmarks run against the mock drive unless DRIVE_ENV picks another one, see drive.c.
+// Playback goes to the ALSA null PCM unless PCM_ENV picks another one. alsa-lib's null plugin takes audio as fast as it is given,
+// so for xruns that mean something use a PCM that plays in real time, like a snd-aloop device (hw:Loopback,0).
+//
+// Built from bench.c plus the modules it drives, see the Makefile:
+// 	make bench
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <linux/netlink.h>
+
+#include "readcd.h"
+#include "drive.h"
+#include "simdrive.h"
+#include "readtoc.h"
+#include "checksum.h"
+#include "readtext.h"
+#include "textloader.h"
+#include "disccache.h"
+#include "cdspeed.h"
+#include "cdreader.h"
+#include "nlis.h"
+#include "control.h"
+#include "player.h"
+#include "playaudio.h"
+#include "config.h"
+#include "stats.h"
+
+#define DEFAULT_BENCH_SECONDS 30
+#define DEFAULT_SWEEP_SECONDS 10 // of audio per configuration
+#define DEFAULT_SWEEP_BATCH_BLOCKS "1,4,8,16,26"
+#define DEFAULT_SWEEP_READ_BLOCKS "15,75,150" // what a playback ring slot, one second and the whole playback buffer ask for
+#define DEFAULT_SWEEP_LATENCY_MS "0,1,4"
+#define DEFAULT_SWEEP_IN_FLIGHT "1,4" // serial, then pipelined like readcd.c does by default
+#define MAX_SWEEP_VALUES 16
+#define OPCODE_READ_CD 0xbe
+#define DEFAULT_SOAK_SECONDS 60
+#define DEFAULT_STALL_EVERY_MS 10000
+#define SOAK_PCM "null"
+#define JITTER_PERIOD_NSEC 5000000L // the sampler thread asks to wake every 5ms, about a period at the default period size
+#define OCCUPANCY_EVERY_WAKEUPS 20 // buffer occupancy is sampled every 100ms
+#define SLOT_MS (FULL_SLOT_BLOCKS * 1000 / CD_AUDIO_BLOCKS_ONE_SEC)
+#define DEFAULT_CHECKSUM_MB 700 // about a full CD
+#define DEFAULT_STARTUP_RUNS 10
+#define DEFAULT_SEEKS 50
+#define DEFAULT_FIRST_SOUND_RUNS 10
+#define FIRST_SOUND_POLL_NSEC 100000L
+#define FULL_SLOT_BLOCKS (CD_AUDIO_BLOCKS_ONE_SEC / 5) // what the playback ring reads per slot when it isn't ramping up
+#define DEFAULT_CONTROL_ROUND_TRIPS 1000
+#define DEFAULT_RECORD_SECONDS 60
+#define DEFAULT_REPLAY_SPEEDUP 10 // gaps between recorded uevents are divided by this
+#define MAX_RECORDED_UEVENTS 100000
+#define NSEC_PER_SEC 1000000000L
+#define BYTES_PER_MB (1024L * 1024L)
+#define READ_CHUNK_BLOCKS CD_AUDIO_BLOCKS_ONE_SEC
+
+typedef struct Usage Usage;
+typedef struct Recording Recording;
+typedef struct ReplayResult ReplayResult;
+typedef struct LatencySamples LatencySamples;
+typedef struct SoakPlayback SoakPlayback;
+typedef struct SoakSampler SoakSampler;
+
+struct Usage {
+	double wallSec;
+	double cpuSec; // user + system, system time is where the sg driver's copies show up
+};
+
+// A recording file is a sequence of { uint64_t nsec since the first uevent, uint32_t size, size bytes of uevent }.
+struct Recording {
+	int count;
+	uint64_t *nsec;
+	uint32_t *sizes;
+	char **msgs;
+	long speedup;
+	int sendFd;
+};
+
+// READ CD command latencies collected by the drive observer during one configuration of the read sweep
+struct LatencySamples {
+	double *sec;
+	long len;
+	long alloc;
+};
+
+// what the playback thread of the soak plays, and how it ended
+struct SoakPlayback {
+	PCM *pcm;
+	uint32_t startLBA;
+	uint32_t leadoutLBA;
+	int status;
+	double cpuSec; // the playback thread's
+	atomic_bool finished;
+};
+
+// The sampler thread wakes on a fixed schedule, how late each wakeup is measures the scheduling jitter playback is exposed to.
+// Every OCCUPANCY_EVERY_WAKEUPS it also notes how much audio is queued ahead of the speaker.
+struct SoakSampler {
+	PCM *pcm;
+	double start;
+	atomic_bool stop;
+	double *lateSec;
+	long lateLen;
+	long lateAlloc;
+	double *occupancyAt; // seconds since start
+	unsigned int *ringSlots;
+	double *pcmMs;
+	long occupancyLen;
+	long occupancyAlloc;
+};
+
+struct ReplayResult {
+	unsigned long wakeups; // epoll_wait() returns
+	unsigned long delivered; // uevents that made it to userspace
+	unsigned long receiveCalls; // recv()/recvmmsg() calls
+	unsigned long matched; // uevents classifyUevent() reported
+	double cpuSec; // the receiving thread's CPU time
+};
+
+int benchRead(int argc, char *argv[]);
+int sweepRead(uint32_t batchBlocks, uint32_t readBlocks, long latencyMs, int inFlight, bool simulated, long seconds, uint32_t leadoutLBA);
+void recordCommandLatency(const DriveCommand *command, int status, double seconds);
+int parseListArg(int argc, char *argv[], int i, const char *fallback, long *dest);
+int benchPlayback(int argc, char *argv[]);
+void *playSoak(void *arg);
+void noteTextLoaded(CDText *text, int status, void *at);
+void *sampleSoak(void *arg);
+void *burnCPU(void *arg);
+int benchTransport(int argc, char *argv[]);
+int benchChecksum(int argc, char *argv[]);
+int benchStartup(int argc, char *argv[]);
+int timeStartup(bool warm, double *dest);
+int benchSeek(int argc, char *argv[]);
+int benchFirstSound(int argc, char *argv[]);
+int timeFirstSound(SoakPlayback *playback, double *dest);
+int benchControl(int argc, char *argv[]);
+int timeControl(int fd, uint8_t command, long count, double *dest);
+int compareDoubles(const void *a, const void *b);
+int benchUevents(int argc, char *argv[]);
+int recordUevents(const char *path, long seconds);
+int replayUevents(const char *path, long speedup);
+int loadRecording(const char *path, Recording *dest);
+void freeRecording(Recording *rec);
+int replayOnce(Recording *rec, bool filtered, ReplayResult *dest);
+void *sendRecording(void *arg);
+double threadCpuSec(void);
+int readSecondsOfAudio(int transport, uint32_t startLBA, uint32_t leadoutLBA, long seconds);
+void startUsage(Usage *usage);
+void stopUsage(Usage *usage);
+double timevalSec(struct timeval tv);
+long parseLongArg(int argc, char *argv[], int i, long fallback);
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		printf("usage: bench <benchmark> [args...]\n");
+		return 1;
+	}
+	if(strcmp(argv[1], "read") == 0)
+		return benchRead(argc-2, argv+2);
+	if(strcmp(argv[1], "playback") == 0)
+		return benchPlayback(argc-2, argv+2);
+	if(strcmp(argv[1], "transport") == 0)
+		return benchTransport(argc-2, argv+2);
+	if(strcmp(argv[1], "checksum") == 0)
+		return benchChecksum(argc-2, argv+2);
+	if(strcmp(argv[1], "startup") == 0)
+		return benchStartup(argc-2, argv+2);
+	if(strcmp(argv[1], "seek") == 0)
+		return benchSeek(argc-2, argv+2);
+	if(strcmp(argv[1], "firstsound") == 0)
+		return benchFirstSound(argc-2, argv+2);
+	if(strcmp(argv[1], "control") == 0)
+		return benchControl(argc-2, argv+2);
+	if(strcmp(argv[1], "uevents") == 0)
+		return benchUevents(argc-2, argv+2);
+
+	printf("unknown benchmark '%s'\n", argv[1]);
+	return 1;
+}
+
+static LatencySamples latencies;
+
+// Reads seconds of audio for every combination of READ CD batch size, blocks asked for per readCDAudioFromDrive() call
+// (the playback side's buffering), injected drive latency and READ CD commands kept in flight, and reports per configuration:
+// 	x_speed: audio seconds read per wall clock second
+// 	cmd_p50_us, cmd_p99_us: time the drive spent on each READ CD, see reapDriveCommand()
+// 	syscalls_per_audio_sec: what the sg backend would make for it, see DriveStats
+// 	cpu_ms_per_audio_sec: user and system time of the whole process
+// Latency is only injected into the simulated drives, a real one is swept over batch and read sizes once.
+// The commands in flight come last so each latency prints its serial and pipelined rows next to each other.
+int benchRead(int argc, char *argv[]) {
+	long seconds = parseLongArg(argc, argv, 0, DEFAULT_SWEEP_SECONDS);
+	long batches[MAX_SWEEP_VALUES], reads[MAX_SWEEP_VALUES], latenciesMs[MAX_SWEEP_VALUES], inFlight[MAX_SWEEP_VALUES];
+	int batchesLen = parseListArg(argc, argv, 1, DEFAULT_SWEEP_BATCH_BLOCKS, batches);
+	int readsLen = parseListArg(argc, argv, 2, DEFAULT_SWEEP_READ_BLOCKS, reads);
+	int latenciesLen = parseListArg(argc, argv, 3, DEFAULT_SWEEP_LATENCY_MS, latenciesMs);
+	int inFlightLen = parseListArg(argc, argv, 4, DEFAULT_SWEEP_IN_FLIGHT, inFlight);
+	int defaultInFlight = getReadCommandsInFlight();
+	for(int i=0; i<inFlightLen; i++) {
+		if(setReadCommandsInFlight(inFlight[i]))
+			inFlightLen = 0;
+	}
+	setReadCommandsInFlight(defaultInFlight);
+	if(!batchesLen || !readsLen || !latenciesLen || !inFlightLen || seconds <= 0) {
+		printf("usage: bench read [seconds] [batch blocks,...] [blocks per read,...] [latency ms,...] [commands in flight,...]\n");
+		return 1;
+	}
+
+	if(!getenv(DRIVE_ENV))
+		selectDriveBackend(DRIVE_BACKEND_MOCK, NULL);
+	// held for the whole sweep, so the simulated drive isn't opened again and the timing set below stays
+	if(acquireDrive()) {
+		printf("failed to open the drive\n");
+		return 2;
+	}
+	TOC *toc;
+	int status = readTOC(&toc);
+	if(status) {
+		printf("readTOC failed: %d\n", status);
+		releaseDrive();
+		return 2;
+	}
+	uint32_t leadoutLBA = getLeadoutLBA(toc);
+	destroyTOC(toc);
+	free(toc);
+
+	bool simulated = getDriveBackend() == DRIVE_BACKEND_MOCK || getDriveBackend() == DRIVE_BACKEND_IMAGE;
+	if(!simulated)
+		latenciesLen = 1;
+	SimDriveTiming timing;
+	getSimDriveTiming(&timing);
+	setDriveCommandObserver(recordCommandLatency);
+
+	printf("batch_blocks,blocks_per_read,latency_ms,in_flight,audio_sec,x_speed,commands,cmd_p50_us,cmd_p99_us,syscalls_per_audio_sec,cpu_ms_per_audio_sec\n");
+	for(int l=0; l<latenciesLen && !status; l++) {
+		if(simulated) {
+			SimDriveTiming injected = timing;
+			injected.commandUsec = latenciesMs[l] * 1000;
+			setSimDriveTiming(&injected);
+		}
+		for(int b=0; b<batchesLen && !status; b++) {
+			for(int r=0; r<readsLen && !status; r++) {
+				for(int f=0; f<inFlightLen && !status; f++)
+					status = sweepRead(batches[b], reads[r], latenciesMs[l], inFlight[f], simulated, seconds, leadoutLBA);
+			}
+		}
+	}
+
+	setDriveCommandObserver(NULL);
+	free(latencies.sec);
+	if(simulated)
+		setSimDriveTiming(&timing);
+	setReadBatchBlocks(0);
+	setReadCommandsInFlight(defaultInFlight);
+	releaseDrive();
+	return status ? 2 : 0;
+}
+
+// One configuration of the read sweep. Reads wrap around to the start of the disc if it is shorter than seconds,
+// which costs a seek on the image drive like it would on a real one.
+int sweepRead(uint32_t batchBlocks, uint32_t readBlocks, long latencyMs, int inFlight, bool simulated, long seconds, uint32_t leadoutLBA) {
+	void *buf;
+	if(readBlocks == 0 || posix_memalign(&buf, sysconf(_SC_PAGESIZE), readBlocks*CD_AUDIO_BLOCK_SIZE))
+		return -1;
+	// reopened so the probe runs again and picks up the new cap
+	closeOpticalDrive();
+	setReadBatchBlocks(batchBlocks);
+	setReadCommandsInFlight(inFlight);
+
+	latencies.len = 0;
+	DriveStats before, after;
+	getDriveStats(&before);
+	Usage usage;
+	startUsage(&usage);
+	uint32_t lba = 0;
+	long blocksLeft = seconds * CD_AUDIO_BLOCKS_ONE_SEC;
+	int status = 0;
+	while(blocksLeft > 0 && status == 0) {
+		long written = 0;
+		uint32_t blocks = blocksLeft < readBlocks ? blocksLeft : readBlocks;
+		status = readCDAudioFromDrive(lba, leadoutLBA, blocks, buf, &written);
+		if(status == READ_CD_AUDIO_LEADOUT_REACHED)
+			status = 0;
+		lba += written/CD_AUDIO_BLOCK_SIZE;
+		blocksLeft -= written/CD_AUDIO_BLOCK_SIZE;
+		if(lba >= leadoutLBA)
+			lba = 0;
+		if(written == 0 && status == 0)
+			status = -1;
+	}
+	stopUsage(&usage);
+	getDriveStats(&after);
+	free(buf);
+	char latencyField[32];
+	snprintf(latencyField, sizeof(latencyField), simulated ? "%ld" : "drive", latencyMs);
+	if(status) {
+		printf("%u,%u,%s,%d,failed %d\n", batchBlocks, readBlocks, latencyField, inFlight, status);
+		return status;
+	}
+
+	double audioSec = (double)seconds;
+	double p50 = 0, p99 = 0;
+	if(latencies.len > 0) {
+		qsort(latencies.sec, latencies.len, sizeof(double), compareDoubles);
+		p50 = latencies.sec[latencies.len/2];
+		p99 = latencies.sec[latencies.len*99/100];
+	}
+	printf("%u,%u,%s,%d,%.1f,%.2f,%ld,%.0f,%.0f,%.1f,%.3f\n", getReadBatchBlocks(), readBlocks, latencyField, inFlight, audioSec, audioSec / usage.wallSec,
+			latencies.len, 1e6 * p50, 1e6 * p99, (after.syscalls - before.syscalls) / audioSec, 1000 * usage.cpuSec / audioSec);
+	return 0;
+}
+
+// The drive observer, the reads all happen on the benchmark's thread so there is nothing to lock.
+void recordCommandLatency(const DriveCommand *command, int status, double seconds) {
+	if(command->cdb[0] != OPCODE_READ_CD || status)
+		return;
+	if(latencies.len == latencies.alloc) {
+		long alloc = latencies.alloc ? latencies.alloc * 2 : 1024;
+		double *resized = realloc(latencies.sec, alloc * sizeof(double));
+		if(!resized)
+			return;
+		latencies.sec = resized;
+		latencies.alloc = alloc;
+	}
+	latencies.sec[latencies.len++] = seconds;
+}
+
+// Reads a comma separated list of non negative numbers into dest, MAX_SWEEP_VALUES at most. Returns how many, 0 if the list is bad.
+int parseListArg(int argc, char *argv[], int i, const char *fallback, long *dest) {
+	const char *list = i < argc ? argv[i] : fallback;
+	int len = 0;
+	while(len < MAX_SWEEP_VALUES) {
+		char *endp;
+		long value = strtol(list, &endp, 10);
+		if(endp == list || value < 0 || (*endp != ',' && *endp != '\0'))
+			return 0;
+		dest[len++] = value;
+		if(*endp == '\0')
+			break;
+		list = endp+1;
+	}
+	return len;
+}
+
+static atomic_bool stopBurning;
+
+// Runs what main.c does, TOC, initPCM() and playback from the first track with the CD-Text read in the background, for seconds,
+// while optionally the simulated drive stalls for stall ms every stall every ms and cpu hogs threads spin on the CPUs. Reports:
+// 	toc_ms, init_pcm_ms: how long each took, one after the other from the start of the run
+// 	text_ms, first_sound_ms: from the start of the run to the CD-Text being loaded (-1 if the disc has none) and the PCM starting to play
+// 	xruns: times the PCM ran dry
+// 	pcm_buffer_ms: the PCM's buffer at the end, it grows after xruns
+// 	period_frames, wakeups_per_sec, play_cpu_pct: the PCM's period, and how often the playback thread woke up and how much CPU it used
+// 	ring_min_fill, ring_empty_waits: see RingStats, both 0 in mmap access where the PCM's buffer is the ring
+// 	occupancy_min_ms, occupancy_mean_ms: audio queued in the ring and the PCM, sampled every 100ms once sound has started
+// 	jitter_p50_us, jitter_p99_us, jitter_max_us: how late the sampler thread's wakeups were
+// then, after a blank line, the occupancy samples themselves.
+int benchPlayback(int argc, char *argv[]) {
+	long seconds = parseLongArg(argc, argv, 0, DEFAULT_SOAK_SECONDS);
+	long stallMs = parseLongArg(argc, argv, 1, 0);
+	long stallEveryMs = parseLongArg(argc, argv, 2, DEFAULT_STALL_EVERY_MS);
+	long hogs = parseLongArg(argc, argv, 3, 0);
+	long periodFrames = parseLongArg(argc, argv, 4, 0);
+	long bufferFrames = parseLongArg(argc, argv, 5, 0);
+	if(seconds <= 0 || periodFrames < 0 || bufferFrames < 0) {
+		printf("usage: bench playback [seconds] [stall ms] [stall every ms] [cpu hogs] [period frames] [buffer frames]\n");
+		return 1;
+	}
+
+	setenv(PCM_ENV, SOAK_PCM, 0);
+	if(!getenv(DRIVE_ENV))
+		selectDriveBackend(DRIVE_BACKEND_MOCK, NULL);
+	if(acquireDrive()) {
+		printf("failed to open the drive\n");
+		return 2;
+	}
+	bool simulated = getDriveBackend() == DRIVE_BACKEND_MOCK || getDriveBackend() == DRIVE_BACKEND_IMAGE;
+	SimDriveTiming timing;
+	getSimDriveTiming(&timing);
+	if(simulated) {
+		SimDriveTiming stalling = timing;
+		stalling.stallUsec = stallMs * 1000;
+		stalling.stallEveryMs = stallEveryMs;
+		setSimDriveTiming(&stalling);
+	}
+
+	atomic_store(&stopBurning, false);
+	pthread_t *hogThreads = calloc(hogs ? hogs : 1, sizeof(pthread_t));
+	long hogsStarted = 0;
+	while(hogThreads && hogsStarted < hogs && pthread_create(&hogThreads[hogsStarted], NULL, burnCPU, NULL) == 0)
+		hogsStarted++;
+
+	SoakSampler sampler;
+	memset(&sampler, 0, sizeof(SoakSampler));
+	sampler.lateAlloc = seconds * (NSEC_PER_SEC / JITTER_PERIOD_NSEC) + 1;
+	sampler.occupancyAlloc = sampler.lateAlloc / OCCUPANCY_EVERY_WAKEUPS + 1;
+	sampler.lateSec = malloc(sampler.lateAlloc * sizeof(double));
+	sampler.occupancyAt = malloc(sampler.occupancyAlloc * sizeof(double));
+	sampler.ringSlots = malloc(sampler.occupancyAlloc * sizeof(unsigned int));
+	sampler.pcmMs = malloc(sampler.occupancyAlloc * sizeof(double));
+
+	int status = 0;
+	double start = monotonicSec();
+	double tocAt = 0, textAt = 0, pcmAt = 0;
+	TOC *toc = NULL;
+	TextLoader *textLoader = NULL;
+	SoakPlayback playback;
+	memset(&playback, 0, sizeof(SoakPlayback));
+	pthread_t playThread, sampleThread;
+	bool playing = false, sampling = false;
+	if(!sampler.lateSec || !sampler.occupancyAt || !sampler.ringSlots || !sampler.pcmMs)
+		status = -1;
+	else if((status = readTOC(&toc)))
+		printf("readTOC failed: %d\n", status);
+	else {
+		tocAt = monotonicSec();
+		if((status = initPCM(&playback.pcm)))
+			printf("initPCM failed: %d\n", status);
+		else if((periodFrames || bufferFrames) && (status = setPCMBufferSize(playback.pcm, periodFrames, bufferFrames)))
+			printf("setPCMBufferSize failed: %d\n", status);
+		pcmAt = monotonicSec();
+	}
+	if(!status) {
+		playback.startLBA = getTrackOffsetLBA(toc, getFirstTrackNumber(toc), 0);
+		playback.leadoutLBA = getLeadoutLBA(toc);
+		sampler.pcm = playback.pcm;
+		sampler.start = start;
+		if(startTextLoader(&textLoader, toc, noteTextLoaded, &textAt))
+			textLoader = NULL;
+		playing = pthread_create(&playThread, NULL, playSoak, &playback) == 0;
+		sampling = playing && pthread_create(&sampleThread, NULL, sampleSoak, &sampler) == 0;
+		if(!sampling)
+			status = -1;
+	}
+	if(!status) {
+		struct timespec poll = { .tv_sec = 0, .tv_nsec = NSEC_PER_SEC / 10 };
+		while(monotonicSec() - start < seconds && !atomic_load(&playback.finished))
+			nanosleep(&poll, NULL);
+	}
+	double playedSec = monotonicSec() - start;
+	// the sampler looks at the playback's ring, so it stops before the ring goes away
+	if(sampling) {
+		atomic_store(&sampler.stop, true);
+		pthread_join(sampleThread, NULL);
+	}
+	if(playing) {
+		stopPlaying(playback.pcm);
+		pthread_join(playThread, NULL);
+	}
+	// textAt is written by the loader's thread, it is only safe to read once that is gone
+	if(textLoader)
+		waitForText(textLoader);
+	atomic_store(&stopBurning, true);
+	for(long i=0; i<hogsStarted; i++)
+		pthread_join(hogThreads[i], NULL);
+	free(hogThreads);
+
+	if(!status) {
+		PlaybackStats stats;
+		getPlaybackStats(playback.pcm, &stats);
+		RingStats ring;
+		if(getPlaybackRingStats(playback.pcm, &ring))
+			memset(&ring, 0, sizeof(RingStats));
+		double occupancyMin = 0, occupancyTotal = 0;
+		long occupancyCounted = 0;
+		for(long i=0; i<sampler.occupancyLen; i++) {
+			if(stats.firstSoundAt == 0 || sampler.occupancyAt[i] < stats.firstSoundAt - start)
+				continue;
+			double ms = sampler.ringSlots[i] * SLOT_MS + sampler.pcmMs[i];
+			if(occupancyCounted == 0 || ms < occupancyMin)
+				occupancyMin = ms;
+			occupancyTotal += ms;
+			occupancyCounted++;
+		}
+		double p50 = 0, p99 = 0, max = 0;
+		if(sampler.lateLen > 0) {
+			qsort(sampler.lateSec, sampler.lateLen, sizeof(double), compareDoubles);
+			p50 = sampler.lateSec[sampler.lateLen/2];
+			p99 = sampler.lateSec[sampler.lateLen*99/100];
+			max = sampler.lateSec[sampler.lateLen-1];
+		}
+
+		printf("pcm,access,seconds,played_sec,stall_ms,stall_every_ms,cpu_hogs,toc_ms,text_ms,init_pcm_ms,first_sound_ms,xruns,pcm_buffer_ms,period_frames,"
+				"wakeups_per_sec,play_cpu_pct,ring_min_fill,ring_empty_waits,occupancy_min_ms,occupancy_mean_ms,jitter_p50_us,jitter_p99_us,jitter_max_us,status\n");
+		printf("%s,%s,%ld,%.1f,%ld,%ld,%ld,%.1f,%.1f,%.1f,%.1f,%lu,%.0f,%lu,%.0f,%.2f,%u,%lu,%.0f,%.0f,%.0f,%.0f,%.0f,%d\n", getenv(PCM_ENV),
+				usesMmapAccess(playback.pcm) ? "mmap" : "rw", seconds, playedSec, simulated ? stallMs : 0, stallEveryMs, hogsStarted,
+				1000 * (tocAt - start), textAt ? 1000 * (textAt - start) : -1, 1000 * (pcmAt - tocAt),
+				stats.firstSoundAt ? 1000 * (stats.firstSoundAt - start) : -1, stats.xruns,
+				1000.0 * stats.bufferFrames / getSamplingRate(playback.pcm), stats.periodFrames, stats.wakeups / playedSec,
+				100 * playback.cpuSec / playedSec, ring.minFill, ring.emptyWaits,
+				occupancyMin, occupancyCounted ? occupancyTotal / occupancyCounted : 0, 1e6 * p50, 1e6 * p99, 1e6 * max, playback.status);
+		printf("\nt_sec,ring_slots,pcm_ms\n");
+		for(long i=0; i<sampler.occupancyLen; i++)
+			printf("%.1f,%u,%.0f\n", sampler.occupancyAt[i], sampler.ringSlots[i], sampler.pcmMs[i]);
+	}
+
+	if(playback.pcm) {
+		destroyPCM(playback.pcm);
+		free(playback.pcm);
+	}
+	if(textLoader)
+		stopTextLoader(textLoader);
+	if(toc) {
+		destroyTOC(toc);
+		free(toc);
+	}
+	free(sampler.lateSec);
+	free(sampler.occupancyAt);
+	free(sampler.ringSlots);
+	free(sampler.pcmMs);
+	if(simulated)
+		setSimDriveTiming(&timing);
+	closeOpticalDrive();
+	releaseDrive();
+	return status ? 2 : 0;
+}
+
+void *playSoak(void *arg) {
+	SoakPlayback *playback = arg;
+	double cpuStart = threadCpuSec();
+	playback->status = startPlayingFrom(playback->startLBA, playback->leadoutLBA, playback->pcm);
+	playback->cpuSec = threadCpuSec() - cpuStart;
+	atomic_store(&playback->finished, true);
+	return NULL;
+}
+
+// On the text loader's thread.
+void noteTextLoaded(CDText *text, int status, void *at) {
+	(void)status; // no text is enough to go on
+	if(text)
+		*(double *)at = monotonicSec();
+}
+
+// A wakeup more than a period late is counted and the schedule starts again from now, rather than firing a burst to catch up.
+void *sampleSoak(void *arg) {
+	SoakSampler *sampler = arg;
+	struct timespec next;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	long wakeups = 0;
+	while(!atomic_load(&sampler->stop)) {
+		next.tv_nsec += JITTER_PERIOD_NSEC;
+		if(next.tv_nsec >= NSEC_PER_SEC) {
+			next.tv_sec++;
+			next.tv_nsec -= NSEC_PER_SEC;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		double late = (now.tv_sec - next.tv_sec) + (now.tv_nsec - next.tv_nsec) / 1e9;
+		if(sampler->lateLen < sampler->lateAlloc)
+			sampler->lateSec[sampler->lateLen++] = late > 0 ? late : 0;
+		if(late * NSEC_PER_SEC > JITTER_PERIOD_NSEC)
+			next = now;
+
+		if(++wakeups % OCCUPANCY_EVERY_WAKEUPS != 0 || sampler->occupancyLen == sampler->occupancyAlloc)
+			continue;
+		RingStats ring;
+		PlaybackStats stats;
+		getPlaybackStats(sampler->pcm, &stats);
+		long i = sampler->occupancyLen++;
+		sampler->occupancyAt[i] = monotonicSec() - sampler->start;
+		sampler->ringSlots[i] = getPlaybackRingStats(sampler->pcm, &ring) == 0 && isPlaying(sampler->pcm) ? ring.fill : 0;
+		sampler->pcmMs[i] = 1000.0 * stats.queuedFrames / getSamplingRate(sampler->pcm);
+	}
+	return NULL;
+}
+
+void *burnCPU(void *arg) {
+	(void)arg;
+	volatile unsigned long spins = 0;
+	while(!atomic_load(&stopBurning))
+		spins++;
+	return NULL;
+}
+
+// Reads the same stretch of the disc with each transport and reports how much was copied and how much CPU it took per second of audio.
+int benchTransport(int argc, char *argv[]) {
+	long seconds = parseLongArg(argc, argv, 0, DEFAULT_BENCH_SECONDS);
+	long startLBA = parseLongArg(argc, argv, 1, 0);
+
+	TOC *toc;
+	int status = readTOC(&toc);
+	if(status) {
+		printf("readTOC failed: %d\n", status);
+		return 2;
+	}
+	uint32_t leadoutLBA = getLeadoutLBA(toc);
+
+	const int transports[] = { READ_TRANSPORT_COPY, READ_TRANSPORT_DIRECT, READ_TRANSPORT_MMAP };
+	const char *names[] = { "copy", "direct", "mmap" };
+	printf("transport,audio_sec,x_speed,cpu_ms_per_audio_sec,kernel_copied_bytes_per_audio_sec,user_copied_bytes_per_audio_sec\n");
+	for(int i=0; i<3; i++) {
+		if(setReadTransport(transports[i])) {
+			printf("%s,unsupported\n", names[i]);
+			continue;
+		}
+		resetReadTransportStats();
+		Usage usage;
+		startUsage(&usage);
+		status = readSecondsOfAudio(transports[i], startLBA, leadoutLBA, seconds);
+		stopUsage(&usage);
+		if(status) {
+			printf("%s,failed %d\n", names[i], status);
+			continue;
+		}
+
+		ReadTransportStats stats;
+		getReadTransportStats(&stats);
+		double audioSec = (double)stats.bytesRead / (CD_AUDIO_BLOCK_SIZE * CD_AUDIO_BLOCKS_ONE_SEC);
+		if(audioSec <= 0)
+			continue;
+		printf("%s,%.1f,%.2f,%.3f,%.0f,%.0f\n", names[i], audioSec, audioSec / usage.wallSec, 1000 * usage.cpuSec / audioSec,
+				stats.bytesCopiedByKernel / audioSec, stats.bytesCopiedByUser / audioSec);
+	}
+	setReadTransport(READ_TRANSPORT_COPY);
+	destroyTOC(toc);
+	return 0;
+}
+
+// Runs each checksum kernel over the same pseudo random track and reports its speed as MB/s and as a multiple of real time.
+// The checksums are printed too, every kernel has to agree with the scalar one.
+int benchChecksum(int argc, char *argv[]) {
+	long mb = parseLongArg(argc, argv, 0, DEFAULT_CHECKSUM_MB);
+	size_t frames = mb * BYTES_PER_MB / 4;
+	size_t size = frames * 4;
+	uint32_t *track = malloc(size);
+	if(!track || size == 0) {
+		printf("failed to allocate %ld MB\n", mb);
+		free(track);
+		return 2;
+	}
+	uint32_t seed = 0x12345678;
+	for(size_t i=0; i<frames; i++) {
+		seed = seed * 1664525 + 1013904223;
+		track[i] = seed;
+	}
+
+	const int kernels[] = { CHECKSUM_KERNEL_SCALAR, CHECKSUM_KERNEL_SSE2, CHECKSUM_KERNEL_AVX2 };
+	double audioSec = (double)size / (CD_AUDIO_BLOCK_SIZE * CD_AUDIO_BLOCKS_ONE_SEC);
+	printf("kernel,crc32_mb_per_sec,crc32_x_speed,accuraterip_mb_per_sec,accuraterip_x_speed,crc32,accuraterip_v1,accuraterip_v2\n");
+	for(int i=0; i<3; i++) {
+		if(setChecksumKernel(kernels[i])) {
+			printf("%s,unsupported\n", getChecksumKernelName(kernels[i]));
+			continue;
+		}
+		double start = monotonicSec();
+		uint32_t crc = ~crc32Update(0xffffffff, (const uint8_t *)track, size);
+		double crcSec = monotonicSec() - start;
+
+		uint32_t lo = 0, hi = 0;
+		start = monotonicSec();
+		accurateRipUpdate(track, frames, 1, &lo, &hi);
+		double arSec = monotonicSec() - start;
+
+		printf("%s,%.0f,%.0f,%.0f,%.0f,%08X,%08X,%08X\n", getChecksumKernelName(kernels[i]), mb / crcSec, audioSec / crcSec,
+				mb / arSec, audioSec / arSec, crc, lo, lo + hi);
+	}
+	setChecksumKernel(CHECKSUM_KERNEL_BEST);
+	free(track);
+	return 0;
+}
+
+// Cold is what main did before the disc cache, READ TOC and READ TOC format 0101b every time.
+// Warm opens and maps the cache fresh each run, like a new process would, and finds the disc in it.
+int benchStartup(int argc, char *argv[]) {
+	long runs = parseLongArg(argc, argv, 0, DEFAULT_STARTUP_RUNS);
+	double primeSec;
+	int status = timeStartup(true, &primeSec); // makes sure the disc is in the cache
+	if(status) {
+		printf("startup failed: %d\n", status);
+		return 2;
+	}
+
+	const char *modes[] = { "cold", "warm" };
+	printf("mode,runs,mean_ms,min_ms,max_ms\n");
+	for(int warm=0; warm<2; warm++) {
+		double total = 0, min = 0, max = 0;
+		for(long i=0; i<runs; i++) {
+			double sec;
+			if((status = timeStartup(warm, &sec))) {
+				printf("%s,failed %d\n", modes[warm], status);
+				return 2;
+			}
+			total += sec;
+			if(i == 0 || sec < min)
+				min = sec;
+			if(sec > max)
+				max = sec;
+		}
+		if(runs > 0)
+			printf("%s,%ld,%.2f,%.2f,%.2f\n", modes[warm], runs, 1000 * total / runs, 1000 * min, 1000 * max);
+	}
+	return 0;
+}
+
+// A disc without CD-Text still counts, readText() answering that is part of startup too.
+int timeStartup(bool warm, double *dest) {
+	double start = monotonicSec();
+	TOC *toc;
+	int status = readTOC(&toc);
+	if(status)
+		return status;
+	CDText *text = NULL;
+	if(warm) {
+		closeDiscCache();
+		status = readTextCached(&text, toc);
+	}
+	else
+		status = readText(&text, 0);
+	*dest = monotonicSec() - start;
+
+	if(text) {
+		destroyCDText(text);
+		free(text);
+	}
+	destroyTOC(toc);
+	free(toc);
+	if(status == READ_TEXT_NO_CDTEXT || status == READ_TEXT_EMPTY)
+		status = 0;
+	return status;
+}
+
+// Each seek goes to a pseudo random LBA on the disc and times the first read there, at the playback speed.
+// Both read sizes get their own targets so neither finds the other's sectors in the drive's cache,
+// and the sector cache is left off so every read goes to the drive.
+// The difference between the two is roughly what the ramp after a seek saves before the first sound.
+int benchSeek(int argc, char *argv[]) {
+	long seeks = parseLongArg(argc, argv, 0, DEFAULT_SEEKS);
+	TOC *toc;
+	int status = readTOC(&toc);
+	if(status) {
+		printf("readTOC failed: %d\n", status);
+		return 2;
+	}
+	uint32_t leadoutLBA = getLeadoutLBA(toc);
+	destroyTOC(toc);
+	free(toc);
+	if(leadoutLBA <= FULL_SLOT_BLOCKS) {
+		printf("disc too short\n");
+		return 2;
+	}
+
+	void *buf;
+	if(posix_memalign(&buf, sysconf(_SC_PAGESIZE), FULL_SLOT_BLOCKS*CD_AUDIO_BLOCK_SIZE))
+		return 2;
+	applySpeedPolicy(SPEED_POLICY_PLAYBACK);
+
+	const uint32_t sizes[] = { SEEK_FIRST_BLOCKS, FULL_SLOT_BLOCKS };
+	const char *modes[] = { "urgent", "full" };
+	uint32_t seed = 0x2545f491;
+	printf("first_read,blocks,seeks,mean_ms,min_ms,max_ms\n");
+	for(int i=0; i<2; i++) {
+		double total = 0, min = 0, max = 0;
+		for(long n=0; n<seeks; n++) {
+			seed = seed * 1664525 + 1013904223;
+			uint32_t lba = seed % (leadoutLBA - FULL_SLOT_BLOCKS);
+			long written;
+			double start = monotonicSec();
+			status = readCDAudioFromDrive(lba, leadoutLBA, sizes[i], buf, &written);
+			double sec = monotonicSec() - start;
+			if(status) {
+				printf("%s,failed %d\n", modes[i], status);
+				break;
+			}
+			total += sec;
+			if(n == 0 || sec < min)
+				min = sec;
+			if(sec > max)
+				max = sec;
+		}
+		if(status)
+			break;
+		if(seeks > 0)
+			printf("%s,%u,%ld,%.2f,%.2f,%.2f\n", modes[i], sizes[i], seeks, 1000 * total / seeks, 1000 * min, 1000 * max);
+	}
+	closeOpticalDrive();
+	free(buf);
+	return status ? 2 : 0;
+}
+
+// Starts playback of the first track runs times for each PCM access with and without a fast start, see setFastStart(), and reports:
+// 	first_sound_ms: mean, min and max from startPlayingFrom() to the PCM starting to play
+// 	xruns: over all the runs, what starting before the buffer is full has cost
+// Like playback it runs against the mock drive unless DRIVE_ENV picks another, and its latency (SIM_DRIVE_ENV) is what a slow first read costs.
+// The sector cache is left off so every start reads from the drive.
+int benchFirstSound(int argc, char *argv[]) {
+	long runs = parseLongArg(argc, argv, 0, DEFAULT_FIRST_SOUND_RUNS);
+	if(runs <= 0)
+		runs = 1;
+	setenv(PCM_ENV, SOAK_PCM, 0);
+	if(!getenv(DRIVE_ENV))
+		selectDriveBackend(DRIVE_BACKEND_MOCK, NULL);
+	if(acquireDrive()) {
+		printf("failed to open the drive\n");
+		return 2;
+	}
+	TOC *toc;
+	int status = readTOC(&toc);
+	if(status) {
+		printf("readTOC failed: %d\n", status);
+		releaseDrive();
+		return 2;
+	}
+	SoakPlayback playback;
+	memset(&playback, 0, sizeof(SoakPlayback));
+	playback.startLBA = getTrackOffsetLBA(toc, getFirstTrackNumber(toc), 0);
+	playback.leadoutLBA = getLeadoutLBA(toc);
+	destroyTOC(toc);
+	free(toc);
+
+	const int accesses[] = { PCM_ACCESS_RW, PCM_ACCESS_MMAP };
+	printf("access,fast_start,runs,mean_ms,min_ms,max_ms,xruns\n");
+	for(int i=0; i<2 && !status; i++) {
+		for(int fast=0; fast<2 && !status; fast++) {
+			if((status = initPCMAccess(&playback.pcm, accesses[i]))) {
+				printf("initPCMAccess failed: %d\n", status);
+				break;
+			}
+			// a device without mmap access falls back to RW, which has already been timed
+			if(accesses[i] == PCM_ACCESS_MMAP && !usesMmapAccess(playback.pcm)) {
+				printf("mmap,%s,unsupported\n", fast ? "yes" : "no");
+				destroyPCM(playback.pcm);
+				free(playback.pcm);
+				continue;
+			}
+			setFastStart(playback.pcm, fast);
+			double total = 0, min = 0, max = 0;
+			for(long n=0; n<runs && !status; n++) {
+				double sec;
+				if((status = timeFirstSound(&playback, &sec)))
+					break;
+				total += sec;
+				if(n == 0 || sec < min)
+					min = sec;
+				if(sec > max)
+					max = sec;
+			}
+			PlaybackStats stats;
+			getPlaybackStats(playback.pcm, &stats);
+			if(status)
+				printf("%s,%s,failed %d\n", usesMmapAccess(playback.pcm) ? "mmap" : "rw", fast ? "yes" : "no", status);
+			else
+				printf("%s,%s,%ld,%.1f,%.1f,%.1f,%lu\n", usesMmapAccess(playback.pcm) ? "mmap" : "rw", fast ? "yes" : "no", runs,
+						1000 * total / runs, 1000 * min, 1000 * max, stats.xruns);
+			destroyPCM(playback.pcm);
+			free(playback.pcm);
+		}
+	}
+	closeOpticalDrive();
+	releaseDrive();
+	return status ? 2 : 0;
+}
+
+// Plays from playback->startLBA until the PCM starts playing, then stops it.
+int timeFirstSound(SoakPlayback *playback, double *dest) {
+	atomic_store(&playback->finished, false);
+	double start = monotonicSec();
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, playSoak, playback))
+		return -1;
+	PlaybackStats stats;
+	struct timespec poll = { .tv_sec = 0, .tv_nsec = FIRST_SOUND_POLL_NSEC };
+	// the last run's first sound is still there until startPlayingFrom() resets it
+	do {
+		nanosleep(&poll, NULL);
+		getPlaybackStats(playback->pcm, &stats);
+	} while(stats.firstSoundAt < start && !atomic_load(&playback->finished));
+	stopPlaying(playback->pcm);
+	pthread_join(thread, NULL);
+	if(stats.firstSoundAt < start)
+		return playback->status ? playback->status : -1;
+	*dest = stats.firstSoundAt - start;
+	return 0;
+}
+
+// Status is answered without touching the player's threads, so it is the floor: the socket, the epoll loop and one getPlayerStatus().
+// Pause and resume are timed alternately while something is playing, each includes the snd_pcm_pause() call.
+int benchControl(int argc, char *argv[]) {
+	long count = parseLongArg(argc, argv, 0, DEFAULT_CONTROL_ROUND_TRIPS);
+	if(count <= 0)
+		count = 1;
+	char path[CONTROL_MAX_PATH];
+	if(getControlSocketPath(path, CONTROL_MAX_PATH, false)) {
+		printf("no private directory for the control socket, is XDG_RUNTIME_DIR set?\n");
+		return 2;
+	}
+	int fd = connectControl(path);
+	if(fd == -1) {
+		printf("failed to connect to %s, is playerd running?\n", path);
+		return 2;
+	}
+	double *sec = malloc(count * sizeof(double));
+	if(!sec) {
+		close(fd);
+		return 2;
+	}
+
+	ControlRequest request = { .command = CONTROL_STATUS };
+	ControlReply reply;
+	bool playing = sendControl(fd, &request, &reply) == 0 && reply.state == PLAYER_PLAYING;
+	const char *names[] = { "status", "pause", "resume" };
+	uint8_t commands[] = { CONTROL_STATUS, CONTROL_PAUSE, CONTROL_RESUME };
+	int modes = playing ? 3 : 1;
+
+	printf("command,round_trips,mean_us,p50_us,p99_us,max_us\n");
+	int status = 0;
+	for(int i=0; i<modes && !status; i++) {
+		if((status = timeControl(fd, commands[i], count, sec))) {
+			printf("%s,failed %d\n", names[i], status);
+			break;
+		}
+		double total = 0;
+		for(long n=0; n<count; n++)
+			total += sec[n];
+		qsort(sec, count, sizeof(double), compareDoubles);
+		printf("%s,%ld,%.1f,%.1f,%.1f,%.1f\n", names[i], count, 1e6 * total / count, 1e6 * sec[count/2], 1e6 * sec[count*99/100], 1e6 * sec[count-1]);
+	}
+	free(sec);
+	close(fd);
+	return status ? 2 : 0;
+}
+
+// Times count round trips of command. Pause and resume are sent in pairs so playback is left as it was found,
+// only the one being measured is timed.
+int timeControl(int fd, uint8_t command, long count, double *dest) {
+	ControlRequest request = { .command = command };
+	ControlRequest undo = { .command = command == CONTROL_PAUSE ? CONTROL_RESUME : CONTROL_PAUSE };
+	ControlReply reply;
+	for(long n=0; n<count; n++) {
+		if(command == CONTROL_RESUME && sendControl(fd, &undo, &reply))
+			return -1;
+		double start = monotonicSec();
+		if(sendControl(fd, &request, &reply))
+			return -1;
+		dest[n] = monotonicSec() - start;
+		if(reply.status)
+			return reply.status;
+		if(command == CONTROL_PAUSE && sendControl(fd, &undo, &reply))
+			return -1;
+	}
+	return 0;
+}
+
+int compareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+int benchUevents(int argc, char *argv[]) {
+	if(argc >= 2 && strcmp(argv[0], "record") == 0)
+		return recordUevents(argv[1], parseLongArg(argc, argv, 2, DEFAULT_RECORD_SECONDS));
+	if(argc >= 2 && strcmp(argv[0], "replay") == 0)
+		return replayUevents(argv[1], parseLongArg(argc, argv, 2, DEFAULT_REPLAY_SPEEDUP));
+	printf("usage: bench uevents record <file> [seconds] | replay <file> [speedup]\n");
+	return 1;
+}
+
+// Listens on its own unfiltered netlink socket so the recording has everything the host sent, not just what the filter keeps.
+int recordUevents(const char *path, long seconds) {
+	int sockFd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	struct sockaddr_nl addr;
+	memset(&addr, 0, sizeof(struct sockaddr_nl));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if(sockFd == -1 || bind(sockFd, (struct sockaddr *)&addr, sizeof(struct sockaddr_nl)) == -1) {
+		printf("failed to open the uevent socket\n");
+		return 2;
+	}
+	FILE *f = fopen(path, "wb");
+	if(!f) {
+		printf("failed to open %s\n", path);
+		close(sockFd);
+		return 2;
+	}
+
+	struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+	setsockopt(sockFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(struct timeval));
+	double start = monotonicSec();
+	long count = 0;
+	char msg[MAX_NETLINK_MSG];
+	while(monotonicSec() - start < seconds) {
+		ssize_t size = recv(sockFd, msg, MAX_NETLINK_MSG, 0);
+		if(size <= 0)
+			continue;
+		uint64_t nsec = (monotonicSec() - start) * NSEC_PER_SEC;
+		uint32_t size32 = size;
+		fwrite(&nsec, sizeof(uint64_t), 1, f);
+		fwrite(&size32, sizeof(uint32_t), 1, f);
+		fwrite(msg, 1, size, f);
+		count++;
+	}
+	fclose(f);
+	close(sockFd);
+	printf("recorded %ld uevents in %ld seconds\n", count, seconds);
+	return 0;
+}
+
+// Unfiltered is what nlis.c did before the filter, every uevent is delivered and taken with its own recv().
+// Filtered attaches the same BPF program openUeventSocket() does and takes what is left with recvmmsg() batches.
+// Both parse and classify everything they get, so the CPU numbers include the userspace side of each.
+int replayUevents(const char *path, long speedup) {
+	Recording rec;
+	if(loadRecording(path, &rec)) {
+		printf("failed to load %s\n", path);
+		return 2;
+	}
+	rec.speedup = speedup > 0 ? speedup : 1;
+
+	const char *modes[] = { "unfiltered_recv", "filtered_recvmmsg" };
+	printf("mode,uevents,delivered,wakeups,receive_calls,matched,cpu_us,cpu_us_per_uevent\n");
+	for(int filtered=0; filtered<2; filtered++) {
+		ReplayResult result;
+		if(replayOnce(&rec, filtered, &result)) {
+			printf("%s,failed\n", modes[filtered]);
+			continue;
+		}
+		printf("%s,%d,%lu,%lu,%lu,%lu,%.0f,%.3f\n", modes[filtered], rec.count, result.delivered, result.wakeups, result.receiveCalls,
+				result.matched, 1e6 * result.cpuSec, rec.count ? 1e6 * result.cpuSec / rec.count : 0);
+	}
+	freeRecording(&rec);
+	return 0;
+}
+
+int loadRecording(const char *path, Recording *dest) {
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return -1;
+	memset(dest, 0, sizeof(Recording));
+	dest->nsec = malloc(MAX_RECORDED_UEVENTS * sizeof(uint64_t));
+	dest->sizes = malloc(MAX_RECORDED_UEVENTS * sizeof(uint32_t));
+	dest->msgs = malloc(MAX_RECORDED_UEVENTS * sizeof(char *));
+	if(!dest->nsec || !dest->sizes || !dest->msgs) {
+		fclose(f);
+		freeRecording(dest);
+		return -1;
+	}
+	uint64_t nsec;
+	uint32_t size;
+	while(dest->count < MAX_RECORDED_UEVENTS && fread(&nsec, sizeof(uint64_t), 1, f) == 1 && fread(&size, sizeof(uint32_t), 1, f) == 1) {
+		if(size == 0 || size > MAX_NETLINK_MSG)
+			break;
+		char *msg = malloc(size);
+		if(!msg || fread(msg, 1, size, f) != size) {
+			free(msg);
+			break;
+		}
+		dest->nsec[dest->count] = nsec;
+		dest->sizes[dest->count] = size;
+		dest->msgs[dest->count] = msg;
+		dest->count++;
+	}
+	fclose(f);
+	return 0;
+}
+
+void freeRecording(Recording *rec) {
+	for(int i=0; i<rec->count; i++)
+		free(rec->msgs[i]);
+	free(rec->msgs);
+	free(rec->nsec);
+	free(rec->sizes);
+	rec->count = 0;
+}
+
+// The sender thread plays the recording into one end of a socketpair, the calling thread receives like playerd.c does.
+int replayOnce(Recording *rec, bool filtered, ReplayResult *dest) {
+	memset(dest, 0, sizeof(ReplayResult));
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) == -1)
+		return -1;
+	int recvFd = fds[0];
+	fcntl(recvFd, F_SETFL, O_NONBLOCK);
+	if(filtered && attachUeventFilter(recvFd)) {
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event event = { .events = EPOLLIN, .data.fd = recvFd };
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, recvFd, &event);
+
+	rec->sendFd = fds[1];
+	pthread_t sender;
+	if(pthread_create(&sender, NULL, sendRecording, rec)) {
+		close(epollFd);
+		close(fds[0]);
+		close(fds[1]);
+		return -1;
+	}
+
+	double cpuStart = threadCpuSec();
+	static UeventBatch batch;
+	bool closed = false;
+	while(!closed) {
+		struct epoll_event ready;
+		if(epoll_wait(epollFd, &ready, 1, -1) < 1)
+			continue;
+		dest->wakeups++;
+		while(!closed) {
+			int count;
+			if(filtered)
+				count = receiveUevents(recvFd, &batch);
+			else {
+				count = 0;
+				ssize_t size = recv(recvFd, batch.msgs[0], MAX_NETLINK_MSG, MSG_DONTWAIT);
+				if(size > 0) {
+					batch.sizes[0] = size;
+					count = 1;
+				}
+				else if(size == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+					count = -1;
+			}
+			dest->receiveCalls++;
+			if(count == -1)
+				closed = true;
+			if(count <= 0)
+				break;
+			for(int i=0; i<count; i++) {
+				Uevent uevent;
+				dest->delivered++;
+				if(parseUevent(batch.msgs[i], batch.sizes[i], &uevent) == 0 && classifyUevent(&uevent) != UEVENT_IGNORED)
+					dest->matched++;
+			}
+		}
+	}
+	dest->cpuSec = threadCpuSec() - cpuStart;
+
+	pthread_join(sender, NULL);
+	close(epollFd);
+	close(recvFd);
+	return 0;
+}
+
+// Keeps the recorded gaps, divided by the speedup, and closes its end when done so the receiver knows.
+void *sendRecording(void *arg) {
+	Recording *rec = arg;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(int i=0; i<rec->count; i++) {
+		uint64_t offset = rec->nsec[i] / rec->speedup;
+		struct timespec at = { .tv_sec = start.tv_sec + offset / NSEC_PER_SEC, .tv_nsec = start.tv_nsec + offset % NSEC_PER_SEC };
+		if(at.tv_nsec >= NSEC_PER_SEC) {
+			at.tv_sec++;
+			at.tv_nsec -= NSEC_PER_SEC;
+		}
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &at, NULL);
+		send(rec->sendFd, rec->msgs[i], rec->sizes[i], 0);
+	}
+	close(rec->sendFd);
+	return NULL;
+}
+
+double threadCpuSec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// The copy and direct transports read into one page aligned buffer, like the playback ring slots.
+// The mmap transport uses the data where the driver left it, which is the whole point of it.
+int readSecondsOfAudio(int transport, uint32_t startLBA, uint32_t leadoutLBA, long seconds) {
+	void *buf;
+	if(posix_memalign(&buf, sysconf(_SC_PAGESIZE), READ_CHUNK_BLOCKS*CD_AUDIO_BLOCK_SIZE))
+		return -1;
+
+	uint32_t lba = startLBA;
+	uint32_t endLBA = startLBA + seconds*CD_AUDIO_BLOCKS_ONE_SEC;
+	int status = 0;
+	while(lba < endLBA && status == 0) {
+		long written = 0;
+		if(transport == READ_TRANSPORT_MMAP) {
+			void *data;
+			status = readCDAudioMapped(lba, leadoutLBA, endLBA-lba, &data, &written);
+		}
+		else {
+			uint32_t blocks = endLBA-lba < READ_CHUNK_BLOCKS ? endLBA-lba : READ_CHUNK_BLOCKS;
+			status = readCDAudioInto(lba, leadoutLBA, blocks, buf, &written);
+		}
+		lba += written/CD_AUDIO_BLOCK_SIZE;
+	}
+	free(buf);
+	if(status == READ_CD_AUDIO_LEADOUT_REACHED)
+		status = 0;
+	return status;
+}
+
+void startUsage(Usage *usage) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	usage->cpuSec = timevalSec(ru.ru_utime) + timevalSec(ru.ru_stime);
+	usage->wallSec = monotonicSec();
+}
+
+void stopUsage(Usage *usage) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	usage->cpuSec = timevalSec(ru.ru_utime) + timevalSec(ru.ru_stime) - usage->cpuSec;
+	usage->wallSec = monotonicSec() - usage->wallSec;
+}
+
+double timevalSec(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+long parseLongArg(int argc, char *argv[], int i, long fallback) {
+	if(i >= argc)
+		return fallback;
+	char *endp;
+	long value = strtol(argv[i], &endp, 10);
+	if(endp == argv[i] || *endp != '\0' || value < 0)
+		return fallback;
+	return value;
+}
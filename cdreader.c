@@ -0,0 +1,108 @@
+// Reader thread that keeps a RingBuf filled with CD audio.
+// Shared by playback and ripping so neither has to wait on the drive between writes.
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "cdreader.h"
+#include "readcd.h"
+#include "secureread.h"
+#include "checksum.h"
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 1
+#define FAILED_START_THREAD 2
+
+void *readIntoRing(void *reader);
+
+struct CDReader {
+	pthread_t thread;
+	RingBuf *ring;
+	uint32_t startLBA;
+	uint32_t endLBA;
+	uint32_t blocksPerSlot;
+	uint32_t nextSlotBlocks; // doubles from the first slot's size up to blocksPerSlot
+	atomic_bool stop; // set by the consumer if it gives up early
+	atomic_bool finished; // set by the reader once it has published its last slot
+};
+
+// Starts a thread reading from startLBA up to, but not including, endLBA into ring.
+// Each slot gets blocksPerSlot blocks, so the ring's slot size must be at least blocksPerSlot*CD_AUDIO_BLOCK_SIZE.
+// On failure *dest is unmodified.
+int startCDReader(CDReader **dest, RingBuf *ring, uint32_t startLBA, uint32_t endLBA, uint32_t blocksPerSlot) {
+	return startCDReaderRamped(dest, ring, startLBA, endLBA, blocksPerSlot, blocksPerSlot);
+}
+
+// Same as startCDReader(), but the first slot only gets firstSlotBlocks blocks and each slot after that twice as many, up to blocksPerSlot.
+// After a seek a small first read gets audio to the consumer sooner, the bigger reads after it build the buffer back up.
+int startCDReaderRamped(CDReader **dest, RingBuf *ring, uint32_t startLBA, uint32_t endLBA, uint32_t blocksPerSlot, uint32_t firstSlotBlocks) {
+	CDReader *reader = malloc(sizeof(CDReader));
+	if(!reader)
+		return FAILED_ALLOCATE_MEMORY;
+	reader->ring = ring;
+	reader->startLBA = startLBA;
+	reader->endLBA = endLBA;
+	reader->blocksPerSlot = blocksPerSlot;
+	reader->nextSlotBlocks = firstSlotBlocks > 0 && firstSlotBlocks < blocksPerSlot ? firstSlotBlocks : blocksPerSlot;
+	atomic_init(&reader->stop, false);
+	atomic_init(&reader->finished, false);
+
+	if(pthread_create(&reader->thread, NULL, readIntoRing, reader)) {
+		free(reader);
+		return FAILED_START_THREAD;
+	}
+	*dest = reader;
+	return SUCCESS;
+}
+
+// True once the reader has published its last slot, there will be nothing more in the ring after what is there now.
+bool isCDReaderFinished(CDReader *reader) {
+	return atomic_load(&reader->finished);
+}
+
+// Tells the reader to stop, waits for it and frees it. The ring is left to the caller.
+void stopCDReader(CDReader *reader) {
+	atomic_store(&reader->stop, true);
+	pthread_join(reader->thread, NULL);
+	free(reader);
+}
+
+// Reader thread. Fills slots from startLBA until endLBA, an error, or the consumer says stop.
+// The last slot published always has RING_SLOT_LAST or RING_SLOT_ERROR set so the consumer knows when to finish.
+void *readIntoRing(void *arg) {
+	CDReader *reader = arg;
+	uint32_t lba = reader->startLBA;
+	bool done = false;
+	while(!done && !atomic_load(&reader->stop)) {
+		RingSlot *slot = getWritableSlot(reader->ring);
+		if(!slot) {
+			waitForRing();
+			continue;
+		}
+		slot->flags = 0;
+		slot->startLBA = lba;
+		slot->size = 0;
+		if(isSecureReadEnabled())
+			slot->status = secureReadCDAudioInto(lba, reader->endLBA, reader->nextSlotBlocks, slot->data, &slot->size);
+		else
+			slot->status = readCDAudioInto(lba, reader->endLBA, reader->nextSlotBlocks, slot->data, &slot->size);
+		reader->nextSlotBlocks = reader->nextSlotBlocks*2 < reader->blocksPerSlot ? reader->nextSlotBlocks*2 : reader->blocksPerSlot;
+		// unverified audio is still the best the drive could do, the consumer sees the status and decides what to make of it
+		bool unverified = slot->status == SECURE_READ_UNVERIFIED;
+		if(slot->status == READ_CD_AUDIO_LEADOUT_REACHED || (unverified && lba + slot->size/CD_AUDIO_BLOCK_SIZE >= reader->endLBA)) {
+			slot->flags |= RING_SLOT_LAST;
+			done = true;
+		}
+		else if(slot->status && !unverified) {
+			slot->flags |= RING_SLOT_ERROR;
+			done = true;
+		}
+		if(!(slot->flags & RING_SLOT_ERROR))
+			checksumAudio(lba, slot->data, slot->size);
+		lba += slot->size / CD_AUDIO_BLOCK_SIZE;
+		publishSlot(reader->ring);
+	}
+	atomic_store(&reader->finished, true);
+	return NULL;
+}
@@ -0,0 +1,18 @@
+
+#ifndef CDREADER_H
+#define CDREADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "ringbuf.h"
+
+#define SEEK_FIRST_BLOCKS 2 // blocks in the first read after a seek or at a fast start, ~27ms of audio, about one ALSA period
+
+typedef struct CDReader CDReader;
+
+int startCDReader(CDReader **dest, RingBuf *ring, uint32_t startLBA, uint32_t endLBA, uint32_t blocksPerSlot);
+int startCDReaderRamped(CDReader **dest, RingBuf *ring, uint32_t startLBA, uint32_t endLBA, uint32_t blocksPerSlot, uint32_t firstSlotBlocks);
+bool isCDReaderFinished(CDReader *reader);
+void stopCDReader(CDReader *reader);
+
+#endif
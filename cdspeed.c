@@ -0,0 +1,276 @@
+// Picks how fast the drive spins for what the audio is being used for.
+// Playback only needs a little over 1x, anything faster just adds noise, heat and seek time.
+// Ripping wants everything the drive can give.
+//
+// SET CD SPEED is tried first since almost every drive supports it, SET STREAMING is the fallback for drives that only honour that.
+// 	MMC-3 Manual, 6.37 SET CD SPEED Command
+// 	MMC-3 Manual, 6.39 SET STREAMING Command
+// The speed the drive had before the first change comes from MODE SENSE page 2Ah and is put back by restoreDriveSpeed().
+//
+// Every read made while a speed is requested is timed, and the sustained rate at each requested speed is kept
+// in a small per drive profile in SPEED_PROFILE_PATH.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cdspeed.h"
+#include "readcd.h"
+#include "drive.h"
+#include "config.h"
+
+#define ONE_BYTE 8
+
+#define SET_CD_SPEED_CDB_SIZE 12
+#define SET_CD_SPEED_OPCODE 0xbb
+#define iREAD_SPEED_MSB 2
+#define iWRITE_SPEED_MSB 4
+
+#define SET_STREAMING_CDB_SIZE 12
+#define SET_STREAMING_OPCODE 0xb6
+#define iPARAM_LIST_LEN_MSB 9
+#define PERFORMANCE_DESCRIPTOR_SIZE 28
+#define iDESCRIPTOR_END_LBA 8
+#define iDESCRIPTOR_READ_SIZE 12
+#define iDESCRIPTOR_READ_TIME 16
+#define iDESCRIPTOR_WRITE_SIZE 20
+#define iDESCRIPTOR_WRITE_TIME 24
+#define STREAMING_TIME_MS 1000 // the sizes in the descriptor are how many kB per this many ms
+#define END_OF_DISC_LBA 0x7fffffff
+
+#define MODE_SENSE_CDB_SIZE 10
+#define MODE_SENSE_OPCODE 0x5a
+#define CAPABILITIES_PAGE 0x2a
+#define MODE_SENSE_ALLOC_LEN 0xff
+#define MODE_HEADER_SIZE 8
+#define iBLOCK_DESCRIPTOR_LEN 6
+#define PAGE_CODE_MASK 0b00111111
+#define iCURRENT_READ_SPEED 14 // offset into page 2Ah
+
+#define KBPS_PER_X_TENTHS 1764 // 1x is 176.4kB/s (1000 byte kB, as MMC uses)
+#define PLAYBACK_SPEED_X 4 // fast enough to refill the ring after a hiccup, slow enough to stay quiet
+#define MAX_SPEED_SAMPLES 16
+#define MAX_PROFILE_LINE 128
+#define PROFILE_FILE_MODE 0644 // mkstemp() makes it 0600
+#define MAX_PATH 512
+
+#define SUCCESS 0
+#define FAILED_OPEN_DEVICE 1
+#define FAILED_SET_SPEED 2
+#define BAD_POLICY 3
+#define FAILED_WRITE_PROFILE 4
+
+static int sendCommand(uint8_t *cdb, unsigned char cdbLen, int direction, uint8_t *dataBuf, unsigned int dataLen);
+static int sendSetCDSpeed(uint16_t readKBps);
+static int sendSetStreaming(uint16_t readKBps);
+static uint16_t readCurrentSpeed(void);
+static void putBE32(uint8_t *dest, uint32_t value);
+static uint16_t xToKBps(int x);
+
+static bool changedSpeed = false;
+static uint16_t previousKBps = SPEED_MAX_KBPS; // the drive's own setting, restored by restoreDriveSpeed()
+static uint16_t requestedKBps = 0; // 0 until a speed has been requested
+static SpeedSample samples[MAX_SPEED_SAMPLES];
+static int samplesLen = 0;
+
+int applySpeedPolicy(int policy) {
+	switch(policy) {
+		case SPEED_POLICY_DRIVE:
+			return restoreDriveSpeed();
+		case SPEED_POLICY_PLAYBACK:
+			return setDriveSpeed(xToKBps(PLAYBACK_SPEED_X));
+		case SPEED_POLICY_BULK:
+			return setDriveSpeed(SPEED_MAX_KBPS);
+		default:
+			return BAD_POLICY;
+	}
+}
+
+// readKBps is in 1000 byte kB/s, SPEED_MAX_KBPS asks for the fastest the drive can do.
+// The drive rounds to a speed it supports, usually the nearest one below.
+// The drive is held across the commands so it isn't opened once for each.
+int setDriveSpeed(uint16_t readKBps) {
+	if(acquireDrive())
+		return FAILED_OPEN_DEVICE;
+	if(!changedSpeed) {
+		uint16_t current = readCurrentSpeed();
+		if(current)
+			previousKBps = current;
+	}
+	int status = sendSetCDSpeed(readKBps) && sendSetStreaming(readKBps);
+	releaseDrive();
+	if(status)
+		return FAILED_SET_SPEED;
+	changedSpeed = true;
+	requestedKBps = readKBps;
+	return SUCCESS;
+}
+
+// Puts back the speed the drive had before the first setDriveSpeed(). Does nothing if the speed was never changed.
+// Called by closeOpticalDrive().
+int restoreDriveSpeed(void) {
+	if(!changedSpeed)
+		return SUCCESS;
+	if(acquireDrive())
+		return FAILED_OPEN_DEVICE;
+	saveSpeedProfile();
+	int status = sendSetCDSpeed(previousKBps) && sendSetStreaming(previousKBps);
+	releaseDrive();
+	if(status)
+		return FAILED_SET_SPEED;
+	changedSpeed = false;
+	requestedKBps = 0;
+	return SUCCESS;
+}
+
+// Called by readcd.c after every read, with the time the read spent waiting on the drive.
+// Only counted while a speed has been requested, otherwise there is nothing to attribute it to.
+void recordReadThroughput(long bytes, double seconds) {
+	if(!requestedKBps || seconds <= 0)
+		return;
+	int i;
+	for(i=0; i<samplesLen && samples[i].requestedKBps != requestedKBps; i++);
+	if(i == samplesLen) {
+		if(samplesLen == MAX_SPEED_SAMPLES)
+			return;
+		samplesLen++;
+		memset(&samples[i], 0, sizeof(SpeedSample));
+		samples[i].requestedKBps = requestedKBps;
+	}
+	samples[i].bytes += bytes;
+	samples[i].seconds += seconds;
+}
+
+// Copies up to maxSamples of this run's measurements into dest and returns how many were copied.
+int getSpeedProfile(SpeedSample *dest, int maxSamples) {
+	int count = samplesLen < maxSamples ? samplesLen : maxSamples;
+	memcpy(dest, samples, count * sizeof(SpeedSample));
+	return count;
+}
+
+// The profile is a text file of "<drive id>\t<requested kB/s>\t<measured kB/s>" lines.
+// This run's measurements replace any earlier ones for the same drive and speed.
+int saveSpeedProfile(void) {
+	if(samplesLen == 0)
+		return SUCCESS;
+	const char *id = getDriveId();
+
+	// a name of its own, like the batch cache in probecd.c, since /var/tmp is shared with every user
+	char tmpPath[MAX_PATH];
+	snprintf(tmpPath, MAX_PATH, "%s.XXXXXX", SPEED_PROFILE_PATH);
+	int fd = mkstemp(tmpPath);
+	if(fd == -1)
+		return FAILED_WRITE_PROFILE;
+	fchmod(fd, PROFILE_FILE_MODE);
+	FILE *out = fdopen(fd, "w");
+	if(!out) {
+		close(fd);
+		unlink(tmpPath);
+		return FAILED_WRITE_PROFILE;
+	}
+
+	FILE *in = fopen(SPEED_PROFILE_PATH, "r");
+	if(in) {
+		char line[MAX_PROFILE_LINE];
+		size_t idLen = strlen(id);
+		while(fgets(line, MAX_PROFILE_LINE, in)) {
+			bool replaced = false;
+			if(strncmp(line, id, idLen) == 0 && line[idLen] == '\t') {
+				unsigned long kbps = strtoul(line+idLen+1, NULL, 10);
+				for(int i=0; i<samplesLen; i++)
+					replaced |= samples[i].requestedKBps == kbps;
+			}
+			if(!replaced)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	for(int i=0; i<samplesLen; i++) {
+		if(samples[i].seconds > 0)
+			fprintf(out, "%s\t%u\t%.0f\n", id, samples[i].requestedKBps, samples[i].bytes / samples[i].seconds / 1000);
+	}
+	if(fclose(out) || rename(tmpPath, SPEED_PROFILE_PATH)) {
+		unlink(tmpPath);
+		return FAILED_WRITE_PROFILE;
+	}
+	return SUCCESS;
+}
+
+// direction is one of the DRIVE_DATA_* values in drive.h
+static int sendCommand(uint8_t *cdb, unsigned char cdbLen, int direction, uint8_t *dataBuf, unsigned int dataLen) {
+	DriveCommand command;
+	initDriveCommand(&command, direction, dataBuf, dataLen);
+	memcpy(command.cdb, cdb, cdbLen);
+	command.cdbLen = cdbLen;
+
+	if(sendDriveCommand(&command))
+		return FAILED_SET_SPEED;
+	return SUCCESS;
+}
+
+static int sendSetCDSpeed(uint16_t readKBps) {
+	uint8_t cdb[SET_CD_SPEED_CDB_SIZE];
+	memset(cdb, 0, SET_CD_SPEED_CDB_SIZE);
+	cdb[0] = SET_CD_SPEED_OPCODE;
+	cdb[iREAD_SPEED_MSB] = readKBps >> ONE_BYTE;
+	cdb[iREAD_SPEED_MSB+1] = readKBps;
+	cdb[iWRITE_SPEED_MSB] = SPEED_MAX_KBPS >> ONE_BYTE; // leave writing alone
+	cdb[iWRITE_SPEED_MSB+1] = SPEED_MAX_KBPS & 0xff;
+	return sendCommand(cdb, SET_CD_SPEED_CDB_SIZE, DRIVE_DATA_NONE, NULL, 0);
+}
+
+// SET STREAMING describes the speed as "read size kB every read time ms" over an LBA range, the whole disc here.
+static int sendSetStreaming(uint16_t readKBps) {
+	uint8_t cdb[SET_STREAMING_CDB_SIZE];
+	memset(cdb, 0, SET_STREAMING_CDB_SIZE);
+	cdb[0] = SET_STREAMING_OPCODE;
+	cdb[iPARAM_LIST_LEN_MSB] = 0;
+	cdb[iPARAM_LIST_LEN_MSB+1] = PERFORMANCE_DESCRIPTOR_SIZE;
+
+	uint32_t kbPerTime = readKBps == SPEED_MAX_KBPS ? 0xffffffff : readKBps;
+	uint8_t descriptor[PERFORMANCE_DESCRIPTOR_SIZE];
+	memset(descriptor, 0, PERFORMANCE_DESCRIPTOR_SIZE);
+	putBE32(descriptor+iDESCRIPTOR_END_LBA, END_OF_DISC_LBA);
+	putBE32(descriptor+iDESCRIPTOR_READ_SIZE, kbPerTime);
+	putBE32(descriptor+iDESCRIPTOR_READ_TIME, STREAMING_TIME_MS);
+	putBE32(descriptor+iDESCRIPTOR_WRITE_SIZE, kbPerTime);
+	putBE32(descriptor+iDESCRIPTOR_WRITE_TIME, STREAMING_TIME_MS);
+	return sendCommand(cdb, SET_STREAMING_CDB_SIZE, DRIVE_DATA_OUT, descriptor, PERFORMANCE_DESCRIPTOR_SIZE);
+}
+
+// Returns 0 if the drive doesn't report it.
+static uint16_t readCurrentSpeed(void) {
+	uint8_t cdb[MODE_SENSE_CDB_SIZE];
+	memset(cdb, 0, MODE_SENSE_CDB_SIZE);
+	cdb[0] = MODE_SENSE_OPCODE;
+	cdb[2] = CAPABILITIES_PAGE;
+	cdb[8] = MODE_SENSE_ALLOC_LEN;
+
+	uint8_t data[MODE_SENSE_ALLOC_LEN];
+	memset(data, 0, MODE_SENSE_ALLOC_LEN);
+	if(sendCommand(cdb, MODE_SENSE_CDB_SIZE, DRIVE_DATA_IN, data, MODE_SENSE_ALLOC_LEN))
+		return 0;
+
+	unsigned int blockDescriptorLen = (data[iBLOCK_DESCRIPTOR_LEN] << ONE_BYTE) | data[iBLOCK_DESCRIPTOR_LEN+1];
+	unsigned int iPage = MODE_HEADER_SIZE + blockDescriptorLen;
+	if(iPage + iCURRENT_READ_SPEED + 1 >= MODE_SENSE_ALLOC_LEN)
+		return 0;
+	uint8_t *page = data + iPage;
+	if((page[0] & PAGE_CODE_MASK) != CAPABILITIES_PAGE)
+		return 0;
+	return (page[iCURRENT_READ_SPEED] << ONE_BYTE) | page[iCURRENT_READ_SPEED+1];
+}
+
+static void putBE32(uint8_t *dest, uint32_t value) {
+	dest[0] = value >> ONE_BYTE*3;
+	dest[1] = value >> ONE_BYTE*2;
+	dest[2] = value >> ONE_BYTE;
+	dest[3] = value;
+}
+
+static uint16_t xToKBps(int x) {
+	return (x * KBPS_PER_X_TENTHS + 9) / 10;
+}
@@ -0,0 +1,30 @@
+
+#ifndef CDSPEED_H
+#define CDSPEED_H
+
+#include <stdint.h>
+
+// speed policies for applySpeedPolicy()
+#define SPEED_POLICY_DRIVE 0 // whatever the drive was doing before, nothing is sent
+#define SPEED_POLICY_PLAYBACK 1 // slow and quiet, just enough to stay ahead of real time
+#define SPEED_POLICY_BULK 2 // as fast as the drive can go, for ripping
+
+#define SPEED_MAX_KBPS 0xffff // asks the drive for its maximum
+
+typedef struct SpeedSample SpeedSample;
+
+// throughput measured while a speed was requested
+struct SpeedSample {
+	uint16_t requestedKBps;
+	double bytes;
+	double seconds; // time spent inside READ CD, not time spent idle between reads
+};
+
+int applySpeedPolicy(int policy);
+int setDriveSpeed(uint16_t readKBps);
+int restoreDriveSpeed(void);
+void recordReadThroughput(long bytes, double seconds);
+int getSpeedProfile(SpeedSample *dest, int maxSamples);
+int saveSpeedProfile(void);
+
+#endif
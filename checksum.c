@@ -0,0 +1,402 @@
+// Per track AccurateRip (v1 and v2) and CRC32 checksums, computed as audio comes off the disc so no second pass is needed.
+//
+// AccurateRip multiplies every 32 bit stereo frame by its 1 based position in the track and sums the products.
+// 	v1 keeps the low 32 bits of each product, v2 adds the high 32 bits on top of that.
+// 	The first 5 blocks (less one frame) of the first track and the last 5 blocks of the last audio track are left out, drives can't agree on them.
+// 	http://wiki.hydrogenaud.io/index.php?title=AccurateRip
+// CRC32 is the usual reflected 0xEDB88320 polynomial over every byte of the track.
+// 	Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" (folding by 4 then Barrett reduction)
+//
+// Audio reaches the checksums through checksumAudio(), called from the CDReader thread and the mmap playback path once a read is final,
+// so secure read's re-reads are never counted. Blocks have to arrive in order, anything read twice is ignored
+// and a track with a hole in it is marked as having a gap rather than given a wrong checksum.
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "checksum.h"
+#include "readcd.h"
+
+#define CRC32_POLY 0xedb88320
+#define FRAME_SIZE 4
+#define FRAMES_PER_BLOCK (CD_AUDIO_BLOCK_SIZE / FRAME_SIZE)
+#define AR_SKIPPED_FRAMES (5 * FRAMES_PER_BLOCK)
+#define CLMUL_MIN_LEN 64
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 1
+#define KERNEL_UNSUPPORTED 2
+
+typedef uint32_t (*CRCFunc)(uint32_t crc, const uint8_t *data, size_t len);
+typedef void (*ARFunc)(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi);
+
+typedef struct TrackState TrackState;
+
+struct TrackState {
+	TrackChecksum sum;
+	uint32_t crcRegister; // not yet inverted
+	uint32_t arLo; // sum of the low halves of the products, which is v1
+	uint32_t arHi; // sum of the high halves, v2 is arLo + arHi
+	uint32_t arFrom; // first 1 based frame counted by AccurateRip
+	uint32_t arTo; // last 1 based frame counted
+};
+
+struct DiscChecksums {
+	TrackState *tracks;
+	uint8_t tracksLen;
+};
+
+static void updateTrack(TrackState *track, uint32_t startLBA, const uint8_t *data, uint32_t blocks);
+static uint32_t crc32Scalar(uint32_t crc, const uint8_t *data, size_t len);
+static void accurateRipScalar(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi);
+#ifdef HAVE_X86_KERNELS
+static uint32_t crc32CLMUL(uint32_t crc, const uint8_t *data, size_t len);
+static void accurateRipSSE2(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi);
+static void accurateRipAVX2(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi);
+#endif
+static void pickKernel(void);
+static void makeCRCTable(void);
+
+static int kernel = CHECKSUM_KERNEL_BEST; // CHECKSUM_KERNEL_BEST until the first kernel is used
+static CRCFunc crcFunc;
+static ARFunc arFunc;
+static uint32_t crcTable[8][256]; // slicing by 8
+static bool crcTableMade = false;
+static DiscChecksums *active = NULL;
+
+// One set of checksums for every audio track on the disc. On failure *dest is unmodified.
+int makeDiscChecksums(DiscChecksums **dest, TOC *toc) {
+	DiscChecksums *sums = malloc(sizeof(DiscChecksums));
+	if(!sums)
+		return FAILED_ALLOCATE_MEMORY;
+	sums->tracksLen = getTrackCount(toc);
+	sums->tracks = calloc(sums->tracksLen, sizeof(TrackState));
+	if(!sums->tracks) {
+		free(sums);
+		return FAILED_ALLOCATE_MEMORY;
+	}
+
+	uint8_t first = getFirstTrackNumber(toc);
+	uint8_t lastAudio = 0;
+	for(uint8_t i=0; i<sums->tracksLen; i++) {
+		if(isAudioTrack(getTrack(toc, first+i)))
+			lastAudio = first+i;
+	}
+	for(uint8_t i=0; i<sums->tracksLen; i++) {
+		TrackState *track = &sums->tracks[i];
+		track->sum.trackNum = first+i;
+		track->sum.startLBA = getStartLBA(getTrack(toc, first+i));
+		track->sum.endLBA = isAudioTrack(getTrack(toc, first+i)) ? getTrackEndLBA(toc, first+i) : track->sum.startLBA;
+		track->sum.nextLBA = track->sum.startLBA;
+		track->crcRegister = 0xffffffff;
+		uint32_t frames = (track->sum.endLBA - track->sum.startLBA) * FRAMES_PER_BLOCK;
+		track->arFrom = track->sum.trackNum == first ? AR_SKIPPED_FRAMES : 1;
+		track->arTo = frames;
+		if(track->sum.trackNum == lastAudio)
+			track->arTo = frames > AR_SKIPPED_FRAMES ? frames - AR_SKIPPED_FRAMES : 0;
+	}
+	*dest = sums;
+	return SUCCESS;
+}
+
+void destroyDiscChecksums(DiscChecksums *sums) {
+	if(active == sums)
+		active = NULL;
+	free(sums->tracks);
+	free(sums);
+}
+
+// Feeds size bytes of audio starting at startLBA to whichever tracks they belong to.
+void updateDiscChecksums(DiscChecksums *sums, uint32_t startLBA, const void *data, long size) {
+	uint32_t blocks = size / CD_AUDIO_BLOCK_SIZE;
+	uint32_t endLBA = startLBA + blocks;
+	for(uint8_t i=0; i<sums->tracksLen; i++) {
+		TrackState *track = &sums->tracks[i];
+		if(endLBA <= track->sum.startLBA || startLBA >= track->sum.endLBA)
+			continue;
+		uint32_t from = startLBA > track->sum.startLBA ? startLBA : track->sum.startLBA;
+		uint32_t to = endLBA < track->sum.endLBA ? endLBA : track->sum.endLBA;
+		updateTrack(track, from, (const uint8_t *)data + (from-startLBA)*CD_AUDIO_BLOCK_SIZE, to-from);
+	}
+}
+
+// Fills *dest with the track's checksums and returns true if every block of the track has been seen.
+// If not, *dest still has the checksums of what has been seen so far.
+bool getTrackChecksum(DiscChecksums *sums, uint8_t trackNum, TrackChecksum *dest) {
+	for(uint8_t i=0; i<sums->tracksLen; i++) {
+		TrackState *track = &sums->tracks[i];
+		if(track->sum.trackNum != trackNum)
+			continue;
+		*dest = track->sum;
+		dest->accurateRipV1 = track->arLo;
+		dest->accurateRipV2 = track->arLo + track->arHi;
+		dest->crc32 = ~track->crcRegister;
+		return !track->sum.gap && track->sum.nextLBA == track->sum.endLBA && track->sum.endLBA > track->sum.startLBA;
+	}
+	return false;
+}
+
+// Sets the checksums checksumAudio() feeds, NULL to stop checksumming.
+void setActiveChecksums(DiscChecksums *sums) {
+	active = sums;
+}
+
+// Called with audio once it is final. Does nothing unless setActiveChecksums() was given something.
+void checksumAudio(uint32_t startLBA, const void *data, long size) {
+	if(active)
+		updateDiscChecksums(active, startLBA, data, size);
+}
+
+// crc is the running register, start it at 0xffffffff and invert it at the end.
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len) {
+	if(kernel == CHECKSUM_KERNEL_BEST)
+		pickKernel();
+	return crcFunc(crc, data, len);
+}
+
+// Adds count frames to the AccurateRip sums, frames[0] being at 1 based position firstMultiplier in the track.
+void accurateRipUpdate(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi) {
+	if(kernel == CHECKSUM_KERNEL_BEST)
+		pickKernel();
+	arFunc(frames, count, firstMultiplier, sumLo, sumHi);
+}
+
+// Forces one of the CHECKSUM_KERNEL_* kernels. Fails if the CPU can't run it, the current kernel is left as it was.
+int setChecksumKernel(int newKernel) {
+	makeCRCTable();
+	if(newKernel == CHECKSUM_KERNEL_BEST) {
+		pickKernel();
+		return SUCCESS;
+	}
+	if(newKernel == CHECKSUM_KERNEL_SCALAR) {
+		crcFunc = crc32Scalar;
+		arFunc = accurateRipScalar;
+	}
+#ifdef HAVE_X86_KERNELS
+	else if(newKernel == CHECKSUM_KERNEL_SSE2 && __builtin_cpu_supports("sse4.1") && __builtin_cpu_supports("pclmul")) {
+		crcFunc = crc32CLMUL;
+		arFunc = accurateRipSSE2;
+	}
+	else if(newKernel == CHECKSUM_KERNEL_AVX2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("pclmul")) {
+		crcFunc = crc32CLMUL;
+		arFunc = accurateRipAVX2;
+	}
+#endif
+	else
+		return KERNEL_UNSUPPORTED;
+	kernel = newKernel;
+	return SUCCESS;
+}
+
+// Returns the kernel in use, one of the CHECKSUM_KERNEL_* values other than CHECKSUM_KERNEL_BEST.
+int getChecksumKernel(void) {
+	if(kernel == CHECKSUM_KERNEL_BEST)
+		pickKernel();
+	return kernel;
+}
+
+const char *getChecksumKernelName(int k) {
+	switch(k) {
+		case CHECKSUM_KERNEL_SCALAR: return "scalar";
+		case CHECKSUM_KERNEL_SSE2: return "sse2+pclmul";
+		case CHECKSUM_KERNEL_AVX2: return "avx2+pclmul";
+		default: return "best";
+	}
+}
+
+static void updateTrack(TrackState *track, uint32_t startLBA, const uint8_t *data, uint32_t blocks) {
+	if(startLBA > track->sum.nextLBA) {
+		track->sum.gap = true;
+		return;
+	}
+	uint32_t skip = track->sum.nextLBA - startLBA; // already counted
+	if(skip >= blocks)
+		return;
+	data += skip*CD_AUDIO_BLOCK_SIZE;
+	blocks -= skip;
+
+	size_t len = (size_t)blocks*CD_AUDIO_BLOCK_SIZE;
+	track->crcRegister = crc32Update(track->crcRegister, data, len);
+
+	// frame positions are 1 based, only the part inside [arFrom, arTo] counts but the multiplier keeps counting through the rest
+	uint32_t firstFrame = (track->sum.nextLBA - track->sum.startLBA) * FRAMES_PER_BLOCK + 1;
+	uint32_t lastFrame = firstFrame + blocks*FRAMES_PER_BLOCK - 1;
+	uint32_t from = firstFrame > track->arFrom ? firstFrame : track->arFrom;
+	uint32_t to = lastFrame < track->arTo ? lastFrame : track->arTo;
+	if(from <= to) {
+		const uint32_t *frames = (const uint32_t *)data + (from-firstFrame);
+		accurateRipUpdate(frames, to-from+1, from, &track->arLo, &track->arHi);
+	}
+	track->sum.nextLBA += blocks;
+}
+
+static void pickKernel(void) {
+	if(setChecksumKernel(CHECKSUM_KERNEL_AVX2) && setChecksumKernel(CHECKSUM_KERNEL_SSE2))
+		setChecksumKernel(CHECKSUM_KERNEL_SCALAR);
+}
+
+static void makeCRCTable(void) {
+	if(crcTableMade)
+		return;
+	for(uint32_t i=0; i<256; i++) {
+		uint32_t crc = i;
+		for(int bit=0; bit<8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32_POLY : crc >> 1;
+		crcTable[0][i] = crc;
+	}
+	for(uint32_t i=0; i<256; i++) {
+		for(int slice=1; slice<8; slice++)
+			crcTable[slice][i] = (crcTable[slice-1][i] >> 8) ^ crcTable[0][crcTable[slice-1][i] & 0xff];
+	}
+	crcTableMade = true;
+}
+
+// slicing by 8, frames are little endian on disc and so is every CPU this runs on
+static uint32_t crc32Scalar(uint32_t crc, const uint8_t *data, size_t len) {
+	for(; len >= 8; len -= 8, data += 8) {
+		uint32_t lo, hi;
+		memcpy(&lo, data, 4);
+		memcpy(&hi, data+4, 4);
+		lo ^= crc;
+		crc = crcTable[7][lo & 0xff] ^ crcTable[6][(lo >> 8) & 0xff] ^ crcTable[5][(lo >> 16) & 0xff] ^ crcTable[4][lo >> 24] ^
+			crcTable[3][hi & 0xff] ^ crcTable[2][(hi >> 8) & 0xff] ^ crcTable[1][(hi >> 16) & 0xff] ^ crcTable[0][hi >> 24];
+	}
+	for(; len; len--, data++)
+		crc = (crc >> 8) ^ crcTable[0][(crc ^ *data) & 0xff];
+	return crc;
+}
+
+// The 64 bit products are accumulated in 64 bits, their halves are split out at the end.
+// Only the halves matter and both wrap at 32 bits, so the wider sum is never needed.
+static void accurateRipScalar(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi) {
+	uint32_t lo = *sumLo;
+	uint32_t hi = *sumHi;
+	uint32_t multiplier = firstMultiplier;
+	for(size_t i=0; i<count; i++, multiplier++) {
+		uint64_t product = (uint64_t)frames[i] * multiplier;
+		lo += (uint32_t)product;
+		hi += (uint32_t)(product >> 32);
+	}
+	*sumLo = lo;
+	*sumHi = hi;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Folds 64 bytes at a time with carry-less multiplies, then down to 128 bits, 64 and finally 32 with a Barrett reduction.
+// Constants are x^n mod P for the folding distances, bit reflected, plus P and floor(x^64/P) for the reduction.
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32CLMUL(uint32_t crc, const uint8_t *data, size_t len) {
+	if(len < CLMUL_MIN_LEN)
+		return crc32Scalar(crc, data, len);
+
+	const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+	const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+	const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+	const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_loadu_si128((const __m128i *)(data + 0x00));
+	__m128i x2 = _mm_loadu_si128((const __m128i *)(data + 0x10));
+	__m128i x3 = _mm_loadu_si128((const __m128i *)(data + 0x20));
+	__m128i x4 = _mm_loadu_si128((const __m128i *)(data + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	data += CLMUL_MIN_LEN;
+	len -= CLMUL_MIN_LEN;
+
+	for(; len >= CLMUL_MIN_LEN; data += CLMUL_MIN_LEN, len -= CLMUL_MIN_LEN) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+		__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+		__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+		__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(data + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(data + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(data + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(data + 0x30)));
+	}
+
+	// four lanes down to one
+	__m128i folds[3] = { x2, x3, x4 };
+	for(int i=0; i<3; i++) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, folds[i]), x5);
+	}
+	for(; len >= 16; data += 16, len -= 16) {
+		__m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)data)), x5);
+	}
+
+	// 128 bits to 64
+	__m128i x2r = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2r);
+	x2r = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, mask32);
+	x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2r);
+
+	// Barrett reduction to 32
+	x2r = _mm_and_si128(x1, mask32);
+	x2r = _mm_clmulepi64_si128(x2r, poly, 0x10);
+	x2r = _mm_and_si128(x2r, mask32);
+	x2r = _mm_clmulepi64_si128(x2r, poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2r);
+	crc = _mm_extract_epi32(x1, 1);
+
+	return crc32Scalar(crc, data, len);
+}
+
+// _mm_mul_epu32 multiplies the even 32 bit lanes into full 64 bit products, the odd lanes are shifted down to get theirs.
+// Adding the products as 32 bit lanes keeps the low and high halves in separate lanes with no carry between them,
+// which is exactly the two wrapping sums AccurateRip wants.
+__attribute__((target("sse2")))
+static void accurateRipSSE2(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi) {
+	const size_t lanes = 4;
+	__m128i multipliers = _mm_add_epi32(_mm_set1_epi32(firstMultiplier), _mm_setr_epi32(0, 1, 2, 3));
+	const __m128i step = _mm_set1_epi32(lanes);
+	__m128i sums = _mm_setzero_si128();
+	size_t i = 0;
+	for(; i + lanes <= count; i += lanes) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(frames+i));
+		sums = _mm_add_epi32(sums, _mm_mul_epu32(v, multipliers));
+		sums = _mm_add_epi32(sums, _mm_mul_epu32(_mm_srli_epi64(v, 32), _mm_srli_epi64(multipliers, 32)));
+		multipliers = _mm_add_epi32(multipliers, step);
+	}
+	uint32_t lanesOut[4];
+	_mm_storeu_si128((__m128i *)lanesOut, sums);
+	*sumLo += lanesOut[0] + lanesOut[2];
+	*sumHi += lanesOut[1] + lanesOut[3];
+	accurateRipScalar(frames+i, count-i, firstMultiplier+i, sumLo, sumHi);
+}
+
+__attribute__((target("avx2")))
+static void accurateRipAVX2(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi) {
+	const size_t lanes = 8;
+	__m256i multipliers = _mm256_add_epi32(_mm256_set1_epi32(firstMultiplier), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+	const __m256i step = _mm256_set1_epi32(lanes);
+	__m256i sums = _mm256_setzero_si256();
+	size_t i = 0;
+	for(; i + lanes <= count; i += lanes) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(frames+i));
+		sums = _mm256_add_epi32(sums, _mm256_mul_epu32(v, multipliers));
+		sums = _mm256_add_epi32(sums, _mm256_mul_epu32(_mm256_srli_epi64(v, 32), _mm256_srli_epi64(multipliers, 32)));
+		multipliers = _mm256_add_epi32(multipliers, step);
+	}
+	uint32_t lanesOut[8];
+	_mm256_storeu_si256((__m256i *)lanesOut, sums);
+	*sumLo += lanesOut[0] + lanesOut[2] + lanesOut[4] + lanesOut[6];
+	*sumHi += lanesOut[1] + lanesOut[3] + lanesOut[5] + lanesOut[7];
+	accurateRipSSE2(frames+i, count-i, firstMultiplier+i, sumLo, sumHi);
+}
+
+#endif
@@ -0,0 +1,43 @@
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "readtoc.h"
+
+// kernels for setChecksumKernel(), CHECKSUM_KERNEL_BEST picks the widest one the CPU supports
+#define CHECKSUM_KERNEL_BEST 0
+#define CHECKSUM_KERNEL_SCALAR 1
+#define CHECKSUM_KERNEL_SSE2 2 // SSE2 AccurateRip, PCLMULQDQ CRC32
+#define CHECKSUM_KERNEL_AVX2 3 // AVX2 AccurateRip, PCLMULQDQ CRC32
+
+typedef struct DiscChecksums DiscChecksums;
+typedef struct TrackChecksum TrackChecksum;
+
+struct TrackChecksum {
+	uint8_t trackNum;
+	uint32_t startLBA;
+	uint32_t endLBA;
+	uint32_t nextLBA; // the next block the checksums are waiting for
+	bool gap; // audio was skipped, the checksums can never be complete
+	uint32_t accurateRipV1;
+	uint32_t accurateRipV2;
+	uint32_t crc32; // plain CRC32 of the track's audio, the same one EAC logs
+};
+
+int makeDiscChecksums(DiscChecksums **dest, TOC *toc);
+void destroyDiscChecksums(DiscChecksums *sums);
+void updateDiscChecksums(DiscChecksums *sums, uint32_t startLBA, const void *data, long size);
+bool getTrackChecksum(DiscChecksums *sums, uint8_t trackNum, TrackChecksum *dest);
+void setActiveChecksums(DiscChecksums *sums);
+void checksumAudio(uint32_t startLBA, const void *data, long size);
+
+uint32_t crc32Update(uint32_t crc, const uint8_t *data, size_t len);
+void accurateRipUpdate(const uint32_t *frames, size_t count, uint32_t firstMultiplier, uint32_t *sumLo, uint32_t *sumHi);
+int setChecksumKernel(int kernel);
+int getChecksumKernel(void);
+const char *getChecksumKernelName(int kernel);
+
+#endif
@@ -2,5 +2,17 @@
 #define CONFIG_H
 
 #define OPTICAL_DRIVE_PATH "/dev/sg0"
+#define DRIVE_ENV "OPTICALCONTROL_DRIVE" // set to image:<file> or mock[:<ms>] to run without a drive, see drive.c
+#define TRACE_ENV "OPTICALCONTROL_TRACE" // <file> records every drive command to it, noaudio:<file> leaves out the audio, see trace.c
+#define SIM_DRIVE_ENV "OPTICALCONTROL_SIM" // latency=<ms>,seek=<ms>,speed=<x>,stall=<ms>,stallevery=<ms>,maxblocks=<n>,jitter=<frames>,biterrors=<rate> for the simulated drives, see simdrive.c
+#define PCM_ENV "OPTICALCONTROL_PCM" // ALSA PCM to play to instead of "default", ex. null, see playaudio.c
+#define BATCH_CACHE_PATH "/var/tmp/opticalcontrol-batch" // READ CD transfer sizes known to work, per drive
+#define SPEED_PROFILE_PATH "/var/tmp/opticalcontrol-speed" // measured read rate at each requested speed, per drive
+#define DISC_CACHE_PATH "/var/tmp/opticalcontrol-discs" // CD-Text of discs seen before, see disccache.c
+#define DISC_CACHE_SLOTS 64 // discs the cache holds, ~5KB each
+#define SECTOR_CACHE_MB 32 // blocks kept in memory during playback for replays and seeking back, ~3 minutes of audio
+#define STATS_PATH "/dev/shm/opticalcontrol-stats" // counters playerd publishes for playerctl stats and the like, see stats.c
+#define CONTROL_SOCKET_NAME "opticalcontrol.sock" // where playerd listens for playerctl and other clients, in $XDG_RUNTIME_DIR, see control.c
+#define CONTROL_FALLBACK_DIR "/tmp/opticalcontrol-" // followed by the uid, a 0700 directory for the socket when there is no XDG_RUNTIME_DIR
 
 #endif
@@ -0,0 +1,172 @@
+// Local control socket for the resident player (playerd.c), so a client can play, pause, seek or skip
+// without opening the drive, reading the TOC or setting up the PCM itself.
+//
+// It is a UNIX domain SOCK_SEQPACKET socket, so each request and reply is one message and neither side has to reassemble them,
+// and a client going away shows up as a 0 length read. Requests and replies are fixed 8 byte structs, see control.h.
+// 	man 7 unix
+//
+// The socket lives in a directory only its user can get into, so no one else can delete it, take its name first or connect to it:
+// $XDG_RUNTIME_DIR, which systemd-logind makes 0700 per user, or else a CONTROL_FALLBACK_DIR<uid> directory this makes itself.
+// 	https://specifications.freedesktop.org/basedir-spec/latest/
+
+#define _GNU_SOURCE // accept4()
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#include "control.h"
+#include "config.h"
+
+#define CONTROL_BACKLOG 8
+
+#define SUCCESS 0
+#define FAILED_SEND 1
+#define FAILED_RECEIVE 2
+#define BAD_MESSAGE 3
+#define NO_RUNTIME_DIR 4
+#define PATH_TOO_LONG 5
+#define SOCKET_IN_USE 6 // a player is already listening there, or something that isn't our socket has the name
+
+#define PRIVATE_DIR_MODE 0700
+
+static int fillAddress(const char *path, struct sockaddr_un *dest);
+static bool isPrivateDir(const char *path);
+static int removeStaleSocket(const char *path);
+
+// Puts the path of this user's control socket in dest. create makes the fallback directory if it isn't there yet, for the player,
+// a client only needs the path. Fails if the directory turns out to be someone else's, or open to them.
+int getControlSocketPath(char *dest, size_t destLen, bool create) {
+	char dir[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+	if(runtimeDir && runtimeDir[0] == '/')
+		snprintf(dir, sizeof(dir), "%s", runtimeDir);
+	else {
+		snprintf(dir, sizeof(dir), "%s%u", CONTROL_FALLBACK_DIR, (unsigned int)getuid());
+		if(create && mkdir(dir, PRIVATE_DIR_MODE) == -1 && errno != EEXIST)
+			return NO_RUNTIME_DIR;
+	}
+	if(!isPrivateDir(dir))
+		return NO_RUNTIME_DIR;
+	if(snprintf(dest, destLen, "%s/%s", dir, CONTROL_SOCKET_NAME) >= (int)destLen)
+		return PATH_TOO_LONG;
+	return SUCCESS;
+}
+
+// Opens the non blocking listening socket at path, replacing a socket a previous player left behind. Returns -1 on failure.
+// Nothing else at path is removed: not a player that is still listening, and not anything that isn't a socket of this user's.
+// Only the user the player runs as can connect.
+int openControlSocket(const char *path) {
+	struct sockaddr_un addr;
+	if(fillAddress(path, &addr) || removeStaleSocket(path))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+
+	mode_t oldMask = umask(S_IRWXG | S_IRWXO);
+	int bound = bind(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un));
+	umask(oldMask);
+	if(bound == -1 || listen(fd, CONTROL_BACKLOG) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// Returns the new client's fd, non blocking like the listening socket, or -1 if there was nobody waiting.
+int acceptControlClient(int listenFd) {
+	return accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+}
+
+// Returns 1 if a request was read into dest, 0 if the client has gone, -1 if there is nothing to read yet.
+// A message that isn't a whole request is read and thrown away.
+int receiveControl(int fd, ControlRequest *dest) {
+	for(;;) {
+		ssize_t size = recv(fd, dest, sizeof(ControlRequest), MSG_TRUNC);
+		if(size == 0)
+			return 0;
+		if(size == sizeof(ControlRequest))
+			return 1;
+		if(size == -1 && errno == EINTR)
+			continue;
+		if(size == -1)
+			return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+	}
+}
+
+int replyControl(int fd, const ControlReply *reply) {
+	if(send(fd, reply, sizeof(ControlReply), MSG_NOSIGNAL) != sizeof(ControlReply))
+		return FAILED_SEND;
+	return SUCCESS;
+}
+
+// Connects a blocking client socket to the player listening at path. Returns -1 on failure, the player may not be running.
+int connectControl(const char *path) {
+	struct sockaddr_un addr;
+	if(fillAddress(path, &addr))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(fd == -1)
+		return -1;
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(struct sockaddr_un)) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// One round trip: sends the request and waits for the player's reply.
+int sendControl(int fd, const ControlRequest *request, ControlReply *reply) {
+	if(send(fd, request, sizeof(ControlRequest), MSG_NOSIGNAL) != sizeof(ControlRequest))
+		return FAILED_SEND;
+	ssize_t size;
+	do {
+		size = recv(fd, reply, sizeof(ControlReply), MSG_TRUNC);
+	} while(size == -1 && errno == EINTR);
+	if(size <= 0)
+		return FAILED_RECEIVE;
+	if(size != sizeof(ControlReply))
+		return BAD_MESSAGE;
+	return SUCCESS;
+}
+
+static int fillAddress(const char *path, struct sockaddr_un *dest) {
+	memset(dest, 0, sizeof(struct sockaddr_un));
+	dest->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(dest->sun_path))
+		return -1;
+	strcpy(dest->sun_path, path);
+	return SUCCESS;
+}
+
+// A real directory, not a symlink to one, that belongs to this user and nobody else can get into.
+static bool isPrivateDir(const char *path) {
+	struct stat st;
+	if(lstat(path, &st) == -1)
+		return false;
+	return S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & (S_IRWXG | S_IRWXO)) == 0;
+}
+
+// A socket of this user's that nobody answers on is what a player that didn't get to clean up leaves behind, that is removed.
+static int removeStaleSocket(const char *path) {
+	struct stat st;
+	if(lstat(path, &st) == -1)
+		return errno == ENOENT ? SUCCESS : SOCKET_IN_USE;
+	if(!S_ISSOCK(st.st_mode) || st.st_uid != getuid())
+		return SOCKET_IN_USE;
+	int fd = connectControl(path);
+	if(fd != -1) {
+		close(fd);
+		return SOCKET_IN_USE;
+	}
+	if(errno != ECONNREFUSED)
+		return SOCKET_IN_USE;
+	return unlink(path) == -1 ? SOCKET_IN_USE : SUCCESS;
+}
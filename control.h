@@ -0,0 +1,50 @@
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// commands, the first byte of a ControlRequest
+#define CONTROL_PLAY 1 // track, frames into it
+#define CONTROL_PAUSE 2
+#define CONTROL_RESUME 3
+#define CONTROL_STOP 4
+#define CONTROL_SEEK 5 // frames into the track playing now
+#define CONTROL_NEXT 6
+#define CONTROL_PREV 7
+#define CONTROL_STATUS 8
+
+#define CONTROL_BAD_COMMAND 0xff // ControlReply status for a command the player doesn't know
+#define CONTROL_MAX_PATH 108 // sun_path in struct sockaddr_un, for getControlSocketPath()
+
+typedef struct ControlRequest ControlRequest;
+typedef struct ControlReply ControlReply;
+
+// Both are 8 bytes in host byte order, the socket never leaves the machine. One request or reply per message.
+struct ControlRequest {
+	uint8_t command;
+	uint8_t track;
+	uint8_t reserved[2];
+	uint32_t frames; // CD frames, 1/75s
+};
+
+// Every command is answered with the player's status after it, so a client never needs a second round trip to see the result.
+struct ControlReply {
+	uint8_t status; // 0, or the error the player returned for the command
+	uint8_t state; // PLAYER_STOPPED etc. from player.h
+	uint8_t track;
+	uint8_t trackCount;
+	uint32_t frames; // how far into track
+};
+
+int getControlSocketPath(char *dest, size_t destLen, bool create);
+int openControlSocket(const char *path);
+int acceptControlClient(int listenFd);
+int receiveControl(int fd, ControlRequest *dest);
+int replyControl(int fd, const ControlReply *reply);
+int connectControl(const char *path);
+int sendControl(int fd, const ControlRequest *request, ControlReply *reply);
+
+#endif
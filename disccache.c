@@ -0,0 +1,225 @@
+// Remembers the CD-Text of discs that have been seen before, so playing one again doesn't wait on READ TOC format 0101b.
+// Many drives take far longer to answer that than to start playing.
+//
+// Discs are keyed by their freedb disc ID, and the serialized TOC is kept alongside to tell apart discs that share an ID.
+// READ TOC itself is still issued every time, the ID is computed from it.
+//
+// The cache is one file of DISC_CACHE_SLOTS fixed size slots behind a small header, mapped into memory when first used.
+// 	Each slot holds one disc: its TOC, its CD-Text pack data (or the status readText() gave for it, discs without CD-Text are remembered too)
+// 	and a CRC32 over all of that. A slot whose CRC doesn't match is treated as empty.
+// 	When every slot is taken the least recently used one is overwritten. Recency is a counter in the header, not a timestamp, so clock changes can't confuse it.
+// 	If the header doesn't match what this build expects (different magic, version or slot count, or the file is the wrong size) the file is started over.
+// The file is locked with flock() while it is read or written, so two instances can share it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "disccache.h"
+#include "checksum.h"
+#include "config.h"
+
+#define CACHE_MAGIC "OCDC"
+#define CACHE_MAGIC_LEN 4
+#define CACHE_VERSION 1
+#define CDTEXT_MAX 4608 // 4612 byte READ TOC response less its 4 byte header
+
+#define SUCCESS 0
+#define FAILED_OPEN_CACHE 1
+#define FAILED_MAP_CACHE 2
+
+typedef struct CacheHeader CacheHeader;
+typedef struct CacheSlot CacheSlot;
+
+struct CacheHeader {
+	char magic[CACHE_MAGIC_LEN];
+	uint32_t version;
+	uint32_t slotCount;
+	uint32_t slotSize;
+	uint64_t clock; // bumped on every hit and store, slots remember the value from their last use
+};
+
+struct CacheSlot {
+	uint64_t lastUsed; // 0 for an empty slot, not covered by crc so a hit doesn't have to rewrite it
+	uint32_t crc; // CRC32 of everything from discId to the end of the used text
+	uint32_t discId;
+	int32_t textStatus; // what readText() returned, text is only valid if this is 0
+	uint16_t tocLen;
+	uint16_t textLen;
+	uint8_t toc[TOC_SERIALIZED_MAX];
+	uint8_t text[CDTEXT_MAX];
+};
+
+static CacheSlot *findSlot(uint32_t discId, const uint8_t *toc, unsigned int tocLen);
+static CacheSlot *pickVictim(void);
+static void storeSlot(CacheSlot *slot, uint32_t discId, const uint8_t *toc, unsigned int tocLen, int textStatus, const void *text, unsigned int textLen);
+static uint32_t slotCRC(CacheSlot *slot);
+static bool headerValid(CacheHeader *header, off_t fileSize);
+static int resetCacheFile(int fd);
+
+static int cacheFD = -1;
+static CacheHeader *header = NULL;
+static CacheSlot *slots = NULL;
+static size_t mappedSize = 0;
+static DiscCacheStats stats;
+
+// Same as readText(toc's disc, 0), but only asks the drive if the disc isn't already in the cache.
+// Without a usable cache file it just calls readText().
+int readTextCached(CDText **dest, TOC *toc) {
+	if(!header && openDiscCache())
+		return readText(dest, 0);
+
+	uint8_t tocBytes[TOC_SERIALIZED_MAX];
+	unsigned int tocLen = serializeTOC(toc, tocBytes);
+	uint32_t discId = getDiscId(toc);
+
+	flock(cacheFD, LOCK_EX);
+	CacheSlot *slot = findSlot(discId, tocBytes, tocLen);
+	if(slot) {
+		stats.hits++;
+		slot->lastUsed = ++header->clock;
+		int status = slot->textStatus;
+		if(status == SUCCESS)
+			status = makeTextFromPacks(dest, slot->text, slot->textLen, 0);
+		flock(cacheFD, LOCK_UN);
+		return status;
+	}
+	stats.misses++;
+	flock(cacheFD, LOCK_UN);
+
+	// the lock isn't held over the drive, another instance may have stored the disc by the time this one does, which is harmless
+	int status = readText(dest, 0);
+	const void *packs = NULL;
+	unsigned int packsLen = 0;
+	if(status == SUCCESS)
+		packsLen = getTextPacks(*dest, &packs);
+	// only answers about the disc are worth remembering, not failures to talk to the drive
+	if((status == SUCCESS && packsLen <= CDTEXT_MAX) || status == READ_TEXT_NO_CDTEXT || status == READ_TEXT_EMPTY) {
+		flock(cacheFD, LOCK_EX);
+		if(!findSlot(discId, tocBytes, tocLen))
+			storeSlot(pickVictim(), discId, tocBytes, tocLen, status, packs, packsLen);
+		flock(cacheFD, LOCK_UN);
+	}
+	return status;
+}
+
+// Opens and maps DISC_CACHE_PATH, creating or starting it over if needed. readTextCached() calls this itself.
+int openDiscCache(void) {
+	if(header)
+		return SUCCESS;
+	cacheFD = open(DISC_CACHE_PATH, O_RDWR | O_CREAT, 0644);
+	if(cacheFD == -1)
+		return FAILED_OPEN_CACHE;
+
+	mappedSize = sizeof(CacheHeader) + (size_t)DISC_CACHE_SLOTS * sizeof(CacheSlot);
+	flock(cacheFD, LOCK_EX);
+	struct stat st;
+	CacheHeader onDisk;
+	memset(&onDisk, 0, sizeof(CacheHeader));
+	bool valid = fstat(cacheFD, &st) == 0 && pread(cacheFD, &onDisk, sizeof(CacheHeader), 0) == sizeof(CacheHeader) && headerValid(&onDisk, st.st_size);
+	if(!valid && resetCacheFile(cacheFD)) {
+		flock(cacheFD, LOCK_UN);
+		closeDiscCache();
+		return FAILED_OPEN_CACHE;
+	}
+	flock(cacheFD, LOCK_UN);
+
+	void *mapped = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_SHARED, cacheFD, 0);
+	if(mapped == MAP_FAILED) {
+		closeDiscCache();
+		return FAILED_MAP_CACHE;
+	}
+	header = mapped;
+	slots = (CacheSlot *)((uint8_t *)mapped + sizeof(CacheHeader));
+	return SUCCESS;
+}
+
+void closeDiscCache(void) {
+	if(header)
+		munmap(header, mappedSize);
+	if(cacheFD != -1)
+		close(cacheFD);
+	header = NULL;
+	slots = NULL;
+	cacheFD = -1;
+}
+
+void getDiscCacheStats(DiscCacheStats *dest) {
+	*dest = stats;
+}
+
+static CacheSlot *findSlot(uint32_t discId, const uint8_t *toc, unsigned int tocLen) {
+	for(uint32_t i=0; i<DISC_CACHE_SLOTS; i++) {
+		CacheSlot *slot = &slots[i];
+		if(!slot->lastUsed || slot->discId != discId || slot->tocLen != tocLen || memcmp(slot->toc, toc, tocLen))
+			continue;
+		if(slot->textLen > CDTEXT_MAX || slot->crc != slotCRC(slot)) {
+			stats.corruptSlots++;
+			slot->lastUsed = 0;
+			continue;
+		}
+		return slot;
+	}
+	return NULL;
+}
+
+// An empty slot if there is one, otherwise the least recently used.
+static CacheSlot *pickVictim(void) {
+	CacheSlot *victim = &slots[0];
+	for(uint32_t i=0; i<DISC_CACHE_SLOTS; i++) {
+		if(!slots[i].lastUsed)
+			return &slots[i];
+		if(slots[i].lastUsed < victim->lastUsed)
+			victim = &slots[i];
+	}
+	stats.evictions++;
+	return victim;
+}
+
+static void storeSlot(CacheSlot *slot, uint32_t discId, const uint8_t *toc, unsigned int tocLen, int textStatus, const void *text, unsigned int textLen) {
+	slot->lastUsed = 0; // a crash part way through leaves an empty slot rather than a half written one
+	slot->discId = discId;
+	slot->textStatus = textStatus;
+	slot->tocLen = tocLen;
+	slot->textLen = textLen;
+	memcpy(slot->toc, toc, tocLen);
+	if(textLen)
+		memcpy(slot->text, text, textLen);
+	slot->crc = slotCRC(slot);
+	slot->lastUsed = ++header->clock;
+}
+
+static uint32_t slotCRC(CacheSlot *slot) {
+	uint32_t crc = 0xffffffff;
+	crc = crc32Update(crc, (const uint8_t *)&slot->discId, offsetof(CacheSlot, toc) - offsetof(CacheSlot, discId));
+	crc = crc32Update(crc, slot->toc, slot->tocLen);
+	crc = crc32Update(crc, slot->text, slot->textLen);
+	return ~crc;
+}
+
+static bool headerValid(CacheHeader *h, off_t fileSize) {
+	return memcmp(h->magic, CACHE_MAGIC, CACHE_MAGIC_LEN) == 0 && h->version == CACHE_VERSION && h->slotCount == DISC_CACHE_SLOTS
+		&& h->slotSize == sizeof(CacheSlot) && (size_t)fileSize == mappedSize;
+}
+
+static int resetCacheFile(int fd) {
+	stats.rebuilds++;
+	if(ftruncate(fd, 0) || ftruncate(fd, mappedSize))
+		return FAILED_OPEN_CACHE;
+	CacheHeader fresh;
+	memset(&fresh, 0, sizeof(CacheHeader));
+	memcpy(fresh.magic, CACHE_MAGIC, CACHE_MAGIC_LEN);
+	fresh.version = CACHE_VERSION;
+	fresh.slotCount = DISC_CACHE_SLOTS;
+	fresh.slotSize = sizeof(CacheSlot);
+	if(pwrite(fd, &fresh, sizeof(CacheHeader), 0) != sizeof(CacheHeader))
+		return FAILED_OPEN_CACHE;
+	return SUCCESS;
+}
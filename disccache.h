@@ -0,0 +1,24 @@
+
+#ifndef DISCCACHE_H
+#define DISCCACHE_H
+
+#include <stdint.h>
+#include "readtoc.h"
+#include "readtext.h"
+
+typedef struct DiscCacheStats DiscCacheStats;
+
+struct DiscCacheStats {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long corruptSlots; // slots whose checksum didn't match, treated as empty
+	unsigned long rebuilds; // times the file was unusable and started over
+};
+
+int readTextCached(CDText **dest, TOC *toc);
+int openDiscCache(void);
+void closeDiscCache(void);
+void getDiscCacheStats(DiscCacheStats *dest);
+
+#endif
@@ -0,0 +1,610 @@
+// The one handle every module sends its MMC commands through, and the backends behind it.
+//
+// readcd.c, readtoc.c, readtext.c, probecd.c and cdspeed.c all build a DriveCommand and hand it here, instead of each opening
+// the device and filling in its own sg_io_hdr_t. The handle is reference counted: acquireDrive() opens it the first time,
+// releaseDrive() closes it when the last holder lets go. A command sent with nobody holding the drive opens it just for that command,
+// so a program that sends several (main.c, playerd.c) holds it for as long as it runs and the device is opened once.
+//
+// Backends:
+// 	DRIVE_BACKEND_SG, the real thing: SG_IO for one command at a time, the sg v3 write()/read() interface to queue them
+// 	https://sg.danny.cz/sg/p/sg_v3_ho.html
+// 	DRIVE_BACKEND_IMAGE and DRIVE_BACKEND_MOCK, simulated drives that answer the same commands without hardware, see simdrive.c
+// 	DRIVE_BACKEND_REPLAY, a recording of a real drive played back, see trace.c
+// The backend is picked with selectDriveBackend(), or from the DRIVE_ENV environment variable the first time the drive is opened:
+// 	sg:<path>	image:<file.cue or file.bin>	mock[:<ms per command>]	replay:<trace>[@<time scale>]
+// Whatever the backend, every command can be recorded with startDriveTrace() or the TRACE_ENV environment variable,
+// and every command is timed and counted in stats.c.
+//
+// A drive works on one command at a time, so a slow command nobody is waiting on (CD-Text, see textloader.c) sent in front of
+// an audio read holds that read up. A thread that calls setDriveBackground(true) has its commands wait until the drive has been idle
+// for DRIVE_IDLE_SEC: nothing sent or queued by any other thread in that time. Playback's reader stops reading whenever the ring is full,
+// so that gap comes once the ring has filled, and the command then costs the ring some of its fill instead of costing the PCM.
+// There's no time limit on that wait, a reader that never lets up keeps the background command off the drive until it stops.
+// Foreground commands in turn wait for a background one already at the drive to finish rather than queue up behind it,
+// both sides wait on arbiterChanged, which whoever finishes a command signals.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <scsi/sg.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "drive.h"
+#include "simdrive.h"
+#include "trace.h"
+#include "stats.h"
+#include "config.h"
+
+#define SCSI_GENERIC_INTERFACE_ID 'S'
+#define MAX_PATH 512
+
+// glibc's scsi/sg.h is older than the kernel's and is missing this one, value is from linux/include/uapi/scsi/sg.h
+#ifndef SG_FLAG_MMAP_IO
+#define SG_FLAG_MMAP_IO 4
+#endif
+
+#define SENSE_RESPONSE_CODE_MASK 0x7f
+#define SENSE_DESCRIPTOR_CURRENT 0x72
+#define SENSE_DESCRIPTOR_DEFERRED 0x73
+#define SENSE_KEY_MASK 0x0f
+
+#define DRIVE_IDLE_SEC 0.05 // a gap between audio reads this long means the reader has caught up
+#define NSEC_PER_SEC 1000000000L
+
+static void selectBackendFromEnv(void);
+static void startTraceFromEnv(void);
+static void initArbiter(void);
+static void startForeground(bool queued);
+static void endForeground(bool queued);
+static void startBackground(void);
+static void endBackground(void);
+static void completed(DriveCommand *command, int status, double seconds);
+static int sgOpen(const char *path);
+static void sgClose(void);
+static int sgExecute(DriveCommand *command);
+static int sgSubmit(DriveCommand *command);
+static int sgReap(DriveCommand **done);
+static int sgDiscard(void);
+static int sgSetReservedSize(int bytes);
+static void *sgMapReserved(size_t size);
+static int sgSubmitError(const DriveCommand *command);
+static void buildSgIoHdr(sg_io_hdr_t *hdr, DriveCommand *command);
+static void collectSgIoHdr(sg_io_hdr_t *hdr, DriveCommand *command);
+
+static const DriveBackend sgBackend = {
+	.open = sgOpen,
+	.close = sgClose,
+	.execute = sgExecute,
+	.submit = sgSubmit,
+	.reap = sgReap,
+	.discard = sgDiscard,
+	.setReservedSize = sgSetReservedSize,
+	.mapReserved = sgMapReserved,
+};
+
+static pthread_mutex_t handleLock = PTHREAD_MUTEX_INITIALIZER;
+static const DriveBackend *backend = &sgBackend;
+static int backendId = DRIVE_BACKEND_SG;
+static bool backendChosen = false; // by selectDriveBackend() or the environment, the environment is only looked at once
+static bool traceEnvChecked = false;
+static char drivePath[MAX_PATH] = OPTICAL_DRIVE_PATH;
+static int holders = 0;
+static bool driveOpen = false;
+// commands can come from any thread
+static atomic_ulong opens;
+static atomic_ulong commands;
+static atomic_ulong checkConditions;
+static atomic_ulong syscalls;
+static DriveCommandObserver observer = NULL;
+static void *reservedMap = NULL; // from mapDriveReserved(), where DRIVE_FLAG_MMAP_IO commands put their data
+static double lastReaped = 0; // when the last queued command completed
+// arbitration, see setDriveBackground(), everything but background is guarded by arbiterLock
+static _Thread_local bool background = false;
+static pthread_once_t arbiterOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t arbiterLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t arbiterChanged; // on CLOCK_MONOTONIC, see initArbiter()
+static int foregroundSending = 0; // in sendDriveCommand() right now
+static int foregroundQueued = 0; // submitted and not yet reaped
+static double lastForegroundAt = 0; // when the last one was sent, queued or completed
+static bool backgroundSending = false;
+
+// sg backend state
+static int sgFD = -1;
+static int sgOpenFlags;
+static sg_io_hdr_t sgQueued[MAX_DRIVE_COMMANDS_QUEUED]; // pack_id is the index, usr_ptr is the DriveCommand
+static bool sgSlotBusy[MAX_DRIVE_COMMANDS_QUEUED];
+static void *sgReserved = NULL;
+static size_t sgReservedSize = 0;
+static unsigned int sgTransferLimit = 0; // bytes the block queue takes in one command, from setDriveTransferLimit(), 0 if unknown
+
+// Picks the backend the next open uses. Fails with DRIVE_BAD_BACKEND while the drive is open.
+// path is the device or image, NULL for the backend's default (OPTICAL_DRIVE_PATH for sg).
+int selectDriveBackend(int id, const char *path) {
+	const DriveBackend *chosen;
+	switch(id) {
+		case DRIVE_BACKEND_SG:
+			chosen = &sgBackend;
+			break;
+		case DRIVE_BACKEND_IMAGE:
+			chosen = getImageDriveBackend();
+			break;
+		case DRIVE_BACKEND_MOCK:
+			chosen = getMockDriveBackend();
+			break;
+		case DRIVE_BACKEND_REPLAY:
+			chosen = getReplayDriveBackend();
+			break;
+		default:
+			return DRIVE_BAD_BACKEND;
+	}
+	pthread_mutex_lock(&handleLock);
+	if(driveOpen) {
+		pthread_mutex_unlock(&handleLock);
+		return DRIVE_BAD_BACKEND;
+	}
+	backend = chosen;
+	backendId = id;
+	backendChosen = true;
+	snprintf(drivePath, MAX_PATH, "%s", path ? path : id == DRIVE_BACKEND_SG ? OPTICAL_DRIVE_PATH : "");
+	pthread_mutex_unlock(&handleLock);
+	return DRIVE_SUCCESS;
+}
+
+int getDriveBackend(void) {
+	return backendId;
+}
+
+// The device node or image the drive is opened from.
+const char *getDrivePath(void) {
+	return drivePath;
+}
+
+// Takes a reference to the drive, opening it if nobody else holds it. Every successful call needs a releaseDrive().
+int acquireDrive(void) {
+	pthread_mutex_lock(&handleLock);
+	if(!backendChosen)
+		selectBackendFromEnv();
+	if(!traceEnvChecked)
+		startTraceFromEnv();
+	if(!driveOpen) {
+		if(backend->open(drivePath)) {
+			pthread_mutex_unlock(&handleLock);
+			return DRIVE_FAILED_OPEN;
+		}
+		driveOpen = true;
+		atomic_fetch_add(&opens, 1);
+	}
+	holders++;
+	pthread_mutex_unlock(&handleLock);
+	return DRIVE_SUCCESS;
+}
+
+// Closes the drive once the last holder has released it. Anything mapped with mapDriveReserved() goes with it.
+void releaseDrive(void) {
+	pthread_mutex_lock(&handleLock);
+	if(holders > 0 && --holders == 0 && driveOpen) {
+		backend->close();
+		driveOpen = false;
+		reservedMap = NULL;
+		flushDriveTrace();
+	}
+	pthread_mutex_unlock(&handleLock);
+}
+
+bool isDriveOpen(void) {
+	return driveOpen;
+}
+
+// Zeroes the command and sets up its data buffer. The caller still fills in cdb and cdbLen.
+void initDriveCommand(DriveCommand *command, int direction, void *data, unsigned int dataLen) {
+	memset(command, 0, sizeof(DriveCommand));
+	command->direction = direction;
+	command->data = data;
+	command->dataLen = dataLen;
+}
+
+// Sends one command and waits for it. DRIVE_CHECK_CONDITION means it completed with sense data.
+int sendDriveCommand(DriveCommand *command) {
+	bool held = acquireDrive() == DRIVE_SUCCESS;
+	if(!held)
+		return DRIVE_FAILED_OPEN;
+	if(background)
+		startBackground();
+	else
+		startForeground(false);
+	atomic_fetch_add(&commands, 1);
+	atomic_fetch_add(&syscalls, 1);
+	double started = monotonicSec();
+	int status = backend->execute(command);
+	if(status == DRIVE_CHECK_CONDITION)
+		atomic_fetch_add(&checkConditions, 1);
+	double now = monotonicSec();
+	if(background)
+		endBackground();
+	else
+		endForeground(false);
+	completed(command, status, now - started);
+	releaseDrive();
+	return status;
+}
+
+// Marks the calling thread's commands as ones nothing is waiting on, to be sent only while the drive is otherwise idle.
+// Background commands go through sendDriveCommand(), a background thread shouldn't be queueing commands.
+void setDriveBackground(bool isBackground) {
+	background = isBackground;
+}
+
+// True if submitDriveCommand() can work on the open drive. A real drive needs to be opened read/write for it.
+bool canQueueDriveCommands(void) {
+	if(!driveOpen || !backend->submit)
+		return false;
+	return backend != &sgBackend || (sgOpenFlags & O_ACCMODE) == O_RDWR;
+}
+
+// Queues a command without waiting for it, the drive must already be held. reapDriveCommand() hands it back once it completes.
+// At most MAX_DRIVE_COMMANDS_QUEUED at a time, and only one thread should be queueing, since any reap collects any command.
+int submitDriveCommand(DriveCommand *command) {
+	if(!canQueueDriveCommands())
+		return DRIVE_ASYNC_UNSUPPORTED;
+	atomic_fetch_add(&commands, 1);
+	atomic_fetch_add(&syscalls, 1);
+	startForeground(true);
+	command->submittedAt = monotonicSec();
+	int status = backend->submit(command);
+	if(status != DRIVE_SUCCESS) {
+		endForeground(true);
+		countStat(STAT_DRIVE_FAILURES, 1);
+	}
+	return status;
+}
+
+// Waits for the next queued command to complete, whichever that is, and points *done at it.
+// The command is timed from when it reached the front of the queue, the drive was busy with the ones ahead of it before that.
+int reapDriveCommand(DriveCommand **done) {
+	if(!canQueueDriveCommands())
+		return DRIVE_ASYNC_UNSUPPORTED;
+	atomic_fetch_add(&syscalls, 1);
+	int status = backend->reap(done);
+	if(status == DRIVE_CHECK_CONDITION)
+		atomic_fetch_add(&checkConditions, 1);
+	if(status != DRIVE_SUCCESS && status != DRIVE_CHECK_CONDITION)
+		countStat(STAT_DRIVE_FAILURES, 1);
+	else {
+		DriveCommand *command = *done;
+		double now = monotonicSec();
+		double started = command->submittedAt > lastReaped ? command->submittedAt : lastReaped;
+		completed(command, status, now - started);
+		lastReaped = now;
+		endForeground(true);
+	}
+	return status;
+}
+
+// Throws away every queued command, for when they can no longer be collected. The reserved buffer is unmapped too.
+int discardDriveCommands(void) {
+	if(!driveOpen)
+		return DRIVE_SUCCESS;
+	reservedMap = NULL;
+	pthread_once(&arbiterOnce, initArbiter);
+	pthread_mutex_lock(&arbiterLock);
+	foregroundQueued = 0;
+	lastForegroundAt = monotonicSec();
+	pthread_cond_broadcast(&arbiterChanged);
+	pthread_mutex_unlock(&arbiterLock);
+	return backend->discard();
+}
+
+// Asks for a reserved buffer of bytes and returns the size the drive ended up with, 0 if it can't tell.
+int setDriveReservedSize(int bytes) {
+	if(!driveOpen)
+		return 0;
+	return backend->setReservedSize(bytes);
+}
+
+// Tells the sg backend the longest transfer the kernel takes in one command, as probed from the drive's block queue.
+// An EINVAL for a command longer than that is taken as DRIVE_TOO_LARGE, any other EINVAL as a command that can't be sent at all.
+void setDriveTransferLimit(unsigned int bytes) {
+	sgTransferLimit = bytes;
+}
+
+// Maps the drive's reserved buffer, which DRIVE_FLAG_MMAP_IO commands transfer into. NULL on failure.
+// The mapping stays until the drive is closed or discardDriveCommands() is called, asking again returns the same one.
+void *mapDriveReserved(size_t size) {
+	if(!driveOpen)
+		return NULL;
+	reservedMap = backend->mapReserved(size);
+	return reservedMap;
+}
+
+// Fixed format (70h/71h) and descriptor format (72h/73h) sense put the sense key and ASC in different places.
+// 	SPC-3, 4.5 Sense data
+uint8_t getSenseKey(const DriveCommand *command) {
+	uint8_t responseCode = command->sense[0] & SENSE_RESPONSE_CODE_MASK;
+	bool descriptor = responseCode == SENSE_DESCRIPTOR_CURRENT || responseCode == SENSE_DESCRIPTOR_DEFERRED;
+	return command->sense[descriptor ? 1 : 2] & SENSE_KEY_MASK;
+}
+
+uint8_t getSenseASC(const DriveCommand *command) {
+	uint8_t responseCode = command->sense[0] & SENSE_RESPONSE_CODE_MASK;
+	bool descriptor = responseCode == SENSE_DESCRIPTOR_CURRENT || responseCode == SENSE_DESCRIPTOR_DEFERRED;
+	return command->sense[descriptor ? 2 : 12];
+}
+
+void getDriveStats(DriveStats *dest) {
+	dest->opens = atomic_load(&opens);
+	dest->commands = atomic_load(&commands);
+	dest->checkConditions = atomic_load(&checkConditions);
+	dest->syscalls = atomic_load(&syscalls);
+}
+
+// Has every completed command reported to observer, NULL to stop. For benchmarks that want each command's latency.
+void setDriveCommandObserver(DriveCommandObserver newObserver) {
+	observer = newObserver;
+}
+
+static void selectBackendFromEnv(void) {
+	backendChosen = true;
+	const char *env = getenv(DRIVE_ENV);
+	if(!env || *env == '\0')
+		return;
+	const char *colon = strchr(env, ':');
+	size_t nameLen = colon ? (size_t)(colon - env) : strlen(env);
+	const char *arg = colon ? colon+1 : NULL;
+	if(nameLen == 5 && strncmp(env, "image", 5) == 0 && arg) {
+		backend = getImageDriveBackend();
+		backendId = DRIVE_BACKEND_IMAGE;
+	}
+	else if(nameLen == 4 && strncmp(env, "mock", 4) == 0) {
+		backend = getMockDriveBackend();
+		backendId = DRIVE_BACKEND_MOCK;
+	}
+	else if(nameLen == 6 && strncmp(env, "replay", 6) == 0 && arg) {
+		backend = getReplayDriveBackend();
+		backendId = DRIVE_BACKEND_REPLAY;
+	}
+	else if(nameLen == 2 && strncmp(env, "sg", 2) == 0 && arg)
+		backendId = DRIVE_BACKEND_SG;
+	else {
+		fprintf(stderr, "ignoring %s=%s, expected sg:<path>, image:<file>, mock[:<ms>] or replay:<trace>[@<scale>]\n", DRIVE_ENV, env);
+		return;
+	}
+	snprintf(drivePath, MAX_PATH, "%s", arg ? arg : "");
+}
+
+// Called with handleLock held. A trace started here is closed at exit, so it isn't cut off part way through a record.
+static void startTraceFromEnv(void) {
+	traceEnvChecked = true;
+	const char *env = getenv(TRACE_ENV);
+	if(!env || *env == '\0')
+		return;
+	bool keepAudio = strncmp(env, "noaudio:", 8) != 0;
+	const char *path = keepAudio ? env : env+8;
+	if(startDriveTrace(path, keepAudio)) {
+		fprintf(stderr, "can't record the drive to %s\n", path);
+		return;
+	}
+	atexit(stopDriveTrace);
+}
+
+// The sg write()/read() interface needs the device opened read/write, if that is not allowed fall back to read only and SG_IO.
+static int sgOpen(const char *path) {
+	sgOpenFlags = O_RDWR;
+	if((sgFD = open(path, O_RDWR)) == -1) {
+		sgOpenFlags = O_RDONLY;
+		sgFD = open(path, O_RDONLY);
+	}
+	memset(sgSlotBusy, 0, sizeof(sgSlotBusy));
+	return sgFD == -1 ? DRIVE_FAILED_OPEN : DRIVE_SUCCESS;
+}
+
+static void sgClose(void) {
+	if(sgReserved)
+		munmap(sgReserved, sgReservedSize);
+	sgReserved = NULL;
+	if(sgFD != -1)
+		close(sgFD);
+	sgFD = -1;
+}
+
+static int sgExecute(DriveCommand *command) {
+	sg_io_hdr_t hdr;
+	buildSgIoHdr(&hdr, command);
+	if(ioctl(sgFD, SG_IO, &hdr) == -1)
+		return sgSubmitError(command);
+	collectSgIoHdr(&hdr, command);
+	return command->senseLen ? DRIVE_CHECK_CONDITION : DRIVE_SUCCESS;
+}
+
+// Uses the asynchronous sg v3 interface: write() queues a command and read() returns whichever one finished first.
+// 	https://sg.danny.cz/sg/p/sg_v3_ho.html (section 10, "Asynchronous usage")
+// The sg_io_hdr_t has to outlive the write(), so each queued command gets one of sgQueued[], and its index is the pack_id.
+static int sgSubmit(DriveCommand *command) {
+	int slot = 0;
+	while(slot < MAX_DRIVE_COMMANDS_QUEUED && sgSlotBusy[slot])
+		slot++;
+	if(slot == MAX_DRIVE_COMMANDS_QUEUED)
+		return DRIVE_QUEUE_FULL;
+	sg_io_hdr_t *hdr = &sgQueued[slot];
+	buildSgIoHdr(hdr, command);
+	hdr->pack_id = slot;
+	hdr->usr_ptr = command;
+	if(write(sgFD, hdr, sizeof(sg_io_hdr_t)) == -1)
+		return sgSubmitError(command);
+	sgSlotBusy[slot] = true;
+	return DRIVE_SUCCESS;
+}
+
+static int sgReap(DriveCommand **done) {
+	for(;;) {
+		sg_io_hdr_t hdr;
+		memset(&hdr, 0, sizeof(sg_io_hdr_t));
+		hdr.interface_id = SCSI_GENERIC_INTERFACE_ID;
+		if(read(sgFD, &hdr, sizeof(sg_io_hdr_t)) == -1) {
+			if(errno == EINTR)
+				continue;
+			return DRIVE_FAILED_RECEIVE;
+		}
+		if(hdr.pack_id < 0 || hdr.pack_id >= MAX_DRIVE_COMMANDS_QUEUED || !sgSlotBusy[hdr.pack_id])
+			continue; // not one of ours
+		sgSlotBusy[hdr.pack_id] = false;
+		DriveCommand *command = hdr.usr_ptr;
+		collectSgIoHdr(&hdr, command);
+		*done = command;
+		return command->senseLen ? DRIVE_CHECK_CONDITION : DRIVE_SUCCESS;
+	}
+}
+
+// The outstanding commands can't be collected any more, closing the fd is the only way to throw them away.
+static int sgDiscard(void) {
+	sgClose();
+	int flags = sgOpenFlags;
+	sgFD = open(drivePath, flags);
+	memset(sgSlotBusy, 0, sizeof(sgSlotBusy));
+	return sgFD == -1 ? DRIVE_FAILED_OPEN : DRIVE_SUCCESS;
+}
+
+// The driver rounds the request down to what it can do, so the size is read back.
+static int sgSetReservedSize(int bytes) {
+	ioctl(sgFD, SG_SET_RESERVED_SIZE, &bytes);
+	int reservedSize = 0;
+	if(ioctl(sgFD, SG_GET_RESERVED_SIZE, &reservedSize) == -1)
+		return 0;
+	return reservedSize;
+}
+
+static void *sgMapReserved(size_t size) {
+	if(sgReserved && sgReservedSize >= size)
+		return sgReserved;
+	if(sgReserved)
+		munmap(sgReserved, sgReservedSize);
+	sgReserved = NULL;
+	void *mapped = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, sgFD, 0);
+	if(mapped == MAP_FAILED)
+		return NULL;
+	sgReserved = mapped;
+	sgReservedSize = size;
+	return sgReserved;
+}
+
+// Only the errors a shorter transfer could get past are DRIVE_TOO_LARGE: ENOMEM, the driver finding no memory for the transfer,
+// and EINVAL for one longer than the block queue takes. EINVAL within the limit, or with no limit known, is a bad command.
+static int sgSubmitError(const DriveCommand *command) {
+	if(errno == ENOMEM || (errno == EINVAL && sgTransferLimit && command->dataLen > sgTransferLimit))
+		return DRIVE_TOO_LARGE;
+	return DRIVE_FAILED_SUBMIT;
+}
+
+static void buildSgIoHdr(sg_io_hdr_t *hdr, DriveCommand *command) {
+	memset(hdr, 0, sizeof(sg_io_hdr_t));
+	hdr->interface_id = SCSI_GENERIC_INTERFACE_ID;
+	hdr->cmdp = command->cdb;
+	hdr->cmd_len = command->cdbLen;
+	hdr->dxfer_direction = command->direction == DRIVE_DATA_IN ? SG_DXFER_FROM_DEV : command->direction == DRIVE_DATA_OUT ? SG_DXFER_TO_DEV : SG_DXFER_NONE;
+	hdr->dxferp = command->data;
+	hdr->dxfer_len = command->dataLen;
+	hdr->mx_sb_len = DRIVE_MAX_SENSE;
+	hdr->sbp = command->sense;
+	hdr->timeout = command->timeoutMs ? command->timeoutMs : DRIVE_DEFAULT_TIMEOUT_MS;
+	if(command->flags & DRIVE_FLAG_DIRECT_IO)
+		hdr->flags |= SG_FLAG_DIRECT_IO;
+	if(command->flags & DRIVE_FLAG_MMAP_IO) {
+		hdr->flags |= SG_FLAG_MMAP_IO;
+		hdr->dxferp = NULL;
+	}
+}
+
+static void collectSgIoHdr(sg_io_hdr_t *hdr, DriveCommand *command) {
+	command->senseLen = hdr->sb_len_wr;
+	command->resid = hdr->resid;
+	command->directIO = (hdr->info & SG_INFO_DIRECT_IO_MASK) == SG_INFO_DIRECT_IO;
+}
+
+// The idle gap is timed with monotonicSec(), so the condition variable has to wait on the same clock.
+static void initArbiter(void) {
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&arbiterChanged, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+// Waits for a background command at the drive to finish, then counts this one as in flight until endForeground().
+static void startForeground(bool queued) {
+	pthread_once(&arbiterOnce, initArbiter);
+	pthread_mutex_lock(&arbiterLock);
+	while(backgroundSending)
+		pthread_cond_wait(&arbiterChanged, &arbiterLock);
+	if(queued)
+		foregroundQueued++;
+	else
+		foregroundSending++;
+	lastForegroundAt = monotonicSec();
+	pthread_mutex_unlock(&arbiterLock);
+}
+
+// The command completed, or never reached the drive. A background command waiting on the idle gap starts timing it from now.
+static void endForeground(bool queued) {
+	pthread_mutex_lock(&arbiterLock);
+	if(queued && foregroundQueued > 0)
+		foregroundQueued--;
+	else if(!queued && foregroundSending > 0)
+		foregroundSending--;
+	lastForegroundAt = monotonicSec();
+	pthread_cond_broadcast(&arbiterChanged);
+	pthread_mutex_unlock(&arbiterLock);
+}
+
+// Waits until nothing else is at the drive and nothing has been for DRIVE_IDLE_SEC, then holds foreground commands off until endBackground().
+static void startBackground(void) {
+	pthread_once(&arbiterOnce, initArbiter);
+	pthread_mutex_lock(&arbiterLock);
+	for(;;) {
+		if(foregroundSending > 0 || foregroundQueued > 0 || backgroundSending) {
+			pthread_cond_wait(&arbiterChanged, &arbiterLock);
+			continue;
+		}
+		double idleAt = lastForegroundAt + DRIVE_IDLE_SEC;
+		if(monotonicSec() >= idleAt)
+			break;
+		// a foreground command that turns up before then signals and moves idleAt on
+		struct timespec deadline = {(time_t)idleAt, (long)((idleAt - (time_t)idleAt) * NSEC_PER_SEC)};
+		if(deadline.tv_nsec >= NSEC_PER_SEC) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= NSEC_PER_SEC;
+		}
+		pthread_cond_timedwait(&arbiterChanged, &arbiterLock, &deadline);
+	}
+	backgroundSending = true;
+	pthread_mutex_unlock(&arbiterLock);
+}
+
+static void endBackground(void) {
+	pthread_mutex_lock(&arbiterLock);
+	backgroundSending = false;
+	pthread_cond_broadcast(&arbiterChanged);
+	pthread_mutex_unlock(&arbiterLock);
+}
+
+// Every command that got an answer, or failed to, ends up here once.
+static void completed(DriveCommand *command, int status, double seconds) {
+	countStat(STAT_DRIVE_COMMANDS, 1);
+	if(status == DRIVE_SUCCESS || status == DRIVE_CHECK_CONDITION)
+		recordDriveLatency(seconds);
+	if(status == DRIVE_CHECK_CONDITION)
+		countStat(STAT_DRIVE_SENSE_ERRORS, 1);
+	else if(status != DRIVE_SUCCESS)
+		countStat(STAT_DRIVE_FAILURES, 1);
+	STATS_PROBE3(drive_command, command->cdb[0], (long)(seconds * 1e6), status);
+	if(isDriveTraceActive())
+		traceDriveCommand(command, status, command->flags & DRIVE_FLAG_MMAP_IO ? reservedMap : command->data, seconds);
+	DriveCommandObserver notify = observer;
+	if(notify)
+		notify(command, status, seconds);
+}
@@ -0,0 +1,111 @@
+
+#ifndef DRIVE_H
+#define DRIVE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define DRIVE_MAX_CDB 16
+#define DRIVE_MAX_SENSE 0xff
+#define DRIVE_DEFAULT_TIMEOUT_MS 5000
+#define MAX_DRIVE_COMMANDS_QUEUED 16 // the sg driver queues at most SG_MAX_QUEUE (16) commands per file descriptor
+
+// which way a command's data goes
+#define DRIVE_DATA_NONE 0
+#define DRIVE_DATA_IN 1 // from the drive
+#define DRIVE_DATA_OUT 2 // to the drive
+
+// DriveCommand flags
+#define DRIVE_FLAG_DIRECT_IO 1 // transfer straight into data instead of through the driver's buffer, if the driver allows it
+#define DRIVE_FLAG_MMAP_IO 2 // transfer into the reserved buffer from mapDriveReserved(), data must be NULL
+
+// results of sendDriveCommand() and the rest
+#define DRIVE_SUCCESS 0
+#define DRIVE_FAILED_OPEN 1
+#define DRIVE_FAILED_SUBMIT 2 // the command never reached the drive
+#define DRIVE_FAILED_RECEIVE 3 // queued commands can't be collected any more, see discardDriveCommands()
+#define DRIVE_CHECK_CONDITION 4 // the drive answered with sense data, it is in the command's sense[]
+#define DRIVE_ASYNC_UNSUPPORTED 5 // this drive can't queue commands, send them one at a time instead
+#define DRIVE_QUEUE_FULL 6
+#define DRIVE_BAD_BACKEND 7
+#define DRIVE_TOO_LARGE 8 // the driver turned the command down for its transfer size (ENOMEM, or EINVAL past setDriveTransferLimit()), a smaller one may go through
+
+// backends for selectDriveBackend()
+#define DRIVE_BACKEND_SG 0 // a real drive through the Linux sg driver, path is its /dev/sgN
+#define DRIVE_BACKEND_IMAGE 1 // a disc image file, see simdrive.c
+#define DRIVE_BACKEND_MOCK 2 // a synthetic disc with injected latency, see simdrive.c
+#define DRIVE_BACKEND_REPLAY 3 // answers from a recording made with startDriveTrace(), see simdrive.c
+
+typedef struct DriveCommand DriveCommand;
+typedef struct DriveBackend DriveBackend;
+typedef struct DriveStats DriveStats;
+
+// Called from whichever thread completed the command, with the drive's time on it, see sendDriveCommand() and reapDriveCommand().
+typedef void (*DriveCommandObserver)(const DriveCommand *command, int status, double seconds);
+
+// One MMC command and everything that comes back from it.
+// The command, and data, must stay put until it completes, which for submitDriveCommand() is when reapDriveCommand() returns it.
+struct DriveCommand {
+	uint8_t cdb[DRIVE_MAX_CDB];
+	uint8_t cdbLen;
+	int direction;
+	void *data;
+	unsigned int dataLen;
+	unsigned int timeoutMs; // 0 for DRIVE_DEFAULT_TIMEOUT_MS
+	int flags;
+
+	// filled in when the command completes
+	uint8_t sense[DRIVE_MAX_SENSE];
+	uint8_t senseLen;
+	int resid; // bytes of dataLen that weren't transferred
+	bool directIO; // DRIVE_FLAG_DIRECT_IO was honoured, the driver silently copies instead when it can't
+
+	double submittedAt; // set by submitDriveCommand(), for timing it
+};
+
+// What a backend implements. submit/reap may be NULL if the backend can only send one command at a time.
+// Called with the drive open, except open itself. Backends don't need to be thread safe beyond what a real drive is:
+// any thread can send commands, but only one thread at a time queues them.
+struct DriveBackend {
+	int (*open)(const char *path);
+	void (*close)(void);
+	int (*execute)(DriveCommand *command);
+	int (*submit)(DriveCommand *command);
+	int (*reap)(DriveCommand **done);
+	int (*discard)(void);
+	int (*setReservedSize)(int bytes);
+	void *(*mapReserved)(size_t size);
+};
+
+struct DriveStats {
+	unsigned long opens;
+	unsigned long commands; // sent or queued
+	unsigned long checkConditions;
+	unsigned long syscalls; // the ioctl(), write() and read() calls the sg backend makes for the commands, the simulated drives count the same
+};
+
+int selectDriveBackend(int backend, const char *path);
+int getDriveBackend(void);
+const char *getDrivePath(void);
+int acquireDrive(void);
+void releaseDrive(void);
+bool isDriveOpen(void);
+
+void initDriveCommand(DriveCommand *command, int direction, void *data, unsigned int dataLen);
+int sendDriveCommand(DriveCommand *command);
+void setDriveBackground(bool background);
+bool canQueueDriveCommands(void);
+int submitDriveCommand(DriveCommand *command);
+int reapDriveCommand(DriveCommand **done);
+int discardDriveCommands(void);
+int setDriveReservedSize(int bytes);
+void setDriveTransferLimit(unsigned int bytes);
+void *mapDriveReserved(size_t size);
+
+uint8_t getSenseKey(const DriveCommand *command);
+uint8_t getSenseASC(const DriveCommand *command);
+void getDriveStats(DriveStats *dest);
+void setDriveCommandObserver(DriveCommandObserver observer);
+
+#endif
@@ -1,12 +1,43 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "readtoc.h"
 #include "readtext.h"
+#include "textloader.h"
 #include "playaudio.h"
+#include "rip.h"
+#include "readcd.h"
+#include "secureread.h"
+#include "checksum.h"
+#include "disccache.h"
+#include "sectorcache.h"
+#include "drive.h"
+#include "config.h"
+
+void *openPCM(void *dest);
+void printNames(CDText *text, int status, void *trackNum);
+
+static int openPCMStatus;
 
 int main(int argc, char *argv[]) {
+	// "main rip [dir]" copies every audio track to WAV files instead of playing
+	// "main securerip [dir]" does the same, but only keeps audio that two reads agree on
+	bool secure = argc > 1 && strcmp(argv[1], "securerip") == 0;
+	bool rip = argc > 1 && (strcmp(argv[1], "rip") == 0 || secure);
+
+	// opening and configuring the PCM can take a while, so playing does it on its own thread while the TOC is read
+	PCM *pcm;
+	pthread_t pcmThread;
+	bool openingPCM = !rip && pthread_create(&pcmThread, NULL, openPCM, &pcm) == 0;
+
+	// held for the whole run, so the TOC, CD-Text and audio reads all share one open of the drive
+	if(acquireDrive()) {
+		printf("failed to open the drive %s\n", getDrivePath());
+		return 1;
+	}
 	TOC *toc;
 	int status = readTOC(&toc); // toc now points to a malloced TOC struct;
 	if(status) {
@@ -14,10 +45,24 @@ int main(int argc, char *argv[]) {
 		return 1;
 	}
 
-	CDText *text = NULL;
-	status = readText(&text, 0);
-	if(status) {
-		printReadTextErr(status);
+	if(rip) {
+		// the track names go into the files, so ripping waits for them
+		CDText *text = NULL;
+		status = readTextCached(&text, toc);
+		if(status) {
+			printReadTextErr(status);
+			putchar('\n');
+		}
+		setSecureRead(secure);
+		const char *dir = argc > 2 ? argv[2] : ".";
+		status = ripDisc(toc, text, dir);
+		closeOpticalDrive();
+		releaseDrive();
+		if(status) {
+			printf("ripDisc failed: %d\n", status);
+			return 5;
+		}
+		return 0;
 	}
 
 	uint8_t startTrackNum = 1;
@@ -38,29 +83,78 @@ int main(int argc, char *argv[]) {
 		return 4;
 	}
 
-	TrackDescriptor *trackN = getTrack(toc, startTrackNum);
+	// "main <track> mm:ss.ff" starts that far into the track
+	uint32_t offsetFrames = 0;
+	if(argc > 2 && !parseTrackOffset(argv[2], &offsetFrames)) {
+		printf("invalid offset '%s', expected mm:ss.ff\n", argv[2]);
+		return 3;
+	}
 
-	PCM *pcm;
-	status = initPCM(&pcm);
+	if(openingPCM)
+		pthread_join(pcmThread, NULL);
+	else
+		openPCMStatus = initPCM(&pcm);
+	status = openPCMStatus;
 	if(status) {
 		printf("initPCM failed %d\n", status);
 		return 2;
 	}
 
-	uint32_t startLBA = getStartLBA(trackN);
+	uint32_t startLBA = getTrackOffsetLBA(toc, startTrackNum, offsetFrames);
 	uint32_t leadoutLBA = getLeadoutLBA(toc);
-	
-	char *albumName = NULL; 
-	char *albumArtist = NULL;
-	char *trackName = NULL;
-	char *trackArtist = NULL;
-
-	if(text) {
-		albumName = getAlbumName(text); 
-		albumArtist = getAlbumArtist(text);
-		trackName = getTrackName(text, startTrackNum);
-		trackArtist = getTrackArtist(text, startTrackNum);
+	printf("Starting playback from track %d\n", startTrackNum);
+
+	// playing doesn't wait for the CD-Text, the names are printed whenever it turns up
+	TextLoader *textLoader = NULL;
+	if(startTextLoader(&textLoader, toc, printNames, &startTrackNum))
+		textLoader = NULL;
+
+	// replaying or going back shouldn't need the drive, ripping reads everything once so it doesn't get a cache
+	setSectorCacheSize(SECTOR_CACHE_MB);
+
+	// tracks played start to finish get their checksums printed afterwards
+	DiscChecksums *sums = NULL;
+	if(makeDiscChecksums(&sums, toc) == 0)
+		setActiveChecksums(sums);
+
+	if((status = startPlayingFrom(startLBA, leadoutLBA, pcm)))
+		printf("startPlayingFrom failed: %d\n", status);
+
+	if(sums) {
+		TrackChecksum sum;
+		for(uint8_t trackNum = startTrackNum; trackNum < getFirstTrackNumber(toc) + getTrackCount(toc); trackNum++) {
+			if(getTrackChecksum(sums, trackNum, &sum))
+				printf("track %02d  CRC32 %08X  AccurateRip v1 %08X  v2 %08X\n", trackNum, sum.crc32, sum.accurateRipV1, sum.accurateRipV2);
+		}
+		setActiveChecksums(NULL);
+		destroyDiscChecksums(sums);
 	}
+	if(textLoader)
+		stopTextLoader(textLoader);
+	closeOpticalDrive();
+	releaseDrive();
+	destroyPCM(pcm);
+	return 0;
+
+}
+
+void *openPCM(void *dest) {
+	openPCMStatus = initPCM(dest);
+	return NULL;
+}
+
+// Runs on the text loader's thread, while the main thread is playing.
+void printNames(CDText *text, int status, void *trackNum) {
+	uint8_t startTrackNum = *(uint8_t *)trackNum;
+	if(status) {
+		printReadTextErr(status);
+		putchar('\n');
+		return;
+	}
+	char *albumName = getAlbumName(text);
+	char *albumArtist = getAlbumArtist(text);
+	char *trackName = getTrackName(text, startTrackNum);
+	char *trackArtist = getTrackArtist(text, startTrackNum);
 	if(albumName && *albumName != '\0') {
 		printf("Album: %s", albumName);
 	}
@@ -68,19 +162,11 @@ int main(int argc, char *argv[]) {
 		printf(", by %s", albumArtist);
 	}
 	putchar('\n');
-	printf("Starting playback from track %d", startTrackNum);
+	printf("Track %d", startTrackNum);
 	if(trackName && *trackName) {
 		printf(": %s", trackName);
 	}
 	if(trackArtist && *trackArtist)
 		printf(", by %s", trackArtist);
 	putchar('\n');
-
-	if(startPlayingFrom(startLBA, leadoutLBA, pcm))
-		printf("BAD\n");
-	destroyPCM(pcm);
-	return 0;
-
 }
-
- 
@@ -1,74 +1,235 @@
 
 // Establish communication with netlink.
-// Ultimately used to determine when a disc is inserted/removed from the drive.
+// Used by the player daemon (playerd.c) to find out when a disc is inserted/removed from the drive.
 //
+// Every uevent on the system is broadcast to every listener, and on a busy host (USB, block, network churn) that is a lot of them.
+// A classic BPF socket filter runs in the kernel on each one and drops everything that isn't SUBSYSTEM=block or SUBSYSTEM=scsi_generic
+// before it is queued, so those never wake the process. What does get through is read UEVENT_BATCH at a time with recvmmsg().
+// 	https://www.kernel.org/doc/html/latest/networking/filter.html
+// 	man 2 recvmmsg
+
+#define _GNU_SOURCE // recvmmsg()
 
 #include <stdio.h>
 #include <sys/socket.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
 #include <string.h>
 #include <unistd.h>
 #include <stdbool.h>
-#include <ctype.h>
+#include <errno.h>
 
-bool isOpticalDriveMsg(char *msgBuf, ssize_t msgSize, char *targetSubstr);
+#include "nlis.h"
+#include "probecd.h"
+#include "config.h"
 
-#define MAX_NETLINK_MSG 2048
+#define MAX_DEVNAME 32
 
-static char *targetDevname;
-static ssize_t targetDevnameLen = -1;
+// The filter looks for "\0SUBSYSTEM=" at each offset in the first scanBytes of the message, 4 instructions per offset.
+// Classic BPF has no backward jumps, so the scan is unrolled, and a program can be at most BPF_MAXINSNS (4096) instructions.
+// SUBSYSTEM follows ACTION and DEVPATH in every kernel uevent, a few hundred bytes in at most.
+// The kernel charges the program against net.core.optmem_max, so if it refuses one the window is halved until it fits.
+#define FILTER_SCAN_BYTES 768
+#define MIN_FILTER_SCAN_BYTES 96
+#define FILTER_SCAN_INSNS 4
+#define FILTER_CHECK_INSNS 17
+#define FILTER_LEN (FILTER_SCAN_BYTES*FILTER_SCAN_INSNS + 1 + FILTER_CHECK_INSNS)
+// the value strings the filter compares, as the big endian words BPF loads
+#define WORD_NUL_SUB 0x00535542 // "\0SUB"
+#define WORD_SYST 0x53595354 // "SYST"
+#define WORD_EM_B 0x454d3d62 // "EM=b"
+#define WORD_EM_S 0x454d3d73 // "EM=s"
+#define WORD_LOCK 0x6c6f636b // "lock"
+#define WORD_CSI_ 0x6373695f // "csi_"
+#define WORD_GENE 0x67656e65 // "gene"
+#define WORD_RIC_NUL 0x72696300 // "ric\0"
+#define FILTER_ACCEPT 0xffffffff // keep the whole message
+#define FILTER_REJECT 0
 
-int main() {
-	int sockFd = socket(AF_NETLINK, SOCK_RAW, NETLINK_KOBJECT_UEVENT);
-	if(sockFd < 0) {
-		printf("failed to create socket.\n");
-		return 1;
-	}
+#define SUCCESS 0
+#define FAILED_ATTACH_FILTER 1
+#define FAILED_FIND_DEVICE 2
+#define BAD_UEVENT 3
+
+static int buildUeventFilter(struct sock_filter *prog, int scanBytes);
+static bool keyIs(const char *entry, const char *key, const char **value);
+
+// name of the drive's block device, empty matches any srN
+static char devname[MAX_DEVNAME];
+static bool devnameSet = false;
+
+// Opens a non blocking socket subscribed to the kernel's uevents with the filter attached, returns -1 on failure.
+int openUeventSocket(void) {
+	int sockFd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+	if(sockFd < 0)
+		return -1;
 
 	// man 7 netlink for info on this formatting.
+	// nl_pid is left 0 so the kernel picks a unique port, getpid() would clash with any other netlink socket this process opens.
 	struct sockaddr_nl addr;
 	memset(&addr, 0, sizeof(struct sockaddr_nl));
 	addr.nl_family = AF_NETLINK;
-	addr.nl_pid = getpid();
+	addr.nl_pid = 0;
 	addr.nl_groups = 1;
-	
-	if(bind(sockFd, (struct sockaddr *) &addr, sizeof(struct sockaddr_nl)) == -1) {
-		printf("bind failed.\n");
-		return 2;
+
+	// attached before bind() so nothing unfiltered is ever queued
+	if(attachUeventFilter(sockFd) || bind(sockFd, (struct sockaddr *) &addr, sizeof(struct sockaddr_nl)) == -1) {
+		close(sockFd);
+		return -1;
+	}
+	return sockFd;
+}
+
+// Attaches the block/scsi_generic filter to fd. Works on any socket that carries one uevent per message, like a socketpair in a test.
+int attachUeventFilter(int fd) {
+	static struct sock_filter prog[FILTER_LEN];
+	for(int scanBytes = FILTER_SCAN_BYTES; scanBytes >= MIN_FILTER_SCAN_BYTES; scanBytes /= 2) {
+		struct sock_fprog fprog = { .len = buildUeventFilter(prog, scanBytes), .filter = prog };
+		if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(struct sock_fprog)) == 0)
+			return SUCCESS;
+		if(errno != ENOMEM)
+			break;
+	}
+	return FAILED_ATTACH_FILTER;
+}
+
+// Scan, one block per offset i:
+// 	ld [i]; jeq "\0SUB" ? next : skip 2; ldx #i; ja check
+// then, with X at the match:
+// 	"SYST" at X+4, then "EM=b" "lock" "\0" or "EM=s" "csi_" "gene" "ric\0"
+// A load past the end of the message makes BPF drop it, which only happens once the scan has passed every entry without a SUBSYSTEM.
+// A message with SUBSYSTEM past the scan window is let through, userspace checks it anyway.
+static int buildUeventFilter(struct sock_filter *prog, int scanBytes) {
+	int n = 0;
+	const int check = scanBytes*FILTER_SCAN_INSNS + 1;
+	for(int i=0; i<scanBytes; i++) {
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, i);
+		prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_NUL_SUB, 0, 2);
+		prog[n++] = (struct sock_filter)BPF_STMT(BPF_LDX | BPF_W | BPF_IMM, i);
+		prog[n] = (struct sock_filter)BPF_STMT(BPF_JMP | BPF_JA, check - (n + 1));
+		n++;
 	}
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT);
 
-	// the property that is expected to exist in a netlink message relating to a disc drive event.
-	char identifier[] = "DEVNAME=sr0";
+	// jump offsets below count from the instruction after the jump, accept is 15 and reject 16 past check
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 4); // check+0
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_SYST, 0, 14);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 8);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_EM_B, 7, 0);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_EM_S, 0, 11); // check+4
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 12);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_CSI_, 0, 9);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 16);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_GENE, 0, 7); // check+8
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 20);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_RIC_NUL, 4, 5);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_IND, 12); // check+11, "EM=b" lands here
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, WORD_LOCK, 0, 3);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_B | BPF_IND, 16);
+	prog[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 0, 1);
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, FILTER_ACCEPT); // check+15
+	prog[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, FILTER_REJECT); // check+16
+	return n;
+}
 
-	char msg[MAX_NETLINK_MSG];
-	ssize_t msgSize = recv(sockFd, &msg, MAX_NETLINK_MSG, 0);
-	if(msgSize == -1) {
-		printf("recv failed.\n");
-		return 3;
+// Picks the drive whose uevents classifyUevent() reports, by its /dev/srN or /dev/sgN node.
+// Until this is called the drive at OPTICAL_DRIVE_PATH is used. If the srN can't be found every optical drive's uevents are reported.
+int setUeventDevice(const char *devicePath) {
+	devnameSet = true;
+	if(findBlockDevname(devicePath, devname, MAX_DEVNAME)) {
+		devname[0] = '\0';
+		return FAILED_FIND_DEVICE;
 	}
+	return SUCCESS;
+}
 
-	if(isOpticalDriveMsg((char *)msg, msgSize, identifier)) {
-		printf("Message from optical drive recieved\n");
+// The srN uevents are matched against, empty if any optical drive's are.
+const char *getUeventDevname(void) {
+	if(!devnameSet)
+		setUeventDevice(OPTICAL_DRIVE_PATH);
+	return devname;
+}
+
+// Takes up to UEVENT_BATCH waiting uevents off fd with one recvmmsg(), without blocking.
+// Returns how many there were, 0 if there were none, or -1 if fd is broken or closed (only a socketpair closes).
+// ENOBUFS means the kernel dropped uevents because the socket was full, nothing can be done about the lost ones, so that is 0 too.
+int receiveUevents(int fd, UeventBatch *batch) {
+	struct mmsghdr headers[UEVENT_BATCH];
+	struct iovec iovs[UEVENT_BATCH];
+	memset(headers, 0, sizeof(headers));
+	for(int i=0; i<UEVENT_BATCH; i++) {
+		iovs[i].iov_base = batch->msgs[i];
+		iovs[i].iov_len = MAX_NETLINK_MSG;
+		headers[i].msg_hdr.msg_iov = &iovs[i];
+		headers[i].msg_hdr.msg_iovlen = 1;
 	}
-	return 0;
 
+	batch->count = 0;
+	int count = recvmmsg(fd, headers, UEVENT_BATCH, MSG_DONTWAIT, NULL);
+	if(count == -1)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ENOBUFS ? 0 : -1;
+	for(int i=0; i<count; i++) {
+		// an empty message is the other end of a socketpair closing
+		if(headers[i].msg_len == 0)
+			return i > 0 ? (batch->count = i) : -1;
+		batch->sizes[i] = headers[i].msg_len;
+	}
+	batch->count = count;
+	return count;
 }
 
-bool isOpticalDriveMsg(char *msgBuf, ssize_t msgSize, char *identifierStr) {
-	bool isMatching = true;
-	char *idStart = identifierStr;
-	char *firstInvalid = msgBuf+msgSize;
-	while(msgBuf != firstInvalid) {
-		if(isMatching && (isMatching = *msgBuf == *identifierStr)) {
-			if(*msgBuf == '\0')
-				return true;
-			identifierStr++;
-		}
-		else if(*msgBuf == '\0') {
-			isMatching = true;
-			identifierStr = idStart;
-		}
-		msgBuf++;
+// A uevent is an "ACTION@DEVPATH" header followed by NUL terminated KEY=value properties.
+// The message has to end in a NUL, which every kernel uevent does, so the values can be used as strings where they are.
+int parseUevent(char *msgBuf, ssize_t msgSize, Uevent *dest) {
+	memset(dest, 0, sizeof(Uevent));
+	if(msgSize <= 0 || msgBuf[msgSize-1] != '\0')
+		return BAD_UEVENT;
+
+	const char *value;
+	const char *entry = msgBuf + strlen(msgBuf) + 1; // skip the header
+	const char *end = msgBuf + msgSize;
+	while(entry < end) {
+		if(keyIs(entry, "ACTION=", &value))
+			dest->action = value;
+		else if(keyIs(entry, "DEVPATH=", &value))
+			dest->devpath = value;
+		else if(keyIs(entry, "SUBSYSTEM=", &value))
+			dest->subsystem = value;
+		else if(keyIs(entry, "DEVNAME=", &value))
+			dest->devname = value;
+		else if(keyIs(entry, "DEVTYPE=", &value))
+			dest->devtype = value;
+		else if(keyIs(entry, "DISK_MEDIA_CHANGE=", &value))
+			dest->mediaChange = strcmp(value, "1") == 0;
+		else if(keyIs(entry, "DISK_EJECT_REQUEST=", &value))
+			dest->ejectRequest = strcmp(value, "1") == 0;
+		entry += strlen(entry) + 1;
 	}
-	return false;
+	return SUCCESS;
+}
+
+static bool keyIs(const char *entry, const char *key, const char **value) {
+	size_t len = strlen(key);
+	if(strncmp(entry, key, len))
+		return false;
+	*value = entry + len;
+	return true;
+}
+
+// The kernel sends a change event with DISK_MEDIA_CHANGE=1 for the block device (devname "sr0") on both insert and removal,
+// and DISK_EJECT_REQUEST=1 when the button is pressed on a locked tray.
+// 	see block/disk-events.c in the kernel source
+int classifyUevent(const Uevent *event) {
+	const char *name = getUeventDevname();
+	if(!event->action || strcmp(event->action, "change") || !event->subsystem || strcmp(event->subsystem, "block") || !event->devname)
+		return UEVENT_IGNORED;
+	// DEVNAME can be "sr0" or, from some kernels, "/dev/sr0"
+	const char *eventName = strrchr(event->devname, '/') ? strrchr(event->devname, '/') + 1 : event->devname;
+	if(*name ? strcmp(eventName, name) != 0 : strncmp(eventName, "sr", 2) != 0)
+		return UEVENT_IGNORED;
+	if(event->ejectRequest)
+		return UEVENT_EJECT_REQUEST;
+	if(event->mediaChange)
+		return UEVENT_MEDIA_CHANGE;
+	return UEVENT_IGNORED;
 }
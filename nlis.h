@@ -0,0 +1,44 @@
+
+#ifndef NLIS_H
+#define NLIS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define MAX_NETLINK_MSG 2048 // the kernel's UEVENT_BUFFER_SIZE, no uevent is longer
+#define UEVENT_BATCH 16 // most uevents taken per receiveUevents()
+
+// what classifyUevent() makes of a uevent
+#define UEVENT_IGNORED 0 // not about the drive, or nothing playback cares about
+#define UEVENT_MEDIA_CHANGE 1 // a disc went in or came out, TEST UNIT READY tells which
+#define UEVENT_EJECT_REQUEST 2 // the eject button was pressed while the tray was locked
+
+typedef struct Uevent Uevent;
+typedef struct UeventBatch UeventBatch;
+
+// Points into the message it was parsed from, NULL for keys the message doesn't have.
+struct Uevent {
+	const char *action;
+	const char *devpath;
+	const char *subsystem;
+	const char *devname;
+	const char *devtype;
+	bool mediaChange; // DISK_MEDIA_CHANGE=1
+	bool ejectRequest; // DISK_EJECT_REQUEST=1
+};
+
+struct UeventBatch {
+	int count;
+	ssize_t sizes[UEVENT_BATCH];
+	char msgs[UEVENT_BATCH][MAX_NETLINK_MSG];
+};
+
+int openUeventSocket(void);
+int attachUeventFilter(int fd);
+int setUeventDevice(const char *devicePath);
+const char *getUeventDevname(void);
+int receiveUevents(int fd, UeventBatch *batch);
+int parseUevent(char *msgBuf, ssize_t msgSize, Uevent *dest);
+int classifyUevent(const Uevent *event);
+
+#endif
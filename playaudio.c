@@ -6,18 +6,44 @@
 
 #include <alsa/asoundlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 #include "playaudio.h"
 #include "readcd.h"
+#include "ringbuf.h"
+#include "cdreader.h"
+#include "cdspeed.h"
+#include "checksum.h"
+#include "stats.h"
+#include "config.h"
 
 #define STEREO 2
 #define CD_SAMPLING_RATE 44100 // frames per second
 #define PCM_BUF_BEFORE_BLOCKING (CD_SAMPLING_RATE / 2) // pcm only buffers this much audio
-#define TARGET_PCM "default"
+#define TARGET_PCM "default" // unless PCM_ENV names another
 #define FRAME_SIZE 4 // Each frames has 2 samples, one for each channel since CD audio is stero, and each sample is 2 bytes (signed 16 bit little endian)
 		    // 	Thus, the size of a single frame is 4 bytes
 #define PERIODS_TO_BUFFER 4 // try to keep at least this many periods in the PCM at a time for smooth playback
 
 #define CD_AUDIO_BLOCKS_TO_BUFFER (CD_AUDIO_BLOCKS_ONE_SEC * 2)
+#define CD_AUDIO_BLOCKS_PER_SLOT (CD_AUDIO_BLOCKS_ONE_SEC / 5) // each ring slot holds 200ms of audio
+#define DEFAULT_RING_SLOTS (CD_AUDIO_BLOCKS_TO_BUFFER / CD_AUDIO_BLOCKS_PER_SLOT)
+#define DEFAULT_RING_LOW_WATERMARK (DEFAULT_RING_SLOTS / 4)
+#define DEFAULT_RING_HIGH_WATERMARK (DEFAULT_RING_SLOTS / 2)
+
+// In mmap access the PCM's own buffer replaces the ring, so it is made as deep as the ring would have been
+#define BLOCK_FRAMES (CD_AUDIO_BLOCK_SIZE / FRAME_SIZE) // 588 frames in each CD audio block
+#define PCM_MMAP_BUF_FRAMES (BLOCK_FRAMES * CD_AUDIO_BLOCKS_TO_BUFFER)
+#define MMAP_READ_BLOCKS CD_AUDIO_BLOCKS_PER_SLOT // most blocks read into the PCM buffer per snd_pcm_mmap_begin()
+#define PCM_WAIT_MS 100 // longest the playback thread sleeps in poll() without looking around
+#define MAX_PCM_POLL_FDS 8 // a PCM usually has one, plugins stacked on plugins a few more
+#define MAX_LATENCY_LEVEL 3 // xruns grow the PCM's buffer up to 2^3 times its usual size
+#define LATENCY_STABLE_SEC 60 // this long without an xrun shrinks it back a step
+#define PREFILL_QUARTERS 3 // of a grown buffer, filled before snd_pcm_writei() starts the PCM
+#define NO_SEEK UINT32_MAX
 
 #define SUCCESS 0
 #define FAILED_OPEN_PCM 1
@@ -28,29 +54,144 @@
 #define FAILED_SET_PARAMS 6
 #define FAILED_ALLOCATE_MEMORY 7
 #define FAILED_SET_BUF 8
+#define FAILED_MAKE_RING 9
+#define FAILED_START_READER 10
+#define FAILED_READ_AUDIO 11
+#define FAILED_WRITE_FRAMES 12
+#define BAD_RING_DEPTH 13
+#define NO_ACTIVE_RING 14
+#define FAILED_SET_SW_PARAMS 15
+#define FAILED_MMAP_BEGIN 16
+#define NOT_PLAYING 17
+#define FAILED_PAUSE 18
+#define FAILED_RECOVER 19
+#define FAILED_MAKE_EVENTFD 20
+#define FAILED_SET_PERIOD 21
+#define STILL_PLAYING 22
 
+int configurePCM(PCM *pcm, unsigned int level);
 sframes writeFramesForPlayback(PCM *pcm, void *frameBuf, snd_pcm_uframes_t framesInBuf);
+int recoverPCM(PCM *pcm, sframes err);
+void relaxLatency(PCM *pcm);
+int playSlot(PCM *pcm, RingSlot *slot, long *offset);
+void waitForPlayback(PCM *pcm, RingBuf *ring, bool wantPCM);
+void wakePlayback(PCM *pcm);
+int playIntoMmap(uint32_t startLBA, uint32_t leadoutLBA, PCM *pcm);
+int copyBlockIntoMmap(PCM *pcm, uint8_t *block, long size);
+uint8_t *getMmapAddr(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset);
+bool hasPeriodQueued(PCM *pcm);
+uint32_t takeSeek(PCM *pcm, uint32_t leadoutLBA);
+void noteFirstSoundAfterSeek(PCM *pcm);
+bool takeStop(PCM *pcm);
+void updatePlayhead(PCM *pcm, uint32_t queuedEndLBA);
+bool isInterrupted(PCM *pcm);
 
 struct PCM {
 	snd_pcm_t *handle;
-	uframes transferLen; // the desired number of frames to send to snd_pcm_writei() at a time
+	uframes transferLen; // PERIODS_TO_BUFFER periods, see getTransferLen(), playback itself writes whatever the PCM has room for
 	uframes samplingRate;
+	bool mmapAccess; // true if the drive is read straight into the PCM's buffer instead of through snd_pcm_writei()
+
+	unsigned int ringSlots;
+	unsigned int ringLowWatermark;
+	unsigned int ringHighWatermark;
+	_Atomic(RingBuf *) ring; // only non NULL while startPlayingFrom() is running
+	RingStats lastRingStats; // stats of the last ring, kept after playback ends
+
+	atomic_bool playing;
+	atomic_bool stopRequested; // set by stopPlaying(), playback drops what is queued and returns
+	_Atomic uint32_t seekLBA; // NO_SEEK unless seekTo() has asked the playback thread to jump
+	_Atomic double seekRequestedAt; // monotonic seconds, when the pending seek was asked for
+	bool awaitingFirstSound; // only touched by the playback thread
+	_Atomic double lastSeekLatency;
+	_Atomic uint32_t playheadLBA; // block being heard right now, as of the last write
+	atomic_ulong xruns;
+	_Atomic double firstSoundAt;
+	bool canPause; // the device supports snd_pcm_pause()
+	unsigned int latencyLevel; // the buffer is 2^latencyLevel times its usual size, only changed by the playback thread once initialized
+	double latencyChangedAt; // monotonic seconds, the last xrun or change of latencyLevel
+	atomic_ulong bufFrames; // the buffer size the PCM actually took
+	atomic_ulong periodFrames;
+	uframes bufFramesWanted; // from setPCMBufferSize(), 0 for the usual size
+	uframes periodFramesWanted; // 0 for whatever the device picks
+	bool fastStart; // see setFastStart()
+	int wakeFd; // eventfd, stopPlaying() and seekTo() wake the playback thread's poll() with it
+	atomic_ulong wakeups; // times the playback thread came back from poll()
 };
 
-// initializes the passed PCM to a valid PCM.
+// initializes the passed PCM to a valid PCM, using mmap access if the device allows it.
 // If any error occurs, dest is unmodified.
 int initPCM(PCM **dest) {
-	int err;
+	return initPCMAccess(dest, PCM_ACCESS_MMAP);
+}
+
+// Same as initPCM(), but access picks how audio is handed to ALSA.
+// 	PCM_ACCESS_MMAP: audio is read from the drive directly into the PCM's buffer (snd_pcm_mmap_begin/commit), saving the copy snd_pcm_writei() makes.
+// 		Falls back to PCM_ACCESS_RW if the device refuses mmap access.
+// 	PCM_ACCESS_RW: audio goes through the reader thread's ring and snd_pcm_writei().
+// Either way the PCM is non-blocking, the playback thread sleeps in poll() on the PCM's descriptors instead, see waitForPlayback().
+int initPCMAccess(PCM **dest, int access) {
 	snd_pcm_t *handle;
+	const char *name = getenv(PCM_ENV);
+	if(snd_pcm_open(&handle, name && *name ? name : TARGET_PCM, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK) < 0) {
+		return FAILED_OPEN_PCM;
+	}
+
+	PCM *pcm = malloc(sizeof(PCM));
+	if(!pcm) {
+		snd_pcm_close(handle);
+		return FAILED_ALLOCATE_MEMORY;
+	}
+	memset(pcm, 0, sizeof(PCM));
+	pcm->handle = handle;
+	pcm->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(pcm->wakeFd == -1) {
+		snd_pcm_close(handle);
+		free(pcm);
+		return FAILED_MAKE_EVENTFD;
+	}
+
+	// only asks whether the device takes mmap access, configurePCM() sets the params for real
 	snd_pcm_hw_params_t *params;
+	snd_pcm_hw_params_alloca(&params);
+	snd_pcm_hw_params_any(handle, params);
+	pcm->mmapAccess = access == PCM_ACCESS_MMAP && snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_MMAP_INTERLEAVED) == 0;
 
-	if((err = snd_pcm_open(&handle, TARGET_PCM, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
-		return FAILED_OPEN_PCM;
+	int status = configurePCM(pcm, 0);
+	if(status) {
+		snd_pcm_close(handle);
+		close(pcm->wakeFd);
+		free(pcm);
+		return status;
 	}
 
-	// initialize variables for hardware params
+	pcm->ringSlots = DEFAULT_RING_SLOTS;
+	pcm->ringLowWatermark = DEFAULT_RING_LOW_WATERMARK;
+	pcm->ringHighWatermark = DEFAULT_RING_HIGH_WATERMARK;
+	pcm->fastStart = true;
+	atomic_init(&pcm->ring, NULL);
+	atomic_init(&pcm->playing, false);
+	atomic_init(&pcm->stopRequested, false);
+	atomic_init(&pcm->seekLBA, NO_SEEK);
+	atomic_init(&pcm->seekRequestedAt, 0);
+	atomic_init(&pcm->lastSeekLatency, 0);
+	atomic_init(&pcm->playheadLBA, 0);
+	atomic_init(&pcm->xruns, 0);
+	atomic_init(&pcm->firstSoundAt, 0);
+	atomic_init(&pcm->wakeups, 0);
+
+	*dest = pcm;
+	return SUCCESS;
+}
+
+// Sets the PCM's hardware and software params for its access, with a buffer 2^level times the usual size
+// (or the one from setPCMBufferSize()), and prepares it.
+// Used again to resize the buffer after xruns and once playback has been steady, see recoverPCM() and relaxLatency().
+// The PCM must not be running, and nothing queued in it survives.
+int configurePCM(PCM *pcm, unsigned int level) {
+	snd_pcm_hw_params_t *params;
 	snd_pcm_hw_params_alloca(&params);
-	snd_pcm_hw_params_any(handle, params); // set default values
+	snd_pcm_hw_params_any(pcm->handle, params); // set default values
 
 	// set parameters.
 	// for CD audio:
@@ -61,13 +202,13 @@ int initPCM(PCM **dest) {
 	//
 	// 	None of these are documented in the "actual" ALSA docs, but this article explains them well:
 	// 	https://www.linuxjournal.com/article/6735
-	if((err = snd_pcm_hw_params_set_access(handle, params, SND_PCM_ACCESS_RW_INTERLEAVED)) < 0) {
+	if(snd_pcm_hw_params_set_access(pcm->handle, params, pcm->mmapAccess ? SND_PCM_ACCESS_MMAP_INTERLEAVED : SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {
 		return FAILED_SET_ACCESS;
 	}
-	if((err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16_LE)) < 0) {
+	if(snd_pcm_hw_params_set_format(pcm->handle, params, SND_PCM_FORMAT_S16_LE) < 0) {
 		return FAILED_SET_FORMAT;
 	}
-	if((err = snd_pcm_hw_params_set_channels(handle, params, STEREO)) < 0) {
+	if(snd_pcm_hw_params_set_channels(pcm->handle, params, STEREO) < 0) {
 		return FAILED_SET_CHANNELS;
 	}
 	unsigned int rate = CD_SAMPLING_RATE;
@@ -76,37 +217,57 @@ int initPCM(PCM **dest) {
 	// NULL is an ignored value which, in other versions of the function, specifies which rate to use if the requested one is not supported.
 	// 	I could not find any information on the final param besides asking Chat-GPT so take with a grain of salt. Seems to be accurate in my usage.
 	// 	In the example https://gist.github.com/ghedo/963382/815c98d1ba0eda1b486eb9d80d9a91a81d995283, 0 is used as well (technically that param is a pointer so I feel like NULL is more appropriate)
-	if((err = snd_pcm_hw_params_set_rate_near(handle, params, &rate, NULL)) < 0) {
+	if(snd_pcm_hw_params_set_rate_near(pcm->handle, params, &rate, NULL) < 0) {
 		return FAILED_SET_RATE;
 	}
 
 	// Sets the number of frames the PCM handle can accept before blocking, keep small to avoid latency when draining the pcm
-	snd_pcm_uframes_t bufFrames = PCM_BUF_BEFORE_BLOCKING;
-	if ((err = snd_pcm_hw_params_set_buffer_size_near(handle, params, &bufFrames) < 0))
+	// With mmap access the buffer also has to absorb slow reads, since there is no ring in front of it.
+	snd_pcm_uframes_t bufFrames = pcm->bufFramesWanted ? pcm->bufFramesWanted : pcm->mmapAccess ? PCM_MMAP_BUF_FRAMES : PCM_BUF_BEFORE_BLOCKING;
+	bufFrames <<= level;
+	if(snd_pcm_hw_params_set_buffer_size_near(pcm->handle, params, &bufFrames) < 0)
 		return FAILED_SET_BUF;
 
+	// from my understanding of https://www.linuxjournal.com/article/6735, a period is the smallest unit of audio data transfer to the PCM. 
+	// The PCM's descriptors poll ready once a period has been played, so this is also how often the playback thread wakes up.
+	// Unless setPCMBufferSize() asked for one, this application just uses whatever the default value is.
+	snd_pcm_uframes_t periodFrames = pcm->periodFramesWanted;
+	if(periodFrames && snd_pcm_hw_params_set_period_size_near(pcm->handle, params, &periodFrames, NULL) < 0)
+		return FAILED_SET_PERIOD;
+
 	// apply the parameters
-	if((err = snd_pcm_hw_params(handle, params)) < 0) {
+	if(snd_pcm_hw_params(pcm->handle, params) < 0) {
 		return FAILED_SET_PARAMS;
 	}
 
-	// from my understanding of https://www.linuxjournal.com/article/6735, a period is the smallest unit of audio data transfer to the PCM. 
 	// get_period_size sets the second param to the number of frames that each period has.
-	// For now this application just uses whatever the default value is and does not attempt to set it's own.
-	snd_pcm_uframes_t periodFrames = 0;
 	snd_pcm_hw_params_get_period_size(params, &periodFrames, NULL);
+	snd_pcm_hw_params_get_buffer_size(params, &bufFrames);
 
-	uframes transferLen = periodFrames * PERIODS_TO_BUFFER;
-	
-	PCM *pcm = malloc(sizeof(PCM));
-	if(!pcm)
-		return FAILED_ALLOCATE_MEMORY;
+	// With mmap access nothing is written until the buffer has been filled from the drive, so don't start until it is full.
+	// snd_pcm_mmap_commit() starts the PCM on its own once the threshold is reached, a fast start or a seek starts it by hand sooner.
+	// snd_pcm_writei() starts it once a period has been written, unless the buffer has grown after xruns, then it waits for
+	// PREFILL_QUARTERS of the buffer so there is a cushion before anything is heard.
+	snd_pcm_uframes_t startThreshold = periodFrames;
+	if(pcm->mmapAccess)
+		startThreshold = (bufFrames / BLOCK_FRAMES) * BLOCK_FRAMES;
+	else if(level > 0)
+		startThreshold = bufFrames / 4 * PREFILL_QUARTERS;
+	if(startThreshold) {
+		snd_pcm_sw_params_t *swParams;
+		snd_pcm_sw_params_alloca(&swParams);
+		if(snd_pcm_sw_params_current(pcm->handle, swParams) < 0
+				|| snd_pcm_sw_params_set_start_threshold(pcm->handle, swParams, startThreshold) < 0
+				|| snd_pcm_sw_params(pcm->handle, swParams) < 0)
+			return FAILED_SET_SW_PARAMS;
+	}
 
-	pcm->handle = handle;
-	pcm->transferLen = transferLen;
+	pcm->transferLen = periodFrames * PERIODS_TO_BUFFER;
 	pcm->samplingRate = rate;
-
-	*dest = pcm;
+	pcm->canPause = snd_pcm_hw_params_can_pause(params);
+	pcm->latencyLevel = level;
+	atomic_store(&pcm->bufFrames, bufFrames);
+	atomic_store(&pcm->periodFrames, periodFrames);
 
 	snd_pcm_prepare(pcm->handle);
 
@@ -117,16 +278,28 @@ int initPCM(PCM **dest) {
 // Does not free the actual pointer to the PCM
 // Accessing the passed PCM is invalid unless it is re-initialized with initPCM.
 void destroyPCM(PCM *pcm) {
+	// a non-blocking drain returns straight away instead of waiting for the audio to finish
+	snd_pcm_nonblock(pcm->handle, 0);
 	snd_pcm_drain(pcm->handle);
 	snd_pcm_close(pcm->handle);
+	close(pcm->wakeFd);
 }
 
 // writes framesInBuf frames from frameBuf to the PCM's buffer to be played
-// returns the number of frames written, otherwise a negative error code;
+// returns the number of frames written, 0 if the PCM is full, otherwise a negative error code;
 sframes writeFramesForPlayback(PCM *pcm, void *frameBuf, snd_pcm_uframes_t framesInBuf) {
 	snd_pcm_sframes_t framesWritten = snd_pcm_writei(pcm->handle, frameBuf, framesInBuf);
-	if(framesWritten >= 0)
+	countStat(STAT_PCM_WRITES, 1);
+	if(framesWritten == -EAGAIN)
+		framesWritten = 0;
+	if(framesWritten >= 0) {
+		countStat(STAT_PCM_FRAMES, framesWritten);
+		if((snd_pcm_uframes_t)framesWritten < framesInBuf) {
+			countStat(STAT_PCM_SHORT_WRITES, 1);
+			STATS_PROBE3(pcm_short_write, framesWritten, framesInBuf, 0);
+		}
 		return framesWritten;
+	}
 	if(framesWritten == -EBADFD)
 		return BAD_STATE;
 	if(framesWritten == -EPIPE)
@@ -136,6 +309,42 @@ sframes writeFramesForPlayback(PCM *pcm, void *frameBuf, snd_pcm_uframes_t frame
 	return UNKNOWN_ERR;
 }
 
+// Playback thread only. Gets the PCM going again after a write or snd_pcm_avail_update() failed with err, UNDERRUN or SUSPENDED.
+// snd_pcm_recover() prepares it again after an xrun, and after a suspend waits for the device to resume (or prepares it, if it can't).
+// 	https://www.alsa-project.org/alsa-doc/alsa-lib/group___p_c_m.html (snd_pcm_recover)
+// An xrun also grows the buffer a step: the PCM is empty by now so resizing loses nothing more, and a bigger buffer
+// rides out the next stall on a loaded host. relaxLatency() shrinks it again once playback has been steady.
+int recoverPCM(PCM *pcm, sframes err) {
+	if(err != UNDERRUN && err != SUSPENDED)
+		return FAILED_RECOVER;
+	if(snd_pcm_recover(pcm->handle, err == UNDERRUN ? -EPIPE : -ESTRPIPE, 1) < 0)
+		return FAILED_RECOVER;
+	// a suspend is the host going to sleep, not playback falling behind
+	if(err == SUSPENDED)
+		return SUCCESS;
+	atomic_fetch_add(&pcm->xruns, 1);
+	countStat(STAT_PCM_XRUNS, 1);
+	STATS_PROBE1(pcm_xrun, atomic_load(&pcm->playheadLBA));
+	pcm->latencyChangedAt = monotonicSec();
+	if(pcm->latencyLevel < MAX_LATENCY_LEVEL && configurePCM(pcm, pcm->latencyLevel+1))
+		return configurePCM(pcm, pcm->latencyLevel) ? FAILED_RECOVER : SUCCESS;
+	return SUCCESS;
+}
+
+// Playback thread only, called where the PCM has just been emptied anyway, as playback starts and at a seek.
+// Shrinks the buffer a step if there hasn't been an xrun for LATENCY_STABLE_SEC, so latency comes back down on a quiet host.
+// Shrinking while audio is queued would drop it, so a long playback without seeks keeps the buffer it grew to until the next one.
+void relaxLatency(PCM *pcm) {
+	if(pcm->latencyLevel == 0 || monotonicSec() - pcm->latencyChangedAt < LATENCY_STABLE_SEC)
+		return;
+	snd_pcm_sframes_t delay = 0;
+	if(snd_pcm_state(pcm->handle) != SND_PCM_STATE_PREPARED || snd_pcm_delay(pcm->handle, &delay) < 0 || delay > 0)
+		return;
+	pcm->latencyChangedAt = monotonicSec();
+	if(configurePCM(pcm, pcm->latencyLevel-1))
+		configurePCM(pcm, pcm->latencyLevel);
+}
+
 snd_pcm_uframes_t getTransferLen(PCM *pcm) {
 	return pcm->transferLen;
 }
@@ -144,37 +353,481 @@ uframes getSamplingRate(PCM *pcm) {
 	return pcm->samplingRate;
 }
 
+bool usesMmapAccess(PCM *pcm) {
+	return pcm->mmapAccess;
+}
+
+// Sets the period and buffer size, in frames, the PCM asks the device for, 0 for either goes back to the usual one.
+// Small periods get lower latency for more wakeups, the buffer is what rides out slow reads (and still grows after xruns).
+// The device may round both, getPlaybackStats() has what it took. Not while playing.
+int setPCMBufferSize(PCM *pcm, uframes periodFrames, uframes bufferFrames) {
+	if(atomic_load(&pcm->playing))
+		return STILL_PLAYING;
+	pcm->periodFramesWanted = periodFrames;
+	pcm->bufFramesWanted = bufferFrames;
+	return configurePCM(pcm, 0);
+}
+
+
+// Sets how many slots (each CD_AUDIO_BLOCKS_PER_SLOT blocks of audio) the ring between the reader and the PCM holds,
+// and the watermarks, in slots, used by the next call to startPlayingFrom().
+// Without a fast start playback does not begin until highWatermark slots are ready, and falling below lowWatermark is counted in the ring stats.
+int setRingDepth(PCM *pcm, unsigned int slots, unsigned int lowWatermark, unsigned int highWatermark) {
+	if(slots == 0 || lowWatermark > highWatermark || highWatermark > slots)
+		return BAD_RING_DEPTH;
+	pcm->ringSlots = slots;
+	pcm->ringLowWatermark = lowWatermark;
+	pcm->ringHighWatermark = highWatermark;
+	return SUCCESS;
+}
+
+// On, the default, playback starts the way a seek does: a SEEK_FIRST_BLOCKS read first, sound as soon as a period of it is in the PCM,
+// then reads doubling up to full size, which outrun playback at anything over 1x. Off, it waits for the ring's high watermark
+// (or in mmap access the whole buffer) to fill first, a second or two of silence that rides out a drive slow to get going.
+// Used by the next call to startPlayingFrom().
+void setFastStart(PCM *pcm, bool fastStart) {
+	pcm->fastStart = fastStart;
+}
+
+// Copies the fill counters of the ring into *dest.
+// While startPlayingFrom() is running these are live, otherwise they are from the last playback.
+int getPlaybackRingStats(PCM *pcm, RingStats *dest) {
+	RingBuf *ring = atomic_load(&pcm->ring);
+	if(ring) {
+		getRingStats(ring, dest);
+		return SUCCESS;
+	}
+	if(pcm->lastRingStats.slotCount == 0)
+		return NO_ACTIVE_RING;
+	*dest = pcm->lastRingStats;
+	return SUCCESS;
+}
+
+// Xruns are counted over the PCM's life, the rest is for the current or last playback. Safe to call from any thread.
+void getPlaybackStats(PCM *pcm, PlaybackStats *dest) {
+	dest->xruns = atomic_load(&pcm->xruns);
+	dest->firstSoundAt = atomic_load(&pcm->firstSoundAt);
+	snd_pcm_sframes_t delay = 0;
+	if(!atomic_load(&pcm->playing) || snd_pcm_delay(pcm->handle, &delay) < 0 || delay < 0)
+		delay = 0;
+	dest->queuedFrames = delay;
+	dest->bufferFrames = atomic_load(&pcm->bufFrames);
+	dest->periodFrames = atomic_load(&pcm->periodFrames);
+	dest->wakeups = atomic_load(&pcm->wakeups);
+}
 
+// The drive is read on its own thread so a slow SG_IO only drains the ring instead of starving the PCM.
+// The calling thread becomes the playback thread and writes whatever the reader has put in the ring.
+// It never blocks in ALSA: it sleeps in one poll() on the PCM's descriptors, the ring and stop/seek requests, see waitForPlayback(),
+// and each time it wakes it writes as much as the PCM has room for.
+// With mmap access the PCM's buffer is the ring, see playIntoMmap().
+// The drive is slowed to SPEED_POLICY_PLAYBACK first, if it refuses it just plays at whatever speed it picks.
 int startPlayingFrom(uint32_t startLBA, uint32_t leadoutLBA, PCM *pcm) {
-	void *framesBuf = NULL;
-	long framesBufSize = 0;
+	applySpeedPolicy(SPEED_POLICY_PLAYBACK);
+	atomic_store(&pcm->seekLBA, NO_SEEK);
+	atomic_store(&pcm->stopRequested, false);
+	atomic_store(&pcm->playheadLBA, startLBA);
+	atomic_store(&pcm->firstSoundAt, 0);
+	resetPCMDelayStats();
+	relaxLatency(pcm);
+	atomic_store(&pcm->playing, true);
+	int status;
+	if(pcm->mmapAccess) {
+		status = playIntoMmap(startLBA, leadoutLBA, pcm);
+		atomic_store(&pcm->playing, false);
+		return status;
+	}
+
+	RingBuf *ring;
+	long slotSize = CD_AUDIO_BLOCKS_PER_SLOT * CD_AUDIO_BLOCK_SIZE;
+	if(makeRingBuf(&ring, pcm->ringSlots, slotSize, pcm->ringLowWatermark, pcm->ringHighWatermark)) {
+		atomic_store(&pcm->playing, false);
+		return FAILED_MAKE_RING;
+	}
+
+	CDReader *reader;
+	uint32_t firstSlotBlocks = pcm->fastStart ? SEEK_FIRST_BLOCKS : CD_AUDIO_BLOCKS_PER_SLOT;
+	if(startCDReaderRamped(&reader, ring, startLBA, leadoutLBA, CD_AUDIO_BLOCKS_PER_SLOT, firstSlotBlocks)) {
+		destroyRingBuf(ring);
+		atomic_store(&pcm->playing, false);
+		return FAILED_START_READER;
+	}
+	atomic_store(&pcm->ring, ring);
+
+	// let the reader get ahead before the first frame is written, unless starting fast
+	unsigned int highWatermark = pcm->fastStart ? 0 : getRingHighWatermark(ring);
+	while(getRingFill(ring) < highWatermark && !isCDReaderFinished(reader) && atomic_load(&pcm->seekLBA) == NO_SEEK && !atomic_load(&pcm->stopRequested))
+		waitForPlayback(pcm, ring, false);
+
+	status = SUCCESS;
+	RingSlot *slot = NULL; // being played, slotOffset bytes of it have been written
+	long slotOffset = 0;
+	bool lastSlotPlayed = false;
+	while(!lastSlotPlayed) {
+		if(takeStop(pcm))
+			break;
+
+		// Everything queued is from before the seek: stop the reader, throw away the ring and what the PCM still holds,
+		// and restart the reader at the target with a small first read so there is sound again within about a period.
+		uint32_t seekLBA = takeSeek(pcm, leadoutLBA);
+		if(seekLBA != NO_SEEK) {
+			stopCDReader(reader);
+			drainRing(ring);
+			snd_pcm_drop(pcm->handle);
+			snd_pcm_prepare(pcm->handle);
+			relaxLatency(pcm);
+			slot = NULL;
+			if(startCDReaderRamped(&reader, ring, seekLBA, leadoutLBA, CD_AUDIO_BLOCKS_PER_SLOT, SEEK_FIRST_BLOCKS)) {
+				reader = NULL;
+				status = FAILED_START_READER;
+				break;
+			}
+			continue;
+		}
+
+		if(!slot) {
+			slot = getReadableSlot(ring);
+			slotOffset = 0;
+			if(!slot) {
+				waitForPlayback(pcm, ring, false);
+				continue;
+			}
+			// reads were aborted because the disc is going away, that is a stop, not a failure
+			if((slot->flags & RING_SLOT_ERROR) && slot->status == READ_CD_AUDIO_ABORTED) {
+				atomic_store(&pcm->stopRequested, true);
+				continue;
+			}
+			if(slot->flags & RING_SLOT_ERROR) {
+				printf("readaudio failed: %d\n", slot->status);
+				status = FAILED_READ_AUDIO;
+				break;
+			}
+		}
+
+		long written = slotOffset;
+		if((status = playSlot(pcm, slot, &slotOffset)))
+			break;
+		if(slotOffset > written)
+			noteFirstSoundAfterSeek(pcm);
+		if(slotOffset < slot->size) {
+			if(slotOffset == written)
+				waitForPlayback(pcm, NULL, true);
+			continue;
+		}
+		// a seek that came in while the last slot was playing still has to be taken
+		lastSlotPlayed = (slot->flags & RING_SLOT_LAST) && atomic_load(&pcm->seekLBA) == NO_SEEK;
+		releaseSlot(ring);
+		slot = NULL;
+	}
+
+	if(reader)
+		stopCDReader(reader);
+	// after xruns the PCM waits for its buffer to fill before starting, which the end of the disc may never do
+	if(!status && !atomic_load(&pcm->stopRequested) && snd_pcm_state(pcm->handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(pcm->handle);
+
+	atomic_store(&pcm->ring, NULL);
+	getRingStats(ring, &pcm->lastRingStats);
+	destroyRingBuf(ring);
+	atomic_store(&pcm->playing, false);
+	return status;
+}
+
+// Asks the playback thread to drop whatever is queued and return from startPlayingFrom(), safe to call from any thread.
+// A reader blocked on the drive still finishes its read first, abortDriveReads() cuts that short too.
+int stopPlaying(PCM *pcm) {
+	if(!atomic_load(&pcm->playing))
+		return NOT_PLAYING;
+	atomic_store(&pcm->stopRequested, true);
+	wakePlayback(pcm);
+	return SUCCESS;
+}
+
+bool isPlaying(PCM *pcm) {
+	return atomic_load(&pcm->playing);
+}
+
+// Pauses or resumes the PCM where it is, nothing queued is lost. Safe to call from any thread while startPlayingFrom() is running,
+// alsa-lib locks each PCM around its calls (1.1.2 and later), and the playback thread just sleeps in poll() until it is resumed.
+// stopPlaying() and seekTo() still work while paused, a seek resumes playback at the target.
+// 	https://www.alsa-project.org/alsa-doc/alsa-lib/group___p_c_m.html (snd_pcm_pause)
+// Not every device can pause, canPausePlaying() says whether this one does, and a PCM that hasn't started yet can't either.
+int pausePlaying(PCM *pcm, bool pause) {
+	if(!atomic_load(&pcm->playing))
+		return NOT_PLAYING;
+	if(!pcm->canPause)
+		return FAILED_PAUSE;
+	snd_pcm_state_t state = snd_pcm_state(pcm->handle);
+	if(state == (pause ? SND_PCM_STATE_PAUSED : SND_PCM_STATE_RUNNING))
+		return SUCCESS;
+	// only a running PCM can be paused, one still filling up to its start threshold can't be
+	if(snd_pcm_pause(pcm->handle, pause) < 0)
+		return FAILED_PAUSE;
+	return SUCCESS;
+}
+
+bool canPausePlaying(PCM *pcm) {
+	return pcm->canPause;
+}
+
+// The block being heard right now, from the last write and how much the PCM still had queued then.
+// Safe to call from any thread, only meaningful while startPlayingFrom() is running.
+uint32_t getPlayheadLBA(PCM *pcm) {
+	return atomic_load(&pcm->playheadLBA);
+}
+
+// Playback thread only. queuedEndLBA is the block after the last one handed to the PCM.
+void updatePlayhead(PCM *pcm, uint32_t queuedEndLBA) {
+	snd_pcm_sframes_t delay = 0;
+	if(snd_pcm_delay(pcm->handle, &delay) < 0 || delay < 0)
+		delay = 0;
+	recordPCMDelay(delay);
+	uint32_t queuedBlocks = delay / BLOCK_FRAMES;
+	atomic_store(&pcm->playheadLBA, queuedBlocks < queuedEndLBA ? queuedEndLBA - queuedBlocks : 0);
+}
+
+// Asks the playback thread to jump to lba, safe to call from any thread while startPlayingFrom() is running.
+// Whatever is queued in the ring and the PCM is dropped, so the jump is heard as soon as the first read at lba finishes.
+// A second call before the first is picked up replaces it.
+int seekTo(PCM *pcm, uint32_t lba) {
+	if(!atomic_load(&pcm->playing))
+		return NOT_PLAYING;
+	atomic_store(&pcm->seekRequestedAt, monotonicSec());
+	atomic_store(&pcm->playheadLBA, lba); // so getPlayheadLBA() reports the target straight away
+	atomic_store(&pcm->seekLBA, lba);
+	wakePlayback(pcm);
+	return SUCCESS;
+}
+
+// Seconds from the last seekTo() to its first audio playing, 0 if there hasn't been one.
+double getLastSeekLatency(PCM *pcm) {
+	return atomic_load(&pcm->lastSeekLatency);
+}
+
+// Playback thread only. Returns the pending seek target, clamped to before the leadout, or NO_SEEK.
+uint32_t takeSeek(PCM *pcm, uint32_t leadoutLBA) {
+	uint32_t lba = atomic_exchange(&pcm->seekLBA, NO_SEEK);
+	if(lba == NO_SEEK)
+		return NO_SEEK;
+	pcm->awaitingFirstSound = true;
+	lba = lba < leadoutLBA ? lba : leadoutLBA - 1;
+	atomic_store(&pcm->playheadLBA, lba);
+	return lba;
+}
+
+// True if a stop or seek is waiting to be taken by the playback thread.
+bool isInterrupted(PCM *pcm) {
+	return atomic_load(&pcm->stopRequested) || atomic_load(&pcm->seekLBA) != NO_SEEK;
+}
+
+// Playback thread only. If a stop was asked for, empties the PCM right away and leaves it prepared for the next startPlayingFrom().
+bool takeStop(PCM *pcm) {
+	if(!atomic_load(&pcm->stopRequested))
+		return false;
+	snd_pcm_drop(pcm->handle);
+	snd_pcm_prepare(pcm->handle);
+	return true;
+}
+
+// Playback thread only. Called each time audio is handed to the PCM, records when the playback first had audio to hear,
+// and the latency of a seek the first time after it. Audio only counts once the PCM is running, one still filling up
+// to its start threshold is silent.
+void noteFirstSoundAfterSeek(PCM *pcm) {
+	if(snd_pcm_state(pcm->handle) != SND_PCM_STATE_RUNNING)
+		return;
+	if(atomic_load(&pcm->firstSoundAt) == 0)
+		atomic_store(&pcm->firstSoundAt, monotonicSec());
+	if(!pcm->awaitingFirstSound)
+		return;
+	pcm->awaitingFirstSound = false;
+	atomic_store(&pcm->lastSeekLatency, monotonicSec() - atomic_load(&pcm->seekRequestedAt));
+}
+
+// Writes as much of the slot, from *offset bytes in, as the PCM has room for right now: exactly what snd_pcm_avail_update() says, or the rest of the slot.
+// Never blocks, if the PCM is full *offset is left alone and the caller waits for it in waitForPlayback().
+int playSlot(PCM *pcm, RingSlot *slot, long *offset) {
+	sframes framesWritten = snd_pcm_avail_update(pcm->handle);
+	if(framesWritten >= 0) {
+		uframes framesLeft = (slot->size - *offset)/FRAME_SIZE;
+		uframes frames = framesLeft < (uframes)framesWritten ? framesLeft : (uframes)framesWritten;
+		if(frames == 0)
+			return SUCCESS;
+		framesWritten = writeFramesForPlayback(pcm, slot->data + *offset, frames);
+	}
+	else
+		framesWritten = framesWritten == -EPIPE ? UNDERRUN : framesWritten == -ESTRPIPE ? SUSPENDED : UNKNOWN_ERR;
+	if(framesWritten >= 0) {
+		*offset += framesWritten*FRAME_SIZE;
+		updatePlayhead(pcm, slot->startLBA + *offset/CD_AUDIO_BLOCK_SIZE);
+		return SUCCESS;
+	}
+	// the caller drops the PCM for a stop or seek next anyway
+	if(isInterrupted(pcm))
+		return SUCCESS;
+	// the reader running dry can starve the PCM, and the host can suspend it, either way the same frames are written again once it recovers
+	if(recoverPCM(pcm, framesWritten) == SUCCESS)
+		return SUCCESS;
+	printf("writeFramesForPlayback failed: %ld\n", framesWritten);
+	return FAILED_WRITE_FRAMES;
+}
+
+// Playback thread only. Sleeps in one poll() until the PCM has room for another period (if wantPCM), the reader publishes a slot
+// (if ring isn't NULL), stopPlaying() or seekTo() wake it, or PCM_WAIT_MS passes. The caller looks at what changed itself.
+// 	https://www.alsa-project.org/alsa-doc/alsa-lib/group___p_c_m.html (snd_pcm_poll_descriptors)
+void waitForPlayback(PCM *pcm, RingBuf *ring, bool wantPCM) {
+	struct pollfd fds[MAX_PCM_POLL_FDS + 2];
+	nfds_t count = 0;
+	fds[count++] = (struct pollfd){ .fd = pcm->wakeFd, .events = POLLIN };
+	if(ring)
+		fds[count++] = (struct pollfd){ .fd = getRingReadyFd(ring), .events = POLLIN };
+	int pcmFds = wantPCM ? snd_pcm_poll_descriptors(pcm->handle, fds+count, MAX_PCM_POLL_FDS) : 0;
+	if(pcmFds < 0)
+		pcmFds = 0;
+	poll(fds, count + pcmFds, PCM_WAIT_MS);
+	atomic_fetch_add_explicit(&pcm->wakeups, 1, memory_order_relaxed);
+
+	// plugins can translate their descriptors' events, some only clear them from here
+	unsigned short revents;
+	if(pcmFds > 0)
+		snd_pcm_poll_descriptors_revents(pcm->handle, fds+count, pcmFds, &revents);
+	// cleared before the caller looks again, so a request or slot that comes in after this still wakes the next poll()
+	clearEventFd(pcm->wakeFd);
+	if(ring)
+		clearRingReady(ring);
+}
+
+// Safe to call from any thread, gets the playback thread out of waitForPlayback() to look at a new request.
+void wakePlayback(PCM *pcm) {
+	signalEventFd(pcm->wakeFd);
+}
+
+// Reads audio from the drive straight into the area of the PCM's buffer that snd_pcm_mmap_begin() hands out, then commits it.
+// This skips both the ring and the copy in snd_pcm_writei(); the PCM's buffer is sized like the ring to ride out slow reads.
+// 	https://www.alsa-project.org/alsa-doc/alsa-lib/pcm.html#pcm_transfer ("Direct Read/Write transfer")
+//
+// A seek drops the PCM's buffer and reads SEEK_FIRST_BLOCKS at the target, doubling the read size back up to MMAP_READ_BLOCKS after that.
+// The PCM is started by hand once a period is in it instead of waiting for the buffer to fill to the start threshold again.
+// A fast start, see setFastStart(), begins playback the same way.
+int playIntoMmap(uint32_t startLBA, uint32_t leadoutLBA, PCM *pcm) {
+	uint8_t bounce[CD_AUDIO_BLOCK_SIZE];
+	uint32_t lba = startLBA;
+	uint32_t readBlocks = pcm->fastStart ? SEEK_FIRST_BLOCKS : MMAP_READ_BLOCKS;
+	bool startNow = pcm->fastStart; // don't wait for the start threshold, start with the first period
 	bool leadoutReached = false;
+	while(!leadoutReached) {
+		if(takeStop(pcm))
+			return SUCCESS;
+		uint32_t seekLBA = takeSeek(pcm, leadoutLBA);
+		if(seekLBA != NO_SEEK) {
+			snd_pcm_drop(pcm->handle);
+			snd_pcm_prepare(pcm->handle);
+			relaxLatency(pcm);
+			lba = seekLBA;
+			readBlocks = SEEK_FIRST_BLOCKS;
+			startNow = true;
+		}
+
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(pcm->handle);
+		if(avail < 0) {
+			// the reads fell behind or the host suspended, recover it and it restarts once the buffer is full again
+			if((avail == -EPIPE || avail == -ESTRPIPE) && recoverPCM(pcm, avail == -EPIPE ? UNDERRUN : SUSPENDED) == SUCCESS)
+				continue;
+			// or a stop or seek is about to drop it anyway
+			if(isInterrupted(pcm))
+				continue;
+			return FAILED_WRITE_FRAMES;
+		}
+		if(avail < BLOCK_FRAMES) {
+			waitForPlayback(pcm, NULL, true);
+			continue;
+		}
+
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = avail < readBlocks*BLOCK_FRAMES ? avail : readBlocks*BLOCK_FRAMES;
+		if(snd_pcm_mmap_begin(pcm->handle, &areas, &offset, &frames) < 0)
+			return FAILED_MMAP_BEGIN;
 
-	for(int buffersFilled = 0; !leadoutReached; buffersFilled++) {
-		//printf("NEW BUFF\n");
-		int status = readCDAudio(startLBA+(buffersFilled*CD_AUDIO_BLOCKS_TO_BUFFER), leadoutLBA, CD_AUDIO_BLOCKS_TO_BUFFER, &framesBuf, &framesBufSize);
-		if(status ==  READ_CD_AUDIO_LEADOUT_REACHED) {
-			//printf("LEADOUT\n");
+		uint32_t blocks = frames / BLOCK_FRAMES;
+		long written = 0;
+		int status;
+		if(blocks > 0) {
+			uint8_t *addr = getMmapAddr(areas, offset);
+			status = readCDAudioInto(lba, leadoutLBA, blocks, addr, &written);
+			bool ok = !status || status == READ_CD_AUDIO_LEADOUT_REACHED;
+			if(ok)
+				checksumAudio(lba, addr, written);
+			// a failed read leaves nothing worth playing, committing 0 frames just closes the begin
+			snd_pcm_mmap_commit(pcm->handle, offset, ok ? written/FRAME_SIZE : 0);
+		}
+		else {
+			// a block would run past the end of the buffer, so read it aside and copy it in around the wrap
+			snd_pcm_mmap_commit(pcm->handle, offset, 0);
+			status = readCDAudioInto(lba, leadoutLBA, 1, bounce, &written);
+			if(!status || status == READ_CD_AUDIO_LEADOUT_REACHED) {
+				checksumAudio(lba, bounce, written);
+				if(copyBlockIntoMmap(pcm, bounce, written))
+					return FAILED_MMAP_BEGIN;
+			}
+		}
+
+		if(status == READ_CD_AUDIO_LEADOUT_REACHED)
 			leadoutReached = true;
+		else if(status == READ_CD_AUDIO_ABORTED) {
+			atomic_store(&pcm->stopRequested, true);
+			continue;
 		}
 		else if(status) {
 			printf("readaudio failed: %d\n", status);
-			return 3;
+			return FAILED_READ_AUDIO;
 		}
-
-		// TODO error handling for writeFramesForPlayback() calls
-
-		long offset = 0; // offset is in bytes, always incremented in multiples of FRAME_SIZE
-		uframes framesPerTransfer = getTransferLen(pcm);
-		while(offset < framesBufSize - (framesPerTransfer*FRAME_SIZE)) {
-			sframes framesWritten = writeFramesForPlayback(pcm, framesBuf+offset, framesPerTransfer);
-			if(framesWritten >= 0) {
-				offset += framesWritten*FRAME_SIZE;
-				continue;
+		if(written > 0) {
+			countStat(STAT_PCM_WRITES, 1);
+			countStat(STAT_PCM_FRAMES, written / FRAME_SIZE);
+		}
+		lba += written / CD_AUDIO_BLOCK_SIZE;
+		updatePlayhead(pcm, lba);
+		readBlocks = readBlocks*2 < MMAP_READ_BLOCKS ? readBlocks*2 : MMAP_READ_BLOCKS;
+		if(written > 0) {
+			if(startNow && snd_pcm_state(pcm->handle) != SND_PCM_STATE_PREPARED)
+				startNow = false;
+			else if(startNow && hasPeriodQueued(pcm)) {
+				snd_pcm_start(pcm->handle);
+				startNow = false;
 			}
+			noteFirstSoundAfterSeek(pcm);
 		}
-		sframes remainder = (framesBufSize - offset)/FRAME_SIZE;
-		sframes framesWritten = writeFramesForPlayback(pcm, framesBuf+offset, remainder);
 	}
-	return 0;
+	// a disc shorter than the buffer never reached the start threshold
+	if(snd_pcm_state(pcm->handle) == SND_PCM_STATE_PREPARED)
+		snd_pcm_start(pcm->handle);
+	return SUCCESS;
+}
+
+// True once there is at least a period of audio in the PCM, enough to start it without running dry straight away.
+bool hasPeriodQueued(PCM *pcm) {
+	snd_pcm_sframes_t queued = 0;
+	return snd_pcm_delay(pcm->handle, &queued) == 0 && queued >= (snd_pcm_sframes_t)atomic_load(&pcm->periodFrames);
+}
+
+// Copies size bytes into the PCM's buffer, over as many snd_pcm_mmap_begin() areas as it takes.
+// The caller must already know there are enough frames available.
+int copyBlockIntoMmap(PCM *pcm, uint8_t *block, long size) {
+	long copied = 0;
+	while(copied < size) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset;
+		snd_pcm_uframes_t frames = (size - copied) / FRAME_SIZE;
+		if(snd_pcm_mmap_begin(pcm->handle, &areas, &offset, &frames) < 0 || frames == 0)
+			return FAILED_MMAP_BEGIN;
+		memcpy(getMmapAddr(areas, offset), block+copied, frames*FRAME_SIZE);
+		snd_pcm_mmap_commit(pcm->handle, offset, frames);
+		copied += frames*FRAME_SIZE;
+	}
+	return SUCCESS;
+}
+
+// With interleaved access both channels share the first area, first and step are in bits.
+uint8_t *getMmapAddr(const snd_pcm_channel_area_t *areas, snd_pcm_uframes_t offset) {
+	return (uint8_t *)areas[0].addr + (areas[0].first / 8) + (offset * (areas[0].step / 8));
 }
@@ -3,23 +3,53 @@
 #define PLAYAUDIO_H
 
 #include <stdint.h>
+#include <stdbool.h>
+#include "ringbuf.h"
 
-// error codes for playBufferedAudio()
-#define BAD_STATE -1;
-#define UNDERRUN -2;
-#define SUSPENDED -3;
-#define UNKNOWN_ERR -4;
+// negative frame counts writeFramesForPlayback() returns for a failed write, and the errors recoverPCM() knows how to recover from
+#define BAD_STATE -1
+#define UNDERRUN -2
+#define SUSPENDED -3
+#define UNKNOWN_ERR -4
+
+// access modes for initPCMAccess()
+#define PCM_ACCESS_RW 0
+#define PCM_ACCESS_MMAP 1
 
 typedef struct PCM PCM;
+typedef struct PlaybackStats PlaybackStats;
 typedef unsigned long uframes;
 typedef long sframes;
 
+struct PlaybackStats {
+	unsigned long xruns; // times the PCM ran dry and had to be prepared again
+	double firstSoundAt; // monotonic seconds, when the PCM first started playing audio of the playback, 0 until then
+	long queuedFrames; // frames in the PCM waiting to be heard, only live while playing
+	unsigned long bufferFrames; // size of the PCM's buffer, it grows after xruns and shrinks back once playback has been steady
+	unsigned long periodFrames; // the PCM wakes playback once a period
+	unsigned long wakeups; // times the playback thread came back from poll(), over the PCM's life
+};
+
 int initPCM(PCM **pcm);
+int initPCMAccess(PCM **pcm, int access);
 void destroyPCM(PCM *pcm);
-void setSamples(PCM *pcm, uint8_t *samples);
 uframes getTransferLen(PCM *pcm);
 uframes getSamplingRate(PCM *pcm);
+bool usesMmapAccess(PCM *pcm);
+int setPCMBufferSize(PCM *pcm, uframes periodFrames, uframes bufferFrames);
+void setFastStart(PCM *pcm, bool fastStart);
+
+int setRingDepth(PCM *pcm, unsigned int slots, unsigned int lowWatermark, unsigned int highWatermark);
+int getPlaybackRingStats(PCM *pcm, RingStats *dest);
+void getPlaybackStats(PCM *pcm, PlaybackStats *dest);
 
 int startPlayingFrom(uint32_t startLBA, uint32_t leadoutLBA, PCM *pcm);
+int stopPlaying(PCM *pcm);
+bool isPlaying(PCM *pcm);
+int pausePlaying(PCM *pcm, bool pause);
+bool canPausePlaying(PCM *pcm);
+uint32_t getPlayheadLBA(PCM *pcm);
+int seekTo(PCM *pcm, uint32_t lba);
+double getLastSeekLatency(PCM *pcm);
 
 #endif
@@ -0,0 +1,308 @@
+// Everything a resident player keeps open between plays: the PCM, the drive, and the loaded disc's TOC and CD-Text.
+// main.c pays for all of that on every run, the daemon (playerd.c) pays once per disc, so a play only has to start the reads.
+//
+// Playback runs on its own thread, since startPlayingFrom() blocks until it ends. Everything else is for one thread only,
+// the daemon's event loop, so only the playback thread and stopPlayer() ever touch the PCM at the same time,
+// and the PCM's own stop/seek requests are made for exactly that.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "player.h"
+#include "playaudio.h"
+#include "readcd.h"
+#include "probecd.h"
+#include "textloader.h"
+#include "sectorcache.h"
+#include "drive.h"
+#include "config.h"
+
+#define STOP_POLL_NSEC 1000000 // 1ms, how often stopPlayer() repeats its stop while it waits for the thread
+#define PREV_RESTART_FRAMES (3*75) // prevTrack() restarts the current track instead once this far into it
+
+#define SUCCESS 0
+#define FAILED_INIT_PCM 1
+#define NO_DISC PLAYER_NO_DISC
+#define NOT_READY PLAYER_NOT_READY
+#define FAILED_READ_TOC 4
+#define BAD_TRACK 5
+#define FAILED_START_THREAD 6
+#define NOT_PLAYING PLAYER_NOT_PLAYING
+#define FAILED_PAUSE 8
+
+typedef struct PlayRange PlayRange;
+
+struct PlayRange {
+	uint32_t startLBA;
+	uint32_t leadoutLBA;
+};
+
+static int playFrom(uint32_t lba);
+static bool getPosition(uint32_t *dest);
+static void *playbackThread(void *arg);
+static void textLoaded(CDText *text, int status, void *arg);
+
+static PCM *pcm = NULL;
+static TOC *toc = NULL;
+static TextLoader *textLoader = NULL;
+static pthread_t thread;
+static bool threadStarted = false; // a thread exists that hasn't been joined yet
+static atomic_bool threadFinished;
+static PlayRange range; // only read by the thread, only written before it starts
+static bool paused = false;
+static bool pausedByStop = false; // the PCM can't pause, the thread was stopped and pausedLBA is where to pick up again
+static uint32_t pausedLBA;
+static bool driveHeld = false; // from the first loadDisc() until closePlayer(), so the drive isn't reopened for every disc
+
+// Opens the PCM and turns on the sector cache. The PCM stays open until closePlayer().
+int openPlayer(void) {
+	if(pcm)
+		return SUCCESS;
+	if(initPCM(&pcm))
+		return FAILED_INIT_PCM;
+	setSectorCacheSize(SECTOR_CACHE_MB);
+	return SUCCESS;
+}
+
+void closePlayer(void) {
+	unloadDisc();
+	if(driveHeld) {
+		releaseDrive();
+		driveHeld = false;
+	}
+	if(pcm) {
+		destroyPCM(pcm);
+		free(pcm);
+		pcm = NULL;
+	}
+}
+
+// Checks the drive has a disc with TEST UNIT READY, then reads its TOC and keeps it. The CD-Text is read (through the disc cache)
+// on a thread of its own, so a play right after loading doesn't wait for it, getPlayerText() is NULL until then.
+// A disc without CD-Text still loads, getPlayerText() just stays NULL for it.
+// PLAYER_NOT_READY means the drive is still spinning the disc up, calling again later is expected.
+int loadDisc(void) {
+	unloadDisc();
+	if(!driveHeld) {
+		if(acquireDrive())
+			return NO_DISC;
+		driveHeld = true;
+	}
+	int ready = testUnitReady();
+	if(ready == UNIT_NO_MEDIUM)
+		return NO_DISC;
+	if(ready != UNIT_READY)
+		return NOT_READY;
+
+	if(readTOC(&toc)) {
+		toc = NULL;
+		return FAILED_READ_TOC;
+	}
+	if(startTextLoader(&textLoader, toc, textLoaded, NULL))
+		textLoader = NULL;
+	return SUCCESS;
+}
+
+// Stops playback and forgets the disc. Reads in progress are aborted rather than waited out,
+// the disc may already be gone and a read of a missing disc only ends when the drive gives up on it.
+// readcd.c lets go of the drive, which puts its speed back and empties the sector cache.
+void unloadDisc(void) {
+	if(threadStarted)
+		abortDriveReads();
+	stopPlayer();
+	closeOpticalDrive();
+	if(textLoader) {
+		stopTextLoader(textLoader);
+		textLoader = NULL;
+	}
+	if(toc) {
+		destroyTOC(toc);
+		free(toc);
+		toc = NULL;
+	}
+}
+
+bool isDiscLoaded(void) {
+	return toc != NULL;
+}
+
+// NULL unless a disc is loaded. Only valid until the next loadDisc()/unloadDisc().
+TOC *getPlayerTOC(void) {
+	return toc;
+}
+
+// NULL unless the loaded disc has CD-Text and it has been read. Safe from any thread, valid until the next loadDisc()/unloadDisc().
+CDText *getPlayerText(void) {
+	return textLoader ? getLoadedText(textLoader) : NULL;
+}
+
+// Stops whatever is playing and starts trackNum, offsetFrames (CD frames, 1/75s) into it, on the playback thread.
+int playTrack(uint8_t trackNum, uint32_t offsetFrames) {
+	if(!toc)
+		return NO_DISC;
+	if(trackNum < getFirstTrackNumber(toc) || trackNum >= getFirstTrackNumber(toc) + getTrackCount(toc))
+		return BAD_TRACK;
+	return playFrom(getTrackOffsetLBA(toc, trackNum, offsetFrames));
+}
+
+// Jumps offsetFrames into the track playing now. Like any jump, a seek while paused resumes playback.
+int seekPlayer(uint32_t offsetFrames) {
+	uint32_t lba;
+	if(!toc)
+		return NO_DISC;
+	if(!getPosition(&lba))
+		return NOT_PLAYING;
+	return playTrack(getTrackAtLBA(toc, lba), offsetFrames);
+}
+
+int nextTrack(void) {
+	uint32_t lba;
+	if(!toc)
+		return NO_DISC;
+	if(!getPosition(&lba))
+		return NOT_PLAYING;
+	return playTrack(getTrackAtLBA(toc, lba) + 1, 0);
+}
+
+// Goes back to the start of the track playing now, or to the track before it if this one has only just started.
+int prevTrack(void) {
+	uint32_t lba;
+	if(!toc)
+		return NO_DISC;
+	if(!getPosition(&lba))
+		return NOT_PLAYING;
+	uint8_t trackNum = getTrackAtLBA(toc, lba);
+	if(trackNum == 0)
+		return playTrack(getFirstTrackNumber(toc), 0);
+	if(lba - getStartLBA(getTrack(toc, trackNum)) < PREV_RESTART_FRAMES && trackNum > getFirstTrackNumber(toc))
+		trackNum--;
+	return playTrack(trackNum, 0);
+}
+
+// Pauses with snd_pcm_pause() so nothing queued is lost and resuming is instant.
+// A PCM that can't pause, or hasn't started playing yet, is stopped instead, and resumePlayer() starts again from the block that was playing.
+int pausePlayer(void) {
+	if(paused)
+		return SUCCESS;
+	if(!isPlayerPlaying())
+		return NOT_PLAYING;
+	if(pausePlaying(pcm, true)) {
+		pausedLBA = getPlayheadLBA(pcm);
+		stopPlayer();
+		pausedByStop = true;
+	}
+	paused = true;
+	return SUCCESS;
+}
+
+int resumePlayer(void) {
+	if(pausedByStop)
+		return playFrom(pausedLBA);
+	// the thread can still end while paused, when the disc is pulled for one
+	if(!isPlayerPlaying()) {
+		paused = false;
+		return NOT_PLAYING;
+	}
+	if(paused && pausePlaying(pcm, false))
+		return FAILED_PAUSE;
+	paused = false;
+	return SUCCESS;
+}
+
+bool isPlayerPaused(void) {
+	return paused;
+}
+
+// Fills in what a client needs to show: the state, the track and how far into it playback is.
+void getPlayerStatus(PlayerStatus *dest) {
+	memset(dest, 0, sizeof(PlayerStatus));
+	if(!toc) {
+		dest->state = PLAYER_EMPTY;
+		return;
+	}
+	dest->firstTrack = getFirstTrackNumber(toc);
+	dest->trackCount = getTrackCount(toc);
+	uint32_t lba;
+	if(!getPosition(&lba)) {
+		dest->state = PLAYER_STOPPED;
+		return;
+	}
+	dest->state = paused ? PLAYER_PAUSED : PLAYER_PLAYING;
+	dest->track = getTrackAtLBA(toc, lba);
+	if(dest->track)
+		dest->trackFrames = lba - getStartLBA(getTrack(toc, dest->track));
+}
+
+// Jumps the playback thread to lba if it is running, so the PCM and the reader carry on without being set up again,
+// otherwise starts a new thread there.
+static int playFrom(uint32_t lba) {
+	paused = false;
+	pausedByStop = false;
+	if(isPlayerPlaying() && seekTo(pcm, lba) == SUCCESS)
+		return SUCCESS;
+	stopPlayer();
+
+	range.startLBA = lba;
+	range.leadoutLBA = getLeadoutLBA(toc);
+	atomic_store(&threadFinished, false);
+	if(pthread_create(&thread, NULL, playbackThread, &range))
+		return FAILED_START_THREAD;
+	threadStarted = true;
+	return SUCCESS;
+}
+
+// The block playing now, or where a pause by stopping left off. False if nothing is playing or paused.
+// A thread that hasn't reached startPlayingFrom() yet is about to play from where it was started.
+static bool getPosition(uint32_t *dest) {
+	if(pausedByStop) {
+		*dest = pausedLBA;
+		return true;
+	}
+	if(!isPlayerPlaying())
+		return false;
+	*dest = isPlaying(pcm) ? getPlayheadLBA(pcm) : range.startLBA;
+	return true;
+}
+
+// Stops playback, dropping what the PCM holds, and waits for the playback thread to end.
+// The thread may not have reached startPlayingFrom() yet, or be about to leave it, so the stop is repeated until it is gone.
+void stopPlayer(void) {
+	paused = false;
+	pausedByStop = false;
+	if(!threadStarted)
+		return;
+	struct timespec wait = { .tv_sec = 0, .tv_nsec = STOP_POLL_NSEC };
+	while(!atomic_load(&threadFinished)) {
+		stopPlaying(pcm);
+		nanosleep(&wait, NULL);
+	}
+	pthread_join(thread, NULL);
+	threadStarted = false;
+}
+
+bool isPlayerPlaying(void) {
+	return threadStarted && !atomic_load(&threadFinished);
+}
+
+static void *playbackThread(void *arg) {
+	PlayRange *play = arg;
+	int status = startPlayingFrom(play->startLBA, play->leadoutLBA, pcm);
+	if(status)
+		printf("startPlayingFrom failed: %d\n", status);
+	atomic_store(&threadFinished, true);
+	return NULL;
+}
+
+// On the text loader's thread.
+static void textLoaded(CDText *text, int status, void *arg) {
+	(void)text; // getPlayerText() hands it out from here on
+	(void)arg;
+	if(status && status != READ_TEXT_NO_CDTEXT && status != READ_TEXT_EMPTY) {
+		printReadTextErr(status);
+		putchar('\n');
+	}
+}
@@ -0,0 +1,48 @@
+
+#ifndef PLAYER_H
+#define PLAYER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "readtoc.h"
+#include "readtext.h"
+
+#define PLAYER_NO_DISC 2 // the drive has no disc in it, or it has not been loaded yet
+#define PLAYER_NOT_READY 3 // there is a disc but the drive isn't ready to read it yet, try again shortly
+#define PLAYER_NOT_PLAYING 7 // pause/seek/next/prev need something playing or paused
+
+// states reported by getPlayerStatus()
+#define PLAYER_STOPPED 0
+#define PLAYER_PLAYING 1
+#define PLAYER_PAUSED 2
+#define PLAYER_EMPTY 3 // no disc loaded
+
+typedef struct PlayerStatus PlayerStatus;
+
+struct PlayerStatus {
+	int state;
+	uint8_t track; // 0 unless playing or paused
+	uint8_t firstTrack;
+	uint8_t trackCount;
+	uint32_t trackFrames; // how far into track, in CD frames (1/75s)
+};
+
+int openPlayer(void);
+void closePlayer(void);
+int loadDisc(void);
+void unloadDisc(void);
+bool isDiscLoaded(void);
+TOC *getPlayerTOC(void);
+CDText *getPlayerText(void);
+int playTrack(uint8_t trackNum, uint32_t offsetFrames);
+void stopPlayer(void);
+bool isPlayerPlaying(void);
+int seekPlayer(uint32_t offsetFrames);
+int nextTrack(void);
+int prevTrack(void);
+int pausePlayer(void);
+int resumePlayer(void);
+bool isPlayerPaused(void);
+void getPlayerStatus(PlayerStatus *dest);
+
+#endif
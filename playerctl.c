@@ -0,0 +1,167 @@
+// Command line client for the resident player's control socket (control.c, playerd.c).
+// Each run is one round trip to playerd, the drive and PCM are never touched from here.
+// stats doesn't even need the socket, it reads the counters playerd publishes to STATS_PATH, see stats.c.
+//
+// usage: playerctl <command>
+// 	play <track> [mm:ss.ff]	play track, optionally starting that far into it
+// 	pause | resume | stop
+// 	seek <mm:ss.ff>		jump within the track playing now
+// 	next | prev		prev restarts the track playing now unless it has only just started
+// 	status
+// 	stats			drive and PCM counters, and how long drive commands take
+// Built from playerctl.c plus the modules it needs, see the Makefile:
+// 	make playerctl
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "control.h"
+#include "player.h"
+#include "readtoc.h"
+#include "stats.h"
+#include "config.h"
+
+#define FRAMES_PER_SEC 75
+#define BYTES_PER_MB (1024.0 * 1024.0)
+#define CD_SAMPLING_RATE 44100 // frames per second
+
+typedef struct CommandName CommandName;
+
+struct CommandName {
+	const char *name;
+	uint8_t command;
+};
+
+bool parseRequest(int argc, char *argv[], ControlRequest *dest);
+void printReply(const ControlReply *reply);
+int printStats(void);
+uint64_t getLatencyPercentileUsec(const StatsSnapshot *stats, double percentile);
+
+static const CommandName commands[] = {
+	{ "play", CONTROL_PLAY },
+	{ "pause", CONTROL_PAUSE },
+	{ "resume", CONTROL_RESUME },
+	{ "stop", CONTROL_STOP },
+	{ "seek", CONTROL_SEEK },
+	{ "next", CONTROL_NEXT },
+	{ "prev", CONTROL_PREV },
+	{ "status", CONTROL_STATUS },
+};
+
+int main(int argc, char *argv[]) {
+	if(argc == 2 && strcmp(argv[1], "stats") == 0)
+		return printStats();
+	ControlRequest request;
+	if(!parseRequest(argc-1, argv+1, &request)) {
+		printf("usage: playerctl play <track> [mm:ss.ff] | pause | resume | stop | seek <mm:ss.ff> | next | prev | status | stats\n");
+		return 1;
+	}
+	char path[CONTROL_MAX_PATH];
+	if(getControlSocketPath(path, CONTROL_MAX_PATH, false)) {
+		printf("no private directory for the control socket, is XDG_RUNTIME_DIR set?\n");
+		return 2;
+	}
+	int fd = connectControl(path);
+	if(fd == -1) {
+		printf("failed to connect to %s, is playerd running?\n", path);
+		return 2;
+	}
+	ControlReply reply;
+	int status = sendControl(fd, &request, &reply);
+	close(fd);
+	if(status) {
+		printf("sendControl failed: %d\n", status);
+		return 2;
+	}
+	printReply(&reply);
+	return reply.status ? 3 : 0;
+}
+
+bool parseRequest(int argc, char *argv[], ControlRequest *dest) {
+	memset(dest, 0, sizeof(ControlRequest));
+	if(argc < 1)
+		return false;
+	for(size_t i=0; i<sizeof(commands)/sizeof(CommandName); i++) {
+		if(strcmp(argv[0], commands[i].name) == 0)
+			dest->command = commands[i].command;
+	}
+
+	if(dest->command == CONTROL_PLAY) {
+		char *endp;
+		long track = argc > 1 ? strtol(argv[1], &endp, 10) : 0;
+		if(argc < 2 || endp == argv[1] || *endp != '\0' || track < 1 || track > 99)
+			return false;
+		dest->track = track;
+		return argc < 3 || parseTrackOffset(argv[2], &dest->frames);
+	}
+	if(dest->command == CONTROL_SEEK)
+		return argc > 1 && parseTrackOffset(argv[1], &dest->frames);
+	return dest->command != 0;
+}
+
+void printReply(const ControlReply *reply) {
+	// no disc is already said by the state below
+	if(reply->status == CONTROL_BAD_COMMAND)
+		printf("playerd didn't understand the command\n");
+	else if(reply->status == PLAYER_NOT_PLAYING)
+		printf("nothing is playing\n");
+	else if(reply->status && reply->status != PLAYER_NO_DISC)
+		printf("command failed: %d\n", reply->status);
+
+	unsigned int sec = reply->frames / FRAMES_PER_SEC;
+	switch(reply->state) {
+		case PLAYER_EMPTY:
+			printf("no disc\n");
+			break;
+		case PLAYER_STOPPED:
+			printf("stopped, %d tracks\n", reply->trackCount);
+			break;
+		case PLAYER_PLAYING:
+		case PLAYER_PAUSED:
+			printf("%s track %d/%d at %u:%02u\n", reply->state == PLAYER_PAUSED ? "paused on" : "playing", reply->track, reply->trackCount, sec / 60, sec % 60);
+			break;
+	}
+}
+
+int printStats(void) {
+	StatsSnapshot stats;
+	int status = readStatsFile(STATS_PATH, &stats);
+	if(status) {
+		printf("failed to read %s: %d, is playerd running?\n", STATS_PATH, status);
+		return 2;
+	}
+	const uint64_t *c = stats.counters;
+	printf("published %.1fs ago by pid %u\n", monotonicSec() - stats.publishedAt, stats.pid);
+	printf("drive: %llu commands, %llu sense errors, %llu failures, %.1f MB read, %llu read retries\n",
+			(unsigned long long)c[STAT_DRIVE_COMMANDS], (unsigned long long)c[STAT_DRIVE_SENSE_ERRORS], (unsigned long long)c[STAT_DRIVE_FAILURES],
+			c[STAT_BYTES_READ] / BYTES_PER_MB, (unsigned long long)c[STAT_READ_RETRIES]);
+	printf("drive latency: p50 < %lluus, p99 < %lluus\n", (unsigned long long)getLatencyPercentileUsec(&stats, 0.5),
+			(unsigned long long)getLatencyPercentileUsec(&stats, 0.99));
+	for(int i=0; i<STATS_LATENCY_BUCKETS; i++) {
+		if(stats.latencyBuckets[i])
+			printf("\t< %lluus\t%llu\n", 2ULL << i, (unsigned long long)stats.latencyBuckets[i]);
+	}
+	printf("pcm: %llu writes, %llu short, %llu xruns, %.1fs of audio, delay %lld frames (lowest %lld)\n",
+			(unsigned long long)c[STAT_PCM_WRITES], (unsigned long long)c[STAT_PCM_SHORT_WRITES], (unsigned long long)c[STAT_PCM_XRUNS],
+			c[STAT_PCM_FRAMES] / (double)CD_SAMPLING_RATE, (long long)stats.pcmDelayFrames, (long long)stats.pcmDelayMinFrames);
+	return 0;
+}
+
+// The upper edge of the histogram bucket the percentile falls in, so it is only good to a factor of 2.
+uint64_t getLatencyPercentileUsec(const StatsSnapshot *stats, double percentile) {
+	uint64_t total = 0;
+	for(int i=0; i<STATS_LATENCY_BUCKETS; i++)
+		total += stats->latencyBuckets[i];
+	uint64_t seen = 0;
+	for(int i=0; i<STATS_LATENCY_BUCKETS; i++) {
+		seen += stats->latencyBuckets[i];
+		if(total && seen >= total * percentile)
+			return 2ULL << i;
+	}
+	return 0;
+}
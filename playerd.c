@@ -0,0 +1,366 @@
+// Resident player. Keeps the PCM and drive open and the disc's TOC and CD-Text loaded, so a play doesn't start by re-reading them.
+//
+// One epoll loop on one thread handles everything but the audio itself:
+// 	the uevent socket, for discs going in and out (nlis.c), filtered in the kernel to block and scsi_generic events
+// 	a timerfd, to retry TEST UNIT READY while a freshly inserted disc spins up
+// 	another timerfd, to publish the drive and PCM counters to STATS_PATH every STATS_PUBLISH_MS (stats.c),
+// 	and to print the disc's names once its CD-Text, read in the background by player.c, turns up
+// 	a signalfd, so SIGINT/SIGTERM end the loop cleanly and put the drive back the way it was found
+// 	the control socket and its clients (control.c), commands from playerctl and the like, answered in the same pass
+// 	https://man7.org/linux/man-pages/man7/epoll.7.html
+//
+// The uevent fd is passed to runPlayerLoop() rather than opened there, so the loop can be driven by synthetic uevents written
+// into one end of a socketpair(AF_UNIX, SOCK_SEQPACKET) instead of the netlink socket, one message per uevent like netlink.
+// attachUeventFilter() works on the socketpair too.
+//
+// Control commands only ever ask the playback thread to do something (seek, stop) or call snd_pcm_pause(),
+// nothing is closed or set up again, so each one takes effect within a period or so of audio.
+//
+// usage: playerd
+// Built from playerd.c plus the modules it drives, see the Makefile:
+// 	make playerd
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include "player.h"
+#include "nlis.h"
+#include "control.h"
+#include "readtoc.h"
+#include "readtext.h"
+#include "stats.h"
+#include "config.h"
+
+#define MAX_EVENTS 8
+#define READY_RETRY_MS 250 // how often TEST UNIT READY is retried while the disc spins up
+#define READY_RETRIES 40 // give up after 10 seconds, the next media change starts over
+#define MAX_CONTROL_CLIENTS 8 // more than this at once are turned away
+#define STATS_PUBLISH_MS 500
+
+#define SUCCESS 0
+#define FAILED_OPEN_PLAYER 1
+#define FAILED_OPEN_UEVENTS 2
+#define FAILED_SETUP_LOOP 3
+#define FAILED_OPEN_CONTROL 4
+
+int runPlayerLoop(int ueventFd, int controlFd);
+bool drainUevents(int ueventFd, int timerFd);
+void acceptClients(int epollFd, int controlFd);
+void serveClient(int epollFd, int clientFd);
+void dropClient(int epollFd, int clientFd);
+bool isClient(int fd);
+void handleControl(const ControlRequest *request, ControlReply *reply);
+void handleUevent(int event, int timerFd);
+void tryLoadDisc(int timerFd);
+void armReadyRetry(int timerFd, bool arm);
+void printDisc(void);
+void printAlbum(void);
+
+static int readyRetriesLeft = 0;
+static bool albumPrinted = true; // false from loading a disc until its CD-Text has been printed
+static int clients[MAX_CONTROL_CLIENTS];
+
+int main(void) {
+	if(openPlayer()) {
+		printf("openPlayer failed\n");
+		return FAILED_OPEN_PLAYER;
+	}
+	int ueventFd = openUeventSocket();
+	if(ueventFd == -1) {
+		printf("failed to open the uevent socket\n");
+		closePlayer();
+		return FAILED_OPEN_UEVENTS;
+	}
+	char controlPath[CONTROL_MAX_PATH] = CONTROL_SOCKET_NAME;
+	int controlFd = getControlSocketPath(controlPath, CONTROL_MAX_PATH, true) ? -1 : openControlSocket(controlPath);
+	if(controlFd == -1) {
+		printf("failed to open the control socket at %s\n", controlPath);
+		close(ueventFd);
+		closePlayer();
+		return FAILED_OPEN_CONTROL;
+	}
+	// playback works the same without it, there is just nothing to look at
+	if(openStatsFile(STATS_PATH))
+		printf("can't publish stats to %s\n", STATS_PATH);
+	int status = runPlayerLoop(ueventFd, controlFd);
+	closeStatsFile();
+	close(controlFd);
+	unlink(controlPath);
+	close(ueventFd);
+	closePlayer();
+	return status;
+}
+
+// Loads whatever disc is in the drive, then serves events until SIGINT or SIGTERM.
+// ueventFd must be non blocking and deliver one uevent per recv(), like the netlink socket.
+// controlFd is the listening control socket, or -1 to run without one.
+int runPlayerLoop(int ueventFd, int controlFd) {
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	// the signals have to be blocked for signalfd to get them instead of the default handler
+	if(sigprocmask(SIG_BLOCK, &signals, NULL) == -1)
+		return FAILED_SETUP_LOOP;
+
+	int epollFd = epoll_create1(EPOLL_CLOEXEC);
+	int signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+	int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	int statsFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	int status = SUCCESS;
+	if(epollFd == -1 || signalFd == -1 || timerFd == -1 || statsFd == -1)
+		status = FAILED_SETUP_LOOP;
+	struct itimerspec publishEvery = {
+		.it_interval = { .tv_sec = 0, .tv_nsec = STATS_PUBLISH_MS * 1000000L },
+		.it_value = { .tv_sec = 0, .tv_nsec = STATS_PUBLISH_MS * 1000000L },
+	};
+	if(status == SUCCESS && timerfd_settime(statsFd, 0, &publishEvery, NULL) == -1)
+		status = FAILED_SETUP_LOOP;
+
+	// the fd itself is the event's data, anything that isn't one of these five is a control client
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++)
+		clients[i] = -1;
+	int fds[] = { ueventFd, signalFd, timerFd, statsFd, controlFd };
+	int fdCount = controlFd == -1 ? 4 : 5;
+	for(int i=0; i<fdCount && status == SUCCESS; i++) {
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = fds[i] };
+		if(epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[i], &event) == -1)
+			status = FAILED_SETUP_LOOP;
+	}
+
+	if(status == SUCCESS) {
+		readyRetriesLeft = READY_RETRIES;
+		tryLoadDisc(timerFd);
+	}
+
+	bool quit = false;
+	while(status == SUCCESS && !quit) {
+		struct epoll_event events[MAX_EVENTS];
+		int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+		if(count == -1) {
+			if(errno == EINTR)
+				continue;
+			status = FAILED_SETUP_LOOP;
+			break;
+		}
+		for(int i=0; i<count; i++) {
+			int fd = events[i].data.fd;
+			if(fd == ueventFd) {
+				if(!drainUevents(ueventFd, timerFd))
+					quit = true;
+			}
+			else if(fd == timerFd) {
+				uint64_t expirations;
+				if(read(timerFd, &expirations, sizeof(uint64_t)) == sizeof(uint64_t))
+					tryLoadDisc(timerFd);
+			}
+			else if(fd == statsFd) {
+				uint64_t expirations;
+				if(read(statsFd, &expirations, sizeof(uint64_t)) == sizeof(uint64_t)) {
+					publishStats();
+					if(!albumPrinted)
+						printAlbum();
+				}
+			}
+			else if(fd == signalFd) {
+				struct signalfd_siginfo info;
+				if(read(signalFd, &info, sizeof(struct signalfd_siginfo)) == sizeof(struct signalfd_siginfo))
+					quit = true;
+			}
+			else if(fd == controlFd)
+				acceptClients(epollFd, controlFd);
+			else if(isClient(fd))
+				serveClient(epollFd, fd);
+		}
+	}
+
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++) {
+		if(clients[i] != -1)
+			dropClient(epollFd, clients[i]);
+	}
+	publishStats();
+	if(statsFd != -1)
+		close(statsFd);
+	if(timerFd != -1)
+		close(timerFd);
+	if(signalFd != -1)
+		close(signalFd);
+	if(epollFd != -1)
+		close(epollFd);
+	sigprocmask(SIG_UNBLOCK, &signals, NULL);
+	return status;
+}
+
+// Handles every uevent waiting on the socket. Returns false if the socket is closed (only a socketpair can do that).
+// The batch is static, it is too big for the stack and only this thread uses it.
+bool drainUevents(int ueventFd, int timerFd) {
+	static UeventBatch batch;
+	int count;
+	while((count = receiveUevents(ueventFd, &batch)) > 0) {
+		for(int i=0; i<count; i++) {
+			Uevent event;
+			if(parseUevent(batch.msgs[i], batch.sizes[i], &event) == 0)
+				handleUevent(classifyUevent(&event), timerFd);
+		}
+	}
+	return count == 0;
+}
+
+void acceptClients(int epollFd, int controlFd) {
+	int clientFd;
+	while((clientFd = acceptControlClient(controlFd)) != -1) {
+		int slot = 0;
+		while(slot < MAX_CONTROL_CLIENTS && clients[slot] != -1)
+			slot++;
+		struct epoll_event event = { .events = EPOLLIN, .data.fd = clientFd };
+		if(slot == MAX_CONTROL_CLIENTS || epoll_ctl(epollFd, EPOLL_CTL_ADD, clientFd, &event) == -1) {
+			close(clientFd);
+			continue;
+		}
+		clients[slot] = clientFd;
+	}
+}
+
+// Answers every request the client has sent so far, and forgets the client once it hangs up.
+void serveClient(int epollFd, int clientFd) {
+	ControlRequest request;
+	int received;
+	while((received = receiveControl(clientFd, &request)) == 1) {
+		ControlReply reply;
+		handleControl(&request, &reply);
+		if(replyControl(clientFd, &reply)) {
+			received = 0;
+			break;
+		}
+	}
+	if(received == 0)
+		dropClient(epollFd, clientFd);
+}
+
+void dropClient(int epollFd, int clientFd) {
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++) {
+		if(clients[i] == clientFd)
+			clients[i] = -1;
+	}
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, NULL);
+	close(clientFd);
+}
+
+bool isClient(int fd) {
+	for(int i=0; i<MAX_CONTROL_CLIENTS; i++) {
+		if(clients[i] == fd)
+			return true;
+	}
+	return false;
+}
+
+void handleControl(const ControlRequest *request, ControlReply *reply) {
+	int status;
+	switch(request->command) {
+		case CONTROL_PLAY:
+			status = playTrack(request->track, request->frames);
+			break;
+		case CONTROL_PAUSE:
+			status = pausePlayer();
+			break;
+		case CONTROL_RESUME:
+			status = resumePlayer();
+			break;
+		case CONTROL_STOP:
+			stopPlayer();
+			status = SUCCESS;
+			break;
+		case CONTROL_SEEK:
+			status = seekPlayer(request->frames);
+			break;
+		case CONTROL_NEXT:
+			status = nextTrack();
+			break;
+		case CONTROL_PREV:
+			status = prevTrack();
+			break;
+		case CONTROL_STATUS:
+			status = SUCCESS;
+			break;
+		default:
+			status = CONTROL_BAD_COMMAND;
+	}
+
+	PlayerStatus player;
+	getPlayerStatus(&player);
+	reply->status = status;
+	reply->state = player.state;
+	reply->track = player.track;
+	reply->trackCount = player.trackCount;
+	reply->frames = player.trackFrames;
+}
+
+// Both events start with the disc unloaded, which aborts any reads and drops what the PCM holds.
+// An eject request means the disc is about to go, a media change may be a disc going in, so that one loads again.
+void handleUevent(int event, int timerFd) {
+	if(event == UEVENT_IGNORED)
+		return;
+	armReadyRetry(timerFd, false);
+	unloadDisc();
+	if(event == UEVENT_EJECT_REQUEST) {
+		printf("disc ejected\n");
+		return;
+	}
+	readyRetriesLeft = READY_RETRIES;
+	tryLoadDisc(timerFd);
+}
+
+void tryLoadDisc(int timerFd) {
+	int status = loadDisc();
+	if(status == PLAYER_NOT_READY && readyRetriesLeft-- > 0) {
+		armReadyRetry(timerFd, true);
+		return;
+	}
+	armReadyRetry(timerFd, false);
+	if(status == SUCCESS)
+		printDisc();
+	else if(status == PLAYER_NO_DISC || status == PLAYER_NOT_READY)
+		printf("no disc\n");
+	else
+		printf("loadDisc failed: %d\n", status);
+}
+
+// One shot, tryLoadDisc() re-arms it if the drive is still not ready.
+void armReadyRetry(int timerFd, bool arm) {
+	struct itimerspec spec;
+	memset(&spec, 0, sizeof(struct itimerspec));
+	if(arm)
+		spec.it_value.tv_nsec = READY_RETRY_MS * 1000000L;
+	timerfd_settime(timerFd, 0, &spec, NULL);
+}
+
+void printDisc(void) {
+	printf("disc loaded, %d tracks\n", getTrackCount(getPlayerTOC()));
+	albumPrinted = false;
+	printAlbum();
+}
+
+// Nothing until the CD-Text has been read, a disc without any never prints.
+void printAlbum(void) {
+	CDText *text = getPlayerText();
+	if(!text)
+		return;
+	albumPrinted = true;
+	char *albumName = getAlbumName(text);
+	char *albumArtist = getAlbumArtist(text);
+	if(!albumName || *albumName == '\0')
+		return;
+	printf("album: %s", albumName);
+	if(albumArtist && *albumArtist != '\0')
+		printf(", by %s", albumArtist);
+	putchar('\n');
+}
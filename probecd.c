@@ -0,0 +1,317 @@
+// Works out how large a single READ CD transfer can be on the opened drive. Its commands go through drive.c like every other module's.
+//
+// Three things limit it:
+// 	the sg reserved buffer, which is the only transfer memory the sg driver guarantees per fd
+// 	https://sg.danny.cz/sg/p/sg_v3_ho.html (SG_GET_RESERVED_SIZE / SG_SET_RESERVED_SIZE)
+//
+// 	max_sectors_kb of the drive's block queue, which the kernel will not exceed for one command
+// 	https://www.kernel.org/doc/Documentation/block/queue-sysfs.txt
+//
+// 	the buffer size the drive reports in the CD/DVD Capabilities and Mechanical Status page (2Ah) of MODE SENSE
+// 	MMC-3 Manual, 5.5.10 CD/DVD Capabilities and Mechanical Status Page
+//
+// Whatever batch size is picked, if the drive or kernel refuses a read for its size readcd.c backs it off and the result is remembered
+// per drive in BATCH_CACHE_PATH so the next run starts from a size that is known to work. Each entry keeps the size the probe allowed
+// when it was written, and a probe that now allows a different size (a new kernel, a bigger reserved buffer) starts over from that.
+// Only real drives are remembered: a simulated drive's limit is whatever that run set it to, see maxblocks in simdrive.c.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+
+#include "probecd.h"
+#include "readcd.h"
+#include "drive.h"
+#include "config.h"
+
+#define ONE_BYTE 8
+
+#define INQUIRY_CDB_SIZE 6
+#define INQUIRY_OPCODE 0x12
+#define INQUIRY_ALLOC_LEN 36
+#define iINQUIRY_VENDOR 8
+#define INQUIRY_VENDOR_LEN 8
+#define iINQUIRY_PRODUCT 16
+#define INQUIRY_PRODUCT_LEN 16
+#define iINQUIRY_REVISION 32
+#define INQUIRY_REVISION_LEN 4
+
+#define TEST_UNIT_READY_CDB_SIZE 6 // all zero, opcode 00h
+#define SENSE_KEY_NOT_READY 0x02
+#define ASC_MEDIUM_NOT_PRESENT 0x3a
+
+#define MODE_SENSE_CDB_SIZE 10
+#define MODE_SENSE_OPCODE 0x5a
+#define CAPABILITIES_PAGE 0x2a
+#define MODE_SENSE_ALLOC_LEN 0xff
+#define MODE_HEADER_SIZE 8
+#define iBLOCK_DESCRIPTOR_LEN 6
+#define PAGE_CODE_MASK 0b00111111
+#define iBUFFER_SIZE_KB 12 // offset into page 2Ah
+
+#define MAX_BATCH_BLOCKS 64 // never ask for more than this at once, even if everything claims to allow it
+#define SYSFS_SG_CLASS "/sys/class/scsi_generic"
+#define SYSFS_BLOCK_CLASS "/sys/class/block"
+#define MAX_PATH 512
+#define MAX_CACHE_LINE 128
+#define CACHE_FILE_MODE 0644 // mkstemp() makes it 0600
+
+#define SUCCESS 0
+#define FAILED_COMMAND 1
+#define FAILED_FIND_DEVICE 2
+
+static int sendReadCommand(uint8_t *cdb, unsigned char cdbLen, uint8_t *dataBuf, unsigned int dataLen);
+static void readInquiryId(char id[DRIVE_ID_LEN+1]);
+static int readMaxSectorsKB(const char *devicePath);
+static int readBufferKB(void);
+static uint32_t readCachedBatchBlocks(const char *id, uint32_t probedBlocks);
+static void cacheBatchBlocks(const char *id, uint32_t blocks, uint32_t probedBlocks);
+static void copyTrimmed(char *dest, const uint8_t *src, int len);
+
+// Fills *dest with the limits of the open drive and picks the batch size readcd.c should start with.
+// devicePath is the /dev/sgN node the drive was opened from, used to find the drive in sysfs. A simulated drive has nothing there.
+int probeDriveLimits(const char *devicePath, DriveLimits *dest) {
+	DriveLimits limits;
+	memset(&limits, 0, sizeof(DriveLimits));
+
+	readInquiryId(limits.id);
+	limits.maxSectorsKB = readMaxSectorsKB(devicePath);
+	setDriveTransferLimit(limits.maxSectorsKB > 0 ? limits.maxSectorsKB*1024 : 0);
+	limits.bufferKB = readBufferKB();
+
+	// ask for a reserved buffer big enough for the largest batch the queue allows, the driver rounds it down to what it can do
+	int wantReserved = MAX_BATCH_BLOCKS * CD_AUDIO_BLOCK_SIZE;
+	if(limits.maxSectorsKB > 0 && limits.maxSectorsKB*1024 < wantReserved)
+		wantReserved = limits.maxSectorsKB*1024;
+	limits.reservedSize = setDriveReservedSize(wantReserved);
+
+	long maxBytes = MAX_BATCH_BLOCKS * CD_AUDIO_BLOCK_SIZE;
+	if(limits.reservedSize > 0 && limits.reservedSize < maxBytes)
+		maxBytes = limits.reservedSize;
+	if(limits.maxSectorsKB > 0 && limits.maxSectorsKB*1024L < maxBytes)
+		maxBytes = limits.maxSectorsKB*1024L;
+	if(limits.bufferKB > 0 && limits.bufferKB*1024L < maxBytes)
+		maxBytes = limits.bufferKB*1024L;
+
+	uint32_t blocks = maxBytes / CD_AUDIO_BLOCK_SIZE;
+	if(blocks == 0)
+		blocks = 1;
+	limits.probedBlocks = blocks;
+	uint32_t cached = getDriveBackend() == DRIVE_BACKEND_SG ? readCachedBatchBlocks(limits.id, blocks) : 0;
+	if(cached && cached < blocks)
+		blocks = cached;
+	limits.batchBlocks = blocks;
+
+	*dest = limits;
+	return SUCCESS;
+}
+
+// Halves the batch size after the drive or kernel refused a transfer for its size, and remembers it for this drive.
+// Returns the new size, which is 1 once there is nothing left to back off to.
+uint32_t backOffBatchBlocks(DriveLimits *limits) {
+	if(limits->batchBlocks > 1) {
+		limits->batchBlocks /= 2;
+		if(getDriveBackend() == DRIVE_BACKEND_SG)
+			cacheBatchBlocks(limits->id, limits->batchBlocks, limits->probedBlocks);
+	}
+	return limits->batchBlocks;
+}
+
+// TEST UNIT READY, the drive answers with sense data unless there is a disc in it ready to be read.
+// Returns UNIT_READY, UNIT_NO_MEDIUM if the sense says MEDIUM NOT PRESENT, otherwise UNIT_NOT_READY (spinning up, tray moving, or no answer).
+// 	MMC-3 Manual, 6.1.19 TEST UNIT READY Command
+// 	SPC-3, 4.5 Sense data, fixed format (70h/71h) and descriptor format (72h/73h) put the sense key and ASC in different places
+int testUnitReady(void) {
+	DriveCommand command;
+	initDriveCommand(&command, DRIVE_DATA_NONE, NULL, 0);
+	command.cdbLen = TEST_UNIT_READY_CDB_SIZE;
+
+	int status = sendDriveCommand(&command);
+	if(status == DRIVE_SUCCESS)
+		return UNIT_READY;
+	if(status == DRIVE_CHECK_CONDITION && getSenseKey(&command) == SENSE_KEY_NOT_READY && getSenseASC(&command) == ASC_MEDIUM_NOT_PRESENT)
+		return UNIT_NO_MEDIUM;
+	return UNIT_NOT_READY;
+}
+
+static int sendReadCommand(uint8_t *cdb, unsigned char cdbLen, uint8_t *dataBuf, unsigned int dataLen) {
+	DriveCommand command;
+	memset(dataBuf, 0, dataLen);
+	initDriveCommand(&command, DRIVE_DATA_IN, dataBuf, dataLen);
+	memcpy(command.cdb, cdb, cdbLen);
+	command.cdbLen = cdbLen;
+
+	if(sendDriveCommand(&command))
+		return FAILED_COMMAND;
+	return SUCCESS;
+}
+
+// id is left as "unknown" if INQUIRY fails, so every such drive shares one cache entry.
+static void readInquiryId(char id[DRIVE_ID_LEN+1]) {
+	uint8_t cdb[INQUIRY_CDB_SIZE];
+	memset(cdb, 0, INQUIRY_CDB_SIZE);
+	cdb[0] = INQUIRY_OPCODE;
+	cdb[4] = INQUIRY_ALLOC_LEN;
+
+	uint8_t data[INQUIRY_ALLOC_LEN];
+	if(sendReadCommand(cdb, INQUIRY_CDB_SIZE, data, INQUIRY_ALLOC_LEN)) {
+		strcpy(id, "unknown");
+		return;
+	}
+
+	char vendor[INQUIRY_VENDOR_LEN+1];
+	char product[INQUIRY_PRODUCT_LEN+1];
+	char revision[INQUIRY_REVISION_LEN+1];
+	copyTrimmed(vendor, data+iINQUIRY_VENDOR, INQUIRY_VENDOR_LEN);
+	copyTrimmed(product, data+iINQUIRY_PRODUCT, INQUIRY_PRODUCT_LEN);
+	copyTrimmed(revision, data+iINQUIRY_REVISION, INQUIRY_REVISION_LEN);
+	snprintf(id, DRIVE_ID_LEN+1, "%s %s %s", vendor, product, revision);
+}
+
+// INQUIRY strings are space padded ASCII. Tabs and newlines are replaced so the id is safe to use as a cache key.
+static void copyTrimmed(char *dest, const uint8_t *src, int len) {
+	int end = 0;
+	for(int i=0; i<len; i++) {
+		char c = src[i];
+		if(c < ' ' || c > '~')
+			c = '_';
+		dest[i] = c;
+		if(c != ' ')
+			end = i+1;
+	}
+	dest[end] = '\0';
+}
+
+// Finds the block device name (srN) of the drive at devicePath, which can be either its /dev/srN or its /dev/sgN node.
+// /sys/class/scsi_generic/sgN/device/block/ has one entry, the matching srN.
+int findBlockDevname(const char *devicePath, char *dest, int destLen) {
+	char pathCopy[MAX_PATH];
+	snprintf(pathCopy, MAX_PATH, "%s", devicePath);
+	char *name = basename(pathCopy);
+	if(strncmp(name, "sr", 2) == 0) {
+		snprintf(dest, destLen, "%s", name);
+		return SUCCESS;
+	}
+
+	char blockDirPath[MAX_PATH];
+	snprintf(blockDirPath, MAX_PATH, "%s/%s/device/block", SYSFS_SG_CLASS, name);
+	DIR *blockDir = opendir(blockDirPath);
+	if(!blockDir)
+		return FAILED_FIND_DEVICE;
+
+	int status = FAILED_FIND_DEVICE;
+	struct dirent *entry;
+	while((entry = readdir(blockDir))) {
+		if(entry->d_name[0] == '.')
+			continue;
+		snprintf(dest, destLen, "%s", entry->d_name);
+		status = SUCCESS;
+		break;
+	}
+	closedir(blockDir);
+	return status;
+}
+
+// The block queue of the matching srN holds max_sectors_kb.
+static int readMaxSectorsKB(const char *devicePath) {
+	char blockName[MAX_PATH];
+	if(findBlockDevname(devicePath, blockName, MAX_PATH))
+		return 0;
+
+	char queuePath[MAX_PATH*2];
+	snprintf(queuePath, sizeof(queuePath), "%s/%s/queue/max_sectors_kb", SYSFS_BLOCK_CLASS, blockName);
+	FILE *f = fopen(queuePath, "r");
+	if(!f)
+		return 0;
+	int maxSectorsKB = 0;
+	if(fscanf(f, "%d", &maxSectorsKB) != 1)
+		maxSectorsKB = 0;
+	fclose(f);
+	return maxSectorsKB;
+}
+
+static int readBufferKB(void) {
+	uint8_t cdb[MODE_SENSE_CDB_SIZE];
+	memset(cdb, 0, MODE_SENSE_CDB_SIZE);
+	cdb[0] = MODE_SENSE_OPCODE;
+	cdb[2] = CAPABILITIES_PAGE;
+	cdb[8] = MODE_SENSE_ALLOC_LEN;
+
+	uint8_t data[MODE_SENSE_ALLOC_LEN];
+	if(sendReadCommand(cdb, MODE_SENSE_CDB_SIZE, data, MODE_SENSE_ALLOC_LEN))
+		return 0;
+
+	unsigned int blockDescriptorLen = (data[iBLOCK_DESCRIPTOR_LEN] << ONE_BYTE) | data[iBLOCK_DESCRIPTOR_LEN+1];
+	unsigned int iPage = MODE_HEADER_SIZE + blockDescriptorLen;
+	if(iPage + iBUFFER_SIZE_KB + 1 >= MODE_SENSE_ALLOC_LEN)
+		return 0;
+	uint8_t *page = data + iPage;
+	if((page[0] & PAGE_CODE_MASK) != CAPABILITIES_PAGE)
+		return 0;
+	return (page[iBUFFER_SIZE_KB] << ONE_BYTE) | page[iBUFFER_SIZE_KB+1];
+}
+
+// The cache is a text file with one "<drive id>\t<blocks>\t<probed blocks>" line per drive.
+// 0 unless there is a line for the drive written when the probe came to probedBlocks too.
+static uint32_t readCachedBatchBlocks(const char *id, uint32_t probedBlocks) {
+	FILE *f = fopen(BATCH_CACHE_PATH, "r");
+	if(!f)
+		return 0;
+
+	uint32_t blocks = 0;
+	char line[MAX_CACHE_LINE];
+	while(fgets(line, MAX_CACHE_LINE, f)) {
+		char *tab = strchr(line, '\t');
+		if(!tab)
+			continue;
+		*tab = '\0';
+		if(strcmp(line, id) == 0) {
+			char *end;
+			uint32_t cached = strtoul(tab+1, &end, 10);
+			if(*end == '\t' && strtoul(end+1, NULL, 10) == probedBlocks)
+				blocks = cached;
+			break;
+		}
+	}
+	fclose(f);
+	return blocks;
+}
+
+// Rewrites the cache with this drive's entry replaced. Failing to write it only costs a slower start next time.
+// The new file gets a name of its own from mkstemp() before it is renamed over the cache, /var/tmp is shared with every user
+// and a fixed name could already be taken, or be a symlink, or be half written by another run.
+static void cacheBatchBlocks(const char *id, uint32_t blocks, uint32_t probedBlocks) {
+	char tmpPath[MAX_PATH];
+	snprintf(tmpPath, MAX_PATH, "%s.XXXXXX", BATCH_CACHE_PATH);
+	int fd = mkstemp(tmpPath);
+	if(fd == -1)
+		return;
+	fchmod(fd, CACHE_FILE_MODE);
+	FILE *out = fdopen(fd, "w");
+	if(!out) {
+		close(fd);
+		unlink(tmpPath);
+		return;
+	}
+
+	FILE *in = fopen(BATCH_CACHE_PATH, "r");
+	if(in) {
+		char line[MAX_CACHE_LINE];
+		size_t idLen = strlen(id);
+		while(fgets(line, MAX_CACHE_LINE, in)) {
+			if(strncmp(line, id, idLen) == 0 && line[idLen] == '\t')
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%s\t%u\t%u\n", id, blocks, probedBlocks);
+	if(fclose(out) || rename(tmpPath, BATCH_CACHE_PATH))
+		unlink(tmpPath);
+}
@@ -0,0 +1,30 @@
+
+#ifndef PROBECD_H
+#define PROBECD_H
+
+#include <stdint.h>
+
+#define DRIVE_ID_LEN 30 // vendor (8) + ' ' + product (16) + ' ' + revision (4) read from INQUIRY, without the terminator
+
+// results of testUnitReady()
+#define UNIT_READY 0
+#define UNIT_NOT_READY 1 // try again, the drive may still be spinning up
+#define UNIT_NO_MEDIUM 2
+
+typedef struct DriveLimits DriveLimits;
+
+struct DriveLimits {
+	char id[DRIVE_ID_LEN+1];
+	int reservedSize; // bytes, from setDriveReservedSize()
+	int maxSectorsKB; // from the block queue in sysfs, 0 if unknown
+	int bufferKB; // drive buffer size from MODE SENSE page 2Ah, 0 if unknown
+	uint32_t probedBlocks; // the largest transfer the limits above allow
+	uint32_t batchBlocks; // largest READ CD transfer, in blocks, believed to work on this drive, lower than probedBlocks once one was refused
+};
+
+int probeDriveLimits(const char *devicePath, DriveLimits *dest);
+uint32_t backOffBatchBlocks(DriveLimits *limits);
+int testUnitReady(void);
+int findBlockDevname(const char *devicePath, char *dest, int destLen);
+
+#endif
@@ -1,15 +1,18 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <fcntl.h>
-#include <scsi/sg.h>
-#include <sys/ioctl.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdbool.h> 
+#include <time.h>
+#include <stdatomic.h>
 
 #include "readcd.h"
-#include "config.h"
+#include "probecd.h"
+#include "drive.h"
+#include "cdspeed.h"
+#include "sectorcache.h"
+#include "stats.h"
 
 #define CDB_SIZE 12
 #define OPCODE 0xbe
@@ -22,13 +25,15 @@
 #define ONE_BYTE 8
 #define iSTART_LBA_LSB 5
 #define iTRANSFER_LEN_LSB 8
-#define MAX_SENSE 0xff
-#define SCSI_GENERIC_INTERFACE_ID 'S'
-#define SG_IO_TIMEOUT 5000
 #define BLOCK_SIZE CD_AUDIO_BLOCK_SIZE
 
-#define BLOCKS_PER_BATCH 4
-#define BATCH_SIZE (BLOCK_SIZE * BLOCKS_PER_BATCH) // must always be a multiple of BLOCK_SIZE
+#define SENSE_KEY_ILLEGAL_REQUEST 0x05
+#define ASC_INVALID_FIELD_IN_CDB 0x24 // what a drive answers a READ CD longer than it will transfer with
+
+#define FALLBACK_BLOCKS_PER_BATCH 4 // used if the drive limits could not be probed
+
+#define MAX_COMMANDS_IN_FLIGHT MAX_DRIVE_COMMANDS_QUEUED
+#define DEFAULT_COMMANDS_IN_FLIGHT 4
 
 #define SUCCESS 0
 #define FAILED_OPEN_DEVICE 1
@@ -37,17 +42,79 @@
 #define BAD_SENSE_DATA 4
 #define START_LBA_OUT_OF_RANGE 5
 #define LEADOUT_REACHED READ_CD_AUDIO_LEADOUT_REACHED
+#define FAILED_SUBMIT_COMMAND 7
+#define FAILED_RECEIVE_RESPONSE 8
+#define BAD_COMMANDS_IN_FLIGHT 9
+#define ASYNC_UNSUPPORTED 10
+#define BAD_TRANSPORT 11
+#define FAILED_MAP_RESERVED 12
+#define ABORTED READ_CD_AUDIO_ABORTED
+#define BAD_BATCH_BLOCKS READ_CD_AUDIO_BAD_BATCH_BLOCKS
+#define TRANSFER_TOO_LARGE 16 // the drive or the kernel turned the batch down for its size
+
+typedef struct PendingBatch PendingBatch;
+
+// everything the drive may still touch while a READ CD is queued
+struct PendingBatch {
+	DriveCommand command;
+	bool busy;
+};
 
 void buildCDB(uint8_t cdb[CDB_SIZE]);
 void setCDBStartLBA(uint8_t cdb[CDB_SIZE], uint32_t startLBA);
 void setCDBTransferLen(uint8_t cdb[CDB_SIZE], uint32_t transferLen);
-void buildSgIoHdr(sg_io_hdr_t *hdr, uint8_t cdb[CDB_SIZE], uint8_t *dataBuf, unsigned int dataBufSize, uint8_t senseBuf[MAX_SENSE]);
-int getCDAudioBatch(unsigned long startLBA, unsigned long batchSize, int opticalDriveFD, void *dest);
+void buildReadCommand(DriveCommand *command, uint32_t startLBA, uint32_t transferLen, void *dest);
+int getCDAudioBatch(unsigned long startLBA, unsigned long batchSize, void *dest);
+int getCDAudioSerial(uint32_t startLBA, uint32_t transferLen, void *dest);
+int getCDAudioPipelined(uint32_t startLBA, uint32_t transferLen, void *dest);
+int openOpticalDrive(void);
+int mapReservedBuffer(void);
+void applyTransport(DriveCommand *command);
+void countTransfer(DriveCommand *command);
+int getSenseStatus(const DriveCommand *command);
+int readRange(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten, bool useCache);
+int readFromDrive(uint32_t startLBA, uint32_t transferLen, void *dest);
 
-static int opticalDriveFD = -1;
+static bool driveHeld = false; // readcd.c holds a reference to the drive from the first read until closeOpticalDrive()
+static int commandsInFlight = DEFAULT_COMMANDS_IN_FLIGHT;
+static bool asyncUsable = false; // cleared once the drive refuses a queued command, until it is opened again
+static DriveLimits limits = { .batchBlocks = FALLBACK_BLOCKS_PER_BATCH };
+static uint32_t batchBlocksCap = 0; // from setReadBatchBlocks(), 0 for whatever the probe finds
+static int transport = READ_TRANSPORT_COPY;
+static uint8_t *mappedReserved = NULL; // the drive's reserved buffer, only mapped in READ_TRANSPORT_MMAP
+static size_t mappedReservedSize = 0;
+static ReadTransportStats transportStats;
+static atomic_bool abortRequested = false; // set from any thread by abortDriveReads(), cleared by closeOpticalDrive()
 
 // transferLen is the number of logical blocks to read, each block being BLOCK_SIZE (2352) bytes
 int readCDAudio(uint32_t startLBA, uint32_t leadoutLBA,uint32_t transferLen, void **dest, long *destSizeWritten) {
+	if(startLBA >= leadoutLBA)
+		return START_LBA_OUT_OF_RANGE;
+	if(startLBA+transferLen >= leadoutLBA)
+		transferLen = leadoutLBA - startLBA;
+
+	void *resized = realloc(*dest, transferLen*BLOCK_SIZE);
+	if(!resized)
+		return FAILED_ALLOCATE_MEMORY;
+	*dest = resized;
+
+	return readCDAudioInto(startLBA, leadoutLBA, transferLen, *dest, destSizeWritten);
+}
+
+// Same as readCDAudio(), but reads into memory owned by the caller instead of reallocating it.
+// dest must have space for at least transferLen*BLOCK_SIZE bytes.
+// Blocks in the sector cache are copied from it, only the rest are read from the drive.
+int readCDAudioInto(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten) {
+	return readRange(startLBA, leadoutLBA, transferLen, dest, destSizeWritten, true);
+}
+
+// Same as readCDAudioInto(), but always goes to the drive and leaves the sector cache alone.
+// For callers that need a fresh read of the disc, like secure reads comparing one read against another.
+int readCDAudioFromDrive(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten) {
+	return readRange(startLBA, leadoutLBA, transferLen, dest, destSizeWritten, false);
+}
+
+int readRange(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten, bool useCache) {
 	bool leadoutReached = false;
 	if(startLBA >= leadoutLBA)
 		return START_LBA_OUT_OF_RANGE;
@@ -55,39 +122,328 @@ int readCDAudio(uint32_t startLBA, uint32_t leadoutLBA,uint32_t transferLen, voi
 		transferLen = leadoutLBA - startLBA;
 		leadoutReached = true;
 	}
-	// opticalDriveFD will be initialized to -1 and set to -1 on error since its value is only set by open()
-	if(opticalDriveFD == -1 && (opticalDriveFD = open(OPTICAL_DRIVE_PATH, O_RDONLY)) == -1) 
+
+	int status = SUCCESS;
+	if(useCache && isSectorCacheEnabled()) {
+		// copy out runs of cached blocks, read runs of missing blocks in one go and cache them
+		uint32_t done = 0;
+		while(done < transferLen && status == SUCCESS) {
+			uint8_t *blockDest = (uint8_t *)dest + done*BLOCK_SIZE;
+			const uint8_t *cached = lookupSector(startLBA+done);
+			if(cached) {
+				memcpy(blockDest, cached, BLOCK_SIZE);
+				done++;
+				continue;
+			}
+			uint32_t run = 1;
+			while(done+run < transferLen && !containsSector(startLBA+done+run))
+				run++;
+			countSectorMisses(run);
+			status = readFromDrive(startLBA+done, run, blockDest);
+			if(status == SUCCESS)
+				cacheSectors(startLBA+done, blockDest, run);
+			done += run;
+		}
+	}
+	else
+		status = readFromDrive(startLBA, transferLen, dest);
+	if(status)
+		return status;
+
+	*destSizeWritten = transferLen*BLOCK_SIZE;
+	if(leadoutReached)
+		return LEADOUT_REACHED;
+	return SUCCESS;
+}
+
+// Reads exactly transferLen blocks, backing off the batch size if the drive refuses it.
+int readFromDrive(uint32_t startLBA, uint32_t transferLen, void *dest) {
+	if(!driveHeld && openOpticalDrive())
 		return FAILED_OPEN_DEVICE;
 
+	double started = monotonicSec();
+	int status;
+	bool retry = false;
+	bool reopened = false; // a queue that can't be collected any more gets one retry on a freshly opened drive
+	bool reopening;
+	do {
+		if(retry) {
+			countStat(STAT_READ_RETRIES, 1);
+			STATS_PROBE1(read_retry, status);
+		}
+		retry = true;
+		status = ASYNC_UNSUPPORTED;
+		// there is only one reserved buffer, so mmap transfers can't overlap
+		if(asyncUsable && commandsInFlight > 1 && transport != READ_TRANSPORT_MMAP) {
+			status = getCDAudioPipelined(startLBA, transferLen, dest);
+			if(status == ASYNC_UNSUPPORTED)
+				asyncUsable = false;
+		}
+		if(status == ASYNC_UNSUPPORTED)
+			status = getCDAudioSerial(startLBA, transferLen, dest);
+		reopening = status == FAILED_RECEIVE_RESPONSE && !reopened;
+		if(reopening) {
+			if(openOpticalDrive())
+				return FAILED_OPEN_DEVICE;
+			reopened = true;
+		}
+	// a transfer that is too large for the drive or kernel fails outright, so retry smaller until there is nothing smaller to try.
+	// Anything else, a scratch or the disc going away, would fail at any size, and backing off for it would slow every later run.
+	} while(reopening || (status == TRANSFER_TOO_LARGE && limits.batchBlocks > 1 && backOffBatchBlocks(&limits)));
+	if(status)
+		return status;
+	recordReadThroughput(transferLen*BLOCK_SIZE, monotonicSec() - started);
+	return SUCCESS;
+}
+
+// Sets how many READ CD commands readCDAudioInto() keeps queued in the drive at once.
+// 1 disables pipelining and sends one command at a time.
+int setReadCommandsInFlight(int commands) {
+	if(commands < 1 || commands > MAX_COMMANDS_IN_FLIGHT)
+		return BAD_COMMANDS_IN_FLIGHT;
+	commandsInFlight = commands;
+	return SUCCESS;
+}
+
+int getReadCommandsInFlight(void) {
+	return commandsInFlight;
+}
+
+// Picks how audio gets from the drive into memory, one of the READ_TRANSPORT_* values in readcd.h.
+// 	READ_TRANSPORT_COPY: the default, the sg driver copies from its own buffer into dest.
+// 	READ_TRANSPORT_DIRECT: SG_FLAG_DIRECT_IO, the drive DMAs straight into dest. Page aligned destinations (like the ring slots in playaudio.c) work best.
+// 		The driver silently falls back to copying if /proc/scsi/sg/allow_dio is 0 or dest is not aligned well enough, which shows up in the stats.
+// 	READ_TRANSPORT_MMAP: SG_FLAG_MMAP_IO, the drive DMAs into the sg reserved buffer which is mapped into this process.
+// 		readCDAudioMapped() hands that memory out without copying, readCDAudioInto() still has to copy it out.
+// These are sg driver features, the simulated drives in simdrive.c accept all three and just copy.
+int setReadTransport(int newTransport) {
+	if(newTransport != READ_TRANSPORT_COPY && newTransport != READ_TRANSPORT_DIRECT && newTransport != READ_TRANSPORT_MMAP)
+		return BAD_TRANSPORT;
+	transport = newTransport;
+	if(transport == READ_TRANSPORT_MMAP && driveHeld && !mappedReserved && mapReservedBuffer())
+		return FAILED_MAP_RESERVED;
+	return SUCCESS;
+}
+
+void getReadTransportStats(ReadTransportStats *dest) {
+	*dest = transportStats;
+}
+
+void resetReadTransportStats(void) {
+	memset(&transportStats, 0, sizeof(ReadTransportStats));
+}
+
+// Reads at most one batch starting at startLBA into the mapped reserved buffer and points *data at it, no copy is made.
+// *data is only valid until the next read. Only usable in READ_TRANSPORT_MMAP.
+int readCDAudioMapped(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void **data, long *dataSize) {
+	bool leadoutReached = false;
+	if(transport != READ_TRANSPORT_MMAP)
+		return BAD_TRANSPORT;
+	if(startLBA >= leadoutLBA)
+		return START_LBA_OUT_OF_RANGE;
+	if(!driveHeld && openOpticalDrive())
+		return FAILED_OPEN_DEVICE;
+	if(!mappedReserved && mapReservedBuffer())
+		return FAILED_MAP_RESERVED;
+
+	if(transferLen > limits.batchBlocks)
+		transferLen = limits.batchBlocks;
+	if(startLBA+transferLen >= leadoutLBA) {
+		transferLen = leadoutLBA - startLBA;
+		leadoutReached = true;
+	}
+
+	int status = getCDAudioBatch(startLBA, transferLen, NULL);
+	if(status)
+		return status;
+	*data = mappedReserved;
+	*dataSize = transferLen*BLOCK_SIZE;
+	if(leadoutReached)
+		return LEADOUT_REACHED;
+	return SUCCESS;
+}
+
+// The reserved buffer is only as big as the probe left it, so batches are capped to fit in it.
+int mapReservedBuffer(void) {
+	if(limits.reservedSize <= 0)
+		return FAILED_MAP_RESERVED;
+	void *mapped = mapDriveReserved(limits.reservedSize);
+	if(!mapped)
+		return FAILED_MAP_RESERVED;
+	mappedReserved = mapped;
+	mappedReservedSize = limits.reservedSize;
+	if(limits.batchBlocks*BLOCK_SIZE > mappedReservedSize)
+		limits.batchBlocks = mappedReservedSize/BLOCK_SIZE;
+	return SUCCESS;
+}
+
+// Sets the command flags for the current transport. In READ_TRANSPORT_MMAP the data pointer has to be NULL.
+void applyTransport(DriveCommand *command) {
+	if(transport == READ_TRANSPORT_DIRECT)
+		command->flags |= DRIVE_FLAG_DIRECT_IO;
+	else if(transport == READ_TRANSPORT_MMAP) {
+		command->flags |= DRIVE_FLAG_MMAP_IO;
+		command->data = NULL;
+	}
+}
+
+// The kernel copies everything in READ_TRANSPORT_COPY, and anything it could not do direct I/O for in READ_TRANSPORT_DIRECT.
+void countTransfer(DriveCommand *command) {
+	long bytes = command->dataLen - command->resid;
+	transportStats.commands++;
+	transportStats.bytesRead += bytes;
+	countStat(STAT_BYTES_READ, bytes);
+	if(transport == READ_TRANSPORT_COPY || (transport == READ_TRANSPORT_DIRECT && !command->directIO))
+		transportStats.bytesCopiedByKernel += bytes;
+}
+
+// Returns the INQUIRY vendor/product/revision of the open drive, empty if it has not been opened or probed.
+const char *getDriveId(void) {
+	return limits.id;
+}
+
+// Makes every read in progress, on any thread, stop at its next batch and return READ_CD_AUDIO_ABORTED, and every read after it too.
+// Batches already queued in the drive are still collected, nothing new is sent.
+// For when the disc is going away and waiting out a full read (or its retries on a missing disc) would only hold things up.
+// Reads work again once closeOpticalDrive() has been called.
+void abortDriveReads(void) {
+	atomic_store(&abortRequested, true);
+}
+
+// Puts the drive's speed back the way it was found and lets go of it, which closes it unless another module still holds it.
+// The next read opens it again.
+void closeOpticalDrive(void) {
+	atomic_store(&abortRequested, false);
+	if(!driveHeld)
+		return;
+	restoreDriveSpeed();
+	mappedReserved = NULL;
+	driveHeld = false;
+	releaseDrive();
+	clearSectorCache();
+}
+
+// Returns the number of blocks each READ CD command currently asks for.
+uint32_t getReadBatchBlocks(void) {
+	return limits.batchBlocks;
+}
+
+// Caps the blocks each READ CD asks for below what the probe finds the drive can take, 0 removes the cap.
+// Takes effect when the drive is next opened, closeOpticalDrive() first to apply it now. For benchmarking batch sizes.
+int setReadBatchBlocks(uint32_t blocks) {
+	if(blocks > THREE_BYTE_LIMIT)
+		return BAD_BATCH_BLOCKS;
+	batchBlocksCap = blocks;
+	return SUCCESS;
+}
+
+// Takes readcd.c's reference to the drive, unless it already has one, and probes its transfer limits to pick the batch size.
+// Also called after discardDriveCommands(), which leaves the drive open but its reserved buffer unmapped.
+int openOpticalDrive(void) {
+	if(!driveHeld) {
+		if(acquireDrive())
+			return FAILED_OPEN_DEVICE;
+		driveHeld = true;
+	}
+	asyncUsable = canQueueDriveCommands();
+	// whatever was cached may have come off a different disc
+	clearSectorCache();
+	probeDriveLimits(getDrivePath(), &limits);
+	if(batchBlocksCap && limits.batchBlocks > batchBlocksCap)
+		limits.batchBlocks = batchBlocksCap;
+	mappedReserved = NULL;
+	if(transport == READ_TRANSPORT_MMAP)
+		mapReservedBuffer();
+	return SUCCESS;
+}
+
+// Reads transferLen blocks one command at a time.
+int getCDAudioSerial(uint32_t startLBA, uint32_t transferLen, void *dest) {
 	const long dataSize = transferLen*BLOCK_SIZE;
-	*dest = realloc(*dest, dataSize);
-	if(!dest)
-		return FAILED_ALLOCATE_MEMORY;
+	const long batchSize = limits.batchBlocks*BLOCK_SIZE;
 
 	// CD Audio is read in batches since ioctl will fail on large transfers. (ex. it fails to grab a full 2 seconds of audio data in one command, in my testing)
-	// getCDAudioBatch() is called repeatedly to fill *dest with transferLen*BLOCK_SIZE bytes of audio data.
+	// The batch size is probed from the drive and kernel limits when the drive is opened, see probecd.c
+	// getCDAudioBatch() is called repeatedly to fill dest with transferLen*BLOCK_SIZE bytes of audio data.
 
-	long offset; // only increment offset in multiples of BATCH_SIZE
+	long offset; // only increment offset in multiples of batchSize
 			      // this allows the offset of bytes to be converted to an offset of CD Audio blocks accurrately with division by BLOCK_SIZE
-	int status; // return value for getCDAudioBatch to check for errors
+	int status = SUCCESS; // return value for getCDAudioBatch to check for errors
 	
-	// loop while there is still space in *dest for another full batch.
-	for(offset = 0; offset<(dataSize-BATCH_SIZE); offset+=BATCH_SIZE) {
-		if((status = getCDAudioBatch(startLBA+(offset/BLOCK_SIZE), BLOCKS_PER_BATCH, opticalDriveFD, (*dest)+offset)))
+	// loop while there is still space in dest for another full batch.
+	for(offset = 0; offset<(dataSize-batchSize); offset+=batchSize) {
+		if((status = getCDAudioBatch(startLBA+(offset/BLOCK_SIZE), limits.batchBlocks, dest+offset)))
 			return status;
 	}
-	// when there is no longer space for a full batch, get a smaller one to fill the rest of *dest
+	// when there is no longer space for a full batch, get a smaller one to fill the rest of dest
 	long blocksRemaining = (dataSize-offset)/BLOCK_SIZE;
 	if(blocksRemaining > 0)
-		status = getCDAudioBatch(startLBA+(offset/BLOCK_SIZE), blocksRemaining, opticalDriveFD, (*dest)+offset);
-	
-	if(status)
-		return status;
+		status = getCDAudioBatch(startLBA+(offset/BLOCK_SIZE), blocksRemaining, dest+offset);
+	return status;
+}
 
-	*destSizeWritten = dataSize;
-	if(leadoutReached)
-		return LEADOUT_REACHED;
-	return SUCCESS;
+// Reads transferLen blocks while keeping up to commandsInFlight READ CD commands queued, so the drive never waits on a round trip to userspace.
+// submitDriveCommand() queues a command and reapDriveCommand() returns whichever one finished first, see drive.c.
+// Returns ASYNC_UNSUPPORTED, with nothing read, if the drive refuses the very first command.
+int getCDAudioPipelined(uint32_t startLBA, uint32_t transferLen, void *dest) {
+	PendingBatch pending[MAX_COMMANDS_IN_FLIGHT];
+	for(int i=0; i<commandsInFlight; i++)
+		pending[i].busy = false;
+
+	int inFlight = 0;
+	uint32_t blocksSubmitted = 0;
+	int status = SUCCESS;
+	while(blocksSubmitted < transferLen || inFlight > 0) {
+		// keep the queue full, unless a batch already failed, then only drain what is left
+		if(status == SUCCESS && atomic_load(&abortRequested))
+			status = ABORTED;
+		while(status == SUCCESS && inFlight < commandsInFlight && blocksSubmitted < transferLen) {
+			int iBatch = 0;
+			while(pending[iBatch].busy)
+				iBatch++;
+			PendingBatch *batch = &pending[iBatch];
+
+			uint32_t batchBlocks = transferLen - blocksSubmitted;
+			if(batchBlocks > limits.batchBlocks)
+				batchBlocks = limits.batchBlocks;
+
+			buildReadCommand(&batch->command, startLBA+blocksSubmitted, batchBlocks, dest+(blocksSubmitted*BLOCK_SIZE));
+			int submitted = submitDriveCommand(&batch->command);
+			if(submitted == DRIVE_TOO_LARGE) {
+				status = TRANSFER_TOO_LARGE;
+				break;
+			}
+			if(submitted) {
+				if(blocksSubmitted == 0)
+					return ASYNC_UNSUPPORTED;
+				status = FAILED_SUBMIT_COMMAND;
+				break;
+			}
+			batch->busy = true;
+			inFlight++;
+			blocksSubmitted += batchBlocks;
+		}
+		if(inFlight == 0)
+			break;
+
+		DriveCommand *done = NULL;
+		int reaped = reapDriveCommand(&done);
+		if(reaped != DRIVE_SUCCESS && reaped != DRIVE_CHECK_CONDITION) {
+			// the outstanding commands can't be collected any more, readFromDrive() prepares the drive again
+			discardDriveCommands();
+			mappedReserved = NULL;
+			return FAILED_RECEIVE_RESPONSE;
+		}
+		PendingBatch *batch = (PendingBatch *)done; // command is the first member
+		if(batch < pending || batch >= pending+commandsInFlight || !batch->busy)
+			continue; // not one of ours
+		batch->busy = false;
+		inFlight--;
+		countTransfer(done);
+		if(status == SUCCESS && reaped == DRIVE_CHECK_CONDITION)
+			status = getSenseStatus(done);
+	}
+	return status;
 }
 
 void buildCDB(uint8_t cdb[CDB_SIZE]) {
@@ -113,33 +469,47 @@ void setCDBTransferLen(uint8_t cdb[CDB_SIZE], uint32_t transferLen) {
 	cdb[iTRANSFER_LEN_LSB-2] = transferLen >> ONE_BYTE*2;
 }
 
-void buildSgIoHdr(sg_io_hdr_t *hdr, uint8_t cdb[CDB_SIZE], uint8_t *dataBuf, unsigned int dataBufSize, uint8_t senseBuf[MAX_SENSE]) {
-	memset(hdr, 0, sizeof(sg_io_hdr_t));
-	
-	hdr->interface_id = SCSI_GENERIC_INTERFACE_ID;
-	hdr->cmdp = cdb;
-	hdr->cmd_len = CDB_SIZE;
-	hdr->dxfer_direction = SG_DXFER_FROM_DEV;
-	hdr->dxferp = dataBuf;
-	hdr->dxfer_len = dataBufSize;
-	hdr->mx_sb_len = MAX_SENSE;
-	hdr->sbp = senseBuf;
-	hdr->timeout = SG_IO_TIMEOUT;
-}
-
-int getCDAudioBatch(unsigned long startLBA, unsigned long batchSize /*should be a very small number*/, int opticalDriveFD, void *dest) {
-	uint8_t cdb[CDB_SIZE];
-	sg_io_hdr_t hdr;
-	uint8_t senseBuf[MAX_SENSE];
-
-	buildCDB(cdb);
-	setCDBStartLBA(cdb, startLBA);
-	setCDBTransferLen(cdb, batchSize);
-	buildSgIoHdr(&hdr, cdb, dest, BLOCK_SIZE*batchSize, senseBuf);
-	if(ioctl(opticalDriveFD, SG_IO, &hdr) == -1)
-		return FAILED_IOCTL;
-	if(hdr.sb_len_wr != 0)
-		return BAD_SENSE_DATA; 
+// A READ CD of transferLen blocks into dest, with the flags for the current transport.
+void buildReadCommand(DriveCommand *command, uint32_t startLBA, uint32_t transferLen, void *dest) {
+	initDriveCommand(command, DRIVE_DATA_IN, dest, transferLen*BLOCK_SIZE);
+	buildCDB(command->cdb);
+	setCDBStartLBA(command->cdb, startLBA);
+	setCDBTransferLen(command->cdb, transferLen);
+	command->cdbLen = CDB_SIZE;
+	applyTransport(command);
+}
+
+int getCDAudioBatch(unsigned long startLBA, unsigned long batchSize /*should be a very small number*/, void *dest) {
+	DriveCommand command;
+
+	if(atomic_load(&abortRequested))
+		return ABORTED;
+	buildReadCommand(&command, startLBA, batchSize, dest);
+	switch(sendDriveCommand(&command)) {
+		case DRIVE_SUCCESS:
+			break;
+		case DRIVE_CHECK_CONDITION:
+			return getSenseStatus(&command);
+		case DRIVE_TOO_LARGE:
+			return TRANSFER_TOO_LARGE;
+		case DRIVE_FAILED_OPEN:
+			return FAILED_OPEN_DEVICE;
+		default:
+			return FAILED_IOCTL;
+	}
+	countTransfer(&command);
+	// readCDAudioMapped() passes NULL since it uses the mapped buffer where it is
+	if(transport == READ_TRANSPORT_MMAP && dest) {
+		memcpy(dest, mappedReserved, command.dataLen);
+		transportStats.bytesCopiedByUser += command.dataLen;
+	}
 	return SUCCESS;
 }
 
+// TRANSFER_TOO_LARGE if the drive refused the READ CD's length, otherwise BAD_SENSE_DATA.
+// 	MMC-3 Manual, 6.1.17 READ CD Command, a Transfer Length beyond what the drive can buffer is an invalid field
+int getSenseStatus(const DriveCommand *command) {
+	if(getSenseKey(command) == SENSE_KEY_ILLEGAL_REQUEST && getSenseASC(command) == ASC_INVALID_FIELD_IN_CDB)
+		return TRANSFER_TOO_LARGE;
+	return BAD_SENSE_DATA;
+}
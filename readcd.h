@@ -7,6 +7,36 @@
 #define CD_AUDIO_BLOCK_SIZE 2352
 #define CD_AUDIO_BLOCKS_ONE_SEC 75 // number of CD audio blocks for one second of CD audio
 #define READ_CD_AUDIO_LEADOUT_REACHED 6
+#define READ_CD_AUDIO_ABORTED 14 // abortDriveReads() was called, see there
+#define READ_CD_AUDIO_BAD_BATCH_BLOCKS 15
+
+// ways of getting audio from the drive, see setReadTransport()
+#define READ_TRANSPORT_COPY 0
+#define READ_TRANSPORT_DIRECT 1
+#define READ_TRANSPORT_MMAP 2
+
+typedef struct ReadTransportStats ReadTransportStats;
+
+struct ReadTransportStats {
+	unsigned long commands;
+	unsigned long bytesRead;
+	unsigned long bytesCopiedByKernel; // bytes the sg driver copied out of its bounce buffer
+	unsigned long bytesCopiedByUser; // bytes readcd.c copied out of the mapped reserved buffer
+};
+
 int readCDAudio(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void **dest, long *destSizeWritten);
+int readCDAudioInto(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten);
+int readCDAudioFromDrive(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten);
+int setReadCommandsInFlight(int commands);
+int getReadCommandsInFlight(void);
+uint32_t getReadBatchBlocks(void);
+int setReadBatchBlocks(uint32_t blocks);
+int setReadTransport(int transport);
+void getReadTransportStats(ReadTransportStats *dest);
+void resetReadTransportStats(void);
+const char *getDriveId(void);
+void closeOpticalDrive(void);
+void abortDriveReads(void);
+int readCDAudioMapped(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void **data, long *dataSize);
 
 #endif
@@ -32,10 +32,7 @@
  * These are the sources that I was able to find for free.
 */
 
-#include <fcntl.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
-#include <scsi/sg.h>
 #include <string.h>
 #include <stdlib.h>
 #include <wchar.h>
@@ -43,6 +40,8 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "cd.h"
+#include "readtext.h"
+#include "drive.h"
 
 // TODO organize macro definitions
 
@@ -62,8 +61,6 @@
 
 
 
-#define DEVICE_FILE "/dev/sg0"
-#define MAX_SENSE 0xff
 #define ONE_BYTE 8
 #define READ_TOC_HDR_SIZE 4
 #define MAX_CD_TRACK_COUNT 99
@@ -71,8 +68,7 @@
 #define PACK_TRACK_NUM_ALBUM 0x00
 #define PACK_TYPE_TOC_INFO 0x88
 #define PACK_TYPE_BLOCK_SIZE_INFO 0x8f
-#define SCSI_GENERIC_INTERFACE_ID 'S'
-#define SG_IO_TIMEOUT 10000
+#define READ_TEXT_TIMEOUT_MS 10000
 
 #define PACK_LEN 18
 #define TEXT_DATA_FIELD_LEN 12
@@ -98,8 +94,8 @@
 #define	FAILED_TO_ALLOCATE_MEMORY 1
 #define	FAILED_TO_OPEN_DEVICE_FILE 2
 #define	FAILED_IOCTL 3
-#define	CDTEXT_DOES_NOT_EXIST 4
-#define	CDTEXT_DATA_EMPTY 5
+#define	CDTEXT_DOES_NOT_EXIST READ_TEXT_NO_CDTEXT
+#define	CDTEXT_DATA_EMPTY READ_TEXT_EMPTY
 #define	BLOCKNUM_OUT_OF_RANGE 6
 #define	BLOCKNUM_NOT_FOUND 7
 
@@ -111,7 +107,6 @@ CDText makeCDText(PackData packs);
 unsigned int getDataLen(uint8_t *readTextResponse);
 void *getPackStart(void *readTextResponse);
 static void buildCDB(uint8_t cdb[CDB_SIZE]);
-static void buildSgIoHdr(sg_io_hdr_t *hdr, uint8_t *cdb, uint8_t dataBuf[ALLOC_LEN], uint8_t senseBuf[MAX_SENSE]);
 uint16_t toUtf8(unsigned char c);
 uint8_t getBlockNum(void *pack);
 PackData makePackData(void *packDataStart, unsigned int packDataSize);
@@ -170,24 +165,22 @@ int main() {
 // returns an error code, 0 is success.
 // most reliable value for defaultBlockNum is 0
 int readText(CDText **dest, uint8_t defaultBlockNum) {
-	int fd = open(DEVICE_FILE, O_RDONLY);
-	if(fd == -1) {
-		return FAILED_TO_OPEN_DEVICE_FILE;
-	}
-
 	uint8_t dataBuf[ALLOC_LEN]; 
-	uint8_t senseBuf[MAX_SENSE];
-	uint8_t cdb[CDB_SIZE];
-	buildCDB(cdb);
-
-	sg_io_hdr_t hdr;
-	buildSgIoHdr(&hdr, cdb, dataBuf, senseBuf);
-
-	if(ioctl(fd, SG_IO, &hdr) == -1) {
-		return FAILED_IOCTL;
-	}
-	if(hdr.sb_len_wr != 0) {
-		return CDTEXT_DOES_NOT_EXIST;
+	DriveCommand command;
+	initDriveCommand(&command, DRIVE_DATA_IN, dataBuf, ALLOC_LEN);
+	buildCDB(command.cdb);
+	command.cdbLen = CDB_SIZE;
+	command.timeoutMs = READ_TEXT_TIMEOUT_MS;
+
+	switch(sendDriveCommand(&command)) {
+		case DRIVE_SUCCESS:
+			break;
+		case DRIVE_FAILED_OPEN:
+			return FAILED_TO_OPEN_DEVICE_FILE;
+		case DRIVE_CHECK_CONDITION:
+			return CDTEXT_DOES_NOT_EXIST;
+		default:
+			return FAILED_IOCTL;
 	}
 
 	unsigned int packsLen = getDataLen(dataBuf);
@@ -201,6 +194,14 @@ int readText(CDText **dest, uint8_t defaultBlockNum) {
 	if(packsLen < ALLOC_LEN)
 		packDataSize = packsLen;
 
+	return makeTextFromPacks(dest, packsStart, packDataSize, defaultBlockNum);
+}
+
+// Same as readText(), but parses pack data that was already read instead of asking the drive for it.
+// packs is copied, so the caller keeps ownership of it. Used to rebuild CD-Text saved by disccache.c.
+int makeTextFromPacks(CDText **dest, const void *packsStart, unsigned int packDataSize, uint8_t defaultBlockNum) {
+	if(packDataSize == 0)
+		return CDTEXT_DATA_EMPTY;
 	void *packsAlloc = malloc(packDataSize);
 	if(!packsAlloc)
 		return FAILED_TO_ALLOCATE_MEMORY;
@@ -219,9 +220,17 @@ int readText(CDText **dest, uint8_t defaultBlockNum) {
 		*textp = text;
 		*dest = textp;
 	}
+	else
+		free(packsAlloc);
 	return status;
 }
 
+// Points *packs at the raw pack data text was built from and returns its size in bytes.
+unsigned int getTextPacks(CDText *text, const void **packs) {
+	*packs = text->packs.start;
+	return text->packs.size;
+}
+
 void printReadTextErr(int err) {
 	switch(err) {
 		case CDTEXT_DOES_NOT_EXIST:
@@ -244,20 +253,6 @@ static void buildCDB(uint8_t cdb[CDB_SIZE]) {
 	cdb[iFORMAT] = FORMAT;
 }
 
-static void buildSgIoHdr(sg_io_hdr_t *hdr, uint8_t cdb[CDB_SIZE], uint8_t dataBuf[ALLOC_LEN], uint8_t senseBuf[MAX_SENSE]) {
-	memset(hdr, 0, sizeof(sg_io_hdr_t));
-	
-	hdr->interface_id = SCSI_GENERIC_INTERFACE_ID;
-	hdr->cmdp = cdb;
-	hdr->cmd_len = CDB_SIZE;
-	hdr->dxfer_direction = SG_DXFER_FROM_DEV;
-	hdr->dxferp = dataBuf;
-	hdr->dxfer_len = ALLOC_LEN;
-	hdr->mx_sb_len = MAX_SENSE;
-	hdr->sbp = senseBuf;
-	hdr->timeout = SG_IO_TIMEOUT;
-}
-
 void *getPackStart(void *readTextResponse) {
 	return readTextResponse+READ_TOC_HDR_SIZE;
 }
@@ -280,7 +275,7 @@ char *makeAlbumInfo(PackData packs, uint8_t typeIndicator) {
 		return NULL;
 
 	unsigned char *thisPack = packs.start;
-	for(int i=0; i<packs.size; i+=PACK_LEN, thisPack+=PACK_LEN) {
+	for(unsigned int i=0; i<packs.size; i+=PACK_LEN, thisPack+=PACK_LEN) {
 		unsigned char id1 = thisPack[0];
 		unsigned char id2 = thisPack[1];
 		if(id1 != typeIndicator || id2 != ALBUM_INDICATOR) 
@@ -360,7 +355,7 @@ int setBlock(CDText *text, uint8_t blockNum) {
 	// Search for the start of the target block (the first pack with Block Number blockNum)
 	// Increase blockLen such that it represents the size in bytes of the block
 	// break once the target has been fully iterated through (Blocks in CD Text are contiguous)
-	for(int i=0; i<text->packs.size; i+=PACK_LEN, thisPack+=PACK_LEN) {
+	for(unsigned int i=0; i<text->packs.size; i+=PACK_LEN, thisPack+=PACK_LEN) {
 		bool thisPackIsInTargetBlock = getBlockNum(thisPack) == blockNum;
 		
 		if(!blockStart && thisPackIsInTargetBlock)
@@ -455,7 +450,7 @@ Track *getTracks(PackData packs, uint8_t trackCount) {
 TrackNumRange getTrackNumRange(PackData packs) {
 	uint8_t *pack = packs.start;
 	TrackNumRange range;
-	for(int i=0; i<packs.size; i+=PACK_LEN, pack+=PACK_LEN) {
+	for(unsigned int i=0; i<packs.size; i+=PACK_LEN, pack+=PACK_LEN) {
 		if(*pack == PACK_TYPE_BLOCK_SIZE_INFO) {
 			range.first = pack[FIRST_TRACK_NUM];
 			range.last = pack[LAST_TRACK_NUM];
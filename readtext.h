@@ -5,9 +5,14 @@
 #include "cd.h"
 #include <stdint.h>
 
+#define READ_TEXT_NO_CDTEXT 4 // the disc has no CD-Text
+#define READ_TEXT_EMPTY 5 // the disc has CD-Text, but there is nothing in it
+
 typedef struct CDText CDText;
 
 int readText(CDText **dest, uint8_t defaultBlockNum);
+int makeTextFromPacks(CDText **dest, const void *packs, unsigned int packsSize, uint8_t defaultBlockNum);
+unsigned int getTextPacks(CDText *text, const void **packs);
 int setBlock(CDText *text, uint8_t blockNum);
 void destroyCDText(CDText *text);
 void printReadTextErr(int err);
@@ -1,14 +1,12 @@
 
-#include <fcntl.h>
-#include <unistd.h>
 #include <stdio.h>
-#include <sys/ioctl.h>
-#include <scsi/sg.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <stdbool.h>
 
 #include "readtoc.h"
+#include "drive.h"
 
 #define CDB_SIZE 10
 #define iOPCODE 0
@@ -22,10 +20,6 @@
 		      // each track descriptor is 8 bytes, response header is 4 bytes.
 		      // (100 * 8) + 4 = 804
 
-#define DEVICE_FILE "/dev/sg0"
-#define SCSI_GENERIC_INTERFACE_ID 'S'
-#define MAX_SENSE_BUF_LEN 64
-
 #define ONE_BYTE 8
 #define TRACK_DESCRIPTOR_SIZE 8	
 #define FIRST_TRACK_NUM 2
@@ -34,6 +28,9 @@
 #define REPRESENTED_HEADER_SIZE 2
 #define CONTROL_MASK 0b00001111
 #define LEADOUT_TRACK_NUM 0xaa
+#define CONTROL_DATA_TRACK 0b00000100 // MMC-3 Manual Table 234, set for data tracks, clear for audio
+#define LBA_PREGAP_FRAMES 150 // LBA 0 is 2 seconds into the disc
+#define FRAMES_PER_SECOND 75
 
 #define SUCCESS 0
 #define FAILED_ALLOCATE_MEMORY 1
@@ -87,48 +84,26 @@ int main() {
 // Return values are in readtoc.h
 // On success, value of *trackCount is set to the number of tracks on the CD. 
 int readTOC(TOC **dest) {
-	int fd = open(DEVICE_FILE, O_RDONLY);
-	if(fd == -1) {
-		printf("failed to open file /dev/sg0\n");
-		return FAILED_OPEN_DEVICE; 
-	}
-
-	// only a very simple command descriptor block is needed
-	uint8_t cdb[CDB_SIZE];
-	memset(cdb, 0, CDB_SIZE);
-	cdb[iOPCODE] = OPCODE;
-	cdb[iALLOC_LEN_LSBYTE] = (uint8_t)ALLOC_LEN;
-	cdb[iALLOC_LEN_MSBYTE] = (uint8_t)(ALLOC_LEN >> ONE_BYTE);
-	
-	// Documentation for sg_io_hdr_t type (at least the best docs I could find):
-	// https://sg.danny.cz/sg/p/scsi-generic_v3.txt
-	sg_io_hdr_t hdr;
-	memset(&hdr, 0, sizeof(sg_io_hdr_t));
-	
 	unsigned char dxferp[ALLOC_LEN];
 	memset(dxferp, 0, ALLOC_LEN);
 
-	unsigned char senseBuf[MAX_SENSE_BUF_LEN];
-	memset(senseBuf, 0, MAX_SENSE_BUF_LEN);
-
-	hdr.interface_id = SCSI_GENERIC_INTERFACE_ID;
-	hdr.dxfer_direction = SG_DXFER_FROM_DEV;
-	hdr.dxferp = dxferp;
-	hdr.dxfer_len = ALLOC_LEN;
-	hdr.cmd_len = CDB_SIZE;
-	hdr.mx_sb_len = MAX_SENSE_BUF_LEN;
-	hdr.cmdp = cdb;
-	hdr.sbp = senseBuf;
-	hdr.timeout = 5000;
-
-	if(ioctl(fd, SG_IO, &hdr) == -1) {
-		close(fd);
-		return IOCTL_FAIL;
-	}
-	close(fd);
-
-	if(hdr.sb_len_wr != 0) {
-		return BAD_SENSE_DATA; 
+	// only a very simple command descriptor block is needed
+	DriveCommand command;
+	initDriveCommand(&command, DRIVE_DATA_IN, dxferp, ALLOC_LEN);
+	command.cdb[iOPCODE] = OPCODE;
+	command.cdb[iALLOC_LEN_LSBYTE] = (uint8_t)ALLOC_LEN;
+	command.cdb[iALLOC_LEN_MSBYTE] = (uint8_t)(ALLOC_LEN >> ONE_BYTE);
+	command.cdbLen = CDB_SIZE;
+
+	switch(sendDriveCommand(&command)) {
+		case DRIVE_SUCCESS:
+			break;
+		case DRIVE_FAILED_OPEN:
+			return FAILED_OPEN_DEVICE;
+		case DRIVE_CHECK_CONDITION:
+			return BAD_SENSE_DATA;
+		default:
+			return IOCTL_FAIL;
 	}
 
 	unsigned int tocDataSize = getDataSize(dxferp);
@@ -243,6 +218,105 @@ uint32_t getStartLBA(TrackDescriptor *track) {
 uint8_t getTrackNumber(TrackDescriptor *track) {
 	return track->trackNum;
 }
+bool isAudioTrack(TrackDescriptor *track) {
+	return !(track->control & CONTROL_DATA_TRACK);
+}
+// freedb style disc ID: a checksum of the track start times in seconds, the disc length in seconds and the track count.
+// Two discs can share an ID, so anything keyed on it should also compare serializeTOC() output.
+// 	https://en.wikipedia.org/wiki/CDDB#Example_calculation_of_a_CDDB1_(FreeDB)_disc_ID
+uint32_t getDiscId(TOC *toc) {
+	uint32_t digitSum = 0;
+	uint8_t first = getFirstTrackNumber(toc);
+	for(uint8_t i=0; i<getTrackCount(toc); i++) {
+		uint32_t seconds = (getStartLBA(getTrack(toc, first+i)) + LBA_PREGAP_FRAMES) / FRAMES_PER_SECOND;
+		for(; seconds > 0; seconds /= 10)
+			digitSum += seconds % 10;
+	}
+	uint32_t firstSeconds = (getStartLBA(getTrack(toc, first)) + LBA_PREGAP_FRAMES) / FRAMES_PER_SECOND;
+	uint32_t leadoutSeconds = (getLeadoutLBA(toc) + LBA_PREGAP_FRAMES) / FRAMES_PER_SECOND;
+	return ((digitSum % 0xff) << 24) | ((leadoutSeconds - firstSeconds) << 8) | getTrackCount(toc);
+}
+
+// Writes a compact copy of every track descriptor into dest (track number, adr/control, big endian start LBA)
+// and returns how many bytes that took, at most TOC_SERIALIZED_MAX.
+unsigned int serializeTOC(TOC *toc, uint8_t *dest) {
+	unsigned int count = toc->trackDescriptorsSize/TRACK_DESCRIPTOR_SIZE;
+	uint8_t *out = dest;
+	for(unsigned int i=0; i<count; i++) {
+		TrackDescriptor *track = &toc->trackDescriptors[i];
+		*out++ = track->trackNum;
+		*out++ = (track->adr << 4) | track->control;
+		*out++ = track->startAddr >> (ONE_BYTE*3);
+		*out++ = track->startAddr >> (ONE_BYTE*2);
+		*out++ = track->startAddr >> ONE_BYTE;
+		*out++ = track->startAddr;
+	}
+	return out - dest;
+}
+
+// A track ends where the next one starts, the last one ends at the leadout.
+uint32_t getTrackEndLBA(TOC *toc, uint8_t trackNum) {
+	uint8_t last = getFirstTrackNumber(toc) + getTrackCount(toc) - 1;
+	if(trackNum >= last)
+		return getLeadoutLBA(toc);
+	return getStartLBA(getTrack(toc, trackNum+1));
+}
+
+// Parses an offset into a track written as mm:ss.ff, where ff is CD frames (1/75 of a second).
+// The minutes and frames can be left off, "90", "1:30" and "1:30.00" are all the same offset.
+// *dest is set to the offset in frames, returns false and leaves it alone if str is not an offset.
+bool parseTrackOffset(const char *str, uint32_t *dest) {
+	unsigned long minutes = 0, seconds, frames = 0;
+	char *endp;
+	if(*str < '0' || *str > '9')
+		return false;
+	seconds = strtoul(str, &endp, 10);
+	if(*endp == ':') {
+		minutes = seconds;
+		str = endp+1;
+		if(*str < '0' || *str > '9')
+			return false;
+		seconds = strtoul(str, &endp, 10);
+		if(seconds >= 60)
+			return false;
+	}
+	if(*endp == '.') {
+		str = endp+1;
+		if(*str < '0' || *str > '9')
+			return false;
+		frames = strtoul(str, &endp, 10);
+		if(frames >= FRAMES_PER_SECOND)
+			return false;
+	}
+	// nothing on a CD is longer than 99 minutes, this also keeps the sum from overflowing
+	if(*endp != '\0' || minutes > 99 || seconds > 99*60)
+		return false;
+	*dest = (minutes*60 + seconds)*FRAMES_PER_SECOND + frames;
+	return true;
+}
+
+// The LBA offsetFrames into the track, clamped to the track's last block so a seek past the end plays the last moment of it.
+uint32_t getTrackOffsetLBA(TOC *toc, uint8_t trackNum, uint32_t offsetFrames) {
+	uint32_t start = getStartLBA(getTrack(toc, trackNum));
+	uint32_t end = getTrackEndLBA(toc, trackNum);
+	if(end <= start)
+		return start;
+	return offsetFrames < end - start ? start + offsetFrames : end - 1;
+}
+
+// The number of the track lba falls in, or 0 if it is before the first track or past the leadout.
+uint8_t getTrackAtLBA(TOC *toc, uint32_t lba) {
+	uint8_t first = getFirstTrackNumber(toc);
+	if(lba >= getLeadoutLBA(toc))
+		return 0;
+	for(int trackNum = first + getTrackCount(toc) - 1; trackNum >= first; trackNum--) {
+		TrackDescriptor *track = getTrack(toc, trackNum);
+		if(track && getStartLBA(track) <= lba)
+			return trackNum;
+	}
+	return 0;
+}
+
 // If the leadout marker does not exist or the toc has 0 tracks in it, this will just return 0. 
 // A nonexistent leadout marker means a malformed disc or bad readTOC() method, and having 0 tracks means there is no music anyway.
 uint32_t getLeadoutLBA(TOC *toc) {
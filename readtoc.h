@@ -3,6 +3,9 @@
 #define READ_TOC_H
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#define TOC_SERIALIZED_MAX (100 * 6) // 99 tracks and the leadout, see serializeTOC()
 
 typedef struct TOC TOC;
 typedef struct TrackDescriptor TrackDescriptor;
@@ -17,5 +20,12 @@ uint8_t getFirstTrackNumber(TOC *toc);
 uint8_t getTrackCount(TOC *toc);
 uint32_t getStartLBA(TrackDescriptor *track);
 uint8_t getTrackNumber(TrackDescriptor *track);
+bool isAudioTrack(TrackDescriptor *track);
 uint32_t getLeadoutLBA(TOC *toc);
+uint32_t getTrackEndLBA(TOC *toc, uint8_t trackNum);
+bool parseTrackOffset(const char *str, uint32_t *dest);
+uint32_t getTrackOffsetLBA(TOC *toc, uint8_t trackNum, uint32_t offsetFrames);
+uint8_t getTrackAtLBA(TOC *toc, uint32_t lba);
+uint32_t getDiscId(TOC *toc);
+unsigned int serializeTOC(TOC *toc, uint8_t *dest);
 #endif
@@ -0,0 +1,250 @@
+// Lock free single producer/single consumer ring used to hand CD audio from the drive reader to the PCM writer.
+//
+// head is only written by the producer and tail is only written by the consumer.
+// Both only ever increase, so head - tail is always the number of filled slots, even after they wrap around.
+// The release store on one index paired with the acquire load on the other is what makes the slot contents visible to the other thread.
+// 	https://en.cppreference.com/w/c/atomic/memory_order
+//
+// A consumer that would rather sleep in poll() than in waitForRing() can wait on getRingReadyFd(), an eventfd the producer
+// bumps with every published slot. That is one write() per slot, a few a second, and never blocks the producer.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <time.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/eventfd.h>
+
+#include "ringbuf.h"
+
+#define CACHE_LINE 64
+#define RING_POLL_NSEC 5000000 // how long either side sleeps when the ring is full/empty, 5ms is well under one slot of audio
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 1
+#define BAD_RING_SIZE 2
+#define FAILED_MAKE_EVENTFD 3
+
+struct RingBuf {
+	// keep the two indexes on separate cache lines so the threads don't fight over one line
+	_Alignas(CACHE_LINE) atomic_ulong head;
+	_Alignas(CACHE_LINE) atomic_ulong tail;
+
+	_Alignas(CACHE_LINE) RingSlot *slots;
+	uint8_t *pool; // one page aligned allocation backing every slot's data
+	unsigned int slotCount;
+	long slotSize;
+	unsigned int lowWatermark;
+	unsigned int highWatermark;
+	int readyFd; // eventfd, readable once a slot has been published since the last clearRingReady()
+
+	// producer side counters
+	atomic_ulong fullWaits;
+	atomic_uint maxFill;
+	// consumer side counters
+	atomic_ulong emptyWaits;
+	atomic_ulong lowWatermarkHits;
+	atomic_uint minFill;
+	bool belowLow; // only touched by the consumer
+};
+
+static void reportEventFdError(const char *op);
+
+static atomic_bool eventFdErrorReported;
+
+// slotSize is in bytes. Watermarks are in slots and are clamped to slotCount.
+// On failure *dest is unmodified.
+int makeRingBuf(RingBuf **dest, unsigned int slotCount, long slotSize, unsigned int lowWatermark, unsigned int highWatermark) {
+	if(slotCount == 0 || slotSize <= 0)
+		return BAD_RING_SIZE;
+	if(highWatermark > slotCount)
+		highWatermark = slotCount;
+	if(lowWatermark > highWatermark)
+		lowWatermark = highWatermark;
+
+	RingBuf *ring;
+	if(posix_memalign((void **)&ring, CACHE_LINE, sizeof(RingBuf)))
+		return FAILED_ALLOCATE_MEMORY;
+	memset(ring, 0, sizeof(RingBuf));
+
+	// slot data is page aligned so it can be handed straight to the sg driver later on
+	long pageSize = sysconf(_SC_PAGESIZE);
+	long stride = ((slotSize + pageSize - 1) / pageSize) * pageSize;
+	ring->slots = calloc(slotCount, sizeof(RingSlot));
+	if(!ring->slots || posix_memalign((void **)&ring->pool, pageSize, stride * slotCount)) {
+		free(ring->slots);
+		free(ring);
+		return FAILED_ALLOCATE_MEMORY;
+	}
+	for(unsigned int i=0; i<slotCount; i++)
+		ring->slots[i].data = ring->pool + (i * stride);
+	ring->readyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if(ring->readyFd == -1) {
+		free(ring->pool);
+		free(ring->slots);
+		free(ring);
+		return FAILED_MAKE_EVENTFD;
+	}
+
+	ring->slotCount = slotCount;
+	ring->slotSize = slotSize;
+	ring->lowWatermark = lowWatermark;
+	ring->highWatermark = highWatermark;
+	atomic_init(&ring->head, 0);
+	atomic_init(&ring->tail, 0);
+	atomic_init(&ring->minFill, slotCount);
+	atomic_init(&ring->maxFill, 0);
+
+	*dest = ring;
+	return SUCCESS;
+}
+
+void destroyRingBuf(RingBuf *ring) {
+	close(ring->readyFd);
+	free(ring->pool);
+	free(ring->slots);
+	free(ring);
+}
+
+// Producer only. Returns the next slot to fill, or NULL if the ring is full.
+// The slot is not visible to the consumer until publishSlot() is called.
+RingSlot *getWritableSlot(RingBuf *ring) {
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	if(head - tail >= ring->slotCount) {
+		atomic_fetch_add_explicit(&ring->fullWaits, 1, memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->slots[head % ring->slotCount];
+}
+
+// Producer only. Hands the slot last returned by getWritableSlot() to the consumer.
+void publishSlot(RingBuf *ring) {
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed) + 1;
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+
+	unsigned int fill = head - atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	if(fill > atomic_load_explicit(&ring->maxFill, memory_order_relaxed))
+		atomic_store_explicit(&ring->maxFill, fill, memory_order_relaxed);
+
+	signalEventFd(ring->readyFd);
+}
+
+// Consumer only. Returns the oldest filled slot, or NULL if the ring is empty.
+RingSlot *getReadableSlot(RingBuf *ring) {
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	if(head == tail) {
+		atomic_fetch_add_explicit(&ring->emptyWaits, 1, memory_order_relaxed);
+		return NULL;
+	}
+	return &ring->slots[tail % ring->slotCount];
+}
+
+// Consumer only. Gives the slot last returned by getReadableSlot() back to the producer.
+void releaseSlot(RingBuf *ring) {
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed) + 1;
+	atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+	unsigned int fill = atomic_load_explicit(&ring->head, memory_order_relaxed) - tail;
+	if(fill < atomic_load_explicit(&ring->minFill, memory_order_relaxed))
+		atomic_store_explicit(&ring->minFill, fill, memory_order_relaxed);
+
+	// only count the crossing, not every slot played while under the watermark
+	if(fill < ring->lowWatermark && !ring->belowLow) {
+		atomic_fetch_add_explicit(&ring->lowWatermarkHits, 1, memory_order_relaxed);
+		ring->belowLow = true;
+	}
+	else if(fill >= ring->lowWatermark)
+		ring->belowLow = false;
+}
+
+// Consumer only, and only while no producer is running. Releases every filled slot at once.
+// Used to throw away audio read ahead of a seek, the dropped slots still show up in slotsConsumed.
+void drainRing(RingBuf *ring) {
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	atomic_store_explicit(&ring->tail, head, memory_order_release);
+}
+
+// Safe to call from any thread, the value may be stale by the time it is used.
+unsigned int getRingFill(RingBuf *ring) {
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+	return head - tail;
+}
+
+unsigned int getRingSlotCount(RingBuf *ring) {
+	return ring->slotCount;
+}
+
+long getRingSlotSize(RingBuf *ring) {
+	return ring->slotSize;
+}
+
+unsigned int getRingLowWatermark(RingBuf *ring) {
+	return ring->lowWatermark;
+}
+
+unsigned int getRingHighWatermark(RingBuf *ring) {
+	return ring->highWatermark;
+}
+
+// Polls readable (POLLIN) once a slot has been published, until the consumer calls clearRingReady().
+// Clear it after waking and before looking at the ring again, then a slot published in between still wakes the next poll().
+int getRingReadyFd(RingBuf *ring) {
+	return ring->readyFd;
+}
+
+// Consumer only.
+void clearRingReady(RingBuf *ring) {
+	clearEventFd(ring->readyFd);
+}
+
+// Wakes whoever polls fd, a non blocking eventfd. playaudio.c wakes its playback thread with these too.
+// Neither can fail on a good eventfd except with EAGAIN, which is harmless: the count is already at its maximum, or already clear.
+// Anything else only leaves the waiter to its poll() timeout, so it is reported, once, and not otherwise handled.
+void signalEventFd(int fd) {
+	uint64_t one = 1;
+	if(write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+		reportEventFdError("write");
+}
+
+void clearEventFd(int fd) {
+	uint64_t count;
+	if(read(fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+		reportEventFdError("read");
+}
+
+// Safe to call from any thread while the ring is in use.
+void getRingStats(RingBuf *ring, RingStats *dest) {
+	unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+	unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	dest->slotCount = ring->slotCount;
+	dest->fill = head - tail;
+	dest->minFill = atomic_load_explicit(&ring->minFill, memory_order_relaxed);
+	dest->maxFill = atomic_load_explicit(&ring->maxFill, memory_order_relaxed);
+	dest->lowWatermark = ring->lowWatermark;
+	dest->highWatermark = ring->highWatermark;
+	dest->slotsProduced = head;
+	dest->slotsConsumed = tail;
+	dest->lowWatermarkHits = atomic_load_explicit(&ring->lowWatermarkHits, memory_order_relaxed);
+	dest->emptyWaits = atomic_load_explicit(&ring->emptyWaits, memory_order_relaxed);
+	dest->fullWaits = atomic_load_explicit(&ring->fullWaits, memory_order_relaxed);
+}
+
+// Sleeps the calling side briefly when the ring has nothing for it, neither side ever blocks on the other.
+void waitForRing(void) {
+	struct timespec wait = { .tv_sec = 0, .tv_nsec = RING_POLL_NSEC };
+	nanosleep(&wait, NULL);
+}
+
+static void reportEventFdError(const char *op) {
+	int err = errno;
+	if(!atomic_exchange(&eventFdErrorReported, true))
+		fprintf(stderr, "eventfd %s failed: %s\n", op, strerror(err));
+}
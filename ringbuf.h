@@ -0,0 +1,61 @@
+
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdint.h>
+
+// Single producer/single consumer ring of CD audio slots.
+// The producer (the drive reader) and the consumer (the PCM writer) never take a lock,
+// each side only ever writes its own index.
+
+#define RING_SLOT_LAST 1 // this slot holds the final audio before the leadout
+#define RING_SLOT_ERROR 2 // the reader failed, this slot holds no audio and playback should stop
+
+typedef struct RingBuf RingBuf;
+typedef struct RingSlot RingSlot;
+typedef struct RingStats RingStats;
+
+struct RingSlot {
+	uint8_t *data;
+	long size; // number of valid bytes in data, at most the ring's slot size
+	uint32_t startLBA;
+	int flags;
+	int status; // status of the read that filled this slot
+};
+
+struct RingStats {
+	unsigned int slotCount;
+	unsigned int fill; // slots currently waiting to be played
+	unsigned int minFill; // lowest fill seen by the consumer since playback started
+	unsigned int maxFill; // highest fill seen by the producer
+	unsigned int lowWatermark;
+	unsigned int highWatermark;
+	unsigned long slotsProduced;
+	unsigned long slotsConsumed;
+	unsigned long lowWatermarkHits; // times the fill dropped below lowWatermark
+	unsigned long emptyWaits; // times the consumer found nothing to play
+	unsigned long fullWaits; // times the producer had nowhere to read into
+};
+
+int makeRingBuf(RingBuf **dest, unsigned int slotCount, long slotSize, unsigned int lowWatermark, unsigned int highWatermark);
+void destroyRingBuf(RingBuf *ring);
+
+RingSlot *getWritableSlot(RingBuf *ring);
+void publishSlot(RingBuf *ring);
+RingSlot *getReadableSlot(RingBuf *ring);
+void releaseSlot(RingBuf *ring);
+void drainRing(RingBuf *ring);
+
+unsigned int getRingFill(RingBuf *ring);
+unsigned int getRingSlotCount(RingBuf *ring);
+long getRingSlotSize(RingBuf *ring);
+unsigned int getRingLowWatermark(RingBuf *ring);
+unsigned int getRingHighWatermark(RingBuf *ring);
+int getRingReadyFd(RingBuf *ring);
+void clearRingReady(RingBuf *ring);
+void signalEventFd(int fd);
+void clearEventFd(int fd);
+void getRingStats(RingBuf *ring, RingStats *dest);
+void waitForRing(void);
+
+#endif
@@ -0,0 +1,190 @@
+// Copies every audio track on the disc to its own WAV file as fast as the drive can read.
+// There is no PCM involved, so nothing paces the reads except the drive and the disk being written to.
+//
+// A CDReader keeps a ring of large page aligned slots full while this thread writes them out,
+// so the drive is never waiting on the filesystem and a track is never held in memory all at once.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdbool.h>
+
+#include "rip.h"
+#include "readcd.h"
+#include "ringbuf.h"
+#include "cdreader.h"
+#include "wav.h"
+#include "cdspeed.h"
+#include "secureread.h"
+#include "checksum.h"
+#include "stats.h"
+
+#define RIP_BLOCKS_PER_SLOT (CD_AUDIO_BLOCKS_ONE_SEC * 4) // ~700KB per write()
+#define RIP_RING_SLOTS 4
+#define MAX_FILE_NAME 256
+#define MAX_PATH 1024
+#define BYTES_PER_MB (1024.0 * 1024.0)
+
+#define SUCCESS 0
+#define FAILED_MAKE_RING 1
+#define FAILED_START_READER 2
+#define FAILED_OPEN_FILE 3
+#define FAILED_WRITE_FILE 4
+#define FAILED_READ_AUDIO 5
+
+typedef struct Progress Progress;
+
+struct Progress {
+	double startSec;
+	long bytesDone;
+	long bytesTotal;
+};
+
+int ripTrack(TOC *toc, CDText *text, uint8_t trackNum, const char *dir, RingBuf *ring, Progress *progress);
+void makeTrackFileName(char *dest, CDText *text, uint8_t trackNum);
+void printProgress(uint8_t trackNum, Progress *progress);
+void printTrackChecksum(DiscChecksums *sums, uint8_t trackNum);
+
+// Writes "NN - <track name>.wav" into dir for every audio track, data tracks are skipped.
+// Returns the status of the first track that failed, later tracks are not attempted.
+// The drive is asked to run at full speed, closeOpticalDrive() puts its old speed back.
+// Each track's CRC32 and AccurateRip checksums are printed as soon as it is written.
+int ripDisc(TOC *toc, CDText *text, const char *dir) {
+	applySpeedPolicy(SPEED_POLICY_BULK);
+	RingBuf *ring;
+	if(makeRingBuf(&ring, RIP_RING_SLOTS, RIP_BLOCKS_PER_SLOT*CD_AUDIO_BLOCK_SIZE, 0, RIP_RING_SLOTS))
+		return FAILED_MAKE_RING;
+
+	uint8_t first = getFirstTrackNumber(toc);
+	uint8_t last = first + getTrackCount(toc) - 1;
+
+	Progress progress;
+	memset(&progress, 0, sizeof(Progress));
+	for(uint8_t trackNum = first; trackNum <= last; trackNum++) {
+		TrackDescriptor *track = getTrack(toc, trackNum);
+		if(isAudioTrack(track))
+			progress.bytesTotal += (long)(getTrackEndLBA(toc, trackNum) - getStartLBA(track)) * CD_AUDIO_BLOCK_SIZE;
+	}
+	progress.startSec = monotonicSec();
+
+	// checksums are nice to have, a rip without them is still a rip
+	DiscChecksums *sums = NULL;
+	if(makeDiscChecksums(&sums, toc) == SUCCESS)
+		setActiveChecksums(sums);
+
+	int status = SUCCESS;
+	for(uint8_t trackNum = first; trackNum <= last && status == SUCCESS; trackNum++) {
+		if(!isAudioTrack(getTrack(toc, trackNum)))
+			continue;
+		status = ripTrack(toc, text, trackNum, dir, ring, &progress);
+		if(status == SUCCESS && sums)
+			printTrackChecksum(sums, trackNum);
+	}
+	putchar('\n');
+
+	if(sums) {
+		setActiveChecksums(NULL);
+		destroyDiscChecksums(sums);
+	}
+	destroyRingBuf(ring);
+	return status;
+}
+
+int ripTrack(TOC *toc, CDText *text, uint8_t trackNum, const char *dir, RingBuf *ring, Progress *progress) {
+	uint32_t startLBA = getStartLBA(getTrack(toc, trackNum));
+	uint32_t endLBA = getTrackEndLBA(toc, trackNum);
+	if(endLBA <= startLBA)
+		return SUCCESS;
+
+	char fileName[MAX_FILE_NAME];
+	char path[MAX_PATH];
+	makeTrackFileName(fileName, text, trackNum);
+	snprintf(path, MAX_PATH, "%s/%s", dir, fileName);
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd == -1) {
+		printf("failed to open %s\n", path);
+		return FAILED_OPEN_FILE;
+	}
+	if(writeWavHeader(fd, (endLBA - startLBA) * CD_AUDIO_BLOCK_SIZE)) {
+		close(fd);
+		return FAILED_WRITE_FILE;
+	}
+
+	CDReader *reader;
+	if(startCDReader(&reader, ring, startLBA, endLBA, RIP_BLOCKS_PER_SLOT)) {
+		close(fd);
+		return FAILED_START_READER;
+	}
+
+	int status = SUCCESS;
+	long unverifiedBytes = 0;
+	bool lastSlotWritten = false;
+	while(!lastSlotWritten) {
+		RingSlot *slot = getReadableSlot(ring);
+		if(!slot) {
+			waitForRing();
+			continue;
+		}
+		if(slot->flags & RING_SLOT_ERROR) {
+			printf("\nreadaudio failed: %d\n", slot->status);
+			status = FAILED_READ_AUDIO;
+			break;
+		}
+		lastSlotWritten = slot->flags & RING_SLOT_LAST;
+		if(slot->status == SECURE_READ_UNVERIFIED)
+			unverifiedBytes += slot->size;
+		if(writeAll(fd, slot->data, slot->size)) {
+			status = FAILED_WRITE_FILE;
+			break;
+		}
+		progress->bytesDone += slot->size;
+		releaseSlot(ring);
+		printProgress(trackNum, progress);
+	}
+	stopCDReader(reader);
+	// anything the reader left behind after a failure belongs to this track, don't let the next one play it
+	while(getReadableSlot(ring))
+		releaseSlot(ring);
+
+	if(close(fd) == -1 && status == SUCCESS)
+		status = FAILED_WRITE_FILE;
+	if(unverifiedBytes)
+		printf("\ntrack %02d: %.1f seconds could not be verified\n", trackNum, (double)unverifiedBytes / (CD_AUDIO_BLOCK_SIZE * CD_AUDIO_BLOCKS_ONE_SEC));
+	return status;
+}
+
+// Uses the CD-Text track title when there is one. '/' can't be in a file name so it is replaced.
+void makeTrackFileName(char *dest, CDText *text, uint8_t trackNum) {
+	char *trackName = text ? getTrackName(text, trackNum) : NULL;
+	if(trackName && *trackName)
+		snprintf(dest, MAX_FILE_NAME, "%02d - %s.wav", trackNum, trackName);
+	else
+		snprintf(dest, MAX_FILE_NAME, "%02d - Track %02d.wav", trackNum, trackNum);
+	for(char *c = dest; *c; c++) {
+		if(*c == '/')
+			*c = '_';
+	}
+}
+
+// Speed is given as a multiple of real time (1x is 176400 bytes/s, the rate CD audio plays at) and as MB/s.
+void printProgress(uint8_t trackNum, Progress *progress) {
+	double elapsed = monotonicSec() - progress->startSec;
+	if(elapsed <= 0)
+		return;
+	double bytesPerSec = progress->bytesDone / elapsed;
+	double xSpeed = bytesPerSec / (CD_AUDIO_BLOCK_SIZE * CD_AUDIO_BLOCKS_ONE_SEC);
+	double percent = progress->bytesTotal ? 100.0 * progress->bytesDone / progress->bytesTotal : 100.0;
+	printf("\rtrack %02d  %5.1f%%  %5.1fx  %6.2f MB/s", trackNum, percent, xSpeed, bytesPerSec / BYTES_PER_MB);
+	fflush(stdout);
+}
+
+void printTrackChecksum(DiscChecksums *sums, uint8_t trackNum) {
+	TrackChecksum sum;
+	if(!getTrackChecksum(sums, trackNum, &sum))
+		return;
+	printf("\ntrack %02d  CRC32 %08X  AccurateRip v1 %08X  v2 %08X\n", trackNum, sum.crc32, sum.accurateRipV1, sum.accurateRipV2);
+}
@@ -0,0 +1,10 @@
+
+#ifndef RIP_H
+#define RIP_H
+
+#include "readtoc.h"
+#include "readtext.h"
+
+int ripDisc(TOC *toc, CDText *text, const char *dir);
+
+#endif
@@ -0,0 +1,206 @@
+// Comparison kernels for checking one read of the disc against another.
+// secureread.c compares every window it reads at least twice, so these have to run a lot faster than the drive.
+//
+// Each kernel has an AVX2, SSE2 and plain C version. The widest one the CPU supports is picked the first time one is used,
+// setSampleCmpKernel() can force another, which is how the scalar versions get exercised on x86.
+// 	https://www.intel.com/content/www/us/en/docs/intrinsics-guide/index.html
+// 	https://gcc.gnu.org/onlinedocs/gcc/x86-Built-in-Functions.html (__builtin_cpu_supports)
+
+#include <string.h>
+#include <stdbool.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+#include "samplecmp.h"
+
+#define SUCCESS 0
+#define KERNEL_UNSUPPORTED 1
+
+typedef size_t (*MatchFunc)(const uint8_t *a, const uint8_t *b, size_t len);
+typedef long (*FindFrameFunc)(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame);
+
+static size_t countMatchingBytesScalar(const uint8_t *a, const uint8_t *b, size_t len);
+static long findFrameScalar(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame);
+#ifdef HAVE_X86_KERNELS
+static size_t countMatchingBytesSSE2(const uint8_t *a, const uint8_t *b, size_t len);
+static long findFrameSSE2(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame);
+static size_t countMatchingBytesAVX2(const uint8_t *a, const uint8_t *b, size_t len);
+static long findFrameAVX2(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame);
+#endif
+static void pickKernel(void);
+
+static int kernel = SAMPLE_CMP_BEST; // SAMPLE_CMP_BEST until the first kernel is used
+static MatchFunc matchFunc;
+static FindFrameFunc findFrameFunc;
+
+// Returns how many bytes at the start of a and b are equal, len if all of them are.
+size_t countMatchingBytes(const uint8_t *a, const uint8_t *b, size_t len) {
+	if(kernel == SAMPLE_CMP_BEST)
+		pickKernel();
+	return matchFunc(a, b, len);
+}
+
+// Looks for run in haystack at every whole frame offset and returns the byte offset of the match closest to expected, or -1 if there is none.
+// Audio is only ever shifted by whole frames, so offsets that split a frame are never tried.
+// Digital silence matches everywhere, picking the closest match keeps it from dragging the alignment to the edge of the search.
+long findNearestSampleRun(const uint8_t *haystack, size_t haystackLen, const uint8_t *run, size_t runLen, size_t expected) {
+	if(kernel == SAMPLE_CMP_BEST)
+		pickKernel();
+	if(runLen < CD_AUDIO_FRAME_SIZE || runLen > haystackLen)
+		return -1;
+
+	uint32_t first;
+	memcpy(&first, run, CD_AUDIO_FRAME_SIZE);
+	size_t lastFrame = (haystackLen - runLen) / CD_AUDIO_FRAME_SIZE;
+	long best = -1;
+	size_t bestDistance = 0;
+	long frame = 0;
+	// the first frame is matched across a whole vector at a time, only candidates are checked in full
+	while((frame = findFrameFunc(haystack, frame, lastFrame+1, first)) != -1) {
+		size_t offset = frame * CD_AUDIO_FRAME_SIZE;
+		size_t distance = offset > expected ? offset - expected : expected - offset;
+		if(best != -1 && offset > expected && distance >= bestDistance)
+			break; // everything after this is further away
+		if(matchFunc(haystack+offset, run, runLen) == runLen && (best == -1 || distance < bestDistance)) {
+			best = offset;
+			bestDistance = distance;
+		}
+		frame++;
+	}
+	return best;
+}
+
+// Forces one of the SAMPLE_CMP_* kernels. Fails if the CPU can't run it, the current kernel is left as it was.
+int setSampleCmpKernel(int newKernel) {
+	if(newKernel == SAMPLE_CMP_BEST) {
+		pickKernel();
+		return SUCCESS;
+	}
+	if(newKernel == SAMPLE_CMP_SCALAR) {
+		matchFunc = countMatchingBytesScalar;
+		findFrameFunc = findFrameScalar;
+	}
+#ifdef HAVE_X86_KERNELS
+	else if(newKernel == SAMPLE_CMP_SSE2 && __builtin_cpu_supports("sse2")) {
+		matchFunc = countMatchingBytesSSE2;
+		findFrameFunc = findFrameSSE2;
+	}
+	else if(newKernel == SAMPLE_CMP_AVX2 && __builtin_cpu_supports("avx2")) {
+		matchFunc = countMatchingBytesAVX2;
+		findFrameFunc = findFrameAVX2;
+	}
+#endif
+	else
+		return KERNEL_UNSUPPORTED;
+	kernel = newKernel;
+	return SUCCESS;
+}
+
+// Returns the kernel in use, one of the SAMPLE_CMP_* values other than SAMPLE_CMP_BEST.
+int getSampleCmpKernel(void) {
+	if(kernel == SAMPLE_CMP_BEST)
+		pickKernel();
+	return kernel;
+}
+
+const char *getSampleCmpKernelName(int k) {
+	switch(k) {
+		case SAMPLE_CMP_SCALAR: return "scalar";
+		case SAMPLE_CMP_SSE2: return "sse2";
+		case SAMPLE_CMP_AVX2: return "avx2";
+		default: return "best";
+	}
+}
+
+static void pickKernel(void) {
+	if(setSampleCmpKernel(SAMPLE_CMP_AVX2) && setSampleCmpKernel(SAMPLE_CMP_SSE2))
+		setSampleCmpKernel(SAMPLE_CMP_SCALAR);
+}
+
+// word at a time, then bytes for the tail and to find exactly where the first difference is
+static size_t countMatchingBytesScalar(const uint8_t *a, const uint8_t *b, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+		uint64_t wordA, wordB;
+		memcpy(&wordA, a+i, sizeof(uint64_t));
+		memcpy(&wordB, b+i, sizeof(uint64_t));
+		if(wordA != wordB)
+			break;
+	}
+	for(; i < len && a[i] == b[i]; i++);
+	return i;
+}
+
+// Returns the first frame index in [fromFrame, toFrame) equal to frame, or -1.
+static long findFrameScalar(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame) {
+	for(size_t i = fromFrame; i < toFrame; i++) {
+		uint32_t candidate;
+		memcpy(&candidate, haystack + i*CD_AUDIO_FRAME_SIZE, CD_AUDIO_FRAME_SIZE);
+		if(candidate == frame)
+			return i;
+	}
+	return -1;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Compares 16 bytes at a time, the movemask of the byte compare has a 0 bit wherever the bytes differ.
+__attribute__((target("sse2")))
+static size_t countMatchingBytesSSE2(const uint8_t *a, const uint8_t *b, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(__m128i) <= len; i += sizeof(__m128i)) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a+i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b+i));
+		unsigned int equal = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+		if(equal != 0xffff)
+			return i + __builtin_ctz(~equal);
+	}
+	return i + countMatchingBytesScalar(a+i, b+i, len-i);
+}
+
+// Frames are 4 bytes, so one 32 bit compare checks 4 frame offsets at once.
+__attribute__((target("sse2")))
+static long findFrameSSE2(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame) {
+	const size_t framesPerVector = sizeof(__m128i) / CD_AUDIO_FRAME_SIZE;
+	__m128i needle = _mm_set1_epi32(frame);
+	size_t i = fromFrame;
+	for(; i + framesPerVector <= toFrame; i += framesPerVector) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(haystack + i*CD_AUDIO_FRAME_SIZE));
+		int hits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(v, needle)));
+		if(hits)
+			return i + __builtin_ctz(hits);
+	}
+	return findFrameScalar(haystack, i, toFrame, frame);
+}
+
+__attribute__((target("avx2")))
+static size_t countMatchingBytesAVX2(const uint8_t *a, const uint8_t *b, size_t len) {
+	size_t i = 0;
+	for(; i + sizeof(__m256i) <= len; i += sizeof(__m256i)) {
+		__m256i va = _mm256_loadu_si256((const __m256i *)(a+i));
+		__m256i vb = _mm256_loadu_si256((const __m256i *)(b+i));
+		unsigned int equal = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+		if(equal != 0xffffffff)
+			return i + __builtin_ctz(~equal);
+	}
+	return i + countMatchingBytesSSE2(a+i, b+i, len-i);
+}
+
+__attribute__((target("avx2")))
+static long findFrameAVX2(const uint8_t *haystack, size_t fromFrame, size_t toFrame, uint32_t frame) {
+	const size_t framesPerVector = sizeof(__m256i) / CD_AUDIO_FRAME_SIZE;
+	__m256i needle = _mm256_set1_epi32(frame);
+	size_t i = fromFrame;
+	for(; i + framesPerVector <= toFrame; i += framesPerVector) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(haystack + i*CD_AUDIO_FRAME_SIZE));
+		int hits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(v, needle)));
+		if(hits)
+			return i + __builtin_ctz(hits);
+	}
+	return findFrameSSE2(haystack, i, toFrame, frame);
+}
+
+#endif
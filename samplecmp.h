@@ -0,0 +1,22 @@
+
+#ifndef SAMPLECMP_H
+#define SAMPLECMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// kernels for setSampleCmpKernel(), SAMPLE_CMP_BEST picks the widest one the CPU supports
+#define SAMPLE_CMP_BEST 0
+#define SAMPLE_CMP_SCALAR 1
+#define SAMPLE_CMP_SSE2 2
+#define SAMPLE_CMP_AVX2 3
+
+#define CD_AUDIO_FRAME_SIZE 4 // one 16 bit stereo sample pair, the smallest unit audio can be shifted by
+
+size_t countMatchingBytes(const uint8_t *a, const uint8_t *b, size_t len);
+long findNearestSampleRun(const uint8_t *haystack, size_t haystackLen, const uint8_t *run, size_t runLen, size_t expected);
+int setSampleCmpKernel(int kernel);
+int getSampleCmpKernel(void);
+const char *getSampleCmpKernelName(int kernel);
+
+#endif
@@ -0,0 +1,206 @@
+// LRU cache of CD audio blocks below readCDAudioInto(), so replaying or jumping back doesn't have to wait on a seek and spin up.
+//
+// Everything is allocated once by setSectorCacheSize(): a page aligned pool of CD_AUDIO_BLOCK_SIZE slabs,
+// one small entry per slab and a hash table of LBA -> entry. Nothing is allocated or freed per read.
+// Entries are linked by index into a doubly linked recency list (most recent at head) and singly linked hash chains.
+// They are 16 bytes and cache line aligned as an array, so walking a hash chain touches as few lines as possible.
+//
+// Not thread safe, it lives under readcd.c which only one thread reads through at a time.
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sectorcache.h"
+#include "readcd.h"
+
+#define CACHE_LINE 64
+#define BYTES_PER_MB (1024L * 1024L)
+#define NO_ENTRY UINT32_MAX
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 1
+#define BAD_CACHE_SIZE 2
+
+typedef struct CacheEntry CacheEntry;
+
+struct CacheEntry {
+	uint32_t lba;
+	uint32_t prev; // towards the most recently used
+	uint32_t next; // towards the least recently used
+	uint32_t hashNext;
+};
+
+static void unlinkEntry(uint32_t i);
+static void pushFront(uint32_t i);
+static void unhashEntry(uint32_t i);
+static uint32_t findEntry(uint32_t lba);
+static uint32_t hashLBA(uint32_t lba);
+
+static uint8_t *pool = NULL;
+static CacheEntry *entries = NULL;
+static uint32_t *buckets = NULL;
+static uint32_t capacity = 0;
+static uint32_t bucketMask = 0;
+static uint32_t used = 0; // entries [0, used) have been handed out at least once
+static uint32_t head = NO_ENTRY; // most recently used
+static uint32_t tail = NO_ENTRY; // least recently used, evicted first
+static SectorCacheStats stats;
+
+// Sizes the cache, throwing away anything in it. 0 turns the cache off and frees it.
+// On failure the cache is left off.
+int setSectorCacheSize(long megabytes) {
+	if(megabytes < 0)
+		return BAD_CACHE_SIZE;
+	free(pool);
+	free(entries);
+	free(buckets);
+	pool = NULL;
+	entries = NULL;
+	buckets = NULL;
+	capacity = 0;
+	clearSectorCache();
+	if(megabytes == 0)
+		return SUCCESS;
+
+	uint32_t blocks = megabytes * BYTES_PER_MB / CD_AUDIO_BLOCK_SIZE;
+	uint32_t bucketCount = 1;
+	while(bucketCount < blocks)
+		bucketCount <<= 1;
+	if(posix_memalign((void **)&pool, sysconf(_SC_PAGESIZE), (size_t)blocks * CD_AUDIO_BLOCK_SIZE)
+			|| posix_memalign((void **)&entries, CACHE_LINE, (size_t)blocks * sizeof(CacheEntry))
+			|| !(buckets = malloc(bucketCount * sizeof(uint32_t)))) {
+		free(pool);
+		free(entries);
+		pool = NULL;
+		entries = NULL;
+		return FAILED_ALLOCATE_MEMORY;
+	}
+	capacity = blocks;
+	bucketMask = bucketCount - 1;
+	clearSectorCache();
+	return SUCCESS;
+}
+
+bool isSectorCacheEnabled(void) {
+	return capacity > 0;
+}
+
+// Returns the cached copy of the block at lba and marks it most recently used, or NULL if it isn't cached.
+// The pointer is only valid until the next cacheSectors().
+const uint8_t *lookupSector(uint32_t lba) {
+	if(!capacity)
+		return NULL;
+	uint32_t i = findEntry(lba);
+	if(i == NO_ENTRY)
+		return NULL;
+	stats.hits++;
+	if(head != i) {
+		unlinkEntry(i);
+		pushFront(i);
+	}
+	return pool + (size_t)i * CD_AUDIO_BLOCK_SIZE;
+}
+
+// Like lookupSector(), but doesn't count or change anything.
+bool containsSector(uint32_t lba) {
+	return capacity && findEntry(lba) != NO_ENTRY;
+}
+
+// Copies blocks starting at startLBA into the cache, evicting the least recently used blocks to make room.
+// Blocks already cached are refreshed with the new data.
+void cacheSectors(uint32_t startLBA, const uint8_t *data, uint32_t blocks) {
+	if(!capacity)
+		return;
+	for(uint32_t b=0; b<blocks; b++) {
+		uint32_t lba = startLBA + b;
+		uint32_t i = findEntry(lba);
+		bool isNew = i == NO_ENTRY;
+		if(!isNew)
+			unlinkEntry(i);
+		else if(used < capacity)
+			i = used++;
+		else {
+			i = tail;
+			unlinkEntry(i);
+			unhashEntry(i);
+			stats.evictions++;
+			stats.blocks--;
+		}
+		if(isNew) {
+			entries[i].lba = lba;
+			entries[i].hashNext = buckets[hashLBA(lba)];
+			buckets[hashLBA(lba)] = i;
+			stats.blocks++;
+		}
+		memcpy(pool + (size_t)i * CD_AUDIO_BLOCK_SIZE, data + (size_t)b * CD_AUDIO_BLOCK_SIZE, CD_AUDIO_BLOCK_SIZE);
+		pushFront(i);
+	}
+}
+
+// Counts blocks the caller had to read from the drive because they weren't cached.
+void countSectorMisses(uint32_t blocks) {
+	stats.misses += blocks;
+}
+
+// Forgets every cached block, for when the disc changes. The pool stays allocated.
+void clearSectorCache(void) {
+	used = 0;
+	head = NO_ENTRY;
+	tail = NO_ENTRY;
+	if(buckets)
+		memset(buckets, 0xff, (bucketMask+1) * sizeof(uint32_t)); // every bucket NO_ENTRY
+	stats.blocks = 0;
+	stats.capacity = capacity;
+}
+
+void getSectorCacheStats(SectorCacheStats *dest) {
+	*dest = stats;
+}
+
+void resetSectorCacheStats(void) {
+	stats.hits = 0;
+	stats.misses = 0;
+	stats.evictions = 0;
+}
+
+static void unlinkEntry(uint32_t i) {
+	CacheEntry *e = &entries[i];
+	if(e->prev != NO_ENTRY)
+		entries[e->prev].next = e->next;
+	else
+		head = e->next;
+	if(e->next != NO_ENTRY)
+		entries[e->next].prev = e->prev;
+	else
+		tail = e->prev;
+}
+
+static void pushFront(uint32_t i) {
+	entries[i].prev = NO_ENTRY;
+	entries[i].next = head;
+	if(head != NO_ENTRY)
+		entries[head].prev = i;
+	head = i;
+	if(tail == NO_ENTRY)
+		tail = i;
+}
+
+static void unhashEntry(uint32_t i) {
+	uint32_t *link = &buckets[hashLBA(entries[i].lba)];
+	while(*link != i)
+		link = &entries[*link].hashNext;
+	*link = entries[i].hashNext;
+}
+
+static uint32_t findEntry(uint32_t lba) {
+	uint32_t i = buckets[hashLBA(lba)];
+	while(i != NO_ENTRY && entries[i].lba != lba)
+		i = entries[i].hashNext;
+	return i;
+}
+
+// consecutive LBAs land in consecutive buckets, which is as spread out as it gets for sequential reads
+static uint32_t hashLBA(uint32_t lba) {
+	return lba & bucketMask;
+}
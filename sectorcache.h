@@ -0,0 +1,28 @@
+
+#ifndef SECTORCACHE_H
+#define SECTORCACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct SectorCacheStats SectorCacheStats;
+
+struct SectorCacheStats {
+	unsigned long hits; // blocks served from memory
+	unsigned long misses; // blocks that had to come from the drive
+	unsigned long evictions;
+	uint32_t blocks; // blocks currently cached
+	uint32_t capacity; // blocks the pool has room for
+};
+
+int setSectorCacheSize(long megabytes);
+bool isSectorCacheEnabled(void);
+const uint8_t *lookupSector(uint32_t lba);
+bool containsSector(uint32_t lba);
+void cacheSectors(uint32_t startLBA, const uint8_t *data, uint32_t blocks);
+void countSectorMisses(uint32_t blocks);
+void clearSectorCache(void);
+void getSectorCacheStats(SectorCacheStats *dest);
+void resetSectorCacheStats(void);
+
+#endif
@@ -0,0 +1,226 @@
+// Secure reads: every window of audio is read until two reads agree, instead of trusting the first READ CD result.
+//
+// Cheap drives don't always start a read exactly where they were asked to, the audio comes back shifted by some number of frames (jitter).
+// Two reads are only comparable once they are lined up, so each window is read with SECURE_MARGIN_BLOCKS extra on either side
+// and every read is aligned by searching it for a run of frames (the anchor) before the data is compared.
+// 	The anchor is the end of the previous verified window when reading continues on from it, so every read is lined up against audio that was already confirmed.
+// 	Otherwise the first read of the window is taken as the reference and the others are lined up against it.
+// Once aligned, each new read is compared against every earlier usable read of the window, the first pair that matches exactly is accepted.
+//
+// Drives with a read cache will happily hand back the same bytes twice, so before every re-read one block far away is read to push the window out of it.
+// Reads go straight to the drive past the sector cache for the same reason, only verified windows are put in it.
+// The alignment and comparison kernels are in samplecmp.c.
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "secureread.h"
+#include "readcd.h"
+#include "samplecmp.h"
+#include "sectorcache.h"
+
+#define BLOCK_SIZE CD_AUDIO_BLOCK_SIZE
+#define SECURE_MARGIN_BLOCKS 2 // read on each side of the window, also the most jitter that can be corrected
+#define MAX_JITTER_BYTES (SECURE_MARGIN_BLOCKS*BLOCK_SIZE)
+#define ANCHOR_SIZE 256 // 64 frames, long enough that a match is not a coincidence outside of silence
+#define DEFAULT_SECURE_READ_ATTEMPTS 5
+#define MAX_SECURE_READ_ATTEMPTS 16
+#define NOT_ALIGNED -1
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 2
+#define BAD_ATTEMPTS 14
+
+static int readWindowOnce(uint32_t padStartLBA, uint32_t leadoutLBA, uint32_t padBlocks, uint8_t *dest);
+static long alignRead(const uint8_t *read, long readSize, const uint8_t *anchor, long expected);
+static void flushDriveCache(uint32_t startLBA, uint32_t leadoutLBA);
+static void rememberTail(const uint8_t *window, long windowSize, uint32_t endLBA);
+static bool windowFits(long shift, long windowOffset, long windowSize, long readSize);
+
+static bool enabled = false;
+static int attempts = DEFAULT_SECURE_READ_ATTEMPTS;
+static uint8_t *reads[MAX_SECURE_READ_ATTEMPTS]; // grown as needed, reused across windows
+static long readCapacity[MAX_SECURE_READ_ATTEMPTS];
+static uint8_t tail[ANCHOR_SIZE]; // last bytes of the previous window
+static uint32_t tailEndLBA = 0; // LBA just after tail, 0 if there is no tail
+static SecureReadStats stats;
+
+// Same contract as readCDAudioInto(), but only returns SUCCESS or READ_CD_AUDIO_LEADOUT_REACHED once two reads of the window have agreed.
+// If they never do, dest is still filled from the last read that could be lined up and SECURE_READ_UNVERIFIED is returned so the caller can decide whether to use it.
+int secureReadCDAudioInto(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten) {
+	bool leadoutReached = false;
+	if(startLBA >= leadoutLBA)
+		return readCDAudioInto(startLBA, leadoutLBA, transferLen, dest, destSizeWritten);
+	if(startLBA+transferLen >= leadoutLBA) {
+		transferLen = leadoutLBA - startLBA;
+		leadoutReached = true;
+	}
+
+	uint32_t padStartLBA = startLBA > SECURE_MARGIN_BLOCKS ? startLBA - SECURE_MARGIN_BLOCKS : 0;
+	uint32_t padEndLBA = startLBA + transferLen + SECURE_MARGIN_BLOCKS;
+	if(padEndLBA > leadoutLBA)
+		padEndLBA = leadoutLBA;
+	uint32_t padBlocks = padEndLBA - padStartLBA;
+	long readSize = padBlocks*BLOCK_SIZE;
+	long windowOffset = (startLBA-padStartLBA)*BLOCK_SIZE; // where the window starts in a read with no jitter
+	long windowSize = transferLen*BLOCK_SIZE;
+
+	// line up against the previous verified window if this one carries on from it and the anchor fits in the margin
+	bool haveTail = tailEndLBA == startLBA && tailEndLBA != 0 && windowOffset >= ANCHOR_SIZE;
+	const uint8_t *anchor = haveTail ? tail : NULL;
+	long anchorExpected = haveTail ? windowOffset - ANCHOR_SIZE : windowOffset;
+
+	stats.windows++;
+	long shifts[MAX_SECURE_READ_ATTEMPTS]; // how far each read's window is from windowOffset, NOT_ALIGNED if it couldn't be lined up
+	int accepted = -1;
+	int last = -1;
+	for(int n=0; n<attempts && accepted == -1; n++) {
+		if(n > 0)
+			flushDriveCache(startLBA, leadoutLBA);
+		if(readSize > readCapacity[n]) {
+			uint8_t *resized = realloc(reads[n], readSize);
+			if(!resized)
+				return FAILED_ALLOCATE_MEMORY;
+			reads[n] = resized;
+			readCapacity[n] = readSize;
+		}
+		int status = readWindowOnce(padStartLBA, leadoutLBA, padBlocks, reads[n]);
+		if(status)
+			return status;
+		stats.reads++;
+		last = n;
+
+		if(!anchor) {
+			// nothing verified to line up against, the first read is the reference
+			anchor = reads[0] + windowOffset;
+			anchorExpected = windowOffset;
+		}
+		shifts[n] = anchor == reads[0] + windowOffset && n == 0 ? 0 : alignRead(reads[n], readSize, anchor, anchorExpected);
+		if(!windowFits(shifts[n], windowOffset, windowSize, readSize))
+			shifts[n] = NOT_ALIGNED;
+
+		// a tail that neither of the first two reads contain was probably wrong itself (it came from an unverified window),
+		// so start over with the first read as the reference
+		if(anchor == tail && n == 1 && shifts[0] == NOT_ALIGNED && shifts[1] == NOT_ALIGNED) {
+			anchor = reads[0] + windowOffset;
+			anchorExpected = windowOffset;
+			shifts[0] = 0;
+			shifts[1] = alignRead(reads[1], readSize, anchor, anchorExpected);
+			if(!windowFits(shifts[1], windowOffset, windowSize, readSize))
+				shifts[1] = NOT_ALIGNED;
+		}
+		if(shifts[n] == NOT_ALIGNED)
+			continue;
+
+		const uint8_t *window = reads[n] + windowOffset + shifts[n];
+		for(int i=0; i<n && accepted == -1; i++) {
+			if(shifts[i] == NOT_ALIGNED)
+				continue;
+			if(countMatchingBytes(reads[i] + windowOffset + shifts[i], window, windowSize) == (size_t)windowSize)
+				accepted = n;
+			else
+				stats.mismatches++;
+		}
+	}
+
+	for(int n=0; n<=last; n++) {
+		if(shifts[n] == NOT_ALIGNED)
+			stats.unaligned++;
+		else if(shifts[n]) {
+			stats.jitterCorrected++;
+			long frames = labs(shifts[n]) / CD_AUDIO_FRAME_SIZE;
+			if(frames > stats.maxJitterFrames)
+				stats.maxJitterFrames = frames;
+		}
+	}
+
+	// with nothing verified, the last read that could be lined up is the best guess
+	int chosen = accepted;
+	for(int n=last; n>=0 && chosen == -1; n--) {
+		if(shifts[n] != NOT_ALIGNED)
+			chosen = n;
+	}
+	const uint8_t *window = chosen != -1 ? reads[chosen] + windowOffset + shifts[chosen] : reads[last] + windowOffset;
+	memcpy(dest, window, windowSize);
+	*destSizeWritten = windowSize;
+	// even an unverified tail keeps the next window lined up with this one, if it is wrong the next window falls back to its own first read
+	rememberTail(window, windowSize, startLBA+transferLen);
+
+	if(accepted == -1) {
+		stats.unverified++;
+		return SECURE_READ_UNVERIFIED;
+	}
+	cacheSectors(startLBA, window, transferLen);
+	if(leadoutReached)
+		return READ_CD_AUDIO_LEADOUT_REACHED;
+	return SUCCESS;
+}
+
+// When enabled, the CDReader thread (and so playback and ripping) reads through secureReadCDAudioInto().
+void setSecureRead(bool enable) {
+	enabled = enable;
+}
+
+bool isSecureReadEnabled(void) {
+	return enabled;
+}
+
+// Sets how many times a window is read before giving up on getting two that agree, at least 2.
+int setSecureReadAttempts(int newAttempts) {
+	if(newAttempts < 2 || newAttempts > MAX_SECURE_READ_ATTEMPTS)
+		return BAD_ATTEMPTS;
+	attempts = newAttempts;
+	return SUCCESS;
+}
+
+void getSecureReadStats(SecureReadStats *dest) {
+	*dest = stats;
+}
+
+void resetSecureReadStats(void) {
+	memset(&stats, 0, sizeof(SecureReadStats));
+}
+
+static int readWindowOnce(uint32_t padStartLBA, uint32_t leadoutLBA, uint32_t padBlocks, uint8_t *dest) {
+	long written = 0;
+	int status = readCDAudioFromDrive(padStartLBA, leadoutLBA, padBlocks, dest, &written);
+	if(status == READ_CD_AUDIO_LEADOUT_REACHED)
+		status = SUCCESS;
+	return status;
+}
+
+// Returns how many bytes the anchor sits from where it should be in read, NOT_ALIGNED if it is not within MAX_JITTER_BYTES of it.
+static long alignRead(const uint8_t *read, long readSize, const uint8_t *anchor, long expected) {
+	long searchStart = expected > MAX_JITTER_BYTES ? expected - MAX_JITTER_BYTES : 0;
+	long searchEnd = expected + MAX_JITTER_BYTES + ANCHOR_SIZE;
+	if(searchEnd > readSize)
+		searchEnd = readSize;
+	if(searchEnd - searchStart < ANCHOR_SIZE)
+		return NOT_ALIGNED;
+	long found = findNearestSampleRun(read+searchStart, searchEnd-searchStart, anchor, ANCHOR_SIZE, expected-searchStart);
+	if(found == -1)
+		return NOT_ALIGNED;
+	return searchStart + found - expected;
+}
+
+// Reads one block half a disc away so the next read of the window has to come off the disc again.
+static void flushDriveCache(uint32_t startLBA, uint32_t leadoutLBA) {
+	uint8_t block[BLOCK_SIZE];
+	long written;
+	uint32_t farLBA = (startLBA + leadoutLBA/2) % leadoutLBA;
+	readCDAudioFromDrive(farLBA, leadoutLBA, 1, block, &written);
+}
+
+static bool windowFits(long shift, long windowOffset, long windowSize, long readSize) {
+	return shift != NOT_ALIGNED && windowOffset + shift >= 0 && windowOffset + shift + windowSize <= readSize;
+}
+
+static void rememberTail(const uint8_t *window, long windowSize, uint32_t endLBA) {
+	if(windowSize < ANCHOR_SIZE) {
+		tailEndLBA = 0;
+		return;
+	}
+	memcpy(tail, window + windowSize - ANCHOR_SIZE, ANCHOR_SIZE);
+	tailEndLBA = endLBA;
+}
@@ -0,0 +1,29 @@
+
+#ifndef SECUREREAD_H
+#define SECUREREAD_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SECURE_READ_UNVERIFIED 13 // no two reads of the window agreed, dest holds the last read as a best effort
+
+typedef struct SecureReadStats SecureReadStats;
+
+struct SecureReadStats {
+	unsigned long windows; // calls to secureReadCDAudioInto()
+	unsigned long reads; // READ CD passes over a window, at least 2 per window
+	unsigned long mismatches; // pairs of reads that were aligned but disagreed
+	unsigned long unaligned; // reads the anchor could not be found in, too much jitter or too damaged to use
+	unsigned long jitterCorrected; // reads that had to be shifted to line up
+	long maxJitterFrames; // largest shift seen, in frames either way
+	unsigned long unverified; // windows that ran out of reads
+};
+
+int secureReadCDAudioInto(uint32_t startLBA, uint32_t leadoutLBA, uint32_t transferLen, void *dest, long *destSizeWritten);
+void setSecureRead(bool enabled);
+bool isSecureReadEnabled(void);
+int setSecureReadAttempts(int attempts);
+void getSecureReadStats(SecureReadStats *dest);
+void resetSecureReadStats(void);
+
+#endif
@@ -0,0 +1,949 @@
+// Simulated drives for drive.c, so everything above it can run and be benchmarked without hardware.
+//
+// Both answer the MMC commands this code sends, the way a drive would, including the sense data for the ones it can't do:
+// 	TEST UNIT READY, INQUIRY, READ TOC/PMA/ATIP formats 0000b and 0101b, READ CD, MODE SENSE page 2Ah, SET CD SPEED, SET STREAMING
+//
+// DRIVE_BACKEND_IMAGE serves a disc image, either a CUE sheet or a bare .bin taken as one audio track.
+// The .bin files are mapped and READ CD copies straight out of the mapping, so serving a read costs one memcpy.
+// The CUE sheet only needs FILE "x.bin" BINARY, TRACK nn AUDIO (or MODE1/2352, MODE2/2352 for data tracks) and INDEX 01 mm:ss:ff,
+// everything else in it is ignored. PREGAP is too, since there is no audio for it in the image.
+// CD-Text comes from a sidecar of raw packs, named by CDTEXTFILE in the sheet or else the image's name with .cdt instead of its extension.
+// It can be bare 18 byte packs or have the 4 byte READ TOC header in front, like cdrecord writes. Without one the disc has no CD-Text.
+//
+// DRIVE_BACKEND_MOCK makes up a disc of MOCK_TRACKS tracks. Every frame holds its own number counted from the start of the disc,
+// so whatever reads it can tell if a block was skipped, repeated or put in the wrong place, or shifted by a few frames.
+//
+// How long commands take comes from setSimDriveTiming(), or the SIM_DRIVE_ENV environment variable when a simulated drive is opened:
+// 	latency=<ms per command>,seek=<ms for a full stroke seek>,speed=<x>,stall=<ms>,stallevery=<ms>,maxblocks=<n>,jitter=<frames>,biterrors=<rate>
+// around latency=1,seek=120,speed=24 is a typical desktop drive. A stall is added to one READ CD every stallevery ms.
+// maxblocks refuses any READ CD longer than that the way a drive does, while MODE SENSE still claims the usual buffer,
+// so the batch size backoff in readcd.c and probecd.c can be run without a drive that needs it.
+// jitter and biterrors make a drive that reads badly, for secure reads to be tried against. A READ CD that doesn't follow on
+// from the last one lands up to jitter frames either side of where it was asked to, and the reads after it carry on from there.
+// biterrors is the share of bits read that come back flipped, ex. biterrors=1e-6. Both are random but repeat every time a drive is opened.
+// The drive works on one command at a time like a real one, so a command queued behind others waits for them too.
+// latency is the round trip though, half on the way to the drive and half back, and the round trips of queued commands overlap:
+// with commands queued the drive starts on the next one as soon as it is done with the last.
+//
+// DRIVE_BACKEND_REPLAY answers from a recording made with startDriveTrace(), see trace.c. Each command gets the answer and takes the time
+// the recorded drive gave the same CDB, scaled by the factor after the @ in "replay:<trace>@<scale>", 0 answering at once.
+// SIM_DRIVE_ENV doesn't apply, the timing is the recording's.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "simdrive.h"
+#include "readcd.h"
+#include "trace.h"
+#include "config.h"
+#include "stats.h"
+
+#define ONE_BYTE 8
+
+#define OPCODE_TEST_UNIT_READY 0x00
+#define OPCODE_INQUIRY 0x12
+#define OPCODE_READ_TOC 0x43
+#define OPCODE_MODE_SENSE 0x5a
+#define OPCODE_SET_STREAMING 0xb6
+#define OPCODE_SET_CD_SPEED 0xbb
+#define OPCODE_READ_CD 0xbe
+
+#define INQUIRY_LEN 36
+#define PERIPHERAL_CD_DVD 0x05
+#define TOC_FORMAT_MASK 0x0f
+#define TOC_FORMAT_TOC 0x00
+#define TOC_FORMAT_CD_TEXT 0x05
+#define TOC_DESCRIPTOR_SIZE 8
+#define TOC_HEADER_SIZE 4
+#define ADR_CONTROL_AUDIO 0x10 // ADR 1 (Q sub-channel position), control 0 (2 channel audio)
+#define ADR_CONTROL_DATA 0x14 // control 0100b, data track
+#define LEADOUT_TRACK_NUM 0xaa
+#define CAPABILITIES_PAGE 0x2a
+#define MODE_HEADER_SIZE 8
+#define CAPABILITIES_PAGE_LEN 0x14
+#define SIM_BUFFER_KB 1024
+#define SIM_MAX_SPEED_KBPS 7056 // 40x, reported when speedX is 0
+#define KBPS_PER_X_TENTHS 1764
+
+#define SENSE_FIXED_CURRENT 0x70
+#define SENSE_FIXED_LEN 18
+#define SENSE_KEY_ILLEGAL_REQUEST 0x05
+#define ASC_INVALID_OPCODE 0x20
+#define ASC_LBA_OUT_OF_RANGE 0x21
+#define ASC_INVALID_FIELD_IN_CDB 0x24
+
+#define MAX_SIM_TRACKS 99
+#define MAX_IMAGE_FILES MAX_SIM_TRACKS
+#define CD_TEXT_PACK_SIZE 18
+#define MAX_CD_TEXT_SIZE (TOC_HEADER_SIZE + 256*CD_TEXT_PACK_SIZE) // 8 blocks of at most 256 packs in all
+#define MAX_PATH 512
+#define MAX_CUE_LINE 1024
+#define SEEK_SETTLE_SHARE 0.25 // part of a full stroke seek that even a short seek pays
+#define NSEC_PER_SEC 1000000000L
+#define AUDIO_FRAME_SIZE 4 // one 16 bit stereo sample pair, what jitter shifts the audio by
+#define RANDOM_SEED 0x9e3779b97f4a7c15ull
+
+typedef struct SimDisc SimDisc;
+typedef struct ImageFile ImageFile;
+typedef struct QueuedCommand QueuedCommand;
+
+// what a simulated disc has to answer READ TOC and READ CD with
+struct SimDisc {
+	const char *product; // INQUIRY product, 16 characters at most
+	uint8_t trackCount;
+	uint32_t trackStart[MAX_SIM_TRACKS];
+	bool dataTrack[MAX_SIM_TRACKS];
+	uint32_t leadoutLBA;
+	uint8_t *cdText; // READ TOC format 0101b response, header included, NULL if the disc has none
+	unsigned int cdTextLen;
+	void (*readBlocks)(uint32_t lba, uint32_t count, uint8_t *dest);
+};
+
+// one mapped .bin, its blocks are LBAs startLBA to startLBA+blocks
+struct ImageFile {
+	uint8_t *map;
+	size_t size;
+	uint32_t startLBA;
+	uint32_t blocks;
+};
+
+struct QueuedCommand {
+	DriveCommand *command;
+	double due; // when the command completes, on the monotonic clock
+	const TraceRecord *record; // what to answer it with when replaying, NULL if it wasn't recorded
+};
+
+static int imageOpen(const char *path);
+static int mockOpen(const char *path);
+static int replayOpen(const char *path);
+static void simClose(void);
+static int simExecute(DriveCommand *command);
+static int simSubmit(DriveCommand *command);
+static int simReap(DriveCommand **done);
+static int simDiscard(void);
+static int simSetReservedSize(int bytes);
+static void *simMapReserved(size_t size);
+static int parseCueSheet(const char *cuePath, char *cdTextPath, size_t cdTextPathLen);
+static int mapImageFile(const char *path);
+static void loadCDText(const char *path);
+static void readTimingFromEnv(void);
+static double scheduleCommand(DriveCommand *command, const TraceRecord *record);
+static double commandCost(DriveCommand *command);
+static int answer(DriveCommand *command);
+static int answerFromTrace(DriveCommand *command, const TraceRecord *record);
+static int answerInquiry(DriveCommand *command);
+static int answerReadTOC(DriveCommand *command);
+static int answerModeSense(DriveCommand *command);
+static int answerReadCD(DriveCommand *command);
+static int checkCondition(DriveCommand *command, uint8_t senseKey, uint8_t asc);
+static void copyOut(DriveCommand *command, const uint8_t *src, unsigned int len);
+static void readImageBlocks(uint32_t lba, uint32_t count, uint8_t *dest);
+static void readMockBlocks(uint32_t lba, uint32_t count, uint8_t *dest);
+static void readJittered(uint32_t lba, uint32_t count, uint8_t *dest);
+static void flipBits(uint8_t *data, size_t len);
+static uint64_t nextRandom(void);
+static uint32_t getCDBLBA(const DriveCommand *command);
+static uint32_t getCDBTransferLen(const DriveCommand *command);
+static uint16_t getMaxSpeedKBps(void);
+static void putBE16(uint8_t *dest, uint16_t value);
+static void putBE32(uint8_t *dest, uint32_t value);
+static void sleepUntil(double when);
+
+static const DriveBackend imageBackend = {
+	.open = imageOpen,
+	.close = simClose,
+	.execute = simExecute,
+	.submit = simSubmit,
+	.reap = simReap,
+	.discard = simDiscard,
+	.setReservedSize = simSetReservedSize,
+	.mapReserved = simMapReserved,
+};
+
+static const DriveBackend mockBackend = {
+	.open = mockOpen,
+	.close = simClose,
+	.execute = simExecute,
+	.submit = simSubmit,
+	.reap = simReap,
+	.discard = simDiscard,
+	.setReservedSize = simSetReservedSize,
+	.mapReserved = simMapReserved,
+};
+
+static const DriveBackend replayBackend = {
+	.open = replayOpen,
+	.close = simClose,
+	.execute = simExecute,
+	.submit = simSubmit,
+	.reap = simReap,
+	.discard = simDiscard,
+	.setReservedSize = simSetReservedSize,
+	.mapReserved = simMapReserved,
+};
+
+// any thread can send a command, the lock keeps them answering one at a time like a drive does
+static pthread_mutex_t simLock = PTHREAD_MUTEX_INITIALIZER;
+static SimDisc disc;
+static ImageFile files[MAX_IMAGE_FILES];
+static int filesLen = 0;
+static SimDriveTiming timing;
+static bool timingChosen = false; // by setSimDriveTiming() or the environment, the environment is only looked at once
+static uint16_t speedKBps = 0; // from SET CD SPEED, 0 until one is sent
+static uint32_t headLBA = 0; // where the last READ CD left the pickup
+static double nextStall = 0; // when the next injected stall is due, 0 until the first READ CD
+static QueuedCommand queue[MAX_DRIVE_COMMANDS_QUEUED];
+static int queued = 0;
+static double busyUntil = 0; // when the drive is done with the last command sent or queued
+static uint8_t *reserved = NULL;
+static size_t reservedSize = 0;
+static Trace *replay = NULL; // the recording being replayed, NULL for the image and mock drives
+static double replayScale = 1;
+static uint64_t randomState = RANDOM_SEED; // for jitter and bit errors, reset on every open so runs repeat
+static long jitterBytes = 0; // how far from where it was asked to the last READ CD landed
+static uint32_t jitterNextLBA = 0; // a READ CD starting here follows on and keeps jitterBytes
+static uint8_t *jitterBuffer = NULL; // a jittered read straddles one block more than it returns
+static size_t jitterBufferSize = 0;
+
+const DriveBackend *getImageDriveBackend(void) {
+	return &imageBackend;
+}
+
+const DriveBackend *getMockDriveBackend(void) {
+	return &mockBackend;
+}
+
+const DriveBackend *getReplayDriveBackend(void) {
+	return &replayBackend;
+}
+
+// How well the replay is following the recording so far, see getTraceMatchStats(). All 0 if nothing is being replayed.
+void getReplayStats(unsigned long *matched, unsigned long *outOfOrder, unsigned long *unmatched) {
+	pthread_mutex_lock(&simLock);
+	if(replay)
+		getTraceMatchStats(replay, matched, outOfOrder, unmatched);
+	else
+		*matched = *outOfOrder = *unmatched = 0;
+	pthread_mutex_unlock(&simLock);
+}
+
+// Sets how long both simulated drives take to answer, see SimDriveTiming.
+// Opening the mock backend from "mock:<ms>" sets commandUsec, so set it after that to override.
+// Timing set here stays for every open after, SIM_DRIVE_ENV is only read if this was never called.
+void setSimDriveTiming(const SimDriveTiming *newTiming) {
+	pthread_mutex_lock(&simLock);
+	timing = *newTiming;
+	timingChosen = true;
+	pthread_mutex_unlock(&simLock);
+}
+
+void getSimDriveTiming(SimDriveTiming *dest) {
+	pthread_mutex_lock(&simLock);
+	*dest = timing;
+	pthread_mutex_unlock(&simLock);
+}
+
+// path is a .cue sheet, or a .bin that is taken as a single audio track.
+static int imageOpen(const char *path) {
+	memset(&disc, 0, sizeof(SimDisc));
+	disc.product = "IMAGE";
+	disc.readBlocks = readImageBlocks;
+	filesLen = 0;
+
+	char cdTextPath[MAX_PATH] = "";
+	size_t pathLen = strlen(path);
+	int status;
+	if(pathLen > 4 && strcasecmp(path + pathLen-4, ".cue") == 0)
+		status = parseCueSheet(path, cdTextPath, MAX_PATH);
+	else {
+		status = mapImageFile(path);
+		disc.trackCount = 1;
+	}
+	if(status == DRIVE_SUCCESS && disc.trackCount == 0)
+		status = DRIVE_FAILED_OPEN;
+	if(status) {
+		simClose();
+		return status;
+	}
+	disc.leadoutLBA = files[filesLen-1].startLBA + files[filesLen-1].blocks;
+
+	// the sidecar is named after the image unless the sheet named one
+	if(cdTextPath[0] == '\0') {
+		snprintf(cdTextPath, MAX_PATH, "%s", path);
+		char *dot = strrchr(cdTextPath, '.');
+		char *slash = strrchr(cdTextPath, '/');
+		if(dot && (!slash || dot > slash))
+			*dot = '\0';
+		strncat(cdTextPath, ".cdt", MAX_PATH - strlen(cdTextPath) - 1);
+	}
+	loadCDText(cdTextPath);
+
+	pthread_mutex_lock(&simLock);
+	if(!timingChosen)
+		readTimingFromEnv();
+	queued = 0;
+	headLBA = 0;
+	nextStall = 0;
+	randomState = RANDOM_SEED;
+	jitterBytes = 0;
+	jitterNextLBA = 0;
+	pthread_mutex_unlock(&simLock);
+	return DRIVE_SUCCESS;
+}
+
+// path is the latency in ms. Empty takes it from SIM_DRIVE_ENV, or MOCK_DEFAULT_LATENCY_MS if that doesn't set one either.
+static int mockOpen(const char *path) {
+	memset(&disc, 0, sizeof(SimDisc));
+	disc.product = "MOCK";
+	disc.trackCount = MOCK_TRACKS;
+	for(int i=0; i<MOCK_TRACKS; i++)
+		disc.trackStart[i] = i * MOCK_TRACK_SECONDS * CD_AUDIO_BLOCKS_ONE_SEC;
+	disc.leadoutLBA = MOCK_TRACKS * MOCK_TRACK_SECONDS * CD_AUDIO_BLOCKS_ONE_SEC;
+	disc.readBlocks = readMockBlocks;
+
+	pthread_mutex_lock(&simLock);
+	if(!timingChosen)
+		readTimingFromEnv();
+	if(path && *path)
+		timing.commandUsec = strtoul(path, NULL, 10) * 1000;
+	else if(!timing.commandUsec)
+		timing.commandUsec = MOCK_DEFAULT_LATENCY_MS * 1000;
+	queued = 0;
+	headLBA = 0;
+	nextStall = 0;
+	randomState = RANDOM_SEED;
+	jitterBytes = 0;
+	jitterNextLBA = 0;
+	pthread_mutex_unlock(&simLock);
+	return DRIVE_SUCCESS;
+}
+
+// path is the trace, optionally followed by @<scale> for the recorded latencies, 0.5 replaying twice as fast.
+static int replayOpen(const char *path) {
+	char tracePath[MAX_PATH];
+	snprintf(tracePath, MAX_PATH, "%s", path);
+	double scale = 1;
+	char *at = strrchr(tracePath, '@');
+	if(at) {
+		char *end;
+		double parsed = strtod(at+1, &end);
+		if(end != at+1 && *end == '\0' && parsed >= 0) {
+			scale = parsed;
+			*at = '\0';
+		}
+	}
+	Trace *trace = loadTrace(tracePath);
+	if(!trace)
+		return DRIVE_FAILED_OPEN;
+
+	memset(&disc, 0, sizeof(SimDisc));
+	pthread_mutex_lock(&simLock);
+	replay = trace;
+	replayScale = scale;
+	queued = 0;
+	pthread_mutex_unlock(&simLock);
+	return DRIVE_SUCCESS;
+}
+
+static void simClose(void) {
+	for(int i=0; i<filesLen; i++)
+		munmap(files[i].map, files[i].size);
+	filesLen = 0;
+	free(disc.cdText);
+	disc.cdText = NULL;
+	free(reserved);
+	reserved = NULL;
+	reservedSize = 0;
+	free(jitterBuffer);
+	jitterBuffer = NULL;
+	jitterBufferSize = 0;
+	queued = 0;
+	speedKBps = 0;
+	pthread_mutex_lock(&simLock);
+	destroyTrace(replay);
+	replay = NULL;
+	pthread_mutex_unlock(&simLock);
+}
+
+static int simExecute(DriveCommand *command) {
+	pthread_mutex_lock(&simLock);
+	const TraceRecord *record = replay ? matchTraceRecord(replay, command) : NULL;
+	double due = scheduleCommand(command, record);
+	pthread_mutex_unlock(&simLock);
+
+	sleepUntil(due);
+	pthread_mutex_lock(&simLock);
+	int status = replay ? answerFromTrace(command, record) : answer(command);
+	pthread_mutex_unlock(&simLock);
+	return status;
+}
+
+// Nothing is answered until it is reaped, the queue only records when each command would have completed.
+static int simSubmit(DriveCommand *command) {
+	pthread_mutex_lock(&simLock);
+	if(queued == MAX_DRIVE_COMMANDS_QUEUED) {
+		pthread_mutex_unlock(&simLock);
+		return DRIVE_QUEUE_FULL;
+	}
+	const TraceRecord *record = replay ? matchTraceRecord(replay, command) : NULL;
+	queue[queued].command = command;
+	queue[queued].due = scheduleCommand(command, record);
+	queue[queued].record = record;
+	queued++;
+	pthread_mutex_unlock(&simLock);
+	return DRIVE_SUCCESS;
+}
+
+// Commands complete in the order they were queued.
+static int simReap(DriveCommand **done) {
+	pthread_mutex_lock(&simLock);
+	if(queued == 0) {
+		pthread_mutex_unlock(&simLock);
+		return DRIVE_FAILED_RECEIVE;
+	}
+	QueuedCommand next = queue[0];
+	memmove(queue, queue+1, (queued-1) * sizeof(QueuedCommand));
+	queued--;
+	pthread_mutex_unlock(&simLock);
+
+	sleepUntil(next.due);
+	pthread_mutex_lock(&simLock);
+	*done = next.command;
+	int status = replay ? answerFromTrace(next.command, next.record) : answer(next.command);
+	pthread_mutex_unlock(&simLock);
+	return status;
+}
+
+static int simDiscard(void) {
+	pthread_mutex_lock(&simLock);
+	queued = 0;
+	busyUntil = 0;
+	pthread_mutex_unlock(&simLock);
+	return DRIVE_SUCCESS;
+}
+
+// There is no driver limit to simulate, whatever is asked for is what the drive has.
+static int simSetReservedSize(int bytes) {
+	return bytes;
+}
+
+static void *simMapReserved(size_t size) {
+	if(reserved && reservedSize >= size)
+		return reserved;
+	free(reserved);
+	reserved = NULL;
+	if(posix_memalign((void **)&reserved, sysconf(_SC_PAGESIZE), size))
+		return NULL;
+	reservedSize = size;
+	return reserved;
+}
+
+// Fills in disc from the sheet. FILE paths are relative to the sheet. Every TRACK needs an INDEX 01 before the next one.
+static int parseCueSheet(const char *cuePath, char *cdTextPath, size_t cdTextPathLen) {
+	FILE *cue = fopen(cuePath, "r");
+	if(!cue)
+		return DRIVE_FAILED_OPEN;
+	char dirCopy[MAX_PATH];
+	snprintf(dirCopy, MAX_PATH, "%s", cuePath);
+	const char *dir = dirname(dirCopy);
+
+	int status = DRIVE_SUCCESS;
+	bool trackOpen = false; // a TRACK that hasn't had its INDEX 01 yet
+	char line[MAX_CUE_LINE];
+	while(status == DRIVE_SUCCESS && fgets(line, MAX_CUE_LINE, cue)) {
+		char keyword[16];
+		int consumed = 0;
+		if(sscanf(line, " %15s %n", keyword, &consumed) != 1)
+			continue;
+		char *rest = line + consumed;
+
+		if(strcmp(keyword, "FILE") == 0 || strcmp(keyword, "CDTEXTFILE") == 0) {
+			// the name is quoted if it has spaces in it, FILE has the file type after it
+			char name[MAX_PATH];
+			if(*rest == '"') {
+				char *end = strchr(rest+1, '"');
+				if(!end) {
+					status = DRIVE_FAILED_OPEN;
+					break;
+				}
+				snprintf(name, MAX_PATH, "%.*s", (int)(end - rest - 1), rest+1);
+				rest = end+1;
+			}
+			else if(sscanf(rest, "%511s%n", name, &consumed) == 1)
+				rest += consumed;
+			else {
+				status = DRIVE_FAILED_OPEN;
+				break;
+			}
+			char filePath[MAX_PATH*2];
+			snprintf(filePath, sizeof(filePath), "%s%s%s", name[0] == '/' ? "" : dir, name[0] == '/' ? "" : "/", name);
+			if(keyword[0] == 'C') {
+				if(snprintf(cdTextPath, cdTextPathLen, "%s", filePath) >= (int)cdTextPathLen)
+					cdTextPath[0] = '\0'; // cut short it would name some other file, go without CD-Text instead
+				continue;
+			}
+			// WAVE and MOTOROLA (big endian) would need converting, only raw little endian samples are served as they are
+			char type[16] = "";
+			sscanf(rest, "%15s", type);
+			if(strcmp(type, "BINARY") || trackOpen || filesLen == MAX_IMAGE_FILES)
+				status = DRIVE_FAILED_OPEN;
+			else
+				status = mapImageFile(filePath);
+		}
+		else if(strcmp(keyword, "TRACK") == 0) {
+			unsigned int number;
+			char mode[16];
+			if(filesLen == 0 || trackOpen || disc.trackCount == MAX_SIM_TRACKS || sscanf(rest, "%u %15s", &number, mode) != 2) {
+				status = DRIVE_FAILED_OPEN;
+				break;
+			}
+			// every block in the image is a 2352 byte raw sector, so MODE1/2048 and the like can't be served
+			if(strcmp(mode, "AUDIO") == 0)
+				disc.dataTrack[disc.trackCount] = false;
+			else if(strcmp(mode, "MODE1/2352") == 0 || strcmp(mode, "MODE2/2352") == 0)
+				disc.dataTrack[disc.trackCount] = true;
+			else {
+				status = DRIVE_FAILED_OPEN;
+				break;
+			}
+			trackOpen = true;
+		}
+		else if(strcmp(keyword, "INDEX") == 0) {
+			unsigned int index, min, sec, frame;
+			if(sscanf(rest, "%u %u:%u:%u", &index, &min, &sec, &frame) != 4) {
+				status = DRIVE_FAILED_OPEN;
+				break;
+			}
+			if(index != 1 || !trackOpen)
+				continue;
+			ImageFile *file = &files[filesLen-1];
+			uint32_t offset = (min*60 + sec) * CD_AUDIO_BLOCKS_ONE_SEC + frame;
+			if(offset >= file->blocks) {
+				status = DRIVE_FAILED_OPEN;
+				break;
+			}
+			disc.trackStart[disc.trackCount++] = file->startLBA + offset;
+			trackOpen = false;
+		}
+	}
+	if(trackOpen)
+		status = DRIVE_FAILED_OPEN;
+	fclose(cue);
+	return status;
+}
+
+// Maps one .bin and appends it after the files already mapped.
+static int mapImageFile(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return DRIVE_FAILED_OPEN;
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size < CD_AUDIO_BLOCK_SIZE) {
+		close(fd);
+		return DRIVE_FAILED_OPEN;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return DRIVE_FAILED_OPEN;
+	// the drive reads ahead of the pickup, the kernel can too
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	ImageFile *file = &files[filesLen];
+	file->map = map;
+	file->size = st.st_size;
+	file->startLBA = filesLen ? files[filesLen-1].startLBA + files[filesLen-1].blocks : 0;
+	file->blocks = st.st_size / CD_AUDIO_BLOCK_SIZE;
+	filesLen++;
+	return DRIVE_SUCCESS;
+}
+
+// A missing or malformed sidecar only means the disc has no CD-Text.
+static void loadCDText(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if(!f)
+		return;
+	uint8_t *response = malloc(MAX_CD_TEXT_SIZE + TOC_HEADER_SIZE);
+	if(!response) {
+		fclose(f);
+		return;
+	}
+	// read it in after room for the header, then drop the header the file came with, if it had one
+	size_t len = fread(response + TOC_HEADER_SIZE, 1, MAX_CD_TEXT_SIZE, f);
+	fclose(f);
+	if(len % CD_TEXT_PACK_SIZE == TOC_HEADER_SIZE) {
+		len -= TOC_HEADER_SIZE;
+		memmove(response + TOC_HEADER_SIZE, response + 2*TOC_HEADER_SIZE, len);
+	}
+	if(len == 0 || len % CD_TEXT_PACK_SIZE) {
+		free(response);
+		return;
+	}
+	putBE16(response, len + 2);
+	response[2] = 0;
+	response[3] = 0;
+	disc.cdText = response;
+	disc.cdTextLen = len + TOC_HEADER_SIZE;
+}
+
+// Called with simLock held. Anything missing from the variable is left at 0.
+static void readTimingFromEnv(void) {
+	timingChosen = true;
+	memset(&timing, 0, sizeof(SimDriveTiming));
+	const char *env = getenv(SIM_DRIVE_ENV);
+	if(!env)
+		return;
+	while(*env) {
+		unsigned int value;
+		double rate;
+		int consumed = 0;
+		if(sscanf(env, "latency=%u%n", &value, &consumed) == 1)
+			timing.commandUsec = value * 1000;
+		else if(sscanf(env, "seek=%u%n", &value, &consumed) == 1)
+			timing.seekUsec = value * 1000;
+		else if(sscanf(env, "speed=%u%n", &value, &consumed) == 1)
+			timing.speedX = value;
+		else if(sscanf(env, "stallevery=%u%n", &value, &consumed) == 1)
+			timing.stallEveryMs = value;
+		else if(sscanf(env, "stall=%u%n", &value, &consumed) == 1)
+			timing.stallUsec = value * 1000;
+		else if(sscanf(env, "maxblocks=%u%n", &value, &consumed) == 1)
+			timing.maxTransferBlocks = value;
+		else if(sscanf(env, "jitter=%u%n", &value, &consumed) == 1)
+			timing.jitterFrames = value;
+		else if(sscanf(env, "biterrors=%lf%n", &rate, &consumed) == 1 && rate >= 0 && rate <= 1)
+			timing.bitErrorRate = rate;
+		else {
+			fprintf(stderr, "ignoring the rest of %s=%s, expected latency=<ms>,seek=<ms>,speed=<x>,stall=<ms>,stallevery=<ms>,maxblocks=<n>,"
+				"jitter=<frames>,biterrors=<rate>\n", SIM_DRIVE_ENV, env);
+			return;
+		}
+		env += consumed;
+		if(*env == ',')
+			env++;
+	}
+}
+
+// Returns when a command sent now completes, called with simLock held in the order commands are answered.
+// It reaches the drive half a round trip from now, waits there for the drive to be done with the commands ahead of it,
+// and its answer takes the other half to come back. A replayed command takes what the recorded one did, one after another.
+static double scheduleCommand(DriveCommand *command, const TraceRecord *record) {
+	double now = monotonicSec();
+	if(replay) {
+		double cost = record ? record->latencyUsec * replayScale / 1e6 : 0;
+		busyUntil = (busyUntil > now ? busyUntil : now) + cost;
+		return busyUntil;
+	}
+	double halfTrip = timing.commandUsec / 2e6;
+	double arrives = now + halfTrip;
+	busyUntil = (busyUntil > arrives ? busyUntil : arrives) + commandCost(command);
+	return busyUntil + halfTrip;
+}
+
+// How long the drive itself spends on a command, the round trip aside.
+// A READ CD that doesn't start where the last one ended seeks first: SEEK_SETTLE_SHARE of a full stroke to settle, the rest by distance.
+// Then it reads at the slower of speedX and whatever SET CD SPEED asked for, and stalls if one is due.
+static double commandCost(DriveCommand *command) {
+	double cost = 0;
+	if(command->cdb[0] != OPCODE_READ_CD)
+		return cost;
+	if(timing.stallUsec && timing.stallEveryMs) {
+		double now = monotonicSec();
+		if(nextStall && now >= nextStall)
+			cost += timing.stallUsec / 1e6;
+		if(!nextStall || now >= nextStall)
+			nextStall = now + timing.stallEveryMs / 1e3;
+	}
+	uint32_t lba = getCDBLBA(command);
+	uint32_t count = getCDBTransferLen(command);
+	if(lba != headLBA && timing.seekUsec && disc.leadoutLBA) {
+		uint32_t distance = lba > headLBA ? lba - headLBA : headLBA - lba;
+		double stroke = (double)distance / disc.leadoutLBA;
+		if(stroke > 1)
+			stroke = 1;
+		cost += timing.seekUsec / 1e6 * (SEEK_SETTLE_SHARE + (1-SEEK_SETTLE_SHARE) * stroke);
+	}
+	double x = timing.speedX;
+	if(speedKBps && speedKBps < getMaxSpeedKBps())
+		x = speedKBps * 10.0 / KBPS_PER_X_TENTHS;
+	if(x > 0)
+		cost += count / (CD_AUDIO_BLOCKS_ONE_SEC * x);
+	headLBA = lba + count;
+	return cost;
+}
+
+static int answer(DriveCommand *command) {
+	command->senseLen = 0;
+	command->resid = command->dataLen;
+	command->directIO = command->flags & DRIVE_FLAG_DIRECT_IO;
+	switch(command->cdb[0]) {
+		case OPCODE_TEST_UNIT_READY:
+		case OPCODE_SET_STREAMING:
+			return DRIVE_SUCCESS;
+		case OPCODE_SET_CD_SPEED:
+			speedKBps = (command->cdb[2] << ONE_BYTE) | command->cdb[3];
+			if(speedKBps > getMaxSpeedKBps())
+				speedKBps = getMaxSpeedKBps();
+			return DRIVE_SUCCESS;
+		case OPCODE_INQUIRY:
+			return answerInquiry(command);
+		case OPCODE_READ_TOC:
+			return answerReadTOC(command);
+		case OPCODE_MODE_SENSE:
+			return answerModeSense(command);
+		case OPCODE_READ_CD:
+			return answerReadCD(command);
+		default:
+			return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_OPCODE);
+	}
+}
+
+// Gives back what the recorded drive did. A command that was never recorded is refused,
+// and a READ CD recorded without its audio reads as silence.
+static int answerFromTrace(DriveCommand *command, const TraceRecord *record) {
+	command->senseLen = 0;
+	command->resid = command->dataLen;
+	command->directIO = command->flags & DRIVE_FLAG_DIRECT_IO;
+	if(!record)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+
+	uint8_t *dest = command->flags & DRIVE_FLAG_MMAP_IO ? reserved : command->data;
+	size_t room = command->flags & DRIVE_FLAG_MMAP_IO ? reservedSize : command->dataLen;
+	if(command->direction == DRIVE_DATA_IN && dest) {
+		size_t len = record->flags & TRACE_PAYLOAD_DROPPED ? record->dataLen - record->resid : record->payloadLen;
+		if(len > room)
+			len = room;
+		if(record->flags & TRACE_PAYLOAD_DROPPED)
+			memset(dest, 0, len);
+		else
+			memcpy(dest, record->payload, len);
+	}
+	command->resid = record->resid;
+	command->senseLen = record->senseLen < sizeof(command->sense) ? record->senseLen : sizeof(command->sense);
+	memcpy(command->sense, record->sense, command->senseLen);
+	return record->status;
+}
+
+static int answerInquiry(DriveCommand *command) {
+	uint8_t data[INQUIRY_LEN];
+	memset(data, ' ', INQUIRY_LEN);
+	data[0] = PERIPHERAL_CD_DVD;
+	data[1] = 0x80; // removable
+	data[2] = 0;
+	data[3] = 0;
+	data[4] = INQUIRY_LEN - 5;
+	memcpy(data+8, "SIMDRIVE", 8);
+	memcpy(data+16, disc.product, strlen(disc.product));
+	memcpy(data+32, "0001", 4);
+	copyOut(command, data, INQUIRY_LEN);
+	return DRIVE_SUCCESS;
+}
+
+// MMC-3 Manual, Table 233 – READ TOC/PMA/ATIP response data (Format = 0000b)
+// Format 0101b is the sidecar's packs as they are, behind the same 4 byte header.
+static int answerReadTOC(DriveCommand *command) {
+	unsigned int allocLen = (command->cdb[7] << ONE_BYTE) | command->cdb[8];
+	uint8_t format = command->cdb[2] & TOC_FORMAT_MASK;
+	if(format == TOC_FORMAT_CD_TEXT) {
+		// a disc without CD-Text answers like one whose drive can't read it
+		if(!disc.cdText)
+			return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+		copyOut(command, disc.cdText, disc.cdTextLen < allocLen ? disc.cdTextLen : allocLen);
+		return DRIVE_SUCCESS;
+	}
+	if(format != TOC_FORMAT_TOC)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+
+	uint8_t data[TOC_HEADER_SIZE + (MAX_SIM_TRACKS+1) * TOC_DESCRIPTOR_SIZE];
+	memset(data, 0, sizeof(data));
+	unsigned int len = TOC_HEADER_SIZE + (disc.trackCount+1) * TOC_DESCRIPTOR_SIZE;
+	putBE16(data, len - 2);
+	data[2] = 1;
+	data[3] = disc.trackCount;
+	for(int i=0; i<=disc.trackCount; i++) {
+		uint8_t *descriptor = data + TOC_HEADER_SIZE + i*TOC_DESCRIPTOR_SIZE;
+		bool leadout = i == disc.trackCount;
+		descriptor[1] = !leadout && disc.dataTrack[i] ? ADR_CONTROL_DATA : ADR_CONTROL_AUDIO;
+		descriptor[2] = leadout ? LEADOUT_TRACK_NUM : i+1;
+		putBE32(descriptor+4, leadout ? disc.leadoutLBA : disc.trackStart[i]);
+	}
+	copyOut(command, data, len < allocLen ? len : allocLen);
+	return DRIVE_SUCCESS;
+}
+
+// Only the CD/DVD Capabilities and Mechanical Status page, with the buffer size and read speeds filled in.
+// 	MMC-3 Manual, 5.5.10 CD/DVD Capabilities and Mechanical Status Page
+static int answerModeSense(DriveCommand *command) {
+	if((command->cdb[2] & 0x3f) != CAPABILITIES_PAGE)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+	uint8_t data[MODE_HEADER_SIZE + 2 + CAPABILITIES_PAGE_LEN];
+	memset(data, 0, sizeof(data));
+	putBE16(data, sizeof(data) - 2);
+	uint8_t *page = data + MODE_HEADER_SIZE;
+	page[0] = CAPABILITIES_PAGE;
+	page[1] = CAPABILITIES_PAGE_LEN;
+	putBE16(page+8, getMaxSpeedKBps());
+	putBE16(page+12, SIM_BUFFER_KB);
+	putBE16(page+14, speedKBps ? speedKBps : getMaxSpeedKBps());
+	copyOut(command, data, sizeof(data));
+	return DRIVE_SUCCESS;
+}
+
+static int answerReadCD(DriveCommand *command) {
+	uint32_t lba = getCDBLBA(command);
+	uint32_t count = getCDBTransferLen(command);
+	if(lba >= disc.leadoutLBA || count > disc.leadoutLBA - lba)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_LBA_OUT_OF_RANGE);
+	uint8_t *dest = command->flags & DRIVE_FLAG_MMAP_IO ? reserved : command->data;
+	size_t room = command->flags & DRIVE_FLAG_MMAP_IO ? reservedSize : command->dataLen;
+	if(!dest || (size_t)count * CD_AUDIO_BLOCK_SIZE > room)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+	if(timing.maxTransferBlocks && count > timing.maxTransferBlocks)
+		return checkCondition(command, SENSE_KEY_ILLEGAL_REQUEST, ASC_INVALID_FIELD_IN_CDB);
+	if(timing.jitterFrames)
+		readJittered(lba, count, dest);
+	else
+		disc.readBlocks(lba, count, dest);
+	if(timing.bitErrorRate > 0)
+		flipBits(dest, (size_t)count * CD_AUDIO_BLOCK_SIZE);
+	command->resid = command->dataLen - count * CD_AUDIO_BLOCK_SIZE;
+	return DRIVE_SUCCESS;
+}
+
+static int checkCondition(DriveCommand *command, uint8_t senseKey, uint8_t asc) {
+	memset(command->sense, 0, SENSE_FIXED_LEN);
+	command->sense[0] = SENSE_FIXED_CURRENT;
+	command->sense[2] = senseKey;
+	command->sense[7] = SENSE_FIXED_LEN - 8;
+	command->sense[12] = asc;
+	command->senseLen = SENSE_FIXED_LEN;
+	return DRIVE_CHECK_CONDITION;
+}
+
+// Copies what fits of a response into the command's data, like a drive stops at the allocation length.
+static void copyOut(DriveCommand *command, const uint8_t *src, unsigned int len) {
+	if(command->direction != DRIVE_DATA_IN || !command->data)
+		return;
+	if(len > command->dataLen)
+		len = command->dataLen;
+	memcpy(command->data, src, len);
+	command->resid = command->dataLen - len;
+}
+
+// A .bin that doesn't end on a whole block has its last partial block dropped, so every block read is inside a file.
+static void readImageBlocks(uint32_t lba, uint32_t count, uint8_t *dest) {
+	int i = 0;
+	while(count > 0) {
+		while(i < filesLen-1 && lba >= files[i].startLBA + files[i].blocks)
+			i++;
+		uint32_t first = lba - files[i].startLBA;
+		uint32_t run = files[i].blocks - first;
+		if(run > count)
+			run = count;
+		memcpy(dest, files[i].map + (size_t)first * CD_AUDIO_BLOCK_SIZE, (size_t)run * CD_AUDIO_BLOCK_SIZE);
+		dest += (size_t)run * CD_AUDIO_BLOCK_SIZE;
+		lba += run;
+		count -= run;
+	}
+}
+
+static void readMockBlocks(uint32_t lba, uint32_t count, uint8_t *dest) {
+	uint32_t frame = lba * (CD_AUDIO_BLOCK_SIZE / AUDIO_FRAME_SIZE);
+	size_t frames = (size_t)count * (CD_AUDIO_BLOCK_SIZE / AUDIO_FRAME_SIZE);
+	for(size_t i=0; i<frames; i++, frame++)
+		memcpy(dest + i * AUDIO_FRAME_SIZE, &frame, AUDIO_FRAME_SIZE);
+}
+
+// Reads count blocks worth of audio from wherever the drive lands, which is up to jitterFrames either side of lba
+// unless the read follows on from the last one. It can't land outside the disc.
+static void readJittered(uint32_t lba, uint32_t count, uint8_t *dest) {
+	if(lba != jitterNextLBA) {
+		long frames = (long)(nextRandom() % (2*timing.jitterFrames + 1)) - (long)timing.jitterFrames;
+		jitterBytes = frames * AUDIO_FRAME_SIZE;
+	}
+	jitterNextLBA = lba + count;
+
+	long len = (long)count * CD_AUDIO_BLOCK_SIZE;
+	long discSize = (long)disc.leadoutLBA * CD_AUDIO_BLOCK_SIZE;
+	long start = (long)lba * CD_AUDIO_BLOCK_SIZE + jitterBytes;
+	if(start < 0)
+		start = 0;
+	if(start + len > discSize)
+		start = discSize - len;
+	uint32_t firstLBA = start / CD_AUDIO_BLOCK_SIZE;
+	uint32_t blocks = (start + len + CD_AUDIO_BLOCK_SIZE-1) / CD_AUDIO_BLOCK_SIZE - firstLBA;
+	if((size_t)blocks * CD_AUDIO_BLOCK_SIZE > jitterBufferSize) {
+		uint8_t *resized = realloc(jitterBuffer, (size_t)blocks * CD_AUDIO_BLOCK_SIZE);
+		if(!resized) {
+			disc.readBlocks(lba, count, dest); // the drive found its place after all
+			return;
+		}
+		jitterBuffer = resized;
+		jitterBufferSize = (size_t)blocks * CD_AUDIO_BLOCK_SIZE;
+	}
+	disc.readBlocks(firstLBA, blocks, jitterBuffer);
+	memcpy(dest, jitterBuffer + (start - (long)firstLBA * CD_AUDIO_BLOCK_SIZE), len);
+}
+
+// Flips bitErrorRate of the bits in data, rounding the count up or down at random so small reads get their share on average.
+static void flipBits(uint8_t *data, size_t len) {
+	double bits = len * 8.0;
+	unsigned long flips = bits * timing.bitErrorRate + (double)(nextRandom() >> 11) / (1ull << 53);
+	for(unsigned long i=0; i<flips; i++) {
+		uint64_t bit = nextRandom() % (len * 8);
+		data[bit / 8] ^= 1 << (bit % 8);
+	}
+}
+
+// xorshift64, called with simLock held
+static uint64_t nextRandom(void) {
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return randomState;
+}
+
+// READ CD, MMC-3 Manual 6.19
+static uint32_t getCDBLBA(const DriveCommand *command) {
+	return ((uint32_t)command->cdb[2] << ONE_BYTE*3) | (command->cdb[3] << ONE_BYTE*2) | (command->cdb[4] << ONE_BYTE) | command->cdb[5];
+}
+
+static uint32_t getCDBTransferLen(const DriveCommand *command) {
+	return (command->cdb[6] << ONE_BYTE*2) | (command->cdb[7] << ONE_BYTE) | command->cdb[8];
+}
+
+static uint16_t getMaxSpeedKBps(void) {
+	return timing.speedX ? (timing.speedX * KBPS_PER_X_TENTHS + 9) / 10 : SIM_MAX_SPEED_KBPS;
+}
+
+static void putBE16(uint8_t *dest, uint16_t value) {
+	dest[0] = value >> ONE_BYTE;
+	dest[1] = value;
+}
+
+static void putBE32(uint8_t *dest, uint32_t value) {
+	dest[0] = value >> ONE_BYTE*3;
+	dest[1] = value >> ONE_BYTE*2;
+	dest[2] = value >> ONE_BYTE;
+	dest[3] = value;
+}
+
+static void sleepUntil(double when) {
+	struct timespec until;
+	until.tv_sec = (time_t)when;
+	until.tv_nsec = (long)((when - until.tv_sec) * NSEC_PER_SEC);
+	if(until.tv_nsec >= NSEC_PER_SEC)
+		until.tv_nsec = NSEC_PER_SEC - 1;
+	while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, NULL) == EINTR)
+		;
+}
@@ -0,0 +1,31 @@
+#ifndef SIMDRIVE_H
+#define SIMDRIVE_H
+
+#include "drive.h"
+
+#define MOCK_TRACKS 10
+#define MOCK_TRACK_SECONDS 240
+#define MOCK_DEFAULT_LATENCY_MS 1
+
+typedef struct SimDriveTiming SimDriveTiming;
+
+// How long the simulated drives take to answer, and how well they read. All 0 answers every command at once and exactly.
+struct SimDriveTiming {
+	unsigned int commandUsec; // every command, the round trip to the drive. Queued commands overlap theirs, see simdrive.c.
+	unsigned int seekUsec; // a full stroke seek, a READ CD that doesn't follow on from the last one pays part of it
+	unsigned int speedX; // reads no faster than this, 0 for no limit. SET CD SPEED can slow it further.
+	unsigned int stallUsec; // extra time one READ CD takes every stallEveryMs, like a drive retrying a scratch or recalibrating
+	unsigned int stallEveryMs;
+	unsigned int maxTransferBlocks; // a READ CD for more blocks is refused with ILLEGAL REQUEST / INVALID FIELD IN CDB, 0 for no limit
+	unsigned int jitterFrames; // a READ CD that doesn't follow on from the last one lands up to this many frames early or late
+	double bitErrorRate; // share of the bits READ CD returns that come back flipped, 0 for none
+};
+
+const DriveBackend *getImageDriveBackend(void);
+const DriveBackend *getMockDriveBackend(void);
+const DriveBackend *getReplayDriveBackend(void);
+void getReplayStats(unsigned long *matched, unsigned long *outOfOrder, unsigned long *unmatched);
+void setSimDriveTiming(const SimDriveTiming *timing);
+void getSimDriveTiming(SimDriveTiming *dest);
+
+#endif
@@ -0,0 +1,210 @@
+// Counters for the drive and PCM hot paths, and the stats file other processes read them from while playback runs.
+//
+// Every thread that counts something gets its own block of counters, claimed the first time it counts and handed back when it exits,
+// so recording is a load and a store to memory no other thread writes: no locks, no atomic read-modify-write, no shared cache lines.
+// A block handed back keeps its totals and the next new thread carries on from them, so nothing is lost to short lived threads
+// like the CD reader, and totals are the sum over all blocks.
+//
+// publishStats() sums the blocks into a StatsSnapshot in a shared file, under a sequence count like the kernel's seqlock,
+// so a reader (playerctl stats) never blocks the writer and the writer never waits for a reader. playerd publishes on a timer.
+// The file belongs in tmpfs, STATS_PATH is in /dev/shm, so publishing never touches a disk.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+#define MAX_STATS_THREADS 32 // threads counting at once, more than that share the last block and may lose counts
+#define CACHE_LINE 64
+#define READ_RETRIES 1000
+
+#define SUCCESS 0
+#define FAILED_OPEN_STATS 1
+#define BAD_STATS_FILE 2
+#define STATS_BUSY 3 // the writer kept changing it, try again
+
+typedef struct ThreadStats ThreadStats;
+
+struct ThreadStats {
+	_Alignas(CACHE_LINE) atomic_bool owned;
+	_Atomic uint64_t counters[STAT_COUNTERS];
+	_Atomic uint64_t latencyBuckets[STATS_LATENCY_BUCKETS];
+};
+
+static ThreadStats *claimThreadStats(void);
+static void releaseThreadStats(void *block);
+static void makeReleaseKey(void);
+static void addRelaxed(_Atomic uint64_t *counter, uint64_t n);
+
+static ThreadStats blocks[MAX_STATS_THREADS];
+static _Thread_local ThreadStats *mine = NULL;
+static pthread_key_t releaseKey;
+static pthread_once_t releaseKeyOnce = PTHREAD_ONCE_INIT;
+static _Atomic int64_t pcmDelay = 0; // only the playback thread writes these
+static _Atomic int64_t pcmDelayMin = -1; // -1 until a write after resetPCMDelayStats()
+static StatsSnapshot *published = NULL;
+static size_t publishedSize = 0;
+
+// Adds n to a STAT_* counter for the calling thread.
+void countStat(int stat, uint64_t n) {
+	if(stat < 0 || stat >= STAT_COUNTERS)
+		return;
+	ThreadStats *block = mine ? mine : claimThreadStats();
+	addRelaxed(&block->counters[stat], n);
+}
+
+// One drive command took seconds.
+void recordDriveLatency(double seconds) {
+	uint64_t usec = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+	int bucket = 0;
+	while(bucket < STATS_LATENCY_BUCKETS-1 && usec >> (bucket+1))
+		bucket++;
+	ThreadStats *block = mine ? mine : claimThreadStats();
+	addRelaxed(&block->latencyBuckets[bucket], 1);
+}
+
+// Playback thread only, the PCM's snd_pcm_delay() after a write.
+void recordPCMDelay(long frames) {
+	atomic_store_explicit(&pcmDelay, frames, memory_order_relaxed);
+	int64_t min = atomic_load_explicit(&pcmDelayMin, memory_order_relaxed);
+	if(min < 0 || frames < min)
+		atomic_store_explicit(&pcmDelayMin, frames, memory_order_relaxed);
+}
+
+// Called as playback starts, so the minimum delay is for this playback rather than the quiet before it.
+void resetPCMDelayStats(void) {
+	atomic_store_explicit(&pcmDelayMin, -1, memory_order_relaxed);
+}
+
+// Sums every thread's counters. Counts still being made while it runs may or may not be in it.
+void takeStatsSnapshot(StatsSnapshot *dest) {
+	memset(dest, 0, sizeof(StatsSnapshot));
+	dest->magic = STATS_MAGIC;
+	dest->version = STATS_VERSION;
+	dest->pid = getpid();
+	dest->publishedAt = monotonicSec();
+	for(int i=0; i<MAX_STATS_THREADS; i++) {
+		for(int c=0; c<STAT_COUNTERS; c++)
+			dest->counters[c] += atomic_load_explicit(&blocks[i].counters[c], memory_order_relaxed);
+		for(int b=0; b<STATS_LATENCY_BUCKETS; b++)
+			dest->latencyBuckets[b] += atomic_load_explicit(&blocks[i].latencyBuckets[b], memory_order_relaxed);
+	}
+	dest->pcmDelayFrames = atomic_load_explicit(&pcmDelay, memory_order_relaxed);
+	int64_t min = atomic_load_explicit(&pcmDelayMin, memory_order_relaxed);
+	dest->pcmDelayMinFrames = min < 0 ? 0 : min;
+}
+
+// Creates (or takes over) the stats file and maps it. Only one process should publish to a path at a time.
+int openStatsFile(const char *path) {
+	closeStatsFile();
+	int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if(fd == -1)
+		return FAILED_OPEN_STATS;
+	size_t size = sizeof(StatsSnapshot);
+	void *map = MAP_FAILED;
+	if(ftruncate(fd, size) == 0)
+		map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return FAILED_OPEN_STATS;
+	published = map;
+	publishedSize = size;
+	memset(published, 0, size);
+	return SUCCESS;
+}
+
+// Writes a fresh snapshot into the stats file, if one is open. Only one thread should publish.
+void publishStats(void) {
+	if(!published)
+		return;
+	StatsSnapshot snapshot;
+	takeStatsSnapshot(&snapshot);
+	uint32_t sequence = atomic_load_explicit(&published->sequence, memory_order_relaxed);
+	atomic_store_explicit(&published->sequence, sequence+1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	published->magic = snapshot.magic;
+	published->version = snapshot.version;
+	published->pid = snapshot.pid;
+	published->publishedAt = snapshot.publishedAt;
+	memcpy(published->counters, snapshot.counters, sizeof(snapshot.counters));
+	memcpy(published->latencyBuckets, snapshot.latencyBuckets, sizeof(snapshot.latencyBuckets));
+	published->pcmDelayFrames = snapshot.pcmDelayFrames;
+	published->pcmDelayMinFrames = snapshot.pcmDelayMinFrames;
+	atomic_store_explicit(&published->sequence, sequence+2, memory_order_release);
+}
+
+// The file is left behind, with the last snapshot in it, for whoever looks after the fact.
+void closeStatsFile(void) {
+	if(published)
+		munmap(published, publishedSize);
+	published = NULL;
+	publishedSize = 0;
+}
+
+// Copies a consistent snapshot out of the stats file at path, retrying while the publisher is part way through writing one.
+int readStatsFile(const char *path, StatsSnapshot *dest) {
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1)
+		return FAILED_OPEN_STATS;
+	StatsSnapshot *map = mmap(NULL, sizeof(StatsSnapshot), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return FAILED_OPEN_STATS;
+	int status = STATS_BUSY;
+	for(int i=0; i<READ_RETRIES && status == STATS_BUSY; i++) {
+		uint32_t before = atomic_load_explicit(&map->sequence, memory_order_acquire);
+		if(before & 1)
+			continue;
+		memcpy(dest, map, sizeof(StatsSnapshot));
+		atomic_thread_fence(memory_order_acquire);
+		if(atomic_load_explicit(&map->sequence, memory_order_relaxed) == before)
+			status = SUCCESS;
+	}
+	munmap(map, sizeof(StatsSnapshot));
+	if(status == SUCCESS && (dest->magic != STATS_MAGIC || dest->version != STATS_VERSION))
+		status = BAD_STATS_FILE;
+	return status;
+}
+
+// Takes a free block for the calling thread, it goes back when the thread exits.
+static ThreadStats *claimThreadStats(void) {
+	pthread_once(&releaseKeyOnce, makeReleaseKey);
+	ThreadStats *block = &blocks[MAX_STATS_THREADS-1];
+	for(int i=0; i<MAX_STATS_THREADS; i++) {
+		bool expected = false;
+		if(atomic_compare_exchange_strong(&blocks[i].owned, &expected, true)) {
+			block = &blocks[i];
+			pthread_setspecific(releaseKey, block);
+			break;
+		}
+	}
+	mine = block;
+	return block;
+}
+
+static void releaseThreadStats(void *block) {
+	atomic_store(&((ThreadStats *)block)->owned, false);
+}
+
+static void makeReleaseKey(void) {
+	pthread_key_create(&releaseKey, releaseThreadStats);
+}
+
+// Only the owning thread writes a block, so a plain load and store is enough, readers just need to see whole values.
+static void addRelaxed(_Atomic uint64_t *counter, uint64_t n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+// CLOCK_MONOTONIC in seconds, the clock every module times things with.
+double monotonicSec(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
@@ -0,0 +1,64 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Built with -DUSE_USDT (and systemtap's sys/sdt.h installed) the hot paths also fire USDT probes under the opticalcontrol provider,
+// for bpftrace/perf to attach to. They cost a nop each when nothing is attached, and nothing at all without the flag.
+// 	https://sourceware.org/systemtap/wiki/UserSpaceProbeImplementation
+#ifdef USE_USDT
+#include <sys/sdt.h>
+#define STATS_PROBE1(name, a) DTRACE_PROBE1(opticalcontrol, name, a)
+#define STATS_PROBE3(name, a, b, c) DTRACE_PROBE3(opticalcontrol, name, a, b, c)
+#else
+#define STATS_PROBE1(name, a)
+#define STATS_PROBE3(name, a, b, c)
+#endif
+
+// counters, see countStat()
+#define STAT_DRIVE_COMMANDS 0
+#define STAT_DRIVE_SENSE_ERRORS 1 // commands that completed with CHECK CONDITION
+#define STAT_DRIVE_FAILURES 2 // commands that never got to the drive or never came back
+#define STAT_BYTES_READ 3 // audio from READ CD
+#define STAT_READ_RETRIES 4 // reads sent again after a failure, at a smaller batch or on a reopened drive
+#define STAT_PCM_WRITES 5
+#define STAT_PCM_SHORT_WRITES 6 // snd_pcm_writei() took fewer frames than it was given
+#define STAT_PCM_XRUNS 7
+#define STAT_PCM_FRAMES 8 // frames handed to the PCM
+#define STAT_COUNTERS 9
+
+#define STATS_LATENCY_BUCKETS 24 // bucket i counts drive commands that took [2^i, 2^(i+1)) usec, the last one everything longer
+#define STATS_MAGIC 0x5453434f // "OCST"
+#define STATS_VERSION 1
+
+typedef struct StatsSnapshot StatsSnapshot;
+
+// What publishStats() writes into the stats file, and readStatsFile() reads back out.
+// Everything is a running total since the program started except the PCM delay, which is as of the last write to the PCM.
+struct StatsSnapshot {
+	uint32_t magic;
+	uint32_t version;
+	_Atomic uint32_t sequence; // odd while publishStats() is writing, readers retry until they see the same even value either side
+	uint32_t pid;
+	double publishedAt; // CLOCK_MONOTONIC seconds
+	uint64_t counters[STAT_COUNTERS];
+	uint64_t latencyBuckets[STATS_LATENCY_BUCKETS];
+	int64_t pcmDelayFrames;
+	int64_t pcmDelayMinFrames; // lowest since the last playback started, how close the PCM came to running dry
+};
+
+void countStat(int stat, uint64_t n);
+void recordDriveLatency(double seconds);
+void recordPCMDelay(long frames);
+void resetPCMDelayStats(void);
+void takeStatsSnapshot(StatsSnapshot *dest);
+
+int openStatsFile(const char *path);
+void publishStats(void);
+void closeStatsFile(void);
+int readStatsFile(const char *path, StatsSnapshot *dest);
+
+double monotonicSec(void);
+
+#endif
@@ -0,0 +1,591 @@
+// Checks the pieces that can go wrong without a drive or PCM to show it: the SPSC ring, the checksum and sample compare
+// kernels against their scalar versions, secure reads against a simulated drive that reads badly, the sector cache,
+// and the READ CD batch size backing off for a drive that refuses long reads. Prints each failed check and exits 1 if there were any.
+// Built from tests.c plus the ring and the read path, see the Makefile:
+// 	make test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "ringbuf.h"
+#include "checksum.h"
+#include "samplecmp.h"
+#include "secureread.h"
+#include "sectorcache.h"
+#include "readcd.h"
+#include "drive.h"
+#include "simdrive.h"
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+#define RING_SLOTS 8
+#define RING_SLOT_SIZE 64
+#define RING_LOW_WATERMARK 2
+#define RING_HIGH_WATERMARK 6
+#define RING_STRESS_SLOTS 200000
+#define KERNEL_TEST_LEN 4096 // longer than any kernel's unrolled loop, so every tail length below it gets tried
+#define KERNEL_TEST_ALIGNS 32 // misalignments tried, a whole AVX2 vector
+#define MOCK_LEADOUT_LBA (MOCK_TRACKS * MOCK_TRACK_SECONDS * CD_AUDIO_BLOCKS_ONE_SEC)
+#define SECURE_TEST_FIRST_LBA 1000
+#define SECURE_TEST_WINDOWS 4
+#define SECURE_TEST_ATTEMPTS 16
+#define SECURE_TEST_JITTER_FRAMES 8
+#define SECURE_TEST_BIT_ERRORS 2e-7 // most window reads come back clean, some don't
+#define SECURE_TEST_BAD_BIT_ERRORS 1e-3 // no two window reads ever agree
+#define CACHE_TEST_MB 1
+#define CACHE_TEST_FIRST_LBA 1000
+#define CACHE_TEST_READ_BLOCKS 100 // more than one READ CD batch
+#define BACKOFF_TEST_FIRST_LBA 5000
+#define BACKOFF_TEST_MAX_BLOCKS 10 // below the batch the probe picks for the mock, which claims a 1MB buffer
+#define BACKOFF_TEST_READ_BLOCKS 150
+
+typedef struct RingStress RingStress;
+
+struct RingStress {
+	RingBuf *ring;
+	unsigned long count;
+};
+
+static bool check(bool ok, const char *what, const char *file, int line);
+static void testRingOrder(void);
+static void testRingReadyFd(void);
+static void testRingThreads(void);
+static void *produceStress(void *arg);
+static void testCRC32Reference(void);
+static void testChecksumKernels(void);
+static void testSampleCmpKernels(void);
+static void testSecureRead(void);
+static int secureReadWindows(uint32_t *lba, int windows, unsigned long *wrongBlocks);
+static void testSectorCacheLRU(void);
+static void testSectorCacheReads(void);
+static void testBatchBackoff(void);
+static bool isReadable(int fd);
+static void fillRandom(uint8_t *data, size_t len, uint32_t seed);
+static bool isMockAudio(const uint8_t *data, uint32_t lba, uint32_t blocks);
+static void fillBlock(uint8_t *block, uint32_t lba);
+static bool blockMatches(const uint8_t *block, uint32_t lba);
+
+static int failures = 0;
+static int checks = 0;
+
+int main() {
+	testRingOrder();
+	testRingReadyFd();
+	testRingThreads();
+	testCRC32Reference();
+	testChecksumKernels();
+	testSampleCmpKernels();
+	testSecureRead();
+	testSectorCacheLRU();
+	testSectorCacheReads();
+	testBatchBackoff();
+
+	if(failures) {
+		printf("%d of %d checks failed\n", failures, checks);
+		return 1;
+	}
+	printf("all %d checks passed\n", checks);
+	return 0;
+}
+
+static bool check(bool ok, const char *what, const char *file, int line) {
+	checks++;
+	if(!ok) {
+		failures++;
+		printf("%s:%d: failed: %s\n", file, line, what);
+	}
+	return ok;
+}
+
+// Slots come out in the order they went in, a full ring has no slot to write and an empty one none to read.
+static void testRingOrder(void) {
+	RingBuf *ring;
+	CHECK(makeRingBuf(&ring, 0, RING_SLOT_SIZE, 0, 0) != 0);
+	if(!CHECK(makeRingBuf(&ring, RING_SLOTS, RING_SLOT_SIZE, RING_LOW_WATERMARK, RING_HIGH_WATERMARK) == 0))
+		return;
+	CHECK(getRingSlotCount(ring) == RING_SLOTS);
+	CHECK(getRingSlotSize(ring) == RING_SLOT_SIZE);
+	CHECK(getReadableSlot(ring) == NULL);
+
+	// round twice, so the indexes go past the slot count
+	for(uint32_t round=0; round<2; round++) {
+		for(uint32_t i=0; i<RING_SLOTS; i++) {
+			RingSlot *slot = getWritableSlot(ring);
+			if(!CHECK(slot != NULL))
+				break;
+			slot->startLBA = round * RING_SLOTS + i;
+			slot->size = RING_SLOT_SIZE;
+			memset(slot->data, slot->startLBA, RING_SLOT_SIZE);
+			publishSlot(ring);
+		}
+		CHECK(getWritableSlot(ring) == NULL);
+		CHECK(getRingFill(ring) == RING_SLOTS);
+		for(uint32_t i=0; i<RING_SLOTS; i++) {
+			RingSlot *slot = getReadableSlot(ring);
+			if(!CHECK(slot != NULL))
+				break;
+			CHECK(slot->startLBA == round * RING_SLOTS + i);
+			CHECK(slot->data[RING_SLOT_SIZE-1] == (uint8_t)slot->startLBA);
+			releaseSlot(ring);
+		}
+		CHECK(getReadableSlot(ring) == NULL);
+	}
+
+	RingStats stats;
+	getRingStats(ring, &stats);
+	CHECK(stats.slotsProduced == 2 * RING_SLOTS);
+	CHECK(stats.slotsConsumed == 2 * RING_SLOTS);
+	CHECK(stats.maxFill == RING_SLOTS);
+	CHECK(stats.minFill == 0);
+	CHECK(stats.lowWatermarkHits == 2); // once per round, not once per slot under the watermark
+	destroyRingBuf(ring);
+}
+
+// Publishing makes the ready fd readable, clearing it makes it quiet again.
+static void testRingReadyFd(void) {
+	RingBuf *ring;
+	if(!CHECK(makeRingBuf(&ring, RING_SLOTS, RING_SLOT_SIZE, RING_LOW_WATERMARK, RING_HIGH_WATERMARK) == 0))
+		return;
+	int fd = getRingReadyFd(ring);
+	CHECK(!isReadable(fd));
+	getWritableSlot(ring);
+	publishSlot(ring);
+	getWritableSlot(ring);
+	publishSlot(ring);
+	CHECK(isReadable(fd));
+	clearRingReady(ring);
+	CHECK(!isReadable(fd));
+	clearRingReady(ring); // already clear, the read fails with EAGAIN and that's fine
+	CHECK(!isReadable(fd));
+	destroyRingBuf(ring);
+}
+
+// A producer and a consumer on their own threads, the consumer has to see every slot once and in order.
+static void testRingThreads(void) {
+	RingStress stress = {.count = RING_STRESS_SLOTS};
+	if(!CHECK(makeRingBuf(&stress.ring, RING_SLOTS, RING_SLOT_SIZE, RING_LOW_WATERMARK, RING_HIGH_WATERMARK) == 0))
+		return;
+	pthread_t producer;
+	if(!CHECK(pthread_create(&producer, NULL, produceStress, &stress) == 0)) {
+		destroyRingBuf(stress.ring);
+		return;
+	}
+
+	unsigned long outOfOrder = 0;
+	unsigned long badData = 0;
+	for(unsigned long expected=0; expected<stress.count; ) {
+		RingSlot *slot = getReadableSlot(stress.ring);
+		if(!slot) {
+			sched_yield(); // not waitForRing(), the threads should race each other as hard as they can
+			continue;
+		}
+		if(slot->startLBA != (uint32_t)expected)
+			outOfOrder++;
+		uint32_t stamp;
+		memcpy(&stamp, slot->data + RING_SLOT_SIZE - sizeof(stamp), sizeof(stamp));
+		if(stamp != (uint32_t)expected)
+			badData++;
+		releaseSlot(stress.ring);
+		expected++;
+	}
+	pthread_join(producer, NULL);
+	CHECK(outOfOrder == 0);
+	CHECK(badData == 0);
+	CHECK(getRingFill(stress.ring) == 0);
+	destroyRingBuf(stress.ring);
+}
+
+// The stamp goes at the end of the data so a slot published before its data was written shows up as badData.
+static void *produceStress(void *arg) {
+	RingStress *stress = arg;
+	for(unsigned long i=0; i<stress->count; ) {
+		RingSlot *slot = getWritableSlot(stress->ring);
+		if(!slot) {
+			sched_yield();
+			continue;
+		}
+		uint32_t stamp = i;
+		slot->startLBA = stamp;
+		memcpy(slot->data + RING_SLOT_SIZE - sizeof(stamp), &stamp, sizeof(stamp));
+		publishSlot(stress->ring);
+		i++;
+	}
+	return NULL;
+}
+
+// The scalar kernel is the reference for the others, so it gets checked against the standard check value first.
+static void testCRC32Reference(void) {
+	const char *digits = "123456789";
+	if(!CHECK(setChecksumKernel(CHECKSUM_KERNEL_SCALAR) == 0))
+		return;
+	CHECK(~crc32Update(0xffffffff, (const uint8_t *)digits, strlen(digits)) == 0xcbf43926);
+
+	// a few frames worked out by hand: v1 sums frame * position, v2 adds the high halves of the products too
+	uint32_t frames[] = {1, 2, 0xffffffff, 0x80000000};
+	uint32_t lo = 0;
+	uint32_t hi = 0;
+	accurateRipUpdate(frames, 4, 1, &lo, &hi);
+	// 1*1 + 2*2 + 0xffffffff*3 + 0x80000000*4: the low halves are 1 + 4 + 0xfffffffd + 0, the high ones 0 + 0 + 2 + 2
+	CHECK(lo == (uint32_t)(1 + 4 + 0xfffffffdu));
+	CHECK(hi == 4);
+}
+
+// Every kernel the CPU can run has to agree with the scalar one on every length and alignment, including the short tails.
+static void testChecksumKernels(void) {
+	uint8_t *data = malloc(KERNEL_TEST_LEN + KERNEL_TEST_ALIGNS);
+	if(!CHECK(data != NULL))
+		return;
+	fillRandom(data, KERNEL_TEST_LEN + KERNEL_TEST_ALIGNS, 1);
+
+	int kernels[] = {CHECKSUM_KERNEL_SSE2, CHECKSUM_KERNEL_AVX2};
+	for(size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++) {
+		if(setChecksumKernel(kernels[k])) {
+			printf("skipping checksum kernel %s, the CPU doesn't support it\n", getChecksumKernelName(kernels[k]));
+			continue;
+		}
+		unsigned long crcMismatches = 0;
+		unsigned long arMismatches = 0;
+		for(size_t align=0; align<KERNEL_TEST_ALIGNS; align++) {
+			for(size_t len=0; len<=KERNEL_TEST_LEN; len += len < 300 ? 1 : 97) {
+				setChecksumKernel(CHECKSUM_KERNEL_SCALAR);
+				uint32_t crc = crc32Update(0xffffffff, data + align, len);
+				uint32_t lo = 0x12345678;
+				uint32_t hi = 0x9abcdef0;
+				// the frames are read as uint32_t, so only whole frame misalignments are real
+				const uint32_t *frames = (const uint32_t *)(data + align / CD_AUDIO_FRAME_SIZE * CD_AUDIO_FRAME_SIZE);
+				uint32_t firstMultiplier = 1 + align * 1000003;
+				accurateRipUpdate(frames, len / CD_AUDIO_FRAME_SIZE, firstMultiplier, &lo, &hi);
+
+				setChecksumKernel(kernels[k]);
+				if(crc32Update(0xffffffff, data + align, len) != crc)
+					crcMismatches++;
+				uint32_t kernelLo = 0x12345678;
+				uint32_t kernelHi = 0x9abcdef0;
+				accurateRipUpdate(frames, len / CD_AUDIO_FRAME_SIZE, firstMultiplier, &kernelLo, &kernelHi);
+				if(kernelLo != lo || kernelHi != hi)
+					arMismatches++;
+			}
+		}
+		if(crcMismatches || arMismatches)
+			printf("checksum kernel %s: %lu CRC32 and %lu AccurateRip mismatches\n", getChecksumKernelName(kernels[k]), crcMismatches, arMismatches);
+		CHECK(crcMismatches == 0);
+		CHECK(arMismatches == 0);
+	}
+	setChecksumKernel(CHECKSUM_KERNEL_BEST);
+	free(data);
+}
+
+// Same for secure read's compare kernels: a mismatch at every position, and a run planted at every frame offset.
+static void testSampleCmpKernels(void) {
+	uint8_t *a = malloc(KERNEL_TEST_LEN);
+	uint8_t *b = malloc(KERNEL_TEST_LEN);
+	if(!CHECK(a != NULL && b != NULL)) {
+		free(a);
+		free(b);
+		return;
+	}
+	fillRandom(a, KERNEL_TEST_LEN, 2);
+
+	int kernels[] = {SAMPLE_CMP_SSE2, SAMPLE_CMP_AVX2};
+	for(size_t k=0; k<sizeof(kernels)/sizeof(kernels[0]); k++) {
+		if(setSampleCmpKernel(kernels[k])) {
+			printf("skipping sample compare kernel %s, the CPU doesn't support it\n", getSampleCmpKernelName(kernels[k]));
+			continue;
+		}
+		unsigned long mismatches = 0;
+		memcpy(b, a, KERNEL_TEST_LEN);
+		for(size_t at=0; at<=KERNEL_TEST_LEN; at++) {
+			if(at < KERNEL_TEST_LEN)
+				b[at] ^= 0x01;
+			setSampleCmpKernel(SAMPLE_CMP_SCALAR);
+			size_t expected = countMatchingBytes(a, b, KERNEL_TEST_LEN);
+			setSampleCmpKernel(kernels[k]);
+			if(expected != at || countMatchingBytes(a, b, KERNEL_TEST_LEN) != expected)
+				mismatches++;
+			if(at < KERNEL_TEST_LEN)
+				b[at] ^= 0x01;
+		}
+
+		size_t runLen = 16 * CD_AUDIO_FRAME_SIZE;
+		for(size_t offset=0; offset+runLen<=KERNEL_TEST_LEN; offset += CD_AUDIO_FRAME_SIZE) {
+			setSampleCmpKernel(SAMPLE_CMP_SCALAR);
+			long expected = findNearestSampleRun(a, KERNEL_TEST_LEN, a + offset, runLen, KERNEL_TEST_LEN / 2);
+			setSampleCmpKernel(kernels[k]);
+			if(expected != (long)offset || findNearestSampleRun(a, KERNEL_TEST_LEN, a + offset, runLen, KERNEL_TEST_LEN / 2) != expected)
+				mismatches++;
+		}
+		if(mismatches)
+			printf("sample compare kernel %s: %lu mismatches\n", getSampleCmpKernelName(kernels[k]), mismatches);
+		CHECK(mismatches == 0);
+	}
+	setSampleCmpKernel(SAMPLE_CMP_BEST);
+	free(a);
+	free(b);
+}
+
+// Secure reads have to give back exactly what is on the disc from a drive that lands a few frames off after every seek,
+// and from one that flips the odd bit. From one that gets every read wrong they must not claim to have verified anything.
+static void testSecureRead(void) {
+	SimDriveTiming timing = {0};
+	SecureReadStats stats;
+	unsigned long wrongBlocks = 0;
+	uint32_t lba = SECURE_TEST_FIRST_LBA;
+	if(!CHECK(selectDriveBackend(DRIVE_BACKEND_MOCK, "0") == 0))
+		return;
+	setSimDriveTiming(&timing);
+	setSecureReadAttempts(SECURE_TEST_ATTEMPTS);
+	resetSecureReadStats();
+
+	// the first window has nothing verified to line up against, it is only as good as the drive's aim
+	CHECK(secureReadWindows(&lba, 1, &wrongBlocks) == 0);
+	timing.jitterFrames = SECURE_TEST_JITTER_FRAMES;
+	setSimDriveTiming(&timing);
+	CHECK(secureReadWindows(&lba, SECURE_TEST_WINDOWS, &wrongBlocks) == 0);
+	getSecureReadStats(&stats);
+	CHECK(stats.jitterCorrected > 0);
+	CHECK(stats.maxJitterFrames > 0 && stats.maxJitterFrames <= 2*SECURE_TEST_JITTER_FRAMES);
+	CHECK(wrongBlocks == 0);
+
+	timing.jitterFrames = 0;
+	timing.bitErrorRate = SECURE_TEST_BIT_ERRORS;
+	setSimDriveTiming(&timing);
+	CHECK(secureReadWindows(&lba, SECURE_TEST_WINDOWS, &wrongBlocks) == 0);
+	getSecureReadStats(&stats);
+	CHECK(stats.mismatches + stats.unaligned > 0);
+	CHECK(stats.unverified == 0);
+	CHECK(wrongBlocks == 0);
+
+	timing.bitErrorRate = SECURE_TEST_BAD_BIT_ERRORS;
+	setSimDriveTiming(&timing);
+	CHECK(secureReadWindows(&lba, 1, &wrongBlocks) == SECURE_READ_UNVERIFIED);
+	getSecureReadStats(&stats);
+	CHECK(stats.unverified == 1);
+
+	memset(&timing, 0, sizeof(SimDriveTiming));
+	setSimDriveTiming(&timing);
+	closeOpticalDrive();
+}
+
+// Reads windows of a second each from lba on, counting the blocks that don't hold what the mock disc has there.
+// Stops at the first window that isn't verified and returns its status.
+static int secureReadWindows(uint32_t *lba, int windows, unsigned long *wrongBlocks) {
+	uint8_t *window = malloc(CD_AUDIO_BLOCKS_ONE_SEC * CD_AUDIO_BLOCK_SIZE);
+	if(!window)
+		return -1;
+	int status = 0;
+	for(int i=0; i<windows && status == 0; i++) {
+		long written = 0;
+		status = secureReadCDAudioInto(*lba, MOCK_LEADOUT_LBA, CD_AUDIO_BLOCKS_ONE_SEC, window, &written);
+		if(status == 0) {
+			for(uint32_t b=0; b<CD_AUDIO_BLOCKS_ONE_SEC; b++) {
+				if(!isMockAudio(window + b * CD_AUDIO_BLOCK_SIZE, *lba + b, 1))
+					(*wrongBlocks)++;
+			}
+		}
+		*lba += CD_AUDIO_BLOCKS_ONE_SEC;
+	}
+	free(window);
+	return status;
+}
+
+// Filling the cache and going one past evicts the least recently used block, and looking a block up makes it the most recent.
+static void testSectorCacheLRU(void) {
+	uint8_t block[CD_AUDIO_BLOCK_SIZE];
+	SectorCacheStats stats;
+
+	CHECK(setSectorCacheSize(-1) != 0);
+	if(!CHECK(setSectorCacheSize(CACHE_TEST_MB) == 0))
+		return;
+	CHECK(isSectorCacheEnabled());
+	getSectorCacheStats(&stats);
+	uint32_t capacity = stats.capacity;
+	CHECK(capacity == CACHE_TEST_MB * 1024 * 1024 / CD_AUDIO_BLOCK_SIZE);
+
+	uint32_t first = CACHE_TEST_FIRST_LBA;
+	for(uint32_t lba=first; lba<first+capacity; lba++) {
+		fillBlock(block, lba);
+		cacheSectors(lba, block, 1);
+	}
+	getSectorCacheStats(&stats);
+	CHECK(stats.blocks == capacity);
+	CHECK(stats.evictions == 0);
+	CHECK(!containsSector(first - 1));
+
+	// the oldest block is looked at, so the second oldest goes first
+	const uint8_t *cached = lookupSector(first);
+	CHECK(cached != NULL && blockMatches(cached, first));
+	fillBlock(block, first + capacity);
+	cacheSectors(first + capacity, block, 1);
+	CHECK(containsSector(first));
+	CHECK(!containsSector(first + 1));
+	CHECK(containsSector(first + 2));
+	CHECK(containsSector(first + capacity));
+
+	// caching a block that's already there refreshes it without evicting anything
+	fillBlock(block, first + 2);
+	block[0] ^= 0xff;
+	cacheSectors(first + 2, block, 1);
+	cached = lookupSector(first + 2);
+	CHECK(cached != NULL && cached[0] == block[0]);
+	getSectorCacheStats(&stats);
+	CHECK(stats.evictions == 1);
+	CHECK(stats.blocks == capacity);
+
+	// a run of several blocks at once evicts as many, oldest first: first + 3 on, since first and first + 2 were used since
+	uint8_t *run = malloc(3 * CD_AUDIO_BLOCK_SIZE);
+	if(CHECK(run != NULL)) {
+		uint32_t runLBA = first + 2 * capacity;
+		for(uint32_t b=0; b<3; b++)
+			fillBlock(run + b * CD_AUDIO_BLOCK_SIZE, runLBA + b);
+		cacheSectors(runLBA, run, 3);
+		CHECK(!containsSector(first + 3));
+		CHECK(!containsSector(first + 4));
+		CHECK(!containsSector(first + 5));
+		CHECK(containsSector(first + 6));
+		CHECK(containsSector(first) && containsSector(first + 2));
+		cached = lookupSector(runLBA + 1);
+		CHECK(cached != NULL && blockMatches(cached, runLBA + 1));
+		free(run);
+	}
+	// every block still cached holds its own data, whichever slot it landed in
+	unsigned long wrongData = 0;
+	for(uint32_t lba=first+6; lba<first+capacity; lba++) {
+		cached = lookupSector(lba);
+		if(!cached || !blockMatches(cached, lba))
+			wrongData++;
+	}
+	CHECK(wrongData == 0);
+
+	clearSectorCache();
+	CHECK(!containsSector(first));
+	CHECK(lookupSector(first) == NULL);
+	CHECK(setSectorCacheSize(0) == 0);
+	CHECK(!isSectorCacheEnabled());
+	cacheSectors(first, block, 1);
+	CHECK(!containsSector(first));
+}
+
+// Reading the same range twice goes to the drive once, the second time every block comes out of the cache.
+static void testSectorCacheReads(void) {
+	DriveStats drive;
+	SectorCacheStats cache;
+	long written = 0;
+	uint8_t *data = malloc(CACHE_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	if(!CHECK(data != NULL))
+		return;
+	if(!CHECK(selectDriveBackend(DRIVE_BACKEND_MOCK, "0") == 0 && setSectorCacheSize(CACHE_TEST_MB) == 0)) {
+		free(data);
+		return;
+	}
+
+	CHECK(readCDAudioInto(CACHE_TEST_FIRST_LBA, MOCK_LEADOUT_LBA, CACHE_TEST_READ_BLOCKS, data, &written) == 0);
+	CHECK(written == CACHE_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	CHECK(isMockAudio(data, CACHE_TEST_FIRST_LBA, CACHE_TEST_READ_BLOCKS));
+	getDriveStats(&drive);
+	unsigned long commands = drive.commands;
+	getSectorCacheStats(&cache);
+	unsigned long hits = cache.hits;
+	CHECK(commands > 0);
+
+	memset(data, 0, CACHE_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	written = 0;
+	CHECK(readCDAudioInto(CACHE_TEST_FIRST_LBA, MOCK_LEADOUT_LBA, CACHE_TEST_READ_BLOCKS, data, &written) == 0);
+	CHECK(written == CACHE_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	CHECK(isMockAudio(data, CACHE_TEST_FIRST_LBA, CACHE_TEST_READ_BLOCKS));
+	getDriveStats(&drive);
+	CHECK(drive.commands == commands);
+	getSectorCacheStats(&cache);
+	CHECK(cache.hits == hits + CACHE_TEST_READ_BLOCKS);
+
+	setSectorCacheSize(0);
+	closeOpticalDrive();
+	free(data);
+}
+
+// A drive that claims a buffer for more than it will read in one go: the read backs off until its batches fit and still gets every block,
+// and the reads after it start from the smaller batch instead of being refused again.
+static void testBatchBackoff(void) {
+	SimDriveTiming timing = {0};
+	DriveStats drive;
+	long written = 0;
+	uint8_t *data = malloc(BACKOFF_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	if(!CHECK(data != NULL))
+		return;
+	if(!CHECK(selectDriveBackend(DRIVE_BACKEND_MOCK, "0") == 0)) {
+		free(data);
+		return;
+	}
+	setSimDriveTiming(&timing);
+	closeOpticalDrive();
+
+	// the first read opens the drive, which probes the batch size
+	uint32_t lba = BACKOFF_TEST_FIRST_LBA;
+	CHECK(readCDAudioInto(lba, MOCK_LEADOUT_LBA, 1, data, &written) == 0);
+	CHECK(getReadBatchBlocks() > BACKOFF_TEST_MAX_BLOCKS);
+	lba++;
+
+	timing.maxTransferBlocks = BACKOFF_TEST_MAX_BLOCKS;
+	setSimDriveTiming(&timing);
+	CHECK(readCDAudioInto(lba, MOCK_LEADOUT_LBA, BACKOFF_TEST_READ_BLOCKS, data, &written) == 0);
+	CHECK(written == BACKOFF_TEST_READ_BLOCKS * CD_AUDIO_BLOCK_SIZE);
+	CHECK(isMockAudio(data, lba, BACKOFF_TEST_READ_BLOCKS));
+	uint32_t batchBlocks = getReadBatchBlocks();
+	CHECK(batchBlocks > 0 && batchBlocks <= BACKOFF_TEST_MAX_BLOCKS);
+	lba += BACKOFF_TEST_READ_BLOCKS;
+
+	getDriveStats(&drive);
+	unsigned long refused = drive.checkConditions;
+	CHECK(readCDAudioInto(lba, MOCK_LEADOUT_LBA, BACKOFF_TEST_READ_BLOCKS, data, &written) == 0);
+	CHECK(isMockAudio(data, lba, BACKOFF_TEST_READ_BLOCKS));
+	CHECK(getReadBatchBlocks() == batchBlocks);
+	getDriveStats(&drive);
+	CHECK(drive.checkConditions == refused);
+
+	timing.maxTransferBlocks = 0;
+	setSimDriveTiming(&timing);
+	closeOpticalDrive();
+	free(data);
+}
+
+static bool isReadable(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLIN};
+	return poll(&pfd, 1, 0) == 1 && (pfd.revents & POLLIN);
+}
+
+// xorshift, so every run tests the same data
+static void fillRandom(uint8_t *data, size_t len, uint32_t seed) {
+	uint32_t x = seed * 2654435761u;
+	for(size_t i=0; i<len; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		data[i] = x;
+	}
+}
+
+// The mock disc's audio is every frame's number counted from the start of the disc, see simdrive.c.
+static bool isMockAudio(const uint8_t *data, uint32_t lba, uint32_t blocks) {
+	uint32_t frame = lba * (CD_AUDIO_BLOCK_SIZE / CD_AUDIO_FRAME_SIZE);
+	size_t frames = (size_t)blocks * (CD_AUDIO_BLOCK_SIZE / CD_AUDIO_FRAME_SIZE);
+	for(size_t i=0; i<frames; i++, frame++) {
+		if(memcmp(data + i * CD_AUDIO_FRAME_SIZE, &frame, CD_AUDIO_FRAME_SIZE))
+			return false;
+	}
+	return true;
+}
+
+static void fillBlock(uint8_t *block, uint32_t lba) {
+	fillRandom(block, CD_AUDIO_BLOCK_SIZE, lba + 1);
+}
+
+static bool blockMatches(const uint8_t *block, uint32_t lba) {
+	uint8_t expected[CD_AUDIO_BLOCK_SIZE];
+	fillBlock(expected, lba);
+	return memcmp(block, expected, CD_AUDIO_BLOCK_SIZE) == 0;
+}
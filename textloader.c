@@ -0,0 +1,97 @@
+// Reads a disc's CD-Text on its own thread, so playback can start as soon as the TOC is known.
+// READ TOC format 0101b is the slowest thing many drives are asked at startup and playing doesn't need its answer.
+//
+// The thread goes through the disc cache like anything else, and its commands are sent with setDriveBackground(),
+// so drive.c holds them back until the audio reads leave a gap, see drive.c.
+// The CDText isn't touched again once the thread publishes it, so any thread can read names out of what getLoadedText() returns
+// for as long as the loader lives.
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "textloader.h"
+#include "disccache.h"
+#include "drive.h"
+
+#define SUCCESS 0
+#define FAILED_ALLOCATE_MEMORY 1
+#define FAILED_START_THREAD 2
+
+void *loadText(void *loader);
+
+struct TextLoader {
+	pthread_t thread;
+	bool joined; // by waitForText()
+	TOC *toc;
+	TextLoadedCallback onLoaded;
+	void *arg;
+	CDText *_Atomic text; // NULL until the thread has finished with it
+	atomic_int status; // TEXT_LOADING until then
+};
+
+// Starts a thread reading toc's disc's CD-Text. toc must stay put until stopTextLoader().
+// onLoaded may be NULL. On failure *dest is unmodified.
+int startTextLoader(TextLoader **dest, TOC *toc, TextLoadedCallback onLoaded, void *arg) {
+	TextLoader *loader = malloc(sizeof(TextLoader));
+	if(!loader)
+		return FAILED_ALLOCATE_MEMORY;
+	loader->joined = false;
+	loader->toc = toc;
+	loader->onLoaded = onLoaded;
+	loader->arg = arg;
+	atomic_init(&loader->text, NULL);
+	atomic_init(&loader->status, TEXT_LOADING);
+
+	if(pthread_create(&loader->thread, NULL, loadText, loader)) {
+		free(loader);
+		return FAILED_START_THREAD;
+	}
+	*dest = loader;
+	return SUCCESS;
+}
+
+// NULL until the CD-Text has been read, and for good if the disc has none. Safe from any thread.
+CDText *getLoadedText(TextLoader *loader) {
+	return atomic_load_explicit(&loader->text, memory_order_acquire);
+}
+
+// TEXT_LOADING, then readTextCached()'s status.
+int getTextLoaderStatus(TextLoader *loader) {
+	return atomic_load_explicit(&loader->status, memory_order_acquire);
+}
+
+// Waits for the thread to finish, for callers that can't go on without the names, like ripping.
+CDText *waitForText(TextLoader *loader) {
+	if(!loader->joined)
+		pthread_join(loader->thread, NULL);
+	loader->joined = true;
+	return getLoadedText(loader);
+}
+
+// Waits for the thread, a read in progress can't be called off, then frees the loader and the CDText with it.
+void stopTextLoader(TextLoader *loader) {
+	if(!loader->joined)
+		pthread_join(loader->thread, NULL);
+	CDText *text = getLoadedText(loader);
+	if(text) {
+		destroyCDText(text);
+		free(text);
+	}
+	free(loader);
+}
+
+void *loadText(void *arg) {
+	TextLoader *loader = arg;
+	setDriveBackground(true);
+	CDText *text = NULL;
+	int status = readTextCached(&text, loader->toc);
+	if(status)
+		text = NULL;
+	atomic_store_explicit(&loader->text, text, memory_order_release);
+	atomic_store_explicit(&loader->status, status, memory_order_release);
+	if(loader->onLoaded)
+		loader->onLoaded(text, status, loader->arg);
+	return NULL;
+}
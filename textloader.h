@@ -0,0 +1,22 @@
+
+#ifndef TEXTLOADER_H
+#define TEXTLOADER_H
+
+#include <stdbool.h>
+#include "readtoc.h"
+#include "readtext.h"
+
+#define TEXT_LOADING -1 // getTextLoaderStatus() until the loader is done
+
+typedef struct TextLoader TextLoader;
+
+// Called once, on the loader's thread, when it is done. status is readTextCached()'s, text is NULL unless it is 0.
+typedef void (*TextLoadedCallback)(CDText *text, int status, void *arg);
+
+int startTextLoader(TextLoader **dest, TOC *toc, TextLoadedCallback onLoaded, void *arg);
+CDText *getLoadedText(TextLoader *loader);
+int getTextLoaderStatus(TextLoader *loader);
+CDText *waitForText(TextLoader *loader);
+void stopTextLoader(TextLoader *loader);
+
+#endif
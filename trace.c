@@ -0,0 +1,271 @@
+// Records every command sent through drive.c, and reads the recordings back for the replay backend in simdrive.c.
+//
+// A real drive's quirks (the slow first read after spin-up, the odd multi-second stall on a scratched disc) can't be reproduced
+// on a machine without it. Recorded once, they can be replayed into readCDAudio(), readTOC() and readText() as often as needed.
+//
+// The file is TRACE_MAGIC, then one record per completed command, little endian, in the order the commands completed:
+// 	uint32 latency in usec, uint32 data length, int32 resid, uint32 payload length,
+// 	uint8 status, uint8 flags, uint8 CDB length, uint8 sense length,
+// 	then the CDB, the sense data and the payload (the bytes read from the drive) back to back.
+// The latency is the drive's own time on the command. For queued commands the time spent waiting behind the ones queued before it
+// is left out, so replaying with fewer or more commands in flight still gives each command its own cost.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+#define RECORD_HEADER_SIZE 20
+#define OPCODE_READ_CD 0xbe
+#define MATCH_WINDOW 256 // records searched ahead of the last match before looking through the whole trace
+#define INITIAL_RECORDS 1024
+
+#define SUCCESS 0
+#define FAILED_OPEN_TRACE 1
+#define FAILED_WRITE_TRACE 2
+#define TRACE_ALREADY_ACTIVE 3
+
+struct Trace {
+	uint8_t *map;
+	size_t size;
+	TraceRecord *records;
+	unsigned long recordsLen;
+	bool *used; // replayed already, so a repeated command gets the next recording of it
+	unsigned long cursor; // one past the last record matched
+	unsigned long matched;
+	unsigned long outOfOrder;
+	unsigned long unmatched;
+};
+
+static void putLE32(uint8_t *dest, uint32_t value);
+static uint32_t getLE32(const uint8_t *src);
+static bool sameCommand(const TraceRecord *record, const DriveCommand *command);
+
+static pthread_mutex_t writeLock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *traceFile = NULL;
+static bool traceAudio = true;
+
+// Starts recording to path, replacing whatever is there.
+// keepAudio false leaves out what READ CD returned and keeps only its timing, which makes a long recording a fraction of the size.
+// Such a trace replays READ CD as silence.
+int startDriveTrace(const char *path, bool keepAudio) {
+	pthread_mutex_lock(&writeLock);
+	if(traceFile) {
+		pthread_mutex_unlock(&writeLock);
+		return TRACE_ALREADY_ACTIVE;
+	}
+	traceFile = fopen(path, "wb");
+	if(!traceFile || fwrite(TRACE_MAGIC, TRACE_MAGIC_LEN, 1, traceFile) != 1) {
+		if(traceFile)
+			fclose(traceFile);
+		traceFile = NULL;
+		pthread_mutex_unlock(&writeLock);
+		return FAILED_OPEN_TRACE;
+	}
+	traceAudio = keepAudio;
+	pthread_mutex_unlock(&writeLock);
+	return SUCCESS;
+}
+
+void stopDriveTrace(void) {
+	pthread_mutex_lock(&writeLock);
+	if(traceFile)
+		fclose(traceFile);
+	traceFile = NULL;
+	pthread_mutex_unlock(&writeLock);
+}
+
+// Writes out whatever is buffered, so the recording is complete up to now even if the program never stops it.
+void flushDriveTrace(void) {
+	pthread_mutex_lock(&writeLock);
+	if(traceFile)
+		fflush(traceFile);
+	pthread_mutex_unlock(&writeLock);
+}
+
+// Only a hint for drive.c to skip timing commands nobody is recording, traceDriveCommand() checks again.
+bool isDriveTraceActive(void) {
+	return traceFile != NULL;
+}
+
+// Called by drive.c for every command once it completes. dataIn is where the drive put what it read, NULL if it read nothing.
+// A failed write stops the recording rather than leave a trace with a hole in it.
+void traceDriveCommand(const DriveCommand *command, int status, const void *dataIn, double seconds) {
+	uint32_t payloadLen = 0;
+	uint8_t flags = 0;
+	if(dataIn && command->direction == DRIVE_DATA_IN && command->resid >= 0 && (unsigned int)command->resid < command->dataLen)
+		payloadLen = command->dataLen - command->resid;
+	pthread_mutex_lock(&writeLock);
+	if(!traceFile) {
+		pthread_mutex_unlock(&writeLock);
+		return;
+	}
+	if(payloadLen && !traceAudio && command->cdb[0] == OPCODE_READ_CD) {
+		payloadLen = 0;
+		flags |= TRACE_PAYLOAD_DROPPED;
+	}
+
+	uint8_t header[RECORD_HEADER_SIZE];
+	putLE32(header, seconds > 0 ? (uint32_t)(seconds * 1e6 + 0.5) : 0);
+	putLE32(header+4, command->dataLen);
+	putLE32(header+8, (uint32_t)command->resid);
+	putLE32(header+12, payloadLen);
+	header[16] = status;
+	header[17] = flags;
+	header[18] = command->cdbLen;
+	header[19] = command->senseLen;
+	bool written = fwrite(header, RECORD_HEADER_SIZE, 1, traceFile) == 1
+		&& fwrite(command->cdb, 1, command->cdbLen, traceFile) == command->cdbLen
+		&& fwrite(command->sense, 1, command->senseLen, traceFile) == command->senseLen
+		&& (payloadLen == 0 || fwrite(dataIn, payloadLen, 1, traceFile) == 1);
+	if(!written) {
+		fclose(traceFile);
+		traceFile = NULL;
+	}
+	pthread_mutex_unlock(&writeLock);
+}
+
+// Maps a recording and indexes its records. NULL if it can't be read or isn't a trace.
+// A recording cut off part way through a record, like one whose program was killed, loads up to the last whole record.
+Trace *loadTrace(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd == -1)
+		return NULL;
+	struct stat st;
+	if(fstat(fd, &st) || st.st_size < TRACE_MAGIC_LEN) {
+		close(fd);
+		return NULL;
+	}
+	uint8_t *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return NULL;
+	Trace *trace = calloc(1, sizeof(Trace));
+	if(!trace || memcmp(map, TRACE_MAGIC, TRACE_MAGIC_LEN)) {
+		free(trace);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+	trace->map = map;
+	trace->size = st.st_size;
+
+	unsigned long recordsAlloc = INITIAL_RECORDS;
+	trace->records = malloc(recordsAlloc * sizeof(TraceRecord));
+	size_t offset = TRACE_MAGIC_LEN;
+	while(trace->records && offset + RECORD_HEADER_SIZE <= trace->size) {
+		const uint8_t *header = map + offset;
+		TraceRecord record;
+		memset(&record, 0, sizeof(TraceRecord));
+		record.latencyUsec = getLE32(header);
+		record.dataLen = getLE32(header+4);
+		record.resid = (int32_t)getLE32(header+8);
+		record.payloadLen = getLE32(header+12);
+		record.status = header[16];
+		record.flags = header[17];
+		record.cdbLen = header[18];
+		record.senseLen = header[19];
+		size_t recordSize = RECORD_HEADER_SIZE + record.cdbLen + record.senseLen + (size_t)record.payloadLen;
+		if(record.cdbLen > DRIVE_MAX_CDB || recordSize > trace->size - offset)
+			break;
+		memcpy(record.cdb, header + RECORD_HEADER_SIZE, record.cdbLen);
+		record.sense = header + RECORD_HEADER_SIZE + record.cdbLen;
+		record.payload = record.sense + record.senseLen;
+
+		if(trace->recordsLen == recordsAlloc) {
+			recordsAlloc *= 2;
+			TraceRecord *resized = realloc(trace->records, recordsAlloc * sizeof(TraceRecord));
+			if(!resized)
+				break;
+			trace->records = resized;
+		}
+		trace->records[trace->recordsLen++] = record;
+		offset += recordSize;
+	}
+	trace->used = calloc(trace->recordsLen ? trace->recordsLen : 1, sizeof(bool));
+	if(!trace->records || !trace->used) {
+		destroyTrace(trace);
+		return NULL;
+	}
+	return trace;
+}
+
+void destroyTrace(Trace *trace) {
+	if(!trace)
+		return;
+	munmap(trace->map, trace->size);
+	free(trace->records);
+	free(trace->used);
+	free(trace);
+}
+
+unsigned long getTraceLength(Trace *trace) {
+	return trace->recordsLen;
+}
+
+const TraceRecord *getTraceRecord(Trace *trace, unsigned long i) {
+	return i < trace->recordsLen ? &trace->records[i] : NULL;
+}
+
+// Finds the recording of command, so it can be answered the way it was answered then.
+// Replayed code sends the same commands in the same order, give or take a TEST UNIT READY, so the next record usually matches.
+// If none of the next MATCH_WINDOW records does, the earliest unused one anywhere is taken, and failing that any that matches,
+// so a command sent more often than it was recorded still gets an answer. NULL if the command was never recorded.
+const TraceRecord *matchTraceRecord(Trace *trace, const DriveCommand *command) {
+	unsigned long end = trace->cursor + MATCH_WINDOW;
+	if(end > trace->recordsLen)
+		end = trace->recordsLen;
+	long found = -1;
+	for(unsigned long i=trace->cursor; i<end && found == -1; i++) {
+		if(!trace->used[i] && sameCommand(&trace->records[i], command))
+			found = i;
+	}
+	if(found == -1) {
+		for(unsigned long i=0; i<trace->recordsLen && found == -1; i++) {
+			if(!trace->used[i] && sameCommand(&trace->records[i], command))
+				found = i;
+		}
+		for(unsigned long i=0; i<trace->recordsLen && found == -1; i++) {
+			if(sameCommand(&trace->records[i], command))
+				found = i;
+		}
+		if(found == -1) {
+			trace->unmatched++;
+			return NULL;
+		}
+		trace->outOfOrder++;
+	}
+	else
+		trace->matched++;
+	trace->used[found] = true;
+	trace->cursor = found+1;
+	return &trace->records[found];
+}
+
+// matched came in the recorded order, outOfOrder were found elsewhere in the trace, unmatched weren't in it at all.
+// A replay that has to go looking for many commands is no longer replaying what was recorded.
+void getTraceMatchStats(Trace *trace, unsigned long *matched, unsigned long *outOfOrder, unsigned long *unmatched) {
+	*matched = trace->matched;
+	*outOfOrder = trace->outOfOrder;
+	*unmatched = trace->unmatched;
+}
+
+static bool sameCommand(const TraceRecord *record, const DriveCommand *command) {
+	return record->cdbLen == command->cdbLen && memcmp(record->cdb, command->cdb, command->cdbLen) == 0;
+}
+
+static void putLE32(uint8_t *dest, uint32_t value) {
+	dest[0] = value;
+	dest[1] = value >> 8;
+	dest[2] = value >> 16;
+	dest[3] = value >> 24;
+}
+
+static uint32_t getLE32(const uint8_t *src) {
+	return src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24);
+}
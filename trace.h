@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "drive.h"
+
+#define TRACE_MAGIC "OCTRACE1"
+#define TRACE_MAGIC_LEN 8
+
+// TraceRecord flags
+#define TRACE_PAYLOAD_DROPPED 1 // the command read data but it wasn't kept, see startDriveTrace()
+
+typedef struct Trace Trace;
+typedef struct TraceRecord TraceRecord;
+
+// One command as the drive answered it. payload points into the loaded trace.
+struct TraceRecord {
+	uint8_t cdb[DRIVE_MAX_CDB];
+	uint8_t cdbLen;
+	uint8_t status; // what sendDriveCommand() or reapDriveCommand() returned
+	uint8_t flags;
+	uint8_t senseLen;
+	const uint8_t *sense;
+	uint32_t latencyUsec; // time the drive spent on it, not counting time queued behind other commands
+	uint32_t dataLen;
+	int32_t resid;
+	uint32_t payloadLen;
+	const uint8_t *payload;
+};
+
+int startDriveTrace(const char *path, bool keepAudio);
+void stopDriveTrace(void);
+void flushDriveTrace(void);
+bool isDriveTraceActive(void);
+void traceDriveCommand(const DriveCommand *command, int status, const void *dataIn, double seconds);
+
+Trace *loadTrace(const char *path);
+void destroyTrace(Trace *trace);
+unsigned long getTraceLength(Trace *trace);
+const TraceRecord *getTraceRecord(Trace *trace, unsigned long i);
+const TraceRecord *matchTraceRecord(Trace *trace, const DriveCommand *command);
+void getTraceMatchStats(Trace *trace, unsigned long *matched, unsigned long *outOfOrder, unsigned long *unmatched);
+
+#endif
@@ -0,0 +1,70 @@
+// Just enough of the RIFF WAVE format to store CD audio: 44100Hz, 16 bit signed little endian, stereo.
+// 	http://soundfile.sapp.org/doc/WaveFormat/
+// CD audio blocks are already in this layout, so everything after the header is the READ CD data as is.
+
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "wav.h"
+
+#define CD_SAMPLING_RATE 44100
+#define STEREO 2
+#define BITS_PER_SAMPLE 16
+#define FRAME_SIZE 4
+#define FMT_CHUNK_SIZE 16
+#define PCM_FORMAT 1
+#define ONE_BYTE 8
+
+#define SUCCESS 0
+#define FAILED_WRITE 1
+
+static void putLE32(uint8_t *dest, uint32_t value);
+static void putLE16(uint8_t *dest, uint16_t value);
+
+// Writes a complete header for dataSize bytes of CD audio at the current position of fd.
+int writeWavHeader(int fd, uint32_t dataSize) {
+	uint8_t hdr[WAV_HEADER_SIZE];
+	memcpy(hdr, "RIFF", 4);
+	putLE32(hdr+4, WAV_HEADER_SIZE - 8 + dataSize); // everything after this field
+	memcpy(hdr+8, "WAVE", 4);
+	memcpy(hdr+12, "fmt ", 4);
+	putLE32(hdr+16, FMT_CHUNK_SIZE);
+	putLE16(hdr+20, PCM_FORMAT);
+	putLE16(hdr+22, STEREO);
+	putLE32(hdr+24, CD_SAMPLING_RATE);
+	putLE32(hdr+28, CD_SAMPLING_RATE * FRAME_SIZE); // byte rate
+	putLE16(hdr+32, FRAME_SIZE); // block align
+	putLE16(hdr+34, BITS_PER_SAMPLE);
+	memcpy(hdr+36, "data", 4);
+	putLE32(hdr+40, dataSize);
+	return writeAll(fd, hdr, WAV_HEADER_SIZE);
+}
+
+// write() can return early on pipes, signals and full disks, keep going until everything is written or it really fails.
+int writeAll(int fd, const void *buf, long size) {
+	const uint8_t *next = buf;
+	while(size > 0) {
+		ssize_t written = write(fd, next, size);
+		if(written == -1) {
+			if(errno == EINTR)
+				continue;
+			return FAILED_WRITE;
+		}
+		next += written;
+		size -= written;
+	}
+	return SUCCESS;
+}
+
+static void putLE32(uint8_t *dest, uint32_t value) {
+	dest[0] = value;
+	dest[1] = value >> ONE_BYTE;
+	dest[2] = value >> ONE_BYTE*2;
+	dest[3] = value >> ONE_BYTE*3;
+}
+
+static void putLE16(uint8_t *dest, uint16_t value) {
+	dest[0] = value;
+	dest[1] = value >> ONE_BYTE;
+}
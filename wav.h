@@ -0,0 +1,12 @@
+
+#ifndef WAV_H
+#define WAV_H
+
+#include <stdint.h>
+
+#define WAV_HEADER_SIZE 44
+
+int writeWavHeader(int fd, uint32_t dataSize);
+int writeAll(int fd, const void *buf, long size);
+
+#endif